@@ -17,7 +17,13 @@ bool init(iris::instance* iris) {
 }
 
 void destroy(iris::instance* iris) {
-    if (iris->ps2) ps2_destroy(iris->ps2);
+    if (!iris->ps2)
+        return;
+
+    vif_print_unpack_stats(iris->ps2->vif0, stdout);
+    vif_print_unpack_stats(iris->ps2->vif1, stdout);
+
+    ps2_destroy(iris->ps2);
 }
 
 const char* get_extension(const char* path) {
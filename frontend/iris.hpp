@@ -402,6 +402,18 @@ struct instance {
         VkFramebuffer framebuffer = VK_NULL_HANDLE;
     } shader_framebuffers[2];
 
+    // Frames from backends that render to system memory, one staging
+    // buffer per frame in flight
+    struct {
+        VkImage image = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        std::vector <VkBuffer> staging;
+        std::vector <VkDeviceMemory> staging_memory;
+    } software_frame;
+
     struct ps2_state* ps2 = nullptr;
 
     unsigned int window_width = 960;
@@ -606,7 +618,7 @@ namespace audio {
 
 namespace settings {
     bool init(iris::instance* iris, int argc, const char* argv[]);
-    bool check_for_quick_exit(int argc, const char* argv[]);
+    bool check_for_quick_exit(int argc, const char* argv[], int* status);
     void close(iris::instance* iris);
 }
 
@@ -705,6 +717,7 @@ namespace vulkan {
     void cleanup(iris::instance* iris);
     texture upload_texture(iris::instance* iris, void* pixels, int width, int height, int stride);
     void free_texture(iris::instance* iris, texture& tex);
+    VkBuffer create_buffer(iris::instance* iris, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkDeviceMemory& buffer_memory);
     void* read_image(iris::instance* iris, VkImage image, VkFormat format, int width, int height);
 }
 
@@ -59,6 +59,8 @@ bool create_image(iris::instance* iris, uint32_t width, uint32_t height, VkForma
 
         vkDestroyImage(iris->device, image, nullptr);
 
+        image = VK_NULL_HANDLE;
+
         return false;
     }
 
@@ -469,6 +471,164 @@ void render_shader_passes(iris::instance* iris, VkCommandBuffer command_buffer,
     }
 }
 
+static void destroy_software_frame(iris::instance* iris) {
+    auto& sf = iris->software_frame;
+
+    for (size_t i = 0; i < sf.staging.size(); i++) {
+        vkDestroyBuffer(iris->device, sf.staging[i], nullptr);
+        vkFreeMemory(iris->device, sf.staging_memory[i], nullptr);
+    }
+
+    sf.staging.clear();
+    sf.staging_memory.clear();
+
+    if (sf.view) vkDestroyImageView(iris->device, sf.view, nullptr);
+    if (sf.image) vkDestroyImage(iris->device, sf.image, nullptr);
+    if (sf.memory) vkFreeMemory(iris->device, sf.memory, nullptr);
+
+    sf.view = VK_NULL_HANDLE;
+    sf.image = VK_NULL_HANDLE;
+    sf.memory = VK_NULL_HANDLE;
+    sf.width = 0;
+    sf.height = 0;
+}
+
+static inline renderer_image get_software_frame(iris::instance* iris) {
+    renderer_image image = {};
+
+    if (!iris->software_frame.view)
+        return image;
+
+    image.image = iris->software_frame.image;
+    image.view = iris->software_frame.view;
+    image.format = VK_FORMAT_R8G8B8A8_UNORM;
+    image.width = iris->software_frame.width;
+    image.height = iris->software_frame.height;
+
+    return image;
+}
+
+// Backends that render to system memory don't hand us an image, copy
+// their frame into one so the shader passes and the display pass can
+// sample it like any other
+static renderer_image upload_software_frame(iris::instance* iris, VkCommandBuffer command_buffer) {
+    auto& sf = iris->software_frame;
+
+    int w, h, bpp;
+
+    uint8_t* data = (uint8_t*)renderer_get_buffer_data(iris->renderer, &w, &h, &bpp);
+
+    if (!data)
+        return {};
+
+    size_t frames = iris->main_window_data.Frames.size();
+    VkDeviceSize size = (VkDeviceSize)w * h * 4;
+
+    if ((unsigned int)w != sf.width || (unsigned int)h != sf.height || sf.staging.size() != frames) {
+        vkDeviceWaitIdle(iris->device);
+
+        destroy_software_frame(iris);
+
+        if (!create_image(iris, w, h, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT, sf.image, sf.view, sf.memory)) {
+            fprintf(stderr, "render: Failed to create software frame image\n");
+
+            destroy_software_frame(iris);
+
+            return {};
+        }
+
+        for (size_t i = 0; i < frames; i++) {
+            VkDeviceMemory memory = VK_NULL_HANDLE;
+
+            VkBuffer buffer = vulkan::create_buffer(
+                iris,
+                size,
+                VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                memory
+            );
+
+            if (!buffer) {
+                destroy_software_frame(iris);
+
+                return {};
+            }
+
+            sf.staging.push_back(buffer);
+            sf.staging_memory.push_back(memory);
+        }
+
+        sf.width = w;
+        sf.height = h;
+    }
+
+    // The fence for this frame has been waited on, so its staging
+    // buffer is no longer in use
+    VkBuffer staging = sf.staging[iris->main_window_data.FrameIndex];
+    VkDeviceMemory staging_memory = sf.staging_memory[iris->main_window_data.FrameIndex];
+
+    void* ptr;
+
+    vkMapMemory(iris->device, staging_memory, 0, size, 0, &ptr);
+
+    if (bpp == 4) {
+        memcpy(ptr, data, (size_t)size);
+    } else {
+        // 16-bit frames are ABGR1555
+        uint16_t* src = (uint16_t*)data;
+        uint32_t* dst = (uint32_t*)ptr;
+
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            uint32_t r = (src[i] >> 0) & 0x1f;
+            uint32_t g = (src[i] >> 5) & 0x1f;
+            uint32_t b = (src[i] >> 10) & 0x1f;
+
+            dst[i] = (r << 3) | (g << 11) | (b << 19) | 0xff000000;
+        }
+    }
+
+    vkUnmapMemory(iris->device, staging_memory);
+
+    // The whole image is overwritten, its old contents can be dropped.
+    // Only wait for the previous frame to be done sampling it
+    VkImageMemoryBarrier copy_barrier = {};
+    copy_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    copy_barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    copy_barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    copy_barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    copy_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    copy_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    copy_barrier.image = sf.image;
+    copy_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    copy_barrier.subresourceRange.levelCount = 1;
+    copy_barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &copy_barrier);
+
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = w;
+    region.imageExtent.height = h;
+    region.imageExtent.depth = 1;
+    vkCmdCopyBufferToImage(command_buffer, staging, sf.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    VkImageMemoryBarrier use_barrier = {};
+    use_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    use_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    use_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    use_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    use_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    use_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    use_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    use_barrier.image = sf.image;
+    use_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    use_barrier.subresourceRange.levelCount = 1;
+    use_barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &use_barrier);
+
+    return get_software_frame(iris);
+}
+
 bool render_frame(iris::instance* iris, VkCommandBuffer command_buffer, VkFramebuffer framebuffer) {
     renderer_image image;
 
@@ -476,6 +636,9 @@ bool render_frame(iris::instance* iris, VkCommandBuffer command_buffer, VkFrameb
         image = iris->image;
     } else {
         image = renderer_get_frame(iris->renderer);
+
+        if (image.view == VK_NULL_HANDLE)
+            image = upload_software_frame(iris, command_buffer);
     }
 
     bool need_rebuild = image.width != iris->image.width ||
@@ -558,6 +721,13 @@ void switch_backend(iris::instance* iris, int backend) {
 
     renderer_destroy(iris->renderer);
 
+    // The new backend presents its own image, if any
+    vkDeviceWaitIdle(iris->device);
+
+    destroy_software_frame(iris);
+
+    iris->image = {};
+
     iris->renderer = renderer_create();
 
     renderer_create_info info = {};
@@ -593,6 +763,10 @@ void refresh(iris::instance* iris) {
 
     iris->image = renderer_get_frame(iris->renderer);
 
+    // Keep showing the last frame we uploaded
+    if (iris->image.view == VK_NULL_HANDLE)
+        iris->image = get_software_frame(iris);
+
     if (iris->image.view == VK_NULL_HANDLE)
         return;
 
@@ -623,6 +797,8 @@ void destroy(iris::instance* iris) {
         if (fb.memory) vkFreeMemory(iris->device, fb.memory, nullptr);
     }
 
+    destroy_software_frame(iris);
+
     if (iris->shader_descriptor_set_layout) {
         vkDestroyDescriptorSetLayout(iris->device, iris->shader_descriptor_set_layout, nullptr);
     }
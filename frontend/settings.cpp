@@ -4,6 +4,10 @@
 #include "ps2_elf.h"
 #include "ps2_iso9660.h"
 
+#include "gs/renderer/software_thread.hpp"
+#include "gs/renderer/dump.hpp"
+#include "ipu/ipu.h"
+
 #define TOML_EXCEPTIONS 0
 #include <toml++/toml.hpp>
 
@@ -40,6 +44,26 @@ void print_help() {
         "      --slot2              Specify a path to a memory card file to\n"
         "                             be inserted on slot 2\n"
         "      --snap               Specify a directory for storing screenshots\n"
+#ifdef IRIS_BENCH
+        "      --bench-swizzle      Measure software renderer VRAM access speed\n"
+        "                             for every pixel format and exit\n"
+        "      --bench-transfer     Measure software renderer image upload\n"
+        "                             speed for every pixel format and exit\n"
+        "      --bench-unpack       Check the VIF UNPACK kernels, measure their\n"
+        "                             speed and exit\n"
+        "      --bench-idct         Check the IPU IDCT against IEEE 1180,\n"
+        "                             measure its speed and exit\n"
+        "      --bench-csc          Check the IPU colour conversion against\n"
+        "                             the float one, measure its speed and exit\n"
+        "      --bench-fifo         Measure IPU bitstream reader speed and exit\n"
+        "      --bench-ipu          Measure IPU FMV decode speed with and\n"
+        "                             without decode workers and exit\n"
+#endif
+        "      --replay-gs          Replay a GS dump headlessly, print the time\n"
+        "                             and hash of every frame and exit\n"
+        "      --replay-backend     Renderer to replay GS dumps with (null or\n"
+        "                             software, software by default). The\n"
+        "                             hardware renderer can't replay dumps\n"
         "  -h, --help               Display this help and exit\n"
         "  -v, --version            Output version information and exit\n"
     );
@@ -247,7 +271,7 @@ bool parse_toml_settings(iris::instance* iris) {
     return parse_mappings_file(iris);
 }
 
-bool check_for_quick_exit(int argc, const char* argv[]) {
+bool check_for_quick_exit(int argc, const char* argv[], int* status) {
     for (int i = 1; i < argc; i++) {
         std::string a(argv[i]);
 
@@ -258,6 +282,77 @@ bool check_for_quick_exit(int argc, const char* argv[]) {
         } else if (a == "-v" || a == "--version") {
             print_version();
 
+            return true;
+#ifdef IRIS_BENCH
+        } else if (a == "--bench-swizzle") {
+            software_thread_bench_swizzle();
+
+            return true;
+        } else if (a == "--bench-transfer") {
+            software_thread_bench_transfer();
+
+            return true;
+        } else if (a == "--bench-unpack") {
+            *status = ps2_vif_bench_unpack();
+
+            return true;
+        } else if (a == "--bench-idct") {
+            *status = ps2_ipu_bench_idct();
+
+            return true;
+        } else if (a == "--bench-csc") {
+            *status = ps2_ipu_bench_csc();
+
+            return true;
+        } else if (a == "--bench-fifo") {
+            ps2_ipu_bench_fifo();
+
+            return true;
+        } else if (a == "--bench-ipu") {
+            *status = ps2_ipu_bench_decode();
+
+            return true;
+#endif
+        } else if (a == "--replay-gs") {
+            if (i + 1 == argc) {
+                fprintf(stderr, "iris: --replay-gs needs a dump file\n");
+
+                *status = 1;
+
+                return true;
+            }
+
+            int backend = RENDERER_BACKEND_SOFTWARE;
+
+            for (int j = 1; j < argc - 1; j++) {
+                std::string b(argv[j]);
+
+                if (b != "--replay-backend")
+                    continue;
+
+                std::string name(argv[j+1]);
+
+                // The hardware renderer needs a Vulkan device from the
+                // frontend, dumps can't be replayed through it
+                if (name == "null") {
+                    backend = RENDERER_BACKEND_NULL;
+                } else if (name == "hardware") {
+                    fprintf(stderr, "iris: GS dumps can't be replayed with the hardware renderer\n");
+
+                    *status = 1;
+
+                    return true;
+                } else if (name != "software") {
+                    fprintf(stderr, "iris: Unknown replay backend \"%s\" (null or software)\n", name.c_str());
+
+                    *status = 1;
+
+                    return true;
+                }
+            }
+
+            *status = gs_dump_replay(argv[i+1], backend);
+
             return true;
         }
     }
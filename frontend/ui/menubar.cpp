@@ -195,6 +195,8 @@ void show_main_menubar(iris::instance* iris) {
 
             // To-do: Show confirm dialog maybe?
             if (MenuItem(ICON_MS_REFRESH " Reset")) {
+                renderer_reset(iris->renderer);
+
                 ps2_reset(iris->ps2);
             }
 
@@ -237,13 +239,9 @@ void show_main_menubar(iris::instance* iris) {
             if (BeginMenu(ICON_MS_MONITOR " Display")) {
                 if (BeginMenu(ICON_MS_BRUSH " Renderer")) {
                     for (int i = 0; i < 3; i++) {
-                        BeginDisabled(i == RENDERER_BACKEND_SOFTWARE);
-
                         if (MenuItem(renderer_names[i], nullptr, i == iris->renderer_backend)) {
                             render::switch_backend(iris, i);
                         }
-
-                        EndDisabled();
                     }
 
                     ImGui::EndMenu();
@@ -405,6 +403,31 @@ void show_main_menubar(iris::instance* iris) {
                 }
             }
 
+            if (renderer_is_dumping(iris->renderer)) {
+                if (MenuItem(ICON_MS_STOP " Stop GS dump")) {
+                    renderer_stop_dump(iris->renderer);
+
+                    push_info(iris, "GS dump saved");
+                }
+            } else if (MenuItem(ICON_MS_VIDEOCAM " Record GS dump...", nullptr, false, iris->renderer_backend == RENDERER_BACKEND_SOFTWARE)) {
+                audio::mute(iris);
+
+                auto f = pfd::save_file("Save GS dump", "dump.gsd", {
+                    "GS dumps (*.gsd)", "*.gsd",
+                    "All Files (*.*)", "*"
+                });
+
+                while (!f.ready());
+
+                audio::unmute(iris);
+
+                if (f.result().size()) {
+                    if (!renderer_start_dump(iris->renderer, f.result().c_str())) {
+                        push_info(iris, "Couldn't open " + f.result());
+                    }
+                }
+            }
+
             if (MenuItem(ICON_MS_SD_CARD " Memory Card tool")) {
                 iris->show_memory_card_tool = true;
             }
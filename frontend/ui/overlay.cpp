@@ -98,14 +98,41 @@ void show_overlay(iris::instance* iris) {
             EndPlot();
         }
 
-        renderer_stats* stats; // = renderer_get_debug_stats(iris->ctx);
+        renderer_stats* stats = renderer_get_debug_stats(iris->renderer);
 
         PushFont(iris->font_black);
         Text("%d fps", (int)std::roundf(1.0 / ImGui::GetIO().DeltaTime));
         PopFont();
-        // Text("Primitives: %d", stats->primitives);
-        // Text("Texture uploads: %d", stats->texture_uploads);
-        // Text("Texture blits: %d", stats->texture_blits);
+
+        // Only backends that keep stats have them, the software
+        // renderer draws itself and the hardware one through a ring
+        if (stats && stats->threads) {
+            Text("Primitives: %u (%.2f M/s)", stats->primitives, stats->primitives_per_second / 1000000.0f);
+            Text("Pixels: %u (%.2f M/s)", stats->pixels, stats->pixels_per_second / 1000000.0f);
+            Text("Sprites: %u generic, %u fills (%.0f/s), %u copies (%.0f/s)",
+                stats->sprites - stats->sprite_fills - stats->sprite_copies,
+                stats->sprite_fills, stats->sprite_fills_per_second,
+                stats->sprite_copies, stats->sprite_copies_per_second
+            );
+            Text("Texture uploads: %u", stats->texture_uploads);
+            Text("Texture blits: %u", stats->texture_blits);
+        }
+
+        if (stats && stats->ring_packets) {
+            Text("GS ring: %u packets, %.2f MB, %.2f MB peak",
+                stats->ring_packets,
+                stats->command_bytes / (1024.0f * 1024.0f),
+                stats->ring_peak_occupancy / (1024.0f * 1024.0f)
+            );
+            Text("Waits: %u full, %u CSR, %u BUSDIR, %u priv, %u vblank",
+                stats->ring_full_stalls,
+                stats->ring_sync_stalls[GS_SYNC_CSR],
+                stats->ring_sync_stalls[GS_SYNC_BUSDIR],
+                stats->ring_sync_stalls[GS_SYNC_PRIV],
+                stats->ring_sync_stalls[GS_SYNC_VBLANK]
+            );
+            Text("SIGNAL stalls: %u (%u released)", stats->signal_stalls, stats->signal_releases);
+        }
     } End();
 }
 
@@ -330,13 +330,9 @@ void show_graphics_settings(iris::instance* iris) {
 
     if (BeginCombo("##renderer", settings_renderer_names[iris->renderer_backend], ImGuiComboFlags_HeightSmall)) {
         for (int i = 0; i < 3; i++) {
-            BeginDisabled(i == RENDERER_BACKEND_SOFTWARE);
-
             if (Selectable(settings_renderer_names[i], i == iris->renderer_backend)) {
                 render::switch_backend(iris, i);
             }
-
-            EndDisabled();
         }
 
         EndCombo();
@@ -30,8 +30,10 @@ SDL_AppResult SDL_AppInit(void** appstate, int argc, char** argv) {
 
     // Check if we got --help or --version in the commandline args
     // if so, don't do anything else.
-    if (iris::settings::check_for_quick_exit(argc, (const char**)argv)) {
-        return SDL_APP_SUCCESS;
+    int status = 0;
+
+    if (iris::settings::check_for_quick_exit(argc, (const char**)argv, &status)) {
+        return status ? SDL_APP_FAILURE : SDL_APP_SUCCESS;
     }
 
     iris::instance* iris = iris::create();
@@ -28,6 +28,92 @@ static inline void dmac_write_qword(struct ps2_dmac* dmac, uint32_t addr, int me
     ps2_ram_write128(dmac->spr, addr & 0x3ff0, value);
 }
 
+// Resolve a source range to host memory. Returns the number of qwords
+// (up to qwc) that are contiguous at *ptr, or 0 if the source isn't
+// RAM or scratchpad (i.e. MMIO), in which case the caller has to go
+// through the bus.
+static inline uint32_t dmac_map_span(struct ps2_dmac* dmac, uint32_t addr, uint32_t qwc, const uint128_t** ptr) {
+    uint32_t avail;
+
+    if (addr & 0x80000000) {
+        addr &= 0x3ff0;
+
+        *ptr = (const uint128_t*)(dmac->spr->buf + addr);
+
+        avail = (0x4000 - addr) >> 4;
+    } else {
+        struct ps2_ram* ram = dmac->bus->ee_ram;
+
+        addr &= 0xfffffff0;
+
+        if (addr >= ram->size)
+            return 0;
+
+        *ptr = (const uint128_t*)(ram->buf + addr);
+
+        avail = (ram->size - addr) >> 4;
+    }
+
+    return qwc < avail ? qwc : avail;
+}
+
+static inline void dmac_write_device_qword(struct ps2_dmac* dmac, int ch, uint128_t q) {
+    switch (ch) {
+        // VIF0 FIFO address
+        case DMAC_VIF0: ee_bus_write128(dmac->bus, 0x10004000, q); break;
+
+        // VIF1 FIFO address
+        case DMAC_VIF1: {
+            ee_bus_write32(dmac->bus, 0x10005000, q.u32[0]);
+            ee_bus_write32(dmac->bus, 0x10005000, q.u32[1]);
+            ee_bus_write32(dmac->bus, 0x10005000, q.u32[2]);
+            ee_bus_write32(dmac->bus, 0x10005000, q.u32[3]);
+        } break;
+
+        // GIF FIFO address
+        case DMAC_GIF: ps2_gif_fifo_write(dmac->bus->gif, q, GIF_PATH3); break;
+    }
+}
+
+static inline size_t dmac_write_device_span(struct ps2_dmac* dmac, int ch, const uint128_t* data, size_t qwc) {
+    switch (ch) {
+        case DMAC_VIF0: return ps2_vif_fifo_write_span(dmac->bus->vif0, data, qwc);
+        case DMAC_VIF1: return ps2_vif_fifo_write_span(dmac->bus->vif1, data, qwc);
+        case DMAC_GIF: return ps2_gif_fifo_write_span(dmac->bus->gif, data, qwc, GIF_PATH3);
+    }
+
+    return 0;
+}
+
+// Send QWC qwords from MADR to a device FIFO. Whenever the source maps
+// to host memory the device gets the whole span in one call, otherwise
+// (MMIO sources, or the device stalling mid-span) we fall back to
+// sending one qword at a time. QWC itself is left untouched.
+static inline void dmac_send_to_device(struct ps2_dmac* dmac, struct dmac_channel* c, int ch) {
+    uint32_t qwc = c->qwc;
+
+    while (qwc) {
+        const uint128_t* ptr;
+
+        uint32_t size = dmac_map_span(dmac, c->madr, qwc, &ptr);
+
+        if (size) {
+            size_t done = dmac_write_device_span(dmac, ch, ptr, size);
+
+            c->madr += done * 16;
+            qwc -= done;
+
+            if (done == size)
+                continue;
+        }
+
+        dmac_write_device_qword(dmac, ch, dmac_read_qword(dmac, c->madr));
+
+        c->madr += 16;
+        qwc--;
+    }
+}
+
 struct ps2_dmac* ps2_dmac_create(void) {
     return malloc(sizeof(struct ps2_dmac));
 }
@@ -275,14 +361,7 @@ void dmac_handle_vif0_transfer(struct ps2_dmac* dmac) {
 
     int mode = (dmac->vif0.chcr >> 2) & 3;
 
-    for (int i = 0; i < dmac->vif0.qwc; i++) {
-        uint128_t q = dmac_read_qword(dmac, dmac->vif0.madr);
-
-        // VIF0 FIFO address
-        ee_bus_write128(dmac->bus, 0x10004000, q);
-
-        dmac->vif0.madr += 16;
-    }
+    dmac_send_to_device(dmac, &dmac->vif0, DMAC_VIF0);
 
     if (mode == 0) {
         dmac->vif0.chcr &= ~0x100;
@@ -313,18 +392,7 @@ void dmac_handle_vif0_transfer(struct ps2_dmac* dmac) {
             ee_bus_write32(dmac->bus, 0x10004000, dmac->vif0.tag.data >> 32);
         }
 
-        for (int i = 0; i < dmac->vif0.qwc; i++) {
-            uint128_t q = dmac_read_qword(dmac, dmac->vif0.madr);
-
-            // printf("ee: Sending %016lx%016lx from %08x to VIF0 FIFO\n",
-            //     q.u64[1], q.u64[0],
-            //     dmac->vif0.madr
-            // );
-
-            ee_bus_write128(dmac->bus, 0x10004000, q);
-
-            dmac->vif0.madr += 16;
-        }
+        dmac_send_to_device(dmac, &dmac->vif0, DMAC_VIF0);
 
         if (dmac->vif0.tag.id == 1) {
             dmac->vif0.tadr = dmac->vif0.madr;
@@ -348,126 +416,201 @@ void dmac_send_vif1_irq(void* udata, int overshoot) {
     dmac_set_irq(dmac, DMAC_VIF1);
 }
 
-void mfifo_handle_ref_tag(struct ps2_dmac* dmac) {
-    struct dmac_channel* c = dmac->mfifo_drain;
+// MFIFO
+//
+// SPR_FROM writes into a ring buffer in RAM (RBOR/RBSR), the drain
+// channel (VIF1 or GIF) reads chain tags and data back from it through
+// TADR. Data is moved in whole spans, the drain stalls when it catches
+// up with SPR_FROM's MADR, and SPR_FROM stalls when the ring is full.
+// One qword is always left free so a full ring can't look empty, a
+// stalled SPR_FROM is resumed once the drain has emptied the ring.
+static inline uint32_t mfifo_wrap(struct ps2_dmac* dmac, uint32_t addr) {
+    return dmac->rbor | (addr & dmac->rbsr);
+}
 
-    while (c->qwc) {
-        uint128_t q = dmac_read_qword(dmac, c->madr);
+// Qwords between addr and the SPR_FROM write pointer
+static inline uint32_t mfifo_used(struct ps2_dmac* dmac, uint32_t addr) {
+    return ((dmac->spr_from.madr - addr) & dmac->rbsr) >> 4;
+}
 
-        if (c == &dmac->vif1) {
-            // VIF1 FIFO
-            ee_bus_write128(dmac->bus, 0x10005000, q);
-        } else {
-            // GIF FIFO
-            ps2_gif_fifo_write(dmac->bus->gif, q, GIF_PATH3);
-        }
+// Qwords between addr and the end of the ring
+static inline uint32_t mfifo_contiguous(struct ps2_dmac* dmac, uint32_t addr) {
+    return ((dmac->rbsr + 16) - (addr & dmac->rbsr)) >> 4;
+}
 
-        c->madr += 16;
-        c->qwc--;
+// CNT, NEXT, CALL, RET and END tags are followed by their data inside
+// the ring, REF/REFS/REFE data lives elsewhere in memory
+static inline int mfifo_data_in_ring(struct dmac_channel* c) {
+    switch (c->tag.id) {
+        case 0: case 3: case 4: return 0;
     }
 
-    if (channel_is_done(c)) {
-        // fprintf(stdout, "dmac: mfifo channel done end=%d tte-irq=%d\n", c->tag.end, c->tag.irq && (c->chcr & 0x80));
-        dmac_set_irq(dmac, c == &dmac->vif1 ? DMAC_VIF1 : DMAC_GIF);
+    return 1;
+}
 
-        c->chcr &= ~0x100;
+// Qwords SPR_FROM can write without overwriting undrained data
+static inline uint32_t mfifo_free(struct ps2_dmac* dmac) {
+    struct dmac_channel* c = dmac->mfifo_drain;
 
-        return;
-    }
+    // The oldest undrained qword is either the rest of the current
+    // tag's data or the next tag
+    uint32_t addr = (c->qwc && mfifo_data_in_ring(c)) ? c->madr : c->tadr;
 
-    if (c->tag.id == 1) {
-        c->tadr = dmac->rbor | (c->madr & dmac->rbsr);
-    }
+    return ((dmac->rbsr + 16) >> 4) - mfifo_used(dmac, addr) - 1;
 }
 
-void mfifo_write_qword(struct ps2_dmac* dmac, uint128_t q) {
-    struct dmac_channel* c = dmac->mfifo_drain;
+// Copy as much of SPR_FROM's transfer into the ring as fits, returns
+// 1 when the whole transfer made it in
+static int mfifo_fill(struct ps2_dmac* dmac) {
+    struct ps2_ram* ram = dmac->bus->ee_ram;
+
+    uint32_t qwc = dmac->spr_from.qwc;
+    uint32_t room = mfifo_free(dmac);
+
+    if (qwc > room)
+        qwc = room;
+
+    dmac->spr_from.qwc -= qwc;
+
+    // Copy in spans, split wherever either the scratchpad or
+    // the ring wraps around
+    while (qwc) {
+        uint32_t sadr = dmac->spr_from.sadr & 0x3ff0;
+        uint32_t madr = dmac->spr_from.madr;
+        uint32_t size = mfifo_contiguous(dmac, madr);
 
-    if (c->qwc) {
-        uint128_t q = dmac_read_qword(dmac, c->madr);
+        if (size > ((0x4000 - sadr) >> 4))
+            size = (0x4000 - sadr) >> 4;
 
-        if (c == &dmac->vif1) {
-            // VIF1 FIFO
-            ee_bus_write128(dmac->bus, 0x10005000, q);
+        if (size > qwc)
+            size = qwc;
+
+        if (madr + (size * 16) <= ram->size) {
+            memcpy(ram->buf + madr, dmac->spr->buf + sadr, size * 16);
         } else {
-            // GIF FIFO
-            ps2_gif_fifo_write(dmac->bus->gif, q, GIF_PATH3);
+            for (int i = 0; i < size; i++)
+                ee_bus_write128(dmac->bus, madr + (i * 16), ps2_ram_read128(dmac->spr, sadr + (i * 16)));
         }
 
-        c->madr += 16;
-        c->qwc--;
+        dmac->spr_from.madr = mfifo_wrap(dmac, madr + (size * 16));
+        dmac->spr_from.sadr = (sadr + (size * 16)) & 0x3ff0;
 
-        // fprintf(stdout, "dmac: mfifo channel qwc=%d\n", c->qwc);
+        qwc -= size;
+    }
 
-        if (c->qwc == 0) {
-            if (channel_is_done(c)) {
-                // fprintf(stdout, "dmac: mfifo channel done end=%d tte-irq=%d\n", c->tag.end, c->tag.irq && (c->chcr & 0x80));
-                dmac_set_irq(dmac, c == &dmac->vif1 ? DMAC_VIF1 : DMAC_GIF);
+    if (dmac->spr_from.qwc)
+        return 0;
 
-                c->chcr &= ~0x100;
+    dmac_set_irq(dmac, DMAC_SPR_FROM);
 
-                return;
-            }
+    dmac->spr_from.chcr &= ~0x100;
 
-            if (c->tag.id == 1) {
-                c->tadr = dmac->rbor | (c->madr & dmac->rbsr);
-            }
-        }
+    return 1;
+}
+
+// Resume a SPR_FROM transfer stalled on a full ring, returns 1 if
+// anything was written
+static inline int mfifo_refill(struct ps2_dmac* dmac) {
+    uint32_t madr = dmac->spr_from.madr;
+
+    if (!(dmac->spr_from.chcr & 0x100) || !dmac->spr_from.qwc)
+        return 0;
 
+    mfifo_fill(dmac);
+
+    return dmac->spr_from.madr != madr;
+}
+
+void dmac_mfifo_drain(struct ps2_dmac* dmac) {
+    struct dmac_channel* c = dmac->mfifo_drain;
+
+    if (!c || !(c->chcr & 0x100))
         return;
-    }
 
-    uint128_t tag = dmac_read_qword(dmac, c->tadr);
+    int ch = (c == &dmac->vif1) ? DMAC_VIF1 : DMAC_GIF;
 
-    dmac_process_source_tag(dmac, c, tag);
+    while (1) {
+        if (c->qwc) {
+            if (!mfifo_data_in_ring(c)) {
+                dmac_send_to_device(dmac, c, ch);
 
-    if ((c->chcr >> 6) & 1) {
-        ee_bus_write32(dmac->bus, 0x10005000, c->tag.data & 0xffffffff);
-        ee_bus_write32(dmac->bus, 0x10005000, c->tag.data >> 32);
-    }
+                c->qwc = 0;
+            } else {
+                uint32_t qwc = c->qwc;
+                uint32_t used = mfifo_used(dmac, c->madr);
+                uint32_t size = mfifo_contiguous(dmac, c->madr);
 
-    c->tadr = dmac->rbor | (c->tadr & dmac->rbsr);
+                if (!used) {
+                    if (mfifo_refill(dmac))
+                        continue;
 
-    // fprintf(stdout, "dmac: tadr=%08x madr=%08x qwc=%d tagid=%d end=%d\n", c->tadr, c->madr, c->qwc, c->tag.id, c->tag.end);
+                    // Ring is empty, stall until SPR_FROM fills it up
+                    dmac_set_irq(dmac, DMAC_MEIS);
 
-    switch (c->tag.id) {
-        case 1:
-        case 2:
-        case 5:
-        case 6:
-        case 7: {
-            c->madr = dmac->rbor | (c->madr & dmac->rbsr);
-        } break;
+                    return;
+                }
+
+                if (size > used) size = used;
+                if (size > qwc) size = qwc;
+
+                c->qwc = size;
 
-        default: {
-            mfifo_handle_ref_tag(dmac);
+                dmac_send_to_device(dmac, c, ch);
 
-            if (c->tadr == dmac->spr_from.madr) {
-                // fprintf(stdout, "dmac: MFIFO empty\n");
+                c->qwc = qwc - size;
+                c->madr = mfifo_wrap(dmac, c->madr);
 
-                dmac_set_irq(dmac, DMAC_MEIS);
+                if (c->qwc)
+                    continue;
             }
-        } return;
-    }
 
-    if (c->qwc == 0) {
+            if (c->tag.id == 1) {
+                c->tadr = c->madr;
+            }
+        }
+
         if (channel_is_done(c)) {
-            // fprintf(stdout, "dmac: mfifo channel done end=%d tte-irq=%d\n", c->tag.end, c->tag.irq && (c->chcr & 0x80));
-            dmac_set_irq(dmac, c == &dmac->vif1 ? DMAC_VIF1 : DMAC_GIF);
+            dmac_set_irq(dmac, ch);
 
             c->chcr &= ~0x100;
 
             return;
         }
-    }
 
-    if (c->tadr == dmac->spr_from.madr) {
-        // fprintf(stdout, "dmac: MFIFO empty\n");
+        if (!mfifo_used(dmac, c->tadr)) {
+            if (mfifo_refill(dmac))
+                continue;
+
+            dmac_set_irq(dmac, DMAC_MEIS);
+
+            return;
+        }
+
+        uint128_t tag = dmac_read_qword(dmac, c->tadr);
+
+        dmac_process_source_tag(dmac, c, tag);
+
+        // CHCR.TTE: Transfer tag DATA field
+        if ((ch == DMAC_VIF1) && ((c->chcr >> 6) & 1)) {
+            ee_bus_write32(dmac->bus, 0x10005000, c->tag.data & 0xffffffff);
+            ee_bus_write32(dmac->bus, 0x10005000, c->tag.data >> 32);
+        }
 
-        dmac_set_irq(dmac, DMAC_MEIS);
+        c->tadr = mfifo_wrap(dmac, c->tadr);
+
+        if (mfifo_data_in_ring(c))
+            c->madr = mfifo_wrap(dmac, c->madr);
     }
 }
 
+static inline void dmac_mfifo_start(struct ps2_dmac* dmac, struct dmac_channel* c) {
+    // A transfer started with QWC != 0 uses the tag bits in CHCR
+    if (c->qwc)
+        c->tag.id = (c->chcr >> 28) & 7;
+
+    dmac_mfifo_drain(dmac);
+}
+
 void dmac_handle_vif1_transfer(struct ps2_dmac* dmac) {
     // fprintf(stdout, "dmac: VIF1 DMA dir=%d mode=%d tte=%d tie=%d qwc=%d madr=%08x tadr=%08x end=%d\n",
     //     dmac->vif1.chcr & 1,
@@ -483,6 +626,8 @@ void dmac_handle_vif1_transfer(struct ps2_dmac* dmac) {
     int mfifo_drain = (dmac->ctrl >> 2) & 3;
 
     if (mfifo_drain == 2) {
+        dmac_mfifo_start(dmac, &dmac->vif1);
+
         return;
     }
 
@@ -514,17 +659,7 @@ void dmac_handle_vif1_transfer(struct ps2_dmac* dmac) {
         return;
     }
 
-    for (int i = 0; i < dmac->vif1.qwc; i++) {
-        uint128_t q = dmac_read_qword(dmac, dmac->vif1.madr);
-
-        // VIF1 FIFO address
-        ee_bus_write32(dmac->bus, 0x10005000, q.u32[0]);
-        ee_bus_write32(dmac->bus, 0x10005000, q.u32[1]);
-        ee_bus_write32(dmac->bus, 0x10005000, q.u32[2]);
-        ee_bus_write32(dmac->bus, 0x10005000, q.u32[3]);
-
-        dmac->vif1.madr += 16;
-    }
+    dmac_send_to_device(dmac, &dmac->vif1, DMAC_VIF1);
 
     dmac->vif1.qwc = 0;
 
@@ -558,16 +693,7 @@ void dmac_handle_vif1_transfer(struct ps2_dmac* dmac) {
             ee_bus_write32(dmac->bus, 0x10005000, dmac->vif1.tag.data >> 32);
         }
 
-        for (int i = 0; i < dmac->vif1.qwc; i++) {
-            uint128_t q = dmac_read_qword(dmac, dmac->vif1.madr);
-
-            ee_bus_write32(dmac->bus, 0x10005000, q.u32[0]);
-            ee_bus_write32(dmac->bus, 0x10005000, q.u32[1]);
-            ee_bus_write32(dmac->bus, 0x10005000, q.u32[2]);
-            ee_bus_write32(dmac->bus, 0x10005000, q.u32[3]);
-
-            dmac->vif1.madr += 16;
-        }
+        dmac_send_to_device(dmac, &dmac->vif1, DMAC_VIF1);
 
         if (dmac->vif1.tag.id == 1) {
             dmac->vif1.tadr = dmac->vif1.madr;
@@ -592,6 +718,13 @@ void dmac_handle_gif_transfer(struct ps2_dmac* dmac) {
     assert(((dmac->gif.chcr >> 6) & 1) == 0);
 
     int mode = (dmac->gif.chcr >> 2) & 3;
+    int mfifo_drain = (dmac->ctrl >> 2) & 3;
+
+    if (mfifo_drain == 3) {
+        dmac_mfifo_start(dmac, &dmac->gif);
+
+        return;
+    }
 
     event.name = "GIF DMA IRQ";
     event.udata = dmac;
@@ -613,11 +746,6 @@ void dmac_handle_gif_transfer(struct ps2_dmac* dmac) {
     //     dmac->spr_from.madr
     // );
 
-    int mfifo_drain = (dmac->ctrl >> 2) & 3;
-
-    if (mfifo_drain == 3)
-        return;
-
     // printf("ee: GIF DMA dir=%d mode=%d tte=%d tie=%d qwc=%d madr=%08x tadr=%08x\n",
     //     dmac->gif.chcr & 1,
     //     (dmac->gif.chcr >> 2) & 3,
@@ -628,19 +756,7 @@ void dmac_handle_gif_transfer(struct ps2_dmac* dmac) {
     //     dmac->gif.tadr
     // );
 
-    for (int i = 0; i < dmac->gif.qwc; i++) {
-        uint128_t q = dmac_read_qword(dmac, dmac->gif.madr);
-
-        // fprintf(file, "ee: Sending %016lx%016lx from %08x to GIF FIFO (burst)\n",
-        //     q.u64[1], q.u64[0],
-        //     dmac->gif.madr
-        // );
-
-        // GIF FIFO address
-        ps2_gif_fifo_write(dmac->bus->gif, q, GIF_PATH3);
-
-        dmac->gif.madr += 16;
-    }
+    dmac_send_to_device(dmac, &dmac->gif, DMAC_GIF);
 
     if (dmac->gif.tag.end) {
         return;
@@ -660,18 +776,7 @@ void dmac_handle_gif_transfer(struct ps2_dmac* dmac) {
 
         // printf("ee: gif tag qwc=%08x madr=%08x tadr=%08x mem=%d\n", dmac->gif.qwc, dmac->gif.madr, dmac->gif.tadr, dmac->gif.tag.mem);
 
-        for (int i = 0; i < dmac->gif.qwc; i++) {
-            uint128_t q = dmac_read_qword(dmac, dmac->gif.madr);
-
-            // fprintf(file, "ee: Sending %016lx%016lx from %08x to GIF FIFO (chain)\n",
-            //     q.u64[1], q.u64[0],
-            //     dmac->gif.madr
-            // );
-
-            ps2_gif_fifo_write(dmac->bus->gif, q, GIF_PATH3);
-
-            dmac->gif.madr += 16;
-        }
+        dmac_send_to_device(dmac, &dmac->gif, DMAC_GIF);
 
         if (dmac->gif.tag.id == 1) {
             dmac->gif.tadr = dmac->gif.madr;
@@ -990,10 +1095,6 @@ void dmac_spr_from_interleave(struct ps2_dmac* dmac) {
     }
 }
 void dmac_handle_spr_from_transfer(struct ps2_dmac* dmac) {
-    dmac_set_irq(dmac, DMAC_SPR_FROM);
-
-    dmac->spr_from.chcr &= ~0x100;
-
     // fprintf(stdout, "dmac: spr_from start data=%08x dir=%d mod=%d tte=%d madr=%08x qwc=%08x tadr=%08x sadr=%08x rbor=%08x rbsr=%08x\n",
     //     dmac->spr_from.chcr,
     //     dmac->spr_from.chcr & 1,
@@ -1014,25 +1115,21 @@ void dmac_handle_spr_from_transfer(struct ps2_dmac* dmac) {
     if (dmac->mfifo_drain) {
         assert(mode == 0);
 
-        dmac->spr_from.madr = dmac->rbor | (dmac->spr_from.madr & dmac->rbsr);
-
-        for (int i = 0; i < dmac->spr_from.qwc; i++) {
-            uint128_t q = ps2_ram_read128(dmac->spr, dmac->spr_from.sadr & 0x3ff0);
-
-            ee_bus_write128(dmac->bus, dmac->spr_from.madr, q);
-            
-            mfifo_write_qword(dmac, q);
+        dmac->spr_from.madr = mfifo_wrap(dmac, dmac->spr_from.madr);
 
-            dmac->spr_from.madr = dmac->rbor | ((dmac->spr_from.madr + 0x10) & dmac->rbsr);
-            dmac->spr_from.sadr += 0x10;
-            dmac->spr_from.sadr &= 0x3ff0;
-        }
+        // STR stays set if the ring fills up, the drain resumes
+        // the transfer once it has made room
+        mfifo_fill(dmac);
 
-        dmac->spr_from.qwc = 0;
+        dmac_mfifo_drain(dmac);
 
         return;
     }
 
+    dmac_set_irq(dmac, DMAC_SPR_FROM);
+
+    dmac->spr_from.chcr &= ~0x100;
+
     if (mode == 2) {
         dmac_spr_from_interleave(dmac);
 
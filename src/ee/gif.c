@@ -196,37 +196,41 @@ void ps2_gif_write32(struct ps2_gif* gif, uint32_t addr, uint64_t data) {
 //     ps2_gs_write_internal(gif->gs, GS_FOG, data.u64[1] << 20);
 // }
 
-void gif_handle_tag(struct ps2_gif* gif, uint128_t data) {
-    // 1.0f
-    gif->q = 0x3f800000;
-
-    gif->tag.nloop = data.u64[0] & 0x7fff;
-    gif->tag.prim = (data.u64[0] >> 47) & 0x3ff;
-    gif->tag.eop = !!(data.u64[0] & 0x8000);
-    gif->tag.pre = !!(data.u64[0] & 0x400000000000ull);
-    gif->tag.fmt = (data.u64[0] >> 58) & 3;
-    gif->tag.nregs = (data.u64[0] >> 60) & 0xf;
-    gif->tag.reg = data.u64[1];
-    gif->tag.index = 0;
-
-    if (gif->tag.nregs == 0)
-        gif->tag.nregs = 16;
-
-    switch (gif->tag.fmt) {
+static inline void gif_decode_tag(struct gif_tag* tag, uint128_t data) {
+    tag->nloop = data.u64[0] & 0x7fff;
+    tag->prim = (data.u64[0] >> 47) & 0x3ff;
+    tag->eop = !!(data.u64[0] & 0x8000);
+    tag->pre = !!(data.u64[0] & 0x400000000000ull);
+    tag->fmt = (data.u64[0] >> 58) & 3;
+    tag->nregs = (data.u64[0] >> 60) & 0xf;
+    tag->reg = data.u64[1];
+    tag->index = 0;
+
+    if (tag->nregs == 0)
+        tag->nregs = 16;
+
+    switch (tag->fmt) {
         case 0: {
-            gif->tag.remaining = gif->tag.nregs * gif->tag.nloop;
-            gif->tag.qwc = gif->tag.nloop * gif->tag.nregs;
+            tag->remaining = tag->nregs * tag->nloop;
+            tag->qwc = tag->nloop * tag->nregs;
         } break;
         case 1: {
-            gif->tag.remaining = gif->tag.nregs * gif->tag.nloop;
-            gif->tag.qwc = (gif->tag.nloop * gif->tag.nregs + 1) / 2;
+            tag->remaining = tag->nregs * tag->nloop;
+            tag->qwc = (tag->nloop * tag->nregs + 1) / 2;
         } break;
         case 2:
         case 3: {
-            gif->tag.remaining = gif->tag.nloop;
-            gif->tag.qwc = gif->tag.nloop;
+            tag->remaining = tag->nloop;
+            tag->qwc = tag->nloop;
         } break;
     }
+}
+
+void gif_handle_tag(struct ps2_gif* gif, uint128_t data) {
+    // 1.0f
+    gif->q = 0x3f800000;
+
+    gif_decode_tag(&gif->tag, data);
 
     // fprintf(stdout, "giftag: nloop=%04lx eop=%d prim=%04x (pre=%d) fmt=%d nregs=%d reg=%08x%08x size=%d\n",
     //     gif->tag.nloop, gif->tag.eop, gif->tag.prim, gif->tag.pre, gif->tag.fmt, gif->tag.nregs, gif->tag.reg >> 32, gif->tag.reg & 0xffffffff, gif->tag.qwc
@@ -370,6 +374,133 @@ void ps2_gif_fifo_write(struct ps2_gif* gif, uint128_t data, int path) {
     }
 }
 
+// Hand the backend every complete packet in a span of FIFO data (i.e.
+// straight from RAM on PATH3 DMA) without queueing it up first. Packets
+// that straddle the end of the span, or a packet that was already
+// being queued, go through ps2_gif_fifo_write one qword at a time.
+size_t ps2_gif_fifo_write_span(struct ps2_gif* gif, const uint128_t* data, size_t qwc, int path) {
+    struct queue_state* queue = gif->queue[path];
+
+    size_t i = 0;
+
+    while (i < qwc) {
+        if (gif->state != GIF_STATE_RECV_TAG || queue_size(queue)) {
+            ps2_gif_fifo_write(gif, data[i++], path);
+
+            continue;
+        }
+
+        // Gather as many complete packets as we can
+        size_t end = i;
+
+        while (end < qwc) {
+            struct gif_tag tag;
+
+            gif_decode_tag(&tag, data[end]);
+
+            if (end + 1 + tag.qwc > qwc)
+                break;
+
+            gif->tag = tag;
+            gif->tag0 = data[end].u32[0];
+            gif->tag1 = data[end].u32[1];
+            gif->tag2 = data[end].u32[2];
+            gif->tag3 = data[end].u32[3];
+
+            end += 1 + tag.qwc;
+        }
+
+        if (end == i) {
+            ps2_gif_fifo_write(gif, data[i++], path);
+
+            continue;
+        }
+
+        // Set FQC when getting GIF FIFO writes
+        gif->stat |= 0x1f000000;
+        gif->q = 0x3f800000;
+
+        if (gif->transfer)
+            gif->transfer(gif->udata, path, &data[i], (end - i) * sizeof(uint128_t));
+
+        i = end;
+    }
+
+    return qwc;
+}
+
+// Hand a whole transfer (a chain of GIF packets up to EOP) straight
+// from a ring of qwords (i.e. VU1 memory on XGKICK) to the backend.
+// The tags are walked only to find where the transfer ends, the data
+// itself is never copied. A transfer that wraps around the end of the
+// ring is handed over as two spans. The backend interface only takes
+// raw spans, so backends still walk the tags themselves.
+//
+// A tag that claims more data than the ring holds is logged and
+// dropped along with everything after it, the packets before it are
+// still handed over.
+//
+// This doesn't go through the shared tag state machine, a PATH3 packet
+// that is still being queued up is left untouched and is handed over
+// whole once it completes, just like on the real arbiter.
+void ps2_gif_kick(struct ps2_gif* gif, const uint128_t* mem, uint32_t addr, uint32_t size, int path) {
+    uint32_t mask = size - 1;
+    uint32_t start = addr & mask;
+    uint32_t qwc = 0;
+
+    struct gif_tag tag;
+
+    tag.eop = 0;
+
+    while (!tag.eop) {
+        uint128_t data = mem[(start + qwc) & mask];
+
+        if ((data.u64[0] | data.u64[1]) == 0)
+            break;
+
+        gif_decode_tag(&tag, data);
+
+        gif->tag0 = data.u32[0];
+        gif->tag1 = data.u32[1];
+        gif->tag2 = data.u32[2];
+        gif->tag3 = data.u32[3];
+
+        if (qwc + 1 + tag.qwc > size) {
+            fprintf(stderr, "gif: Weird PATH%d tag at %03x nloop=%d nregs=%d eop=%d flg=%d qwc=%d, dropping it\n",
+                path + 1,
+                (start + qwc) & mask,
+                (int)tag.nloop,
+                tag.nregs,
+                tag.eop,
+                tag.fmt,
+                (int)tag.qwc
+            );
+
+            break;
+        }
+
+        qwc += 1 + tag.qwc;
+    }
+
+    if (!qwc)
+        return;
+
+    // Set FQC when getting GIF FIFO writes
+    gif->stat |= 0x1f000000;
+
+    if (!gif->transfer)
+        return;
+
+    uint32_t first = size - start;
+
+    if (qwc <= first) {
+        gif->transfer(gif->udata, path, &mem[start], qwc * sizeof(uint128_t));
+    } else {
+        gif->transfer(gif->udata, path, &mem[start], first * sizeof(uint128_t));
+        gif->transfer(gif->udata, path, &mem[0], (qwc - first) * sizeof(uint128_t));
+    }
+}
+
 void ps2_gif_set_backend(struct ps2_gif* gif, void* udata, void (*func)(void*, int, const void*, size_t)) {
     gif->udata = udata;
     gif->transfer = func; 
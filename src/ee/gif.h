@@ -68,6 +68,8 @@ uint64_t ps2_gif_read32(struct ps2_gif* gif, uint32_t addr);
 void ps2_gif_write32(struct ps2_gif* gif, uint32_t addr, uint64_t data);
 void ps2_gif_write128(struct ps2_gif* gif, uint32_t addr, uint128_t data);
 void ps2_gif_fifo_write(struct ps2_gif* gif, uint128_t data, int path);
+size_t ps2_gif_fifo_write_span(struct ps2_gif* gif, const uint128_t* data, size_t qwc, int path);
+void ps2_gif_kick(struct ps2_gif* gif, const uint128_t* mem, uint32_t addr, uint32_t size, int path);
 void ps2_gif_set_backend(struct ps2_gif* gif, void* udata, void (*func)(void*, int, const void*, size_t));
 
 #ifdef __cplusplus
@@ -27,82 +27,6 @@ void ps2_vif_destroy(struct ps2_vif* vif) {
     free(vif);
 }
 
-static inline void vif_write_vu_mem(struct ps2_vif* vif, uint128_t data) {
-    // Process mask
-    if (vif->unpack_mask) {
-        int cycle = (vif->unpack_cycle > 3) ? 3 : vif->unpack_cycle;
-        int m[4], shift = (cycle & 3) * 8;
-        uint32_t mask = (vif->mask >> shift) & 0xff;
-        m[0] = (mask >> 0) & 3;
-        m[1] = (mask >> 2) & 3;
-        m[2] = (mask >> 4) & 3;
-        m[3] = (mask >> 6) & 3;
-
-        // Note: Mode 3 is undocumented, it sets the row registers
-        //       to the value of the unpacked data, without changing
-        //       the unpacked data itself.
-        for (int i = 0; i < 4; i++) {
-            if (m[i] == 0) {
-                // Normal mode, m==0 -> write value as is
-                if (vif->mode == 0) {
-                    continue;
-                } else if (vif->mode == 1) {
-                    // Addition decompression
-                    data.u32[i] = vif->r[i] + data.u32[i];
-                } else if (vif->mode == 2) {
-                    // Subtraction decompression
-                    data.u32[i] = vif->r[i] + data.u32[i];
-                    vif->r[i] = data.u32[i];
-                } else if (vif->mode == 3) {
-                    vif->r[i] = data.u32[i];
-                }
-            } else if (m[i] == 1) {
-                data.u32[i] = vif->r[i];
-            } else if (m[i] == 2) {
-                data.u32[i] = vif->c[cycle];
-            } else {
-                // m=3 masks this fields' write, so we fetch
-                // the value from VU mem instead
-                data.u32[i] = vif->vu->vu_mem[vif->addr & 0x3ff].u32[i];
-            }
-        }
-    } else {
-        // Do mode processing only
-        for (int i = 0; i < 4; i++) {
-            if (vif->mode == 0) {
-                continue;
-            } else if (vif->mode == 1) {
-                // Offset decompression
-                data.u32[i] = vif->r[i] + data.u32[i];
-            } else if (vif->mode == 2) {
-                // Difference decompression
-                data.u32[i] = vif->r[i] + data.u32[i];
-                vif->r[i] = data.u32[i];
-            } else if (vif->mode == 3) {
-                vif->r[i] = data.u32[i];
-            }
-        }
-    }
-
-    if (vif->unpack_cl == vif->unpack_wl) {
-        // Write data normally
-        vif->vu->vu_mem[(vif->addr++) & 0x3ff] = data;
-    } else if (vif->unpack_cl > vif->unpack_wl) {
-        // Write data until unpack_wl is reached, then skip unpack_skip
-        vif->vu->vu_mem[(vif->addr++) & 0x3ff] = data;
-    } else {
-        fprintf(stderr, "vif%d: Unpack error: unpack_cl (%d) < unpack_wl (%d)\n", vif->id, vif->unpack_cl, vif->unpack_wl);
-        exit(1);
-    }
-
-    vif->unpack_cycle++;
-
-    if (vif->unpack_cycle == vif->unpack_wl) {
-        vif->addr += vif->unpack_skip;
-        vif->unpack_cycle = 0;
-    }
-}
-
 void vif0_send_irq(void* udata, int overshoot) {
     struct ps2_vif* vif = (struct ps2_vif*)udata;
 
@@ -344,6 +268,12 @@ static inline void vif_handle_fifo_write(struct ps2_vif* vif, uint32_t data) {
                 vif->unpack_skip = vif->unpack_cl - vif->unpack_wl;
                 vif->unpack_wl_count = 0;
 
+                if (!vif_unpack_select(vif)) {
+                    fprintf(stderr, "vif%d: Unimplemented unpack format %02x\n", vif->id, vif->unpack_fmt);
+
+                    exit(1);
+                }
+
                 uint32_t pack_size = 16;
 
                 if ((vl == 3 && vn == 3) == 0)
@@ -430,373 +360,72 @@ static inline void vif_handle_fifo_write(struct ps2_vif* vif, uint32_t data) {
             case 0x74: case 0x75: case 0x76: case 0x77:
             case 0x78: case 0x79: case 0x7a: case 0x7b:
             case 0x7c: case 0x7d: case 0x7e: case 0x7f: {
-                switch (vif->unpack_fmt) {
-                    // S-32
-                    case 0x00: {
-                        vif->data.u32[0] = data;
-                        vif->data.u32[1] = data;
-                        vif->data.u32[2] = data;
-                        vif->data.u32[3] = data;
-
-                        vif_write_vu_mem(vif, vif->data);
-                    } break;
-
-                    // S-16
-                    case 0x01: {
-                        for (int i = 0; i < 2; i++) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = (data >> (i * 16)) & 0xffff;
-
-                            if (!vif->unpack_usn) {
-                                q.u32[0] = (int32_t)((int16_t)q.u32[0]);
-                            }
-
-                            q.u32[1] = q.u32[0];
-                            q.u32[2] = q.u32[0];
-                            q.u32[3] = q.u32[0];
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->unpack_num--;
-
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
-
-                    // S-8
-                    case 0x02: {
-                        for (int i = 0; i < 4; i++) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = (data >> (i * 8)) & 0xff;
-
-                            if (!vif->unpack_usn) {
-                                q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                            }
-
-                            q.u32[1] = q.u32[0];
-                            q.u32[2] = q.u32[0];
-                            q.u32[3] = q.u32[0];
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->unpack_num--;
-
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
-
-                    // V2-32
-                    case 0x04: {
-                        vif->unpack_buf[vif->shift++] = data;
-
-                        if (vif->shift == 2) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = vif->unpack_buf[0];
-                            q.u32[1] = vif->unpack_buf[1];
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->shift = 0;
-
-                            vif->unpack_num--;
-
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
-
-                    // V2-16
-                    case 0x05: {
-                        uint128_t q = { 0 };
-
-                        q.u32[0] = data & 0xffff;
-                        q.u32[1] = data >> 16;
-
-                        if (!vif->unpack_usn) {
-                            q.u32[0] = (int32_t)((int16_t)q.u32[0]);
-                            q.u32[1] = (int32_t)((int16_t)q.u32[1]);
-                        }
-
-                        vif_write_vu_mem(vif, q);
-
-                        vif->unpack_num--;
-
-                        if (!vif->unpack_num)
-                            break;
-                    } break;
-
-                    // V2-8
-                    case 0x06: {
-                        for (int i = 0; i < 2; i++) {
-                            uint128_t q = { 0 };
-                            uint16_t d = data >> (i * 16);
-
-                            q.u32[0] = d & 0xff;
-                            q.u32[1] = d >> 8;
-
-                            if (!vif->unpack_usn) {
-                                q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                                q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                            }
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->unpack_num--;
-
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
-
-                    // V3-32
-                    case 0x08: {
-                        vif->unpack_buf[vif->shift++] = data;
-
-                        if (vif->shift == 3) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = vif->unpack_buf[0];
-                            q.u32[1] = vif->unpack_buf[1];
-                            q.u32[2] = vif->unpack_buf[2];
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->shift = 0;
-                            vif->unpack_num--;
+                // Words are staged until there's at least one
+                // whole vector, which then goes through the same
+                // kernel as the bulk path
+                uint8_t* buf = (uint8_t*)vif->unpack_buf;
 
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
+                memcpy(buf + vif->unpack_shift, &data, sizeof(uint32_t));
 
-                    // V3-16
-                    case 0x09: {
-                        vif->unpack_buf[vif->shift++] = data;
+                vif->unpack_shift += sizeof(uint32_t);
 
-                        if (vif->shift == (vif->unpack_shift ? 1 : 2)) {
-                            uint128_t q = { 0 };
+                uint32_t count = vif->unpack_shift / vif->unpack_size;
 
-                            if (!vif->unpack_shift) {
-                                q.u32[0] = vif->unpack_buf[0] & 0xffff;
-                                q.u32[1] = (vif->unpack_buf[0] >> 16) & 0xffff;
-                                q.u32[2] = vif->unpack_buf[1] & 0xffff;
-                            } else {
-                                q.u32[0] = vif->unpack_data;
-                                q.u32[1] = vif->unpack_buf[0] & 0xffff;
-                                q.u32[2] = vif->unpack_buf[0] >> 16;
-                            }
+                if (count > vif->unpack_num)
+                    count = vif->unpack_num;
 
-                            if (!vif->unpack_usn) {
-                                q.u32[0] = (int32_t)((int16_t)q.u32[0]);
-                                q.u32[1] = (int32_t)((int16_t)q.u32[1]);
-                                q.u32[2] = (int32_t)((int16_t)q.u32[2]);
-                            }
+                if (count) {
+                    uint32_t size = count * vif->unpack_size;
 
-                            vif_write_vu_mem(vif, q);
+                    vif->unpack_func(vif, buf, count);
+                    vif->unpack_num -= count;
+                    vif->unpack_shift -= size;
 
-                            vif->shift = 0;
-                            vif->unpack_num--;
-                            vif->unpack_shift ^= 1;
-                            vif->unpack_data = vif->unpack_buf[1] >> 16;
-
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
-
-                    // V3-8 (disgusting)
-                    case 0x0a: {
-                        uint128_t q = { 0 };
-
-                        switch (vif->unpack_shift) {
-                            case 0: {
-                                q.u32[0] = data & 0xff;
-                                q.u32[1] = (data >> 8) & 0xff;
-                                q.u32[2] = (data >> 16) & 0xff;
-
-                                vif->unpack_data = data >> 24;
-                                vif->unpack_shift++;
-
-                                if (!vif->unpack_usn) {
-                                    q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                                    q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                                    q.u32[2] = (int32_t)((int8_t)q.u32[2]);
-                                }
-
-                                vif_write_vu_mem(vif, q);
-
-                                vif->unpack_num--;
-
-                                if (!vif->unpack_num)
-                                    break;
-                            } break;
-
-                            case 1: {
-                                q.u32[0] = vif->unpack_data;
-                                q.u32[1] = data & 0xff;
-                                q.u32[2] = (data >> 8) & 0xff;
-
-                                vif->unpack_data = data >> 16;
-                                vif->unpack_shift++;
-
-                                if (!vif->unpack_usn) {
-                                    q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                                    q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                                    q.u32[2] = (int32_t)((int8_t)q.u32[2]);
-                                }
-
-                                vif_write_vu_mem(vif, q);
-
-                                vif->unpack_num--;
-
-                                if (!vif->unpack_num)
-                                    break;
-                            } break;
-
-                            case 2: {
-                                q.u32[0] = vif->unpack_data & 0xff;
-                                q.u32[1] = (vif->unpack_data >> 8) & 0xff;
-                                q.u32[2] = data & 0xff;
-
-                                vif->unpack_data = (data >> 8) & 0xffffff;
-                                vif->unpack_shift++;
-
-                                if (!vif->unpack_usn) {
-                                    q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                                    q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                                    q.u32[2] = (int32_t)((int8_t)q.u32[2]);
-                                }
-
-                                vif_write_vu_mem(vif, q);
-
-                                vif->unpack_num--;
-
-                                if (!vif->unpack_num)
-                                    break;
-
-                                q.u32[0] = (data >> 8) & 0xff;
-                                q.u32[1] = (data >> 16) & 0xff;
-                                q.u32[2] = (data >> 24) & 0xff;
-
-                                vif->unpack_shift = 0;
-
-                                if (!vif->unpack_usn) {
-                                    q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                                    q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                                    q.u32[2] = (int32_t)((int8_t)q.u32[2]);
-                                }
-
-                                vif_write_vu_mem(vif, q);
-
-                                vif->unpack_num--;
-
-                                if (!vif->unpack_num)
-                                    break;
-                            } break;
-                        }
-                    } break;
-
-                    // V4-32
-                    case 0x0c: {
-                        vif->unpack_buf[vif->shift++] = data;
-
-                        if (vif->shift == 4) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = vif->unpack_buf[0];
-                            q.u32[1] = vif->unpack_buf[1];
-                            q.u32[2] = vif->unpack_buf[2];
-                            q.u32[3] = vif->unpack_buf[3];
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->shift = 0;
-                        }
-                    } break;
-
-                    // V4-16
-                    case 0x0d: {
-                        vif->unpack_buf[vif->shift++] = data;
-
-                        if (vif->shift == 2) {
-                            uint128_t q = { 0 };
-
-                            q.u32[0] = vif->unpack_buf[0] & 0xffff;
-                            q.u32[1] = vif->unpack_buf[0] >> 16;
-                            q.u32[2] = vif->unpack_buf[1] & 0xffff;
-                            q.u32[3] = vif->unpack_buf[1] >> 16;
-
-                            if (!vif->unpack_usn) {
-                                q.u32[0] = (int32_t)((int16_t)q.u32[0]);
-                                q.u32[1] = (int32_t)((int16_t)q.u32[1]);
-                                q.u32[2] = (int32_t)((int16_t)q.u32[2]);
-                                q.u32[3] = (int32_t)((int16_t)q.u32[3]);
-                            }
-
-                            vif_write_vu_mem(vif, q);
-
-                            vif->shift = 0;
-                        }
-                    } break;
-
-                    // V4-8
-                    case 0x0e: {
-                        uint128_t q = { 0 };
+                    memmove(buf, buf + size, vif->unpack_shift);
+                }
 
-                        q.u32[0] = data & 0xff;
-                        q.u32[1] = (data >> 8) & 0xff;
-                        q.u32[2] = (data >> 16) & 0xff;
-                        q.u32[3] = (data >> 24) & 0xff;
+                if (!(--vif->pending_words)) {
+                    vif->state = VIF_IDLE;
+                }
+            } break;
+        }
+    }
+}
 
-                        if (!vif->unpack_usn) {
-                            q.u32[0] = (int32_t)((int8_t)q.u32[0]);
-                            q.u32[1] = (int32_t)((int8_t)q.u32[1]);
-                            q.u32[2] = (int32_t)((int8_t)q.u32[2]);
-                            q.u32[3] = (int32_t)((int8_t)q.u32[3]);
-                        }
+static inline void vif_handle_fifo_span(struct ps2_vif* vif, const uint32_t* data, size_t count) {
+    size_t i = 0;
 
-                        vif_write_vu_mem(vif, q);
-                    } break;
+    while (i < count) {
+        int idle = vif->state == VIF_IDLE;
 
-                    // V4-5
-                    case 0x0f: {
-                        uint128_t q = { 0 };
+        vif_handle_fifo_write(vif, data[i++]);
 
-                        for (int i = 0; i < 2; i++) {
-                            uint16_t c = (data >> (i * 16)) & 0xffff;
+        // We just got an UNPACK command and its whole payload
+        // is already here, unpack everything in one go instead
+        // of going word by word
+        if (!idle || vif->state != VIF_RECV_DATA)
+            continue;
 
-                            q.u32[0] = ((c >> 0) & 0x1f) << 3;
-                            q.u32[1] = ((c >> 5) & 0x1f) << 3;
-                            q.u32[2] = ((c >> 10) & 0x1f) << 3;
-                            q.u32[3] = ((c >> 15) & 1) << 7;
+        if ((vif->cmd & 0x60) != 0x60)
+            continue;
 
-                            vif_write_vu_mem(vif, q);
+        if (vif->pending_words > count - i)
+            continue;
 
-                            vif->unpack_num--;
+        size_t words = vif->pending_words;
 
-                            if (!vif->unpack_num)
-                                break;
-                        }
-                    } break;
+        vif_unpack(vif, &data[i]);
 
-                    default: {
-                        fprintf(stderr, "vif%d: Unimplemented unpack format %02x\n", vif->id, vif->unpack_fmt);
+        i += words;
+    }
+}
 
-                        exit(1);
-                    } break;
-                }
+// Bulk FIFO write, used by the DMAC to hand us a whole span of source
+// memory at once. Returns the number of qwords consumed.
+size_t ps2_vif_fifo_write_span(struct ps2_vif* vif, const uint128_t* data, size_t qwc) {
+    vif_handle_fifo_span(vif, (const uint32_t*)data, qwc * 4);
 
-                if (!(--vif->pending_words)) {
-                    vif->state = VIF_IDLE;
-                }
-            } break;
-        }
-    }
+    return qwc;
 }
 
 uint64_t ps2_vif_read32(struct ps2_vif* vif, uint32_t addr) {
@@ -922,17 +551,11 @@ uint128_t ps2_vif_read128(struct ps2_vif* vif, uint32_t addr) {
 void ps2_vif_write128(struct ps2_vif* vif, uint32_t addr, uint128_t data) {
     switch (addr) {
         case 0x10004000: {
-            vif_handle_fifo_write(vif, data.u32[0]);
-            vif_handle_fifo_write(vif, data.u32[1]);
-            vif_handle_fifo_write(vif, data.u32[2]);
-            vif_handle_fifo_write(vif, data.u32[3]);
+            vif_handle_fifo_span(vif, data.u32, 4);
         } break;
 
         case 0x10005000: {
-            vif_handle_fifo_write(vif, data.u32[0]);
-            vif_handle_fifo_write(vif, data.u32[1]);
-            vif_handle_fifo_write(vif, data.u32[2]);
-            vif_handle_fifo_write(vif, data.u32[3]);
+            vif_handle_fifo_span(vif, data.u32, 4);
         } break;
 
         default: {
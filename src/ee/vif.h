@@ -6,6 +6,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "u128.h"
 #include "bus.h"
@@ -55,6 +56,9 @@ enum {
 #define UNPACK_V4_8  14
 #define UNPACK_V4_5  15
 
+// fmt * usn * mask * mode * write mode, see vif_unpack.cpp
+#define VIF_UNPACK_VARIANTS 512
+
 struct ps2_vif {
     uint32_t stat;
     uint32_t fbrst;
@@ -90,9 +94,13 @@ struct ps2_vif {
     uint32_t unpack_wl_count;
     uint32_t unpack_buf[16];
     uint32_t unpack_shift;
-    uint32_t unpack_data;
+    uint32_t unpack_size;
     int unpack_mask;
     int unpack_cycle;
+    void (*unpack_func)(struct ps2_vif*, const uint8_t*, uint32_t);
+
+    // UNPACK commands seen for each kernel variant
+    uint64_t unpack_stats[VIF_UNPACK_VARIANTS];
 
     int id;
 
@@ -110,6 +118,17 @@ uint64_t ps2_vif_read32(struct ps2_vif* vif, uint32_t addr);
 void ps2_vif_write32(struct ps2_vif* vif, uint32_t addr, uint64_t data);
 uint128_t ps2_vif_read128(struct ps2_vif* vif, uint32_t addr);
 void ps2_vif_write128(struct ps2_vif* vif, uint32_t addr, uint128_t data);
+size_t ps2_vif_fifo_write_span(struct ps2_vif* vif, const uint128_t* data, size_t qwc);
+
+// UNPACK engine (vif_unpack.cpp)
+int vif_unpack_select(struct ps2_vif* vif);
+void vif_unpack(struct ps2_vif* vif, const uint32_t* data);
+void vif_print_unpack_stats(struct ps2_vif* vif, FILE* file);
+
+#ifdef IRIS_BENCH
+// UNPACK kernels against a reference, per-word and bulk, returns 0 on pass
+int ps2_vif_bench_unpack(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,542 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <vector>
+
+#ifdef _EE_USE_INTRINSICS
+#include <emmintrin.h>
+#include <smmintrin.h>
+#endif
+
+#include "vif.h"
+
+#ifdef IRIS_BENCH
+#include <chrono>
+#endif
+
+// Packet-level UNPACK engine
+//
+// Everything that stays constant for a whole UNPACK command (format,
+// signedness, masking, addition mode and write mode) is resolved at
+// compile time, vif_unpack_select picks the matching kernel when the
+// command is decoded. The kernel is then either handed the whole payload
+// at once (vif_unpack) or fed whole vectors as words trickle in through
+// the FIFO.
+
+// Size in bytes of a single packed vector
+template <int Fmt> static constexpr int vif_unpack_size() {
+    if (Fmt == UNPACK_V4_5)
+        return 2;
+
+    return (4 >> (Fmt & 3)) * ((Fmt >> 2) + 1);
+}
+
+template <int Fmt, bool Usn> static inline uint128_t vif_unpack_decode(const uint8_t* p) {
+    constexpr int vn = (Fmt >> 2) + 1;
+    constexpr int bytes = 4 >> (Fmt & 3);
+
+    uint128_t q = { 0 };
+
+    if constexpr (Fmt == UNPACK_V4_5) {
+        uint16_t c = p[0] | (p[1] << 8);
+
+        q.u32[0] = ((c >> 0) & 0x1f) << 3;
+        q.u32[1] = ((c >> 5) & 0x1f) << 3;
+        q.u32[2] = ((c >> 10) & 0x1f) << 3;
+        q.u32[3] = ((c >> 15) & 1) << 7;
+
+        return q;
+    }
+
+#ifndef _EE_USE_INTRINSICS
+    for (int i = 0; i < vn; i++) {
+        if constexpr (bytes == 4) {
+            memcpy(&q.u32[i], p + (i * 4), 4);
+        } else if constexpr (bytes == 2) {
+            uint16_t v; memcpy(&v, p + (i * 2), 2);
+
+            q.u32[i] = Usn ? (uint32_t)v : (uint32_t)(int32_t)(int16_t)v;
+        } else {
+            q.u32[i] = Usn ? (uint32_t)p[i] : (uint32_t)(int32_t)(int8_t)p[i];
+        }
+    }
+
+    if constexpr (vn == 1) {
+        q.u32[1] = q.u32[0];
+        q.u32[2] = q.u32[0];
+        q.u32[3] = q.u32[0];
+    }
+#else
+    __m128i v = _mm_setzero_si128();
+
+    memcpy(&v, p, vn * bytes);
+
+    if constexpr (bytes == 2) {
+        v = Usn ? _mm_cvtepu16_epi32(v) : _mm_cvtepi16_epi32(v);
+    } else if constexpr (bytes == 1) {
+        v = Usn ? _mm_cvtepu8_epi32(v) : _mm_cvtepi8_epi32(v);
+    }
+
+    if constexpr (vn == 1)
+        v = _mm_shuffle_epi32(v, 0);
+
+    _mm_storeu_si128((__m128i*)&q, v);
+#endif
+
+    return q;
+}
+
+// Mask (m) patterns for each write cycle, resolved once per packet
+struct vif_unpack_mask {
+    uint32_t data[4][4];
+    uint32_t row[4][4];
+    uint32_t col[4][4];
+    uint32_t mem[4][4];
+};
+
+static inline void vif_unpack_init_mask(struct ps2_vif* vif, vif_unpack_mask* m) {
+    for (int cycle = 0; cycle < 4; cycle++) {
+        uint32_t mask = vif->unpack_mask ? (vif->mask >> (cycle * 8)) & 0xff : 0;
+
+        for (int i = 0; i < 4; i++) {
+            int f = (mask >> (i * 2)) & 3;
+
+            m->data[cycle][i] = (f == 0) ? 0xffffffff : 0;
+            m->row[cycle][i] = (f == 1) ? 0xffffffff : 0;
+            m->col[cycle][i] = (f == 2) ? 0xffffffff : 0;
+            m->mem[cycle][i] = (f == 3) ? 0xffffffff : 0;
+        }
+    }
+}
+
+// Note: Mode 3 is undocumented, it sets the row registers
+//       to the value of the unpacked data, without changing
+//       the unpacked data itself.
+template <bool Mask, int Mode, bool Skip> static inline void vif_unpack_write(struct ps2_vif* vif, const vif_unpack_mask* m, uint128_t data) {
+    int cycle = (vif->unpack_cycle > 3) ? 3 : vif->unpack_cycle;
+
+    uint128_t* dst = &vif->vu->vu_mem[(vif->addr++) & 0x3ff];
+
+#ifndef _EE_USE_INTRINSICS
+    for (int i = 0; i < 4; i++) {
+        uint32_t r = vif->r[i];
+        uint32_t d = data.u32[i];
+
+        if (!Mask || m->data[cycle][i]) {
+            if constexpr (Mode == 1) {
+                d = r + d;
+            } else if constexpr (Mode == 2) {
+                d = r + d;
+                vif->r[i] = d;
+            } else if constexpr (Mode == 3) {
+                vif->r[i] = d;
+            }
+        } else if (m->row[cycle][i]) {
+            d = r;
+        } else if (m->col[cycle][i]) {
+            d = vif->c[cycle];
+        } else {
+            d = dst->u32[i];
+        }
+
+        data.u32[i] = d;
+    }
+
+    *dst = data;
+#else
+    __m128i d = _mm_loadu_si128((const __m128i*)&data);
+    __m128i r;
+
+    if constexpr (Mode != 0 || Mask)
+        r = _mm_loadu_si128((const __m128i*)vif->r);
+
+    if constexpr (Mode == 1 || Mode == 2)
+        d = _mm_add_epi32(d, r);
+
+    if constexpr (!Mask) {
+        if constexpr (Mode == 2 || Mode == 3)
+            _mm_storeu_si128((__m128i*)vif->r, d);
+
+        _mm_storeu_si128((__m128i*)dst, d);
+    } else {
+        __m128i sel = _mm_loadu_si128((const __m128i*)m->data[cycle]);
+
+        if constexpr (Mode == 2 || Mode == 3)
+            _mm_storeu_si128((__m128i*)vif->r, _mm_blendv_epi8(r, d, sel));
+
+        d = _mm_and_si128(d, sel);
+        d = _mm_or_si128(d, _mm_and_si128(r, _mm_loadu_si128((const __m128i*)m->row[cycle])));
+        d = _mm_or_si128(d, _mm_and_si128(_mm_set1_epi32(vif->c[cycle]), _mm_loadu_si128((const __m128i*)m->col[cycle])));
+        d = _mm_or_si128(d, _mm_and_si128(_mm_loadu_si128((const __m128i*)dst), _mm_loadu_si128((const __m128i*)m->mem[cycle])));
+
+        _mm_storeu_si128((__m128i*)dst, d);
+    }
+#endif
+
+    // The write cycle only matters for picking the mask pattern
+    // and for skipping writes, plain writes don't need to track it
+    if constexpr (Mask || Skip) {
+        vif->unpack_cycle++;
+
+        if (vif->unpack_cycle == vif->unpack_wl) {
+            if constexpr (Skip)
+                vif->addr += vif->unpack_skip;
+
+            vif->unpack_cycle = 0;
+        }
+    }
+}
+
+template <int Fmt, bool Usn, bool Mask, int Mode, bool Skip> static void vif_unpack_vectors(struct ps2_vif* vif, const uint8_t* src, uint32_t num) {
+    constexpr int size = vif_unpack_size<Fmt>();
+
+    vif_unpack_mask m;
+
+    if constexpr (Mask)
+        vif_unpack_init_mask(vif, &m);
+
+    for (uint32_t i = 0; i < num; i++) {
+        vif_unpack_write<Mask, Mode, Skip>(vif, &m, vif_unpack_decode<Fmt, Usn>(src));
+
+        src += size;
+    }
+}
+
+// One kernel for every combination of format, signedness, masking,
+// addition mode and write mode (plain or skipping), indexed like so:
+//   fmt[8:5] usn[4] mask[3] mode[2:1] skip[0]
+typedef void (*vif_unpack_func)(struct ps2_vif*, const uint8_t*, uint32_t);
+
+template <int I> static constexpr vif_unpack_func vif_unpack_entry() {
+    constexpr int fmt = (I >> 5) & 0xf;
+
+    // Formats 3, 7 and 11 don't exist
+    if constexpr ((fmt & 3) == 3 && fmt != UNPACK_V4_5) {
+        return nullptr;
+    } else {
+        return vif_unpack_vectors<fmt, ((I >> 4) & 1) != 0, ((I >> 3) & 1) != 0, (I >> 1) & 3, (I & 1) != 0>;
+    }
+}
+
+template <size_t... I> static constexpr std::array <vif_unpack_func, sizeof...(I)> vif_unpack_make_table(std::index_sequence <I...>) {
+    return {{ vif_unpack_entry <I>()... }};
+}
+
+static constexpr auto vif_unpack_table = vif_unpack_make_table(std::make_index_sequence <VIF_UNPACK_VARIANTS>());
+
+extern "C" int vif_unpack_select(struct ps2_vif* vif) {
+    int index = (vif->unpack_fmt << 5) |
+                (vif->unpack_usn << 4) |
+                ((vif->unpack_mask ? 1 : 0) << 3) |
+                ((vif->mode & 3) << 1) |
+                (vif->unpack_cl != vif->unpack_wl);
+
+    vif_unpack_func func = vif_unpack_table[index];
+
+    if (!func)
+        return 0;
+
+    vif->unpack_func = func;
+    vif->unpack_size = (vif->unpack_fmt == UNPACK_V4_5) ? 2 : (4 >> (vif->unpack_fmt & 3)) * ((vif->unpack_fmt >> 2) + 1);
+    vif->unpack_stats[index]++;
+
+    return 1;
+}
+
+extern "C" void vif_unpack(struct ps2_vif* vif, const uint32_t* data) {
+    vif->unpack_func(vif, (const uint8_t*)data, vif->unpack_num);
+
+    vif->unpack_num = 0;
+    vif->pending_words = 0;
+    vif->state = VIF_IDLE;
+}
+
+static const char* vif_unpack_fmt_names[] = {
+    "S-32", "S-16", "S-8", "?",
+    "V2-32", "V2-16", "V2-8", "?",
+    "V3-32", "V3-16", "V3-8", "?",
+    "V4-32", "V4-16", "V4-8", "V4-5"
+};
+
+// Prints the UNPACK variants this VIF decoded the most commands for
+// since it was initialized, along with how many variants were used
+extern "C" void vif_print_unpack_stats(struct ps2_vif* vif, FILE* file) {
+    static const char* mode_names[] = { "none", "offset", "difference", "row" };
+
+    std::vector <int> keys;
+
+    for (int i = 0; i < VIF_UNPACK_VARIANTS; i++)
+        if (vif->unpack_stats[i])
+            keys.push_back(i);
+
+    if (keys.empty())
+        return;
+
+    std::sort(keys.begin(), keys.end(), [vif](int a, int b) {
+        return vif->unpack_stats[a] > vif->unpack_stats[b];
+    });
+
+    fprintf(file, "VIF%d UNPACK variants (%zu of %d used):\n", vif->id, keys.size(), VIF_UNPACK_VARIANTS);
+
+    for (size_t i = 0; i < std::min(keys.size(), (size_t)10); i++) {
+        int k = keys[i];
+
+        fprintf(file, "  %12llu  fmt=%s%s mode=%s%s%s\n",
+            (unsigned long long)vif->unpack_stats[k],
+            vif_unpack_fmt_names[(k >> 5) & 0xf],
+            (k & 0x10) ? " usn" : "",
+            mode_names[(k >> 1) & 3],
+            (k & 8) ? " mask" : "",
+            (k & 1) ? " skip" : ""
+        );
+    }
+}
+
+#ifdef IRIS_BENCH
+// Plain per-vector UNPACK, written straight from the format, mask and
+// mode descriptions. Only used to check the kernels
+static void vif_unpack_reference(struct ps2_vif* vif, int fmt, int usn, int mask, uint32_t addr, const uint8_t* src, uint32_t num) {
+    int vn = (fmt >> 2) + 1;
+    int bytes = 4 >> (fmt & 3);
+    int cl = vif->cycle & 0xff;
+    int wl = (vif->cycle >> 8) & 0xff;
+    int cycle = 0;
+
+    for (uint32_t n = 0; n < num; n++) {
+        uint32_t d[4] = { 0, 0, 0, 0 };
+
+        if (fmt == UNPACK_V4_5) {
+            uint32_t c = src[0] | (src[1] << 8);
+
+            d[0] = (c & 0x1f) << 3;
+            d[1] = ((c >> 5) & 0x1f) << 3;
+            d[2] = ((c >> 10) & 0x1f) << 3;
+            d[3] = ((c >> 15) & 1) << 7;
+
+            src += 2;
+        } else {
+            for (int i = 0; i < vn; i++) {
+                uint32_t v = 0;
+
+                for (int b = 0; b < bytes; b++)
+                    v |= (uint32_t)src[b] << (b * 8);
+
+                if (!usn && bytes == 2) v = (int32_t)(int16_t)v;
+                if (!usn && bytes == 1) v = (int32_t)(int8_t)v;
+
+                d[i] = v;
+                src += bytes;
+            }
+
+            if (vn == 1)
+                d[1] = d[2] = d[3] = d[0];
+        }
+
+        uint128_t* dst = &vif->vu->vu_mem[addr & 0x3ff];
+        int c = (cycle > 3) ? 3 : cycle;
+
+        for (int i = 0; i < 4; i++) {
+            int f = mask ? (vif->mask >> ((c * 8) + (i * 2))) & 3 : 0;
+
+            switch (f) {
+                case 0: {
+                    switch (vif->mode & 3) {
+                        case 1: d[i] += vif->r[i]; break;
+                        case 2: d[i] += vif->r[i]; vif->r[i] = d[i]; break;
+                        case 3: vif->r[i] = d[i]; break;
+                    }
+                } break;
+                case 1: d[i] = vif->r[i]; break;
+                case 2: d[i] = vif->c[c]; break;
+                case 3: d[i] = dst->u32[i]; break;
+            }
+
+            dst->u32[i] = d[i];
+        }
+
+        addr++;
+
+        if (++cycle == wl) {
+            addr += cl - wl;
+            cycle = 0;
+        }
+    }
+}
+
+// Checks the UNPACK kernels against the reference for every format,
+// signedness, mask, mode and write mode on random VIF1 streams, fed
+// both a word at a time through the FIFO register (the per-word path)
+// and as whole spans the way the DMAC hands them over (the bulk path),
+// then times both. Returns 0 if all three give the same VU memory
+extern "C" int ps2_vif_bench_unpack(void) {
+    const int commands = 64;
+    const int passes = 20;
+
+    struct ps2_vif* vif = (struct ps2_vif*)malloc(sizeof(struct ps2_vif));
+    struct vu_state* vu = (struct vu_state*)calloc(1, sizeof(struct vu_state));
+
+    uint32_t seed = 1;
+
+    auto rand32 = [&seed]() {
+        seed = (seed * 1103515245) + 12345;
+
+        uint32_t hi = seed >> 16;
+
+        seed = (seed * 1103515245) + 12345;
+
+        return (hi << 16) | (seed >> 16);
+    };
+
+    double vectors[16] = { 0 };
+    double word_time[16] = { 0 };
+    double span_time[16] = { 0 };
+    size_t variants = 0;
+    size_t mismatches = 0;
+
+    for (int index = 0; index < VIF_UNPACK_VARIANTS; index++) {
+        int fmt = (index >> 5) & 0xf;
+        int usn = (index >> 4) & 1;
+        int mask = (index >> 3) & 1;
+        int mode = (index >> 1) & 3;
+        int skip = index & 1;
+
+        if ((fmt & 3) == 3 && fmt != UNPACK_V4_5)
+            continue;
+
+        variants++;
+
+        int wl = 1 + (rand32() & 7);
+        int cl = skip ? wl + 1 + (rand32() & 3) : wl;
+
+        uint32_t vif_mask = rand32();
+        uint32_t r[4], c[4];
+
+        for (int i = 0; i < 4; i++) {
+            r[i] = rand32();
+            c[i] = rand32();
+        }
+
+        std::vector <uint128_t> mem(0x400);
+
+        for (uint128_t& q : mem)
+            for (int i = 0; i < 4; i++)
+                q.u32[i] = rand32();
+
+        // The stream, and where each command's payload starts in it
+        struct command { uint32_t addr, num; size_t offset; };
+
+        std::vector <uint32_t> words;
+        std::vector <command> cmds;
+
+        int size = (fmt == UNPACK_V4_5) ? 2 : (4 >> (fmt & 3)) * ((fmt >> 2) + 1);
+
+        for (int n = 0; n < commands; n++) {
+            uint32_t num = 1 + (rand32() & 0xff);
+            uint32_t addr = rand32() & 0x3ff;
+            uint32_t payload = ((size * num) + 3) / 4;
+
+            words.push_back(((0x60 | (mask << 4) | fmt) << 24) | ((num & 0xff) << 16) | (usn << 14) | addr);
+
+            cmds.push_back({ addr, num, words.size() });
+
+            for (uint32_t i = 0; i < payload; i++)
+                words.push_back(rand32());
+
+            vectors[fmt] += passes * num;
+        }
+
+        while (words.size() & 3)
+            words.push_back(0);
+
+        auto reset = [&]() {
+            memset(vif, 0, sizeof(struct ps2_vif));
+
+            vif->id = 1;
+            vif->vu = vu;
+            vif->cycle = cl | (wl << 8);
+            vif->mode = mode;
+            vif->mask = vif_mask;
+
+            memcpy(vif->r, r, sizeof(r));
+            memcpy(vif->c, c, sizeof(c));
+            memcpy(vu->vu_mem, mem.data(), sizeof(vu->vu_mem));
+        };
+
+        uint128_t expected[0x400], result[0x400];
+        uint32_t expected_r[4];
+
+        reset();
+
+        for (const command& cmd : cmds)
+            vif_unpack_reference(vif, fmt, usn, mask, cmd.addr, (const uint8_t*)&words[cmd.offset], cmd.num);
+
+        memcpy(expected, vu->vu_mem, sizeof(expected));
+        memcpy(expected_r, vif->r, sizeof(expected_r));
+
+        for (int bulk = 0; bulk < 2; bulk++) {
+            double time = 0;
+
+            for (int p = 0; p < passes; p++) {
+                reset();
+
+                auto start = std::chrono::steady_clock::now();
+
+                if (bulk) {
+                    ps2_vif_fifo_write_span(vif, (const uint128_t*)words.data(), words.size() / 4);
+                } else {
+                    for (uint32_t w : words)
+                        ps2_vif_write32(vif, 0x10005000, w);
+                }
+
+                time += std::chrono::duration <double>(std::chrono::steady_clock::now() - start).count();
+            }
+
+            (bulk ? span_time : word_time)[fmt] += time;
+
+            memcpy(result, vu->vu_mem, sizeof(result));
+
+            if (memcmp(expected, result, sizeof(result)) || memcmp(expected_r, vif->r, sizeof(expected_r))) {
+                fprintf(stdout, "unpack: %s path mismatch: fmt=%s%s mode=%d%s%s\n",
+                    bulk ? "bulk" : "per-word",
+                    vif_unpack_fmt_names[fmt],
+                    usn ? " usn" : "",
+                    mode,
+                    mask ? " mask" : "",
+                    skip ? " skip" : ""
+                );
+
+                mismatches++;
+            }
+        }
+    }
+
+    fprintf(stdout, "unpack: %zu variants, %zu mismatches: %s\n",
+        variants, mismatches, mismatches ? "FAIL" : "PASS"
+    );
+
+    fprintf(stdout, "%-8s %10s %10s\n", "Format", "Per-word", "Bulk");
+
+    for (int fmt = 0; fmt < 16; fmt++) {
+        if (!vectors[fmt])
+            continue;
+
+        fprintf(stdout, "%-8s %10.1f %10.1f\n",
+            vif_unpack_fmt_names[fmt],
+            vectors[fmt] / word_time[fmt] / 1e6,
+            vectors[fmt] / span_time[fmt] / 1e6
+        );
+    }
+
+    fprintf(stdout, "Millions of vectors per second\n");
+
+    free(vu);
+    free(vif);
+
+    return mismatches ? 1 : 0;
+}
+#endif
@@ -352,82 +352,7 @@ static inline uint16_t vu_get_branch_register(struct vu_state* vu, int reg) {
 }
 
 void vu_xgkick(struct vu_state* vu) {
-    uint16_t addr = vu->xgkick_addr;
-
-    int eop = 1;
-
-    do {
-        uint128_t tag = vu_mem_read(vu, addr++);
-
-        if ((tag.u64[0] | tag.u64[1]) == 0)
-            break;
-
-        // addr &= 0x3ff;
-
-        // if (addr == 0) break;
-
-        // printf("tag: addr=%08x %08x %08x %08x %08x\n", addr - 1, tag.u32[3], tag.u32[2], tag.u32[1], tag.u32[0]);
-
-        ps2_gif_fifo_write(vu->gif, tag, GIF_PATH1);
-
-        eop = (tag.u64[0] & 0x8000) != 0;
-
-        int nloop = tag.u64[0] & 0x7fff;
-        int flg = (tag.u64[0] >> 58) & 3;
-        int nregs = (tag.u64[0] >> 60) & 0xf;
-
-        if (!nloop)
-            continue;
-
-        // if (!nregs)
-        //     nregs = 16;
-
-        int qwc = 0;
-
-        switch (flg) {
-            case 0: {
-                qwc = nregs * nloop;
-            } break;
-            case 1: {
-                qwc = (nregs * nloop + 1) / 2; // Round up for odd cases
-            } break;
-            case 2:
-            case 3: {
-                qwc = nloop;
-            } break;
-        }
-
-        if (qwc >= 0x400) {
-            fprintf(stderr, "vu: Weird xgkick tag nloop=%d nregs=%d eop=%d flg=%d qwc=%d\n",
-                nloop,
-                nregs,
-                eop,
-                flg,
-                qwc
-            ); 
-
-            exit(1);
-        }
-
-        for (int i = 0; i < qwc; i++) {
-            // printf("vu: %08x: %08x %08x %08x %08x\n",
-            //     addr,
-            //     vu->vu_mem[addr].u32[3],
-            //     vu->vu_mem[addr].u32[2],
-            //     vu->vu_mem[addr].u32[1],
-            //     vu->vu_mem[addr].u32[0]
-            // );
-
-            ps2_gif_fifo_write(vu->gif, vu_mem_read(vu, addr++), GIF_PATH1);
-
-            addr &= 0x3ff;
-
-            // if (addr == 0) {
-            //     eop = 1;
-            //     break;
-            // }
-        }
-    } while (!eop);
+    ps2_gif_kick(vu->gif, vu->vu_mem, vu->xgkick_addr, 0x400, GIF_PATH1);
 }
 
 // Upper pipeline
@@ -2520,82 +2445,7 @@ void vu_i_xgkick(struct vu_state* vu, const struct vu_instruction* ins) {
 
     // return;
 
-    uint16_t addr = VU_IS;
-
-    int eop = 1;
-
-    do {
-        uint128_t tag = vu_mem_read(vu, addr++);
-
-        if ((tag.u64[0] | tag.u64[1]) == 0)
-            break;
-
-        // addr &= 0x3ff;
-
-        // if (addr == 0) break;
-
-        // printf("tag: addr=%08x %08x %08x %08x %08x\n", addr - 1, tag.u32[3], tag.u32[2], tag.u32[1], tag.u32[0]);
-
-        ps2_gif_fifo_write(vu->gif, tag, GIF_PATH1);
-
-        eop = (tag.u64[0] & 0x8000) != 0;
-
-        int nloop = tag.u64[0] & 0x7fff;
-        int flg = (tag.u64[0] >> 58) & 3;
-        int nregs = (tag.u64[0] >> 60) & 0xf;
-
-        if (!nloop)
-            continue;
-
-        // if (!nregs)
-        //     nregs = 16;
-
-        int qwc = 0;
-
-        switch (flg) {
-            case 0: {
-                qwc = nregs * nloop;
-            } break;
-            case 1: {
-                qwc = (nregs * nloop + 1) / 2; // Round up for odd cases
-            } break;
-            case 2:
-            case 3: {
-                qwc = nloop;
-            } break;
-        }
-
-        if (qwc >= 0x400) {
-            fprintf(stderr, "vu: Weird xgkick tag nloop=%d nregs=%d eop=%d flg=%d qwc=%d\n",
-                nloop,
-                nregs,
-                eop,
-                flg,
-                qwc
-            ); 
-
-            exit(1);
-        }
-
-        for (int i = 0; i < qwc; i++) {
-            // printf("vu: %08x: %08x %08x %08x %08x\n",
-            //     addr,
-            //     vu->vu_mem[addr].u32[3],
-            //     vu->vu_mem[addr].u32[2],
-            //     vu->vu_mem[addr].u32[1],
-            //     vu->vu_mem[addr].u32[0]
-            // );
-
-            ps2_gif_fifo_write(vu->gif, vu_mem_read(vu, addr++), GIF_PATH1);
-
-            addr &= 0x3ff;
-
-            // if (addr == 0) {
-            //     eop = 1;
-            //     break;
-            // }
-        }
-    } while (!eop);
+    ps2_gif_kick(vu->gif, vu->vu_mem, VU_IS, 0x400, GIF_PATH1);
 }
 void vu_i_xitop(struct vu_state* vu, const struct vu_instruction* ins) {
     vu_set_vi(vu, VU_LD_T, vu->vif->itop);
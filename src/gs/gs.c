@@ -22,6 +22,11 @@ static inline void gs_test_gs_irq(struct ps2_gs* gs) {
     }
 }
 
+static inline void gs_sync(struct ps2_gs* gs, int reason) {
+    if (gs->sync)
+        gs->sync(gs->sync_udata, reason);
+}
+
 static inline int gs_assert_vblank(struct ps2_gs* gs) {
     if ((gs->csr & 8) == 0) {
         gs->csr |= 8;
@@ -92,6 +97,9 @@ void gs_handle_vblank_in(void* udata, int overshoot) {
     field_flip_event.name = "Field flip event";
     field_flip_event.udata = gs;
 
+    // Let the renderer catch up before the frame is presented
+    gs_sync(gs, GS_SYNC_VBLANK);
+
     // Set Vblank and Hblank flag
     if (gs_assert_vblank(gs)) {
         ps2_intc_irq(gs->ee_intc, EE_INTC_GS);
@@ -169,6 +177,9 @@ void ps2_gs_reset(struct ps2_gs* gs) {
     gs->csr |= 2;
     gs->imr = 0x00007f00;
 
+    // The scheduler has been reset along with us
+    gs->sync_poll_pending = 0;
+
     // Schedule Vblank event
     struct sched_event vblank_event;
     vblank_event.callback = gs_handle_vblank_in;
@@ -371,12 +382,22 @@ uint64_t ps2_gs_read64(struct ps2_gs* gs, uint32_t addr) {
         case 0x12001000:
         case 0x12001010:
         case 0x12001040: {
+            gs_sync(gs, GS_SYNC_CSR);
+
             return gs->csr | 0x551b0000;
         }
 
-        case 0x12001080: return gs->siglblid;
+        case 0x12001080: {
+            gs_sync(gs, GS_SYNC_PRIV);
+
+            return gs->siglblid;
+        }
+
+        case 0x12001001: {
+            gs_sync(gs, GS_SYNC_CSR);
 
-        case 0x12001001: return (gs->csr >> 8) & 0xff;
+            return (gs->csr >> 8) & 0xff;
+        }
     }
 
     printf("gs: Unhandled read from %08x\n", addr);
@@ -414,6 +435,9 @@ void ps2_gs_write64(struct ps2_gs* gs, uint32_t addr, uint64_t data) {
         case 0x120000D0: gs->extwrite = data; return;
         case 0x120000E0: gs->bgcolor = data; return;
         case 0x12001000: {
+            // SIGNAL/FINISH/LABEL may still be in flight
+            gs_sync(gs, GS_SYNC_CSR);
+
             if (data & 8) {
                 // Game is requesting vsync
                 // gs->vblank |= 1;
@@ -433,6 +457,8 @@ void ps2_gs_write64(struct ps2_gs* gs, uint32_t addr, uint64_t data) {
             int prev_signal = (gs->imr >> 8) & 1;
             int new_signal = (data >> 8) & 1;
 
+            gs_sync(gs, GS_SYNC_PRIV);
+
             gs->imr = data;
 
             if (gs->signal_pending && (prev_signal && !new_signal)) {
@@ -441,8 +467,18 @@ void ps2_gs_write64(struct ps2_gs* gs, uint32_t addr, uint64_t data) {
                 ps2_intc_irq(gs->ee_intc, EE_INTC_GS);
             }
         } return;
-        case 0x12001040: gs->busdir = data; return;
-        case 0x12001080: gs->siglblid = data; return;
+        case 0x12001040: {
+            // Local->host transfers read back whatever the GS has drawn
+            if (data & 1)
+                gs_sync(gs, GS_SYNC_BUSDIR);
+
+            gs->busdir = data;
+        } return;
+        case 0x12001080: {
+            gs_sync(gs, GS_SYNC_PRIV);
+
+            gs->siglblid = data;
+        } return;
     }
 
     fprintf(stderr, "gs: Unhandled write to %08x with data %016lx\n", addr, data);
@@ -858,10 +894,66 @@ void gs_get_privileged_state(struct ps2_gs* gs, struct gs_privileged_state* stat
     state->siglblid = gs->siglblid;
 }
 
+void gs_set_privileged_state(struct ps2_gs* gs, const struct gs_privileged_state* state) {
+    gs->pmode = state->pmode;
+    gs->smode1 = state->smode1;
+    gs->smode2 = state->smode2;
+    gs->srfsh = state->srfsh;
+    gs->synch1 = state->synch1;
+    gs->synch2 = state->synch2;
+    gs->syncv = state->syncv;
+    gs->dispfb1 = state->dispfb1;
+    gs->display1 = state->display1;
+    gs->dispfb2 = state->dispfb2;
+    gs->display2 = state->display2;
+    gs->extbuf = state->extbuf;
+    gs->extdata = state->extdata;
+    gs->extwrite = state->extwrite;
+    gs->bgcolor = state->bgcolor;
+    gs->csr = state->csr;
+    gs->imr = state->imr;
+    gs->busdir = state->busdir;
+    gs->siglblid = state->siglblid;
+
+    gs_unpack_dispfb1(gs);
+    gs_unpack_dispfb2(gs);
+}
+
 int ps2_gs_is_vblank(struct ps2_gs* gs) {
     return gs->vblank;
 }
 
+void ps2_gs_set_sync(struct ps2_gs* gs, void* udata, void (*func)(void*, int)) {
+    gs->sync_udata = udata;
+    gs->sync = func;
+}
+
+static void gs_handle_sync_poll(void* udata, int overshoot) {
+    struct ps2_gs* gs = (struct ps2_gs*)udata;
+
+    gs->sync_poll_pending = 0;
+
+    gs_sync(gs, GS_SYNC_POLL);
+}
+
+// Threaded backends raise SIGNAL/FINISH/LABEL on their own thread,
+// this makes sure they reach the EE shortly after even if the guest
+// doesn't touch the GS in the meantime
+void ps2_gs_request_sync_poll(struct ps2_gs* gs) {
+    if (gs->sync_poll_pending || !gs->sched)
+        return;
+
+    struct sched_event poll_event;
+    poll_event.callback = gs_handle_sync_poll;
+    poll_event.cycles = GS_SYNC_POLL_CYCLES;
+    poll_event.name = "GS sync poll event";
+    poll_event.udata = gs;
+
+    sched_schedule(gs->sched, poll_event);
+
+    gs->sync_poll_pending = 1;
+}
+
 int ps2_gs_write_signal(struct ps2_gs* gs, uint64_t data) {
     uint64_t mask = data >> 32;
     uint64_t value = data & mask;
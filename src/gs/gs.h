@@ -247,6 +247,19 @@ struct gs_context {
 #define GS_EVENT_VBLANK 0
 #define GS_EVENT_SCISSOR 1
 
+// Reasons for the EE to wait on a threaded renderer backend,
+// i.e. the guest is about to observe GS state
+#define GS_SYNC_CSR 0
+#define GS_SYNC_BUSDIR 1
+#define GS_SYNC_PRIV 2
+#define GS_SYNC_VBLANK 3
+
+// Doesn't wait, only delivers interrupts raised by the backend
+#define GS_SYNC_POLL 4
+#define GS_SYNC_COUNT 5
+
+#define GS_SYNC_POLL_CYCLES 4096
+
 struct ps2_gs {
     uint32_t* vram;
 
@@ -353,6 +366,11 @@ struct ps2_gs {
     // DIMX
     int dither[4][4];
 
+    // Renderer backend sync hook
+    void* sync_udata;
+    void (*sync)(void*, int);
+    int sync_poll_pending;
+
     struct sched_state* sched;
     struct ps2_intc* ee_intc;
     struct ps2_iop_intc* iop_intc;
@@ -367,6 +385,8 @@ void ps2_gs_destroy(struct ps2_gs* gs);
 uint64_t ps2_gs_read64(struct ps2_gs* gs, uint32_t addr);
 void ps2_gs_write64(struct ps2_gs* gs, uint32_t addr, uint64_t data);
 int ps2_gs_is_vblank(struct ps2_gs* gs);
+void ps2_gs_set_sync(struct ps2_gs* gs, void* udata, void (*func)(void*, int));
+void ps2_gs_request_sync_poll(struct ps2_gs* gs);
 
 struct gs_privileged_state {
     uint64_t pmode;
@@ -391,6 +411,7 @@ struct gs_privileged_state {
 };
 
 void gs_get_privileged_state(struct ps2_gs* gs, struct gs_privileged_state* state);
+void gs_set_privileged_state(struct ps2_gs* gs, const struct gs_privileged_state* state);
 
 int ps2_gs_write_signal(struct ps2_gs* gs, uint64_t data);
 int ps2_gs_write_finish(struct ps2_gs* gs, uint64_t data);
@@ -0,0 +1,522 @@
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <chrono>
+
+#include <lz4.h>
+
+#include "ee/gif.h"
+
+#include "dump.hpp"
+#include "software_thread.hpp"
+
+static void gs_dump_flush(gs_dump* dump) {
+    if (dump->chunk.empty())
+        return;
+
+    int bound = LZ4_compressBound((int)dump->chunk.size());
+
+    dump->comp.resize(bound);
+
+    int size = LZ4_compress_default(
+        (const char*)dump->chunk.data(), (char*)dump->comp.data(),
+        (int)dump->chunk.size(), bound
+    );
+
+    uint32_t hdr[2] = { (uint32_t)dump->chunk.size(), (uint32_t)size };
+
+    fwrite(hdr, sizeof(hdr), 1, dump->file);
+    fwrite(dump->comp.data(), 1, size, dump->file);
+
+    dump->bytes += sizeof(hdr) + size;
+    dump->chunk.clear();
+}
+
+static void gs_dump_append(gs_dump* dump, const void* data, size_t size) {
+    const uint8_t* ptr = (const uint8_t*)data;
+
+    while (size) {
+        size_t n = std::min(size, GS_DUMP_CHUNK_SIZE - dump->chunk.size());
+
+        dump->chunk.insert(dump->chunk.end(), ptr, ptr + n);
+
+        ptr += n;
+        size -= n;
+
+        if (dump->chunk.size() == GS_DUMP_CHUNK_SIZE)
+            gs_dump_flush(dump);
+    }
+}
+
+static void gs_dump_record(gs_dump* dump, uint32_t type, const void* data, size_t size) {
+    uint32_t hdr[2] = { type, (uint32_t)size };
+
+    gs_dump_append(dump, hdr, sizeof(hdr));
+    gs_dump_append(dump, data, size);
+}
+
+gs_dump* gs_dump_open(const char* path) {
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        fprintf(stderr, "gsdump: Couldn't open \"%s\" for writing\n", path);
+
+        return nullptr;
+    }
+
+    gs_dump_header header = {};
+
+    header.magic = GS_DUMP_MAGIC;
+    header.version = GS_DUMP_VERSION;
+    header.chunk_size = GS_DUMP_CHUNK_SIZE;
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    gs_dump* dump = new gs_dump;
+
+    dump->file = file;
+    dump->bytes = sizeof(header);
+    dump->chunk.reserve(GS_DUMP_CHUNK_SIZE);
+
+    return dump;
+}
+
+void gs_dump_close(gs_dump* dump) {
+    gs_dump_flush(dump);
+
+    fclose(dump->file);
+
+    delete dump;
+}
+
+// Snapshot of VRAM and the drawing registers. Must be taken
+// while the backend is idle, i.e. right after a frame was presented
+void gs_dump_snapshot(gs_dump* dump, struct ps2_gs* gs) {
+    gs_dump_record(dump, GS_DUMP_VRAM, gs->vram, 0x400000);
+
+    // Registers as a single A+D packet. XYZ writes, TRXDIR, SIGNAL and
+    // friends would kick off work and are left out, CLUT loads are
+    // masked out of TEX0 and TEX2
+    uint64_t packet[2 + (64 * 2)];
+    int n = 0;
+
+    auto write = [&](int reg, uint64_t data) {
+        packet[2 + (n * 2) + 0] = data;
+        packet[2 + (n * 2) + 1] = reg;
+
+        n++;
+    };
+
+    write(GS_PRMODECONT, gs->prmodecont);
+    write(GS_PRIM, gs->prim);
+    write(GS_PRMODE, gs->prmode);
+    write(GS_RGBAQ, gs->rgbaq);
+    write(GS_ST, gs->st);
+    write(GS_UV, gs->uv);
+    write(GS_FOG, gs->fog);
+
+    for (int i = 0; i < 2; i++) {
+        struct gs_context* c = &gs->context[i];
+
+        write(GS_FRAME_1 + i, c->frame);
+        write(GS_ZBUF_1 + i, c->zbuf);
+        write(GS_TEX2_1 + i, c->tex2 & ~(7ull << 61));
+        write(GS_TEX0_1 + i, c->tex0 & ~(7ull << 61));
+        write(GS_TEX1_1 + i, c->tex1);
+        write(GS_MIPTBP1_1 + i, c->miptbp1);
+        write(GS_MIPTBP2_1 + i, c->miptbp2);
+        write(GS_CLAMP_1 + i, c->clamp);
+        write(GS_TEST_1 + i, c->test);
+        write(GS_ALPHA_1 + i, c->alpha);
+        write(GS_XYOFFSET_1 + i, c->xyoffset);
+        write(GS_SCISSOR_1 + i, c->scissor);
+        write(GS_FBA_1 + i, c->fba);
+    }
+
+    write(GS_TEXCLUT, gs->texclut);
+    write(GS_SCANMSK, gs->scanmsk);
+    write(GS_TEXA, gs->texa);
+    write(GS_FOGCOL, gs->fogcol);
+    write(GS_DIMX, gs->dimx);
+    write(GS_DTHE, gs->dthe);
+    write(GS_COLCLAMP, gs->colclamp);
+    write(GS_PABE, gs->pabe);
+    write(GS_BITBLTBUF, gs->bitbltbuf);
+    write(GS_TRXPOS, gs->trxpos);
+    write(GS_TRXREG, gs->trxreg);
+
+    // NLOOP=n EOP=1 FLG=PACKED NREGS=1 REGS=A+D
+    packet[0] = (uint64_t)n | (1ull << 15) | (1ull << 60);
+    packet[1] = 0xe;
+
+    gs_dump_transfer(dump, GIF_PATH3, packet, (2 + (n * 2)) * sizeof(uint64_t));
+
+    dump->pending = false;
+}
+
+void gs_dump_transfer(gs_dump* dump, int path, const void* data, size_t size) {
+    uint32_t hdr[3] = { GS_DUMP_TRANSFER, (uint32_t)(size + 4), (uint32_t)path };
+
+    gs_dump_append(dump, hdr, sizeof(hdr));
+    gs_dump_append(dump, data, size);
+}
+
+void gs_dump_vsync(gs_dump* dump, struct ps2_gs* gs) {
+    struct gs_privileged_state state;
+
+    gs_get_privileged_state(gs, &state);
+
+    gs_dump_record(dump, GS_DUMP_VSYNC, &state, sizeof(state));
+
+    dump->frames++;
+}
+
+// Replay
+struct gs_dump_reader {
+    FILE* file = nullptr;
+
+    std::vector <uint8_t> chunk;
+    std::vector <uint8_t> comp;
+    size_t pos = 0;
+
+    // From the header, no chunk may decompress to more than this
+    uint32_t chunk_size = 0;
+
+    // Set when the file ends or breaks in the middle of something,
+    // running out of chunks between records is the normal end
+    bool corrupt = false;
+};
+
+static bool gs_dump_read(gs_dump_reader* r, void* dst, size_t size) {
+    uint8_t* ptr = (uint8_t*)dst;
+
+    while (size) {
+        if (r->pos == r->chunk.size()) {
+            uint32_t hdr[2];
+
+            size_t got = fread(hdr, 1, sizeof(hdr), r->file);
+
+            if (got != sizeof(hdr)) {
+                r->corrupt = got || (ptr != (uint8_t*)dst);
+
+                return false;
+            }
+
+            if (!hdr[0] || hdr[0] > r->chunk_size || hdr[1] > (uint32_t)LZ4_compressBound((int)r->chunk_size)) {
+                r->corrupt = true;
+
+                return false;
+            }
+
+            r->comp.resize(hdr[1]);
+            r->chunk.resize(hdr[0]);
+            r->pos = 0;
+
+            if (fread(r->comp.data(), 1, hdr[1], r->file) != hdr[1]) {
+                r->corrupt = true;
+
+                return false;
+            }
+
+            int n = LZ4_decompress_safe(
+                (const char*)r->comp.data(), (char*)r->chunk.data(),
+                (int)hdr[1], (int)hdr[0]
+            );
+
+            if (n != (int)hdr[0]) {
+                r->corrupt = true;
+
+                return false;
+            }
+        }
+
+        size_t n = std::min(size, r->chunk.size() - r->pos);
+
+        memcpy(ptr, r->chunk.data() + r->pos, n);
+
+        r->pos += n;
+        ptr += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// Reads the data of a record, a chunk at a time so a bogus size runs
+// into the end of the file before it runs out of memory
+static bool gs_dump_read_record(gs_dump_reader* r, std::vector <uint8_t>& data, size_t size) {
+    data.clear();
+
+    while (size) {
+        size_t n = std::min(size, (size_t)r->chunk_size);
+        size_t end = data.size();
+
+        data.resize(end + n);
+
+        if (!gs_dump_read(r, data.data() + end, n)) {
+            r->corrupt = true;
+
+            return false;
+        }
+
+        size -= n;
+    }
+
+    return true;
+}
+
+// Sizes a record of each type can have
+static bool gs_dump_check_record(const uint32_t* hdr) {
+    switch (hdr[0]) {
+        case GS_DUMP_VRAM: return hdr[1] == 0x400000;
+        case GS_DUMP_TRANSFER: return hdr[1] >= 4;
+        case GS_DUMP_VSYNC: return hdr[1] == sizeof(struct gs_privileged_state);
+    }
+
+    return false;
+}
+
+int gs_dump_replay(const char* path, int backend) {
+    if (backend == RENDERER_BACKEND_HARDWARE) {
+        fprintf(stderr, "gsdump: The hardware renderer needs a Vulkan device, it can't be replayed headlessly\n");
+
+        return 1;
+    }
+
+    gs_dump_reader r;
+
+    r.file = fopen(path, "rb");
+
+    if (!r.file) {
+        fprintf(stderr, "gsdump: Couldn't open \"%s\"\n", path);
+
+        return 1;
+    }
+
+    gs_dump_header header;
+
+    if (fread(&header, sizeof(header), 1, r.file) != 1 || header.magic != GS_DUMP_MAGIC) {
+        fprintf(stderr, "gsdump: \"%s\" is not a GS dump\n", path);
+
+        fclose(r.file);
+
+        return 1;
+    }
+
+    if (header.version != GS_DUMP_VERSION) {
+        fprintf(stderr, "gsdump: Unsupported dump version %u\n", header.version);
+
+        fclose(r.file);
+
+        return 1;
+    }
+
+    if (!header.chunk_size || header.chunk_size > GS_DUMP_CHUNK_SIZE) {
+        fprintf(stderr, "gsdump: Corrupt dump\n");
+
+        fclose(r.file);
+
+        return 1;
+    }
+
+    r.chunk_size = header.chunk_size;
+
+    struct ps2_gs* gs = ps2_gs_create();
+
+    memset(gs, 0, sizeof(struct ps2_gs));
+
+    // Keep GS interrupts masked from the start, there's no INTC to
+    // raise them on and the first FINISH or SIGNAL may come before
+    // the first VSYNC record
+    gs->imr = 0x7f00;
+
+    gs->vram = (uint32_t*)calloc(1, 0x400000);
+
+    struct ps2_gif gif = {};
+
+    renderer_create_info info = {};
+
+    info.gif = &gif;
+    info.gs = gs;
+    info.backend = backend;
+
+    renderer_state* renderer = renderer_create();
+
+    if (!renderer_init(renderer, info)) {
+        fprintf(stderr, "gsdump: Couldn't initialize renderer\n");
+
+        renderer_destroy(renderer);
+        free(gs->vram);
+        free(gs);
+        fclose(r.file);
+
+        return 1;
+    }
+
+    // Transfers of the frame being replayed, read ahead so only the
+    // backend is timed
+    std::vector <uint8_t> frame;
+    std::vector <uint8_t> data;
+
+    unsigned int frames = 0;
+    double total = 0.0, best = 0.0, worst = 0.0;
+
+    // Backend stats summed over every frame
+    uint64_t primitives = 0;
+    uint64_t pixels = 0;
+    uint64_t texture_uploads = 0;
+    uint64_t sprites = 0;
+    uint64_t sprite_fills = 0;
+    uint64_t sprite_copies = 0;
+
+    while (true) {
+        struct gs_privileged_state state;
+        uint32_t hdr[2];
+
+        bool vsync = false;
+
+        frame.clear();
+
+        while (!vsync && !r.corrupt && gs_dump_read(&r, hdr, sizeof(hdr))) {
+            if (!gs_dump_check_record(hdr)) {
+                r.corrupt = true;
+
+                break;
+            }
+
+            if (!gs_dump_read_record(&r, data, hdr[1]))
+                break;
+
+            switch (hdr[0]) {
+                case GS_DUMP_VRAM: {
+                    memcpy(gs->vram, data.data(), 0x400000);
+                } break;
+
+                case GS_DUMP_TRANSFER: {
+                    uint32_t p;
+
+                    memcpy(&p, data.data(), 4);
+
+                    if (p > GIF_PATH3) {
+                        r.corrupt = true;
+
+                        break;
+                    }
+
+                    frame.insert(frame.end(), (uint8_t*)hdr, (uint8_t*)(hdr + 2));
+                    frame.insert(frame.end(), data.begin(), data.end());
+                } break;
+
+                case GS_DUMP_VSYNC: {
+                    memcpy(&state, data.data(), sizeof(state));
+
+                    vsync = true;
+                } break;
+            }
+        }
+
+        if (!vsync || r.corrupt)
+            break;
+
+        // The recorded IMR would unmask them again
+        state.imr = 0x7f00;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < frame.size();) {
+            uint32_t size;
+            uint32_t p;
+
+            memcpy(&size, &frame[i + 4], 4);
+            memcpy(&p, &frame[i + 8], 4);
+
+            renderer->transfer(renderer->udata, p, &frame[i + 12], size - 4);
+
+            i += 8 + size;
+        }
+
+        gs_set_privileged_state(gs, &state);
+
+        renderer_get_frame(renderer);
+
+        double ms = std::chrono::duration <double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // FNV-1a of the displayed frame
+        uint64_t hash = 0xcbf29ce484222325ull;
+        int w, h, bpp;
+
+        uint8_t* buf = (uint8_t*)renderer_get_buffer_data(renderer, &w, &h, &bpp);
+
+        if (buf) {
+            for (size_t i = 0; i < (size_t)w * h * bpp; i++) {
+                hash ^= buf[i];
+                hash *= 0x100000001b3ull;
+            }
+        }
+
+        if (buf) {
+            printf("frame %u: %.3f ms %dx%d hash %016llx\n", frames, ms, w, h, (unsigned long long)hash);
+        } else {
+            printf("frame %u: %.3f ms\n", frames, ms);
+        }
+
+        renderer_stats* stats = renderer_get_debug_stats(renderer);
+
+        if (stats) {
+            primitives += stats->primitives;
+            pixels += stats->pixels;
+            texture_uploads += stats->texture_uploads;
+            sprites += stats->sprites;
+            sprite_fills += stats->sprite_fills;
+            sprite_copies += stats->sprite_copies;
+        }
+
+        best = frames ? std::min(best, ms) : ms;
+        worst = frames ? std::max(worst, ms) : ms;
+        total += ms;
+        frames++;
+    }
+
+    if (frames) {
+        printf("gsdump: %u frames, %.3f ms total, %.3f ms avg, %.3f ms min, %.3f ms max\n",
+            frames, total, total / frames, best, worst
+        );
+
+        // Rates are over the replay's wall time, not the render
+        // thread's busy time the overlay uses
+        if (renderer_get_debug_stats(renderer)) {
+            double s = total / 1000.0;
+
+            printf("gsdump: %llu primitives (%.0f/s), %llu pixels (%.2f M/s), %llu texture uploads\n",
+                (unsigned long long)primitives, primitives / s,
+                (unsigned long long)pixels, pixels / s / 1000000.0,
+                (unsigned long long)texture_uploads
+            );
+
+            printf("gsdump: %llu sprites, %llu generic, %llu fills (%.0f/s), %llu copies (%.0f/s)\n",
+                (unsigned long long)sprites,
+                (unsigned long long)(sprites - sprite_fills - sprite_copies),
+                (unsigned long long)sprite_fills, sprite_fills / s,
+                (unsigned long long)sprite_copies, sprite_copies / s
+            );
+        }
+
+        if (backend == RENDERER_BACKEND_SOFTWARE)
+            software_thread_print_pipeline_stats(renderer->udata, stdout);
+    } else if (!r.corrupt) {
+        printf("gsdump: No frames in dump\n");
+    }
+
+    if (r.corrupt)
+        fprintf(stderr, "gsdump: Corrupt dump\n");
+
+    renderer_destroy(renderer);
+
+    free(gs->vram);
+    free(gs);
+
+    fclose(r.file);
+
+    return r.corrupt ? 1 : 0;
+}
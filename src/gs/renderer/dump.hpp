@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+
+#include "gs/gs.h"
+
+#include "renderer.hpp"
+
+/*
+    GS dumps
+
+    A dump is a snapshot of the GS followed by every GIF transfer the
+    renderer backend received, with a marker at every frame. Replaying
+    it pushes the same stream through a backend without the rest of
+    the emulator, so renderer changes can be timed and checked against
+    the same frames over and over.
+
+    File layout:
+      - gs_dump_header
+      - LZ4 chunks (u32 raw size, u32 compressed size, data), together
+        they make up a stream of records (u32 type, u32 size, data)
+
+    Records:
+      - VRAM: 4 MB of local memory
+      - TRANSFER: u32 path, GIF packets as handed to the backend
+      - VSYNC: gs_privileged_state at the time the frame was shown
+
+    The snapshot is taken from struct ps2_gs, the software renderer
+    keeps VRAM and the drawing registers there. The registers are
+    restored through an A+D packet on PATH3 (the first TRANSFER).
+*/
+
+#define GS_DUMP_MAGIC 0x50444749 // "IGDP"
+#define GS_DUMP_VERSION 1
+
+// Uncompressed size of a chunk
+#define GS_DUMP_CHUNK_SIZE 0x100000
+
+#define GS_DUMP_VRAM 0
+#define GS_DUMP_TRANSFER 1
+#define GS_DUMP_VSYNC 2
+
+struct gs_dump_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunk_size;
+    uint32_t reserved;
+};
+
+struct gs_dump {
+    FILE* file = nullptr;
+
+    // Waiting for the next frame to take the snapshot
+    bool pending = true;
+
+    unsigned int frames = 0;
+    uint64_t bytes = 0;
+
+    std::vector <uint8_t> chunk;
+    std::vector <uint8_t> comp;
+};
+
+gs_dump* gs_dump_open(const char* path);
+void gs_dump_close(gs_dump* dump);
+void gs_dump_snapshot(gs_dump* dump, struct ps2_gs* gs);
+void gs_dump_transfer(gs_dump* dump, int path, const void* data, size_t size);
+void gs_dump_vsync(gs_dump* dump, struct ps2_gs* gs);
+
+// Replay a dump headlessly, prints the time and hash of every frame
+int gs_dump_replay(const char* path, int backend);
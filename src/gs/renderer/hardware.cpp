@@ -1,5 +1,317 @@
 #include "hardware.hpp"
 
+static inline uint64_t hardware_ring_align(uint64_t size) {
+	return (size + 15) & ~15ull;
+}
+
+static inline bool hardware_ring_empty(hardware_ring& ring) {
+	return ring.read_pos.load() == ring.write_pos.load();
+}
+
+// Runs on the EE thread with ring.mtx held. Lets a SIGNAL held back
+// by the GS thread through while the EE has to wait on the ring, it's
+// then recorded as a stalled SIGNAL by ps2_gs_write_signal
+static inline void hardware_release_signal(hardware_ring& ring) {
+	if (!ring.signal_stalled.load() || ring.signal_release)
+		return;
+
+	ring.signal_release = true;
+	ring.stats.signal_releases++;
+	ring.signal_cv.notify_one();
+}
+
+// Runs on the GS thread. A SIGNAL is held back until the EE has
+// acknowledged the previous one by clearing CSR.SIGNAL
+static bool hardware_wait_signal(hardware_ring& ring) {
+	if (ring.signals_acked.load() == ring.signals_posted.load())
+		return false;
+
+	std::unique_lock <std::mutex> lock(ring.mtx);
+
+	ring.signal_stalled = true;
+
+	// The EE may be waiting for the ring to drain
+	ring.space_cv.notify_all();
+
+	ring.signal_cv.wait(lock, [&ring] {
+		return ring.signal_release || ring.quit.load() ||
+			(ring.signals_acked.load() == ring.signals_posted.load());
+	});
+
+	ring.signal_stalled = false;
+	ring.signal_release = false;
+
+	return true;
+}
+
+static bool hardware_post_event(hardware_state* ctx, int type, uint64_t payload) {
+	hardware_ring& ring = ctx->ring;
+
+	if (!ring.running) {
+		switch (type) {
+			case HARDWARE_EVENT_SIGNAL: return ps2_gs_write_signal(ctx->gs, payload);
+			case HARDWARE_EVENT_FINISH: return ps2_gs_write_finish(ctx->gs, payload);
+			case HARDWARE_EVENT_LABEL: return ps2_gs_write_label(ctx->gs, payload);
+		}
+
+		return false;
+	}
+
+	bool stall = false;
+
+	if (type == HARDWARE_EVENT_SIGNAL)
+		stall = hardware_wait_signal(ring);
+
+	std::lock_guard <std::mutex> lock(ring.event_mtx);
+
+	ring.events.push_back({ type, payload });
+	ring.events_pending = true;
+
+	if (type == HARDWARE_EVENT_SIGNAL)
+		ring.signals_posted++;
+
+	// Same results ps2_gs_write_signal/finish/label give
+	return stall || (type == HARDWARE_EVENT_FINISH);
+}
+
+// Runs on the EE thread
+static void hardware_apply_events(hardware_state* ctx) {
+	hardware_ring& ring = ctx->ring;
+
+	if (ring.events_pending.load()) {
+		std::vector <hardware_event> events;
+
+		{
+			std::lock_guard <std::mutex> lock(ring.event_mtx);
+
+			events.swap(ring.events);
+
+			ring.events_pending = false;
+		}
+
+		for (const hardware_event& event : events) {
+			switch (event.type) {
+				case HARDWARE_EVENT_SIGNAL: {
+					ps2_gs_write_signal(ctx->gs, event.payload);
+
+					ring.signals_applied++;
+				} break;
+				case HARDWARE_EVENT_FINISH: ps2_gs_write_finish(ctx->gs, event.payload); break;
+				case HARDWARE_EVENT_LABEL: ps2_gs_write_label(ctx->gs, event.payload); break;
+			}
+		}
+	}
+
+	// CSR.SIGNAL is clear, every SIGNAL delivered so far has been
+	// acknowledged
+	if (!(ctx->gs->csr & 1) && (ring.signals_acked.load() != ring.signals_applied)) {
+		std::lock_guard <std::mutex> lock(ring.mtx);
+
+		if (ring.signal_stalled.load())
+			ring.stats.signal_stalls++;
+
+		ring.signals_acked = ring.signals_applied;
+		ring.signal_cv.notify_one();
+	}
+}
+
+bool RendererSignalHandler::on_signal(uint64_t payload) {
+	return hardware_post_event(m_ctx, HARDWARE_EVENT_SIGNAL, payload);
+}
+
+bool RendererSignalHandler::on_finish(uint64_t payload) {
+	return hardware_post_event(m_ctx, HARDWARE_EVENT_FINISH, payload);
+}
+
+bool RendererSignalHandler::on_label(uint64_t payload) {
+	return hardware_post_event(m_ctx, HARDWARE_EVENT_LABEL, payload);
+}
+
+static void hardware_ring_worker(hardware_state* ctx) {
+	hardware_ring& ring = ctx->ring;
+
+	while (true) {
+		uint64_t pos = ring.read_pos.load();
+
+		if (pos == ring.write_pos.load()) {
+			std::unique_lock <std::mutex> lock(ring.mtx);
+
+			ring.consumer_waiting = true;
+
+			ring.data_cv.wait(lock, [&ring, pos] {
+				return ring.quit.load() || (pos != ring.write_pos.load());
+			});
+
+			ring.consumer_waiting = false;
+
+			// Only quit once everything queued has been processed
+			if (pos == ring.write_pos.load())
+				return;
+
+			continue;
+		}
+
+		uint64_t offset = pos % HARDWARE_RING_SIZE;
+
+		hardware_packet* packet = (hardware_packet*)&ring.buf[offset];
+
+		if (packet->path == HARDWARE_RING_WRAP) {
+			pos += HARDWARE_RING_SIZE - offset;
+		} else {
+			ctx->interface.gif_transfer(packet->path, packet + 1, packet->size);
+
+			pos += sizeof(hardware_packet) + hardware_ring_align(packet->size);
+		}
+
+		ring.read_pos = pos;
+
+		if (ring.producer_waiting.load()) {
+			std::lock_guard <std::mutex> lock(ring.mtx);
+
+			ring.space_cv.notify_all();
+		}
+	}
+}
+
+static void hardware_ring_wait(hardware_ring& ring, uint64_t free) {
+	std::unique_lock <std::mutex> lock(ring.mtx);
+
+	ring.producer_waiting = true;
+
+	// A GS thread stalled on a SIGNAL would never make room, the EE
+	// can't acknowledge it while it's stuck in here
+	ring.space_cv.wait(lock, [&ring, free] {
+		hardware_release_signal(ring);
+
+		return (HARDWARE_RING_SIZE - (ring.write_pos.load() - ring.read_pos.load())) >= free;
+	});
+
+	ring.producer_waiting = false;
+}
+
+static void hardware_ring_push(hardware_ring& ring, int path, const uint8_t* data, uint32_t size) {
+	uint64_t pos = ring.write_pos.load();
+	uint64_t offset = pos % HARDWARE_RING_SIZE;
+	uint64_t need = sizeof(hardware_packet) + hardware_ring_align(size);
+
+	// Packets are never split across the end of the ring, skip
+	// whatever is left and start over
+	uint64_t pad = (offset + need > HARDWARE_RING_SIZE) ? HARDWARE_RING_SIZE - offset : 0;
+
+	if ((HARDWARE_RING_SIZE - (pos - ring.read_pos.load())) < (pad + need)) {
+		ring.stats.full_stalls++;
+
+		hardware_ring_wait(ring, pad + need);
+	}
+
+	if (pad) {
+		((hardware_packet*)&ring.buf[offset])->path = HARDWARE_RING_WRAP;
+
+		pos += pad;
+		offset = 0;
+	}
+
+	hardware_packet* packet = (hardware_packet*)&ring.buf[offset];
+
+	packet->path = path;
+	packet->size = size;
+
+	memcpy(packet + 1, data, size);
+
+	ring.write_pos = pos + need;
+
+	uint64_t occupancy = (pos + need) - ring.read_pos.load();
+
+	if (occupancy > ring.stats.peak_occupancy)
+		ring.stats.peak_occupancy = occupancy;
+
+	ring.stats.packets++;
+	ring.stats.bytes += size;
+
+	if (ring.consumer_waiting.load()) {
+		std::lock_guard <std::mutex> lock(ring.mtx);
+
+		ring.data_cv.notify_one();
+	}
+}
+
+static void hardware_ring_start(hardware_state* ctx) {
+	hardware_ring& ring = ctx->ring;
+
+	ring.buf = new uint8_t[HARDWARE_RING_SIZE];
+	ring.read_pos = 0;
+	ring.write_pos = 0;
+	ring.quit = false;
+	ring.signals_posted = 0;
+	ring.signals_acked = 0;
+	ring.signals_applied = 0;
+	ring.signal_release = false;
+	ring.stats = {};
+	ctx->last_ring_stats = {};
+	ring.thread = std::thread(hardware_ring_worker, ctx);
+	ring.running = true;
+
+	ps2_gs_set_sync(ctx->gs, ctx, hardware_sync);
+}
+
+static void hardware_ring_stop(hardware_state* ctx) {
+	hardware_ring& ring = ctx->ring;
+
+	if (!ring.running)
+		return;
+
+	ps2_gs_set_sync(ctx->gs, nullptr, nullptr);
+
+	{
+		std::lock_guard <std::mutex> lock(ring.mtx);
+
+		ring.quit = true;
+	}
+
+	ring.data_cv.notify_one();
+	ring.signal_cv.notify_one();
+	ring.thread.join();
+	ring.running = false;
+
+	hardware_apply_events(ctx);
+
+	delete[] ring.buf;
+
+	ring.buf = nullptr;
+}
+
+// Runs on the EE thread. Waits for the GS thread to process everything
+// queued, unless it's stalled on a SIGNAL and the caller only needs to
+// see the GS registers, then the stall is what the guest gets to see.
+// Callers that need the whole ring processed release the stall
+static void hardware_wait_idle(hardware_state* ctx, int reason, bool release) {
+	hardware_ring& ring = ctx->ring;
+
+	ring.stats.syncs[reason]++;
+
+	// Picks up an acknowledged SIGNAL before waiting on the GS thread
+	hardware_apply_events(ctx);
+
+	if (ring.running && !hardware_ring_empty(ring)) {
+		ring.stats.sync_stalls[reason]++;
+
+		std::unique_lock <std::mutex> lock(ring.mtx);
+
+		ring.producer_waiting = true;
+
+		ring.space_cv.wait(lock, [&ring, release] {
+			if (release)
+				hardware_release_signal(ring);
+
+			return hardware_ring_empty(ring) || (!release && ring.signal_stalled.load());
+		});
+
+		ring.producer_waiting = false;
+	}
+
+	hardware_apply_events(ctx);
+}
+
 void* hardware_create() {
     return new hardware_state();
 }
@@ -15,7 +327,7 @@ bool hardware_init(void* udata, const renderer_create_info& info) {
 
 	ctx->instance = new ExternallyManagedInstance(info.instance, info.instance_create_info);
 	ctx->device = new ExternallyManagedDevice(info.device, info.device_create_info);
-	ctx->signal_handler = new RendererSignalHandler(ctx->gs);
+	ctx->signal_handler = new RendererSignalHandler(ctx);
 
 	ctx->granite_ctx.set_instance_factory(ctx->instance);
 	ctx->granite_ctx.set_device_factory(ctx->device);
@@ -77,12 +389,16 @@ bool hardware_init(void* udata, const renderer_create_info& info) {
 		ctx->interface.set_super_sampling_rate(super_sampling, true, true);
 	}
 
+	hardware_ring_start(ctx);
+
     return true;
 }
 
 void hardware_reset(void* udata) {
 	hardware_state* ctx = static_cast<hardware_state*>(udata);
 
+	hardware_wait_idle(ctx, GS_SYNC_PRIV, true);
+
 	// ctx->interface.flush();
 	ctx->interface.reset_context_state();
 
@@ -97,6 +413,8 @@ void hardware_reset(void* udata) {
 void hardware_destroy(void* udata) {
     hardware_state* ctx = static_cast<hardware_state*>(udata);
 
+	hardware_ring_stop(ctx);
+
 	delete ctx->instance;
 	delete ctx->device;
 	delete ctx->signal_handler;
@@ -107,6 +425,25 @@ void hardware_destroy(void* udata) {
 renderer_image hardware_get_frame(void* udata) {
     hardware_state* ctx = static_cast<hardware_state*>(udata);
 
+	hardware_wait_idle(ctx, GS_SYNC_VBLANK, true);
+
+	// Ring stats are kept over the whole session, report the frame
+	hardware_ring_stats& cur = ctx->ring.stats;
+	hardware_ring_stats& last = ctx->last_ring_stats;
+
+	ctx->stats.ring_packets = cur.packets - last.packets;
+	ctx->stats.command_bytes = cur.bytes - last.bytes;
+	ctx->stats.ring_peak_occupancy = cur.peak_occupancy;
+	ctx->stats.ring_full_stalls = cur.full_stalls - last.full_stalls;
+	ctx->stats.signal_stalls = cur.signal_stalls - last.signal_stalls;
+	ctx->stats.signal_releases = cur.signal_releases - last.signal_releases;
+
+	for (int i = 0; i < GS_SYNC_COUNT; i++)
+		ctx->stats.ring_sync_stalls[i] = cur.sync_stalls[i] - last.sync_stalls[i];
+
+	cur.peak_occupancy = 0;
+	last = cur;
+
     struct gs_privileged_state state;
 
     gs_get_privileged_state(ctx->gs, &state);
@@ -168,6 +505,8 @@ renderer_image hardware_get_frame(void* udata) {
 
 	ScanoutResult scanout = ctx->interface.vsync(info);
 
+	hardware_apply_events(ctx);
+
 	Image* granite_image = scanout.image.get();
 
 	renderer_image image;
@@ -184,12 +523,65 @@ renderer_image hardware_get_frame(void* udata) {
 extern "C" void hardware_transfer(void* udata, int path, const void* data, size_t size) {
     hardware_state* ctx = static_cast<hardware_state*>(udata);
 
-	ctx->interface.gif_transfer(path, data, size);
+	if (!ctx->ring.running) {
+		ctx->interface.gif_transfer(path, data, size);
+
+		return;
+	}
+
+	// Deliver whatever the GS thread raised since the last packet
+	hardware_apply_events(ctx);
+
+	// Large transfers (mostly IMAGE uploads) are queued in chunks,
+	// parallel-gs keeps track of each path's state across calls
+	const uint8_t* ptr = (const uint8_t*)data;
+
+	while (size) {
+		size_t chunk = std::min(size, (size_t)HARDWARE_RING_MAX_PACKET);
+
+		hardware_ring_push(ctx->ring, path, ptr, chunk);
+
+		ptr += chunk;
+		size -= chunk;
+	}
+
+	// Deliver SIGNAL/FINISH/LABEL raised by this packet without
+	// waiting for the guest to touch the GS again
+	ps2_gs_request_sync_poll(ctx->gs);
+}
+
+extern "C" void hardware_sync(void* udata, int reason) {
+	hardware_state* ctx = static_cast<hardware_state*>(udata);
+	hardware_ring& ring = ctx->ring;
+
+	if (reason == GS_SYNC_POLL) {
+		ring.stats.syncs[reason]++;
+
+		hardware_apply_events(ctx);
+
+		// Keep delivering interrupts while the GS thread is busy
+		if (!hardware_ring_empty(ring) || ring.events_pending.load() || ring.signal_stalled.load())
+			ps2_gs_request_sync_poll(ctx->gs);
+
+		return;
+	}
+
+	// Local->host transfers read back whatever the GS has drawn,
+	// that can't wait for a SIGNAL to be acknowledged
+	hardware_wait_idle(ctx, reason, reason == GS_SYNC_BUSDIR);
+}
+
+renderer_stats* hardware_get_debug_stats(void* udata) {
+	hardware_state* ctx = static_cast<hardware_state*>(udata);
+
+	return &ctx->stats;
 }
 
 void hardware_set_config(void* udata, void* config) {
 	hardware_state* ctx = (hardware_state*)udata;
 
+	hardware_wait_idle(ctx, GS_SYNC_PRIV, true);
+
 	ctx->config = *(hardware_config*)config;
 
 	Hacks hacks = {};
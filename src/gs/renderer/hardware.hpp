@@ -2,6 +2,12 @@
 
 #include <vector>
 #include <cstdio>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
 
 #include <SDL3/SDL.h>
 
@@ -74,24 +80,96 @@ public:
 	}
 };
 
+struct hardware_state;
+
+// SIGNAL/FINISH/LABEL are raised by the GS thread, they get queued
+// here and applied to the GS on the EE thread at the next packet, sync
+// point or poll event. A SIGNAL raised while the previous one hasn't
+// been acknowledged blocks the GS thread until it is
 class RendererSignalHandler : public SignalInterface {
-	struct ps2_gs* m_gs;
+	hardware_state* m_ctx;
 
 public:
 	virtual ~RendererSignalHandler() override = default;
-	RendererSignalHandler(struct ps2_gs* gs) : m_gs(gs) {}
+	RendererSignalHandler(hardware_state* ctx) : m_ctx(ctx) {}
 
-	virtual bool on_signal(uint64_t payload) override {
-		return ps2_gs_write_signal(m_gs, payload);
-	}
+	virtual bool on_signal(uint64_t payload) override;
+	virtual bool on_finish(uint64_t payload) override;
+	virtual bool on_label(uint64_t payload) override;
+};
 
-	virtual bool on_finish(uint64_t payload) override {
-		return ps2_gs_write_finish(m_gs, payload);
-	}
+// GIF packets are copied into a single-producer/single-consumer ring
+// and handed to parallel-gs on a dedicated GS thread. Each packet is
+// a 16-byte header followed by its data, padded to 16 bytes.
+#define HARDWARE_RING_SIZE (16 * 1024 * 1024)
+#define HARDWARE_RING_MAX_PACKET (HARDWARE_RING_SIZE / 4)
+#define HARDWARE_RING_WRAP 0xffffffff
+
+enum : int {
+	HARDWARE_EVENT_SIGNAL = 0,
+	HARDWARE_EVENT_FINISH,
+	HARDWARE_EVENT_LABEL
+};
 
-	virtual bool on_label(uint64_t payload) override {
-		return ps2_gs_write_label(m_gs, payload);;
-	}
+struct hardware_event {
+	int type;
+	uint64_t payload;
+};
+
+struct hardware_packet {
+	uint32_t path;
+	uint32_t size;
+	uint32_t pad[2];
+};
+
+struct hardware_ring_stats {
+	uint64_t packets = 0;
+	uint64_t bytes = 0;
+	uint64_t peak_occupancy = 0;
+	uint64_t full_stalls = 0;
+
+	// Sync requests per GS_SYNC_* reason, and how many of them
+	// actually had to wait for the GS thread to drain the ring
+	uint64_t syncs[GS_SYNC_COUNT] = { 0 };
+	uint64_t sync_stalls[GS_SYNC_COUNT] = { 0 };
+
+	// SIGNALs the GS thread held back until they were acknowledged,
+	// and the ones let through because the EE had to wait on the ring
+	uint64_t signal_stalls = 0;
+	uint64_t signal_releases = 0;
+};
+
+struct hardware_ring {
+	uint8_t* buf = nullptr;
+
+	// Free-running byte counters, the GS thread only advances
+	// read_pos once a packet has been fully processed
+	std::atomic <uint64_t> write_pos = 0;
+	std::atomic <uint64_t> read_pos = 0;
+
+	std::thread thread;
+	std::mutex mtx;
+	std::condition_variable data_cv;
+	std::condition_variable space_cv;
+	std::atomic <bool> consumer_waiting = false;
+	std::atomic <bool> producer_waiting = false;
+	std::atomic <bool> quit = false;
+	bool running = false;
+
+	std::mutex event_mtx;
+	std::vector <hardware_event> events;
+	std::atomic <bool> events_pending = false;
+
+	// SIGNAL stall, posted is advanced by the GS thread, applied and
+	// acked by the EE thread
+	std::condition_variable signal_cv;
+	std::atomic <uint64_t> signals_posted = 0;
+	std::atomic <uint64_t> signals_acked = 0;
+	uint64_t signals_applied = 0;
+	std::atomic <bool> signal_stalled = false;
+	bool signal_release = false;
+
+	hardware_ring_stats stats;
 };
 
 struct hardware_state {
@@ -102,6 +180,11 @@ struct hardware_state {
 	ExternallyManagedInstance* instance;
 	RendererSignalHandler* signal_handler;
 	hardware_config config;
+	hardware_ring ring;
+
+	// Ring stats at the end of the last frame
+	hardware_ring_stats last_ring_stats;
+	renderer_stats stats;
 
     struct ps2_gs* gs;
     struct ps2_gif* gif;
@@ -114,6 +197,9 @@ void hardware_destroy(void* udata);
 void hardware_set_config(void* udata, void* config);
 renderer_image hardware_get_frame(void* udata);
 
+renderer_stats* hardware_get_debug_stats(void* udata);
+
 extern "C" {
 void hardware_transfer(void* udata, int path, const void* data, size_t size);
+void hardware_sync(void* udata, int reason);
 }
\ No newline at end of file
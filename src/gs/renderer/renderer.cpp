@@ -2,6 +2,18 @@
 
 #include "null.hpp"
 #include "hardware.hpp"
+#include "software_thread.hpp"
+#include "dump.hpp"
+
+// Records every transfer on its way to the backend
+static void renderer_dump_transfer(void* udata, int path, const void* data, size_t size) {
+    renderer_state* renderer = (renderer_state*)udata;
+
+    if (!renderer->dump->pending)
+        gs_dump_transfer(renderer->dump, path, data, size);
+
+    renderer->transfer(renderer->udata, path, data, size);
+}
 
 renderer_state* renderer_create(void) {
     return new renderer_state;
@@ -9,6 +21,8 @@ renderer_state* renderer_create(void) {
 
 bool renderer_init(renderer_state* renderer, const renderer_create_info& info) {
     renderer->info = info;
+    renderer->get_buffer_data = nullptr;
+    renderer->get_debug_stats = nullptr;
 
     switch (info.backend) {
         case RENDERER_BACKEND_NULL: {
@@ -22,14 +36,15 @@ bool renderer_init(renderer_state* renderer, const renderer_create_info& info) {
         } break;
 
         case RENDERER_BACKEND_SOFTWARE: {
-            // To-do: Software renderer
-            renderer->create = null_create;
-            renderer->init = null_init;
-            renderer->reset = null_reset;
-            renderer->destroy = null_destroy;
-            renderer->get_frame = null_get_frame;
-            renderer->set_config = null_set_config;
-            renderer->transfer = null_transfer;
+            renderer->create = software_thread_create;
+            renderer->init = software_thread_init;
+            renderer->reset = software_thread_reset;
+            renderer->destroy = software_thread_destroy;
+            renderer->get_frame = software_thread_get_frame;
+            renderer->set_config = software_thread_set_config;
+            renderer->transfer = software_thread_transfer;
+            renderer->get_buffer_data = software_thread_get_buffer_data;
+            renderer->get_debug_stats = software_thread_get_debug_stats;
         } break;
 
         case RENDERER_BACKEND_HARDWARE: {
@@ -40,6 +55,7 @@ bool renderer_init(renderer_state* renderer, const renderer_create_info& info) {
             renderer->get_frame = hardware_get_frame;
             renderer->set_config = hardware_set_config;
             renderer->transfer = hardware_transfer;
+            renderer->get_debug_stats = hardware_get_debug_stats;
         } break;
     }
 
@@ -54,6 +70,9 @@ bool renderer_switch(renderer_state* renderer, int backend, void* config) {
     if (backend == renderer->info.backend)
         return true;
 
+    // The new backend starts out with a blank state
+    renderer_stop_dump(renderer);
+
     renderer->destroy(renderer->udata);
 
     renderer_create_info info = renderer->info;
@@ -64,19 +83,86 @@ bool renderer_switch(renderer_state* renderer, int backend, void* config) {
 }
 
 void renderer_destroy(renderer_state* renderer) {
+    renderer_stop_dump(renderer);
+
     renderer->destroy(renderer->udata);
 
     delete renderer;
 }
 
 void renderer_reset(renderer_state* renderer) {
+    renderer_stop_dump(renderer);
+
     renderer->reset(renderer->udata);
 }
 
 renderer_image renderer_get_frame(renderer_state* renderer) {
-    return renderer->get_frame(renderer->udata);
+    renderer_image image = renderer->get_frame(renderer->udata);
+
+    // The backend is idle after presenting a frame, start recording
+    // from here
+    if (renderer->dump) {
+        if (renderer->dump->pending) {
+            gs_dump_snapshot(renderer->dump, renderer->info.gs);
+        } else {
+            gs_dump_vsync(renderer->dump, renderer->info.gs);
+        }
+    }
+
+    return image;
 }
 
 void renderer_set_config(renderer_state* renderer, void* config) {
     renderer->set_config(renderer->udata, config);
+}
+
+void* renderer_get_buffer_data(renderer_state* renderer, int* w, int* h, int* bpp) {
+    if (!renderer->get_buffer_data)
+        return nullptr;
+
+    return renderer->get_buffer_data(renderer->udata, w, h, bpp);
+}
+
+renderer_stats* renderer_get_debug_stats(renderer_state* renderer) {
+    if (!renderer->get_debug_stats)
+        return nullptr;
+
+    return renderer->get_debug_stats(renderer->udata);
+}
+
+bool renderer_start_dump(renderer_state* renderer, const char* path) {
+    renderer_stop_dump(renderer);
+
+    // The snapshot is taken from struct ps2_gs, only the software
+    // renderer keeps VRAM there. Anything else would record a stale
+    // VRAM, even at boot, as uploads before the first frame are lost
+    if (renderer->info.backend != RENDERER_BACKEND_SOFTWARE) {
+        fprintf(stderr, "renderer: GS dumps can only be recorded with the software renderer\n");
+
+        return false;
+    }
+
+    renderer->dump = gs_dump_open(path);
+
+    if (!renderer->dump)
+        return false;
+
+    ps2_gif_set_backend(renderer->info.gif, renderer, renderer_dump_transfer);
+
+    return true;
+}
+
+void renderer_stop_dump(renderer_state* renderer) {
+    if (!renderer->dump)
+        return;
+
+    gs_dump_close(renderer->dump);
+
+    renderer->dump = nullptr;
+
+    ps2_gif_set_backend(renderer->info.gif, renderer->udata, renderer->transfer);
+}
+
+bool renderer_is_dumping(renderer_state* renderer) {
+    return renderer->dump != nullptr;
 }
\ No newline at end of file
@@ -40,6 +40,37 @@ struct renderer_stats {
     unsigned int texture_uploads = 0;
     unsigned int texture_blits = 0;
     unsigned int frames_rendered = 0;
+    unsigned int pixels = 0;
+    uint64_t pixels_total = 0;
+    float primitives_per_second = 0.0f;
+    float pixels_per_second = 0.0f;
+    unsigned int threads = 0;
+    unsigned int tile_batches = 0;
+    unsigned int tile_barriers = 0;
+    unsigned int serial_primitives = 0;
+    unsigned int sprite_fills = 0;
+    unsigned int sprite_copies = 0;
+    float sprite_fills_per_second = 0.0f;
+    float sprite_copies_per_second = 0.0f;
+    unsigned int hiz_culled = 0;
+    float hiz_cull_rate = 0.0f;
+    unsigned int texture_hits = 0;
+    unsigned int texture_misses = 0;
+    unsigned int texture_invalidations = 0;
+    uint64_t texture_bytes_decoded = 0;
+    uint64_t command_bytes = 0;
+    unsigned int render_wakeups = 0;
+    float render_thread_usage = 0.0f;
+    float frame_readout_ms = 0.0f;
+
+    // Threaded hardware backend, GIF ring use and what the EE had to
+    // wait on during the frame
+    unsigned int ring_packets = 0;
+    uint64_t ring_peak_occupancy = 0;
+    unsigned int ring_full_stalls = 0;
+    unsigned int ring_sync_stalls[GS_SYNC_COUNT] = { 0 };
+    unsigned int signal_stalls = 0;
+    unsigned int signal_releases = 0;
 };
 /*
     An Iris renderer consists of two APIs, a backend API that receives
@@ -76,10 +107,15 @@ struct renderer_image {
     unsigned int height;
 };
 
+struct gs_dump;
+
 struct renderer_state {
     struct ps2_gif* gif = nullptr;
     void* udata = nullptr;
 
+    // GS dump being recorded, if any
+    gs_dump* dump = nullptr;
+
     renderer_create_info info = {};
 
     void* (*create)();
@@ -89,6 +125,10 @@ struct renderer_state {
     renderer_image (*get_frame)(void* udata);
     void (*transfer)(void* udata, int path, const void* data, size_t size);
     void (*set_config)(void* udata, void* config);
+
+    // Optional, only backends that render to system memory
+    void* (*get_buffer_data)(void* udata, int* w, int* h, int* bpp);
+    renderer_stats* (*get_debug_stats)(void* udata);
 };
 
 renderer_state* renderer_create(void);
@@ -98,4 +138,9 @@ void renderer_reset(renderer_state* renderer);
 void renderer_destroy(renderer_state* renderer);
 void renderer_set_config(renderer_state* renderer, void* config);
 
-renderer_image renderer_get_frame(renderer_state* renderer);
\ No newline at end of file
+renderer_image renderer_get_frame(renderer_state* renderer);
+void* renderer_get_buffer_data(renderer_state* renderer, int* w, int* h, int* bpp);
+renderer_stats* renderer_get_debug_stats(renderer_state* renderer);
+bool renderer_start_dump(renderer_state* renderer, const char* path);
+void renderer_stop_dump(renderer_state* renderer);
+bool renderer_is_dumping(renderer_state* renderer);
\ No newline at end of file
@@ -2,110 +2,57 @@
 #include <cstring>
 #include <cstdio>
 #include <cmath>
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <bit>
+#include <type_traits>
 
-#include "gs/gs.h"
-#include "software_thread.hpp"
+#ifdef _EE_USE_INTRINSICS
+#include <immintrin.h>
 
-// INCBIN stuff
-#define INCBIN_PREFIX g_
-#define INCBIN_STYLE INCBIN_STYLE_SNAKE
+#ifdef _MSC_VER
+#include <intrin.h>
 
-#include "incbin.h"
-
-#ifdef __APPLE__
-#define SHADER_FORMAT SDL_GPU_SHADERFORMAT_MSL
-#define SHADER_ENTRYPOINT "main0"
-INCBIN(vertex_shader, "../shaders/vertex.msl");
-INCBIN(fragment_shader, "../shaders/fragment.msl");
-INCBIN_EXTERN(vertex_shader);
-INCBIN_EXTERN(fragment_shader);
+#define SOFTWARE_AVX2
 #else
-#define SHADER_FORMAT SDL_GPU_SHADERFORMAT_SPIRV
-#define SHADER_ENTRYPOINT "main"
-INCBIN(vertex_shader, "../shaders/vertex.spv");
-INCBIN(fragment_shader, "../shaders/fragment.spv");
-INCBIN_EXTERN(vertex_shader);
-INCBIN_EXTERN(fragment_shader);
+#define SOFTWARE_AVX2 __attribute__((target("avx2")))
+#endif
 #endif
 
-#include <SDL3/SDL.h>
+#include "gs/gs.h"
+#include "software_thread.hpp"
+
+
+// Swizzle tables
+//
+// A page is always 2048 words, but its size in pixels, and the order
+// blocks and columns are laid out within it, depend on the format.
+// The tables below describe one level of the swizzle each, the
+// *_swizzle functions combine them into the word offset of a pixel
+// within its page, and the *_page tables hold that offset for every
+// pixel of a page so addressing a pixel only takes one lookup.
 
-int psmct32_block[] = {
+static constexpr int psmct32_block[] = {
     0 , 1 , 4 , 5 , 16, 17, 20, 21,
     2 , 3 , 6 , 7 , 18, 19, 22, 23,
     8 , 9 , 12, 13, 24, 25, 28, 29,
     10, 11, 14, 15, 26, 27, 30, 31
 };
 
-int psmct32_column[] = {
+static constexpr int psmct32_column[] = {
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     2 , 3 , 6 , 7 , 10, 11, 14, 15
 };
 
-static inline int psmct32_addr(int base, int width, int x, int y) {
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 5) * width);
-    int blkx = (x >> 3) & 7;
-    int blky = (y >> 3) & 3;
-    int blk = blkx + (blky * 8);
-    int col = (y >> 1) & 3;
-    int idx = (x & 7) + ((y & 1) * 8);
-
-    // Unswizzle block
-    blk = psmct32_block[blk];
-
-    // Unswizzle column
-    idx = psmct32_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-int psmz32_block[] = {
+static constexpr int psmz32_block[] = {
     24, 25, 28, 29, 8 , 9 , 12, 13,
     26, 27, 30, 31, 10, 11, 14, 15,
     16, 17, 20, 21, 0 , 1 , 4 , 5 ,
     18, 19, 22, 23, 2 , 3 , 6 , 7
 };
 
-static inline int psmz32_addr(int base, int width, int x, int y) {
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 5) * width);
-    int blkx = (x >> 3) & 7;
-    int blky = (y >> 3) & 3;
-    int blk = blkx + (blky * 8);
-    int col = (y >> 1) & 3;
-    int idx = (x & 7) + ((y & 1) * 8);
-
-    // Unswizzle block
-    blk = psmz32_block[blk];
-
-    // Unswizzle column
-    idx = psmct32_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-int psmct16_block[] = {
+static constexpr int psmct16_block[] = {
     0 , 2 , 8 , 10,
     1 , 3 , 9 , 11,
     4 , 6 , 12, 14,
@@ -116,7 +63,7 @@ int psmct16_block[] = {
     21, 23, 29, 31
 };
 
-int psmz16_block[] = {
+static constexpr int psmz16_block[] = {
     24, 26, 16, 18,
     25, 27, 17, 19,
     28, 30, 20, 22,
@@ -127,81 +74,21 @@ int psmz16_block[] = {
     13, 15, 5 , 7
 };
 
-int psmct16_column[] = {
+static constexpr int psmct16_column[] = {
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     2 , 3 , 6 , 7 , 10, 11, 14, 15,
     2 , 3 , 6 , 7 , 10, 11, 14, 15
 };
 
-int psmct16_shift[] = {
+static constexpr int psmct16_shift[] = {
     0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 ,
     1 , 1 , 1 , 1 , 1 , 1 , 1 , 1 ,
     0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 ,
     1 , 1 , 1 , 1 , 1 , 1 , 1 , 1 
 };
 
-static inline int psmct16_addr(int base, int width, int x, int y) {
-    // page            block          column
-    // 64 x 64 pixels  16 x 8 pixels  16 x 2 pixels
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 6) * width);
-    int blkx = (x >> 4) & 3;
-    int blky = (y >> 3) & 7;
-    int blk = blkx + (blky * 4);
-    int col = (y >> 1) & 3;
-    int idx = (x & 15) + ((y & 1) * 16);
-
-    // Unswizzle block
-    blk = psmct16_block[blk];
-
-    // Unswizzle column
-    idx = psmct16_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-static inline int psmz16_addr(int base, int width, int x, int y) {
-    // page            block          column
-    // 64 x 64 pixels  16 x 8 pixels  16 x 2 pixels
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 6) * width);
-    int blkx = (x >> 4) & 3;
-    int blky = (y >> 3) & 7;
-    int blk = blkx + (blky * 4);
-    int col = (y >> 1) & 3;
-    int idx = (x & 15) + ((y & 1) * 16);
-
-    // Unswizzle block
-    blk = psmz16_block[blk];
-
-    // Unswizzle column
-    idx = psmct16_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-int psmct16s_block[] = {
+static constexpr int psmct16s_block[] = {
     0 , 2 , 16, 18,
     1 , 3 , 17, 19,
     8 , 10, 24, 26,
@@ -212,7 +99,7 @@ int psmct16s_block[] = {
     13, 15, 29, 31
 };
 
-int psmz16s_block[] = {
+static constexpr int psmz16s_block[] = {
     24, 26, 8 , 10,
     25, 27, 9 , 11,
     16, 18, 0 , 2 ,
@@ -223,67 +110,7 @@ int psmz16s_block[] = {
     21, 23, 5 , 7
 };
 
-static inline int psmct16s_addr(int base, int width, int x, int y) {
-    // page            block          column
-    // 64 x 64 pixels  16 x 8 pixels  16 x 2 pixels
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 6) * width);
-    int blkx = (x >> 4) & 3;
-    int blky = (y >> 3) & 7;
-    int blk = blkx + (blky * 4);
-    int col = (y >> 1) & 3;
-    int idx = (x & 15) + ((y & 1) * 16);
-
-    // Unswizzle block
-    blk = psmct16s_block[blk];
-
-    // Unswizzle column
-    idx = psmct16_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-static inline int psmz16s_addr(int base, int width, int x, int y) {
-    // page            block          column
-    // 64 x 64 pixels  16 x 8 pixels  16 x 2 pixels
-    // base expressed in blocks
-    // 1 page = 64x32 = 8 KiB = 2048 words
-    // 1 block = 8x8 = 256 B = 64 words
-    // 1 column = 8x2 = 64 B = 16 words
-
-    int page = (x >> 6) + ((y >> 6) * width);
-    int blkx = (x >> 4) & 3;
-    int blky = (y >> 3) & 7;
-    int blk = blkx + (blky * 4);
-    int col = (y >> 1) & 3;
-    int idx = (x & 15) + ((y & 1) * 16);
-
-    // Unswizzle block
-    blk = psmct16s_block[blk];
-
-    // Unswizzle column
-    idx = psmct16_column[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-int psmt8_column_02[] = {
+static constexpr int psmt8_column_02[] = {
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     2 , 3 , 6 , 7 , 10, 11, 14, 15,
@@ -294,7 +121,7 @@ int psmt8_column_02[] = {
     10, 11, 14, 15, 2 , 3 , 6 , 7
 };
 
-int psmt8_column_13[] = {
+static constexpr int psmt8_column_13[] = {
     8 , 9 , 12, 13, 0 , 1 , 4 , 5 ,
     8 , 9 , 12, 13, 0 , 1 , 4 , 5 ,
     10, 11, 14, 15, 2 , 3 , 6 , 7 ,
@@ -305,7 +132,7 @@ int psmt8_column_13[] = {
     2 , 3 , 6 , 7 , 10, 11, 14, 15
 };
 
-int psmt8_shift[] = {
+static constexpr int psmt8_shift[] = {
     0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 ,
     2 , 2 , 2 , 2 , 2 , 2 , 2 , 2 ,
     0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 ,
@@ -316,48 +143,14 @@ int psmt8_shift[] = {
     3 , 3 , 3 , 3 , 3 , 3 , 3 , 3
 };
 
-static inline int psmt8_addr(int base, int width, int x, int y) {
-    // page            block          column
-    // 128 x 64 pixels 16 x 16 pixels 16 x 4 pixels
-    // base expressed in blocks
-    // 1 page = 128x64 = 8 KiB = 2048 words
-    // 1 block = 16x16 = 256 B = 64 words
-    // 1 column = 16x4 = 64 B = 16 words
-    // 1 page = 128/4x64 = 32x64 words
-    // 1 block = 16/4x16 = 4x16 words
-    // 1 column = 16/4x4 = 4x4 words
-
-    int page = (x >> 7) + ((y >> 6) * (width >> 1));
-    int blkx = (x >> 4) & 7;
-    int blky = (y >> 4) & 3;
-    int blk = blkx + (blky * 8);
-    int col = (y >> 2) & 3;
-    int idx = (x & 15) + ((y & 3) * 16);
-    // int shift = (x & 3) * 16;
-
-    // Unswizzle block
-    blk = psmct32_block[blk];
-
-    // Unswizzle column
-    idx = (col & 1) ? psmt8_column_13[idx] : psmt8_column_02[idx];
-
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
-
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
-}
-
-int psmt4_block[] = {
+static constexpr int psmt4_block[] = {
     0 , 2 , 8 , 10, 1 , 3 , 9 , 11,
     4 , 6 , 12, 14, 5 , 7 , 13, 15,
     16, 18, 24, 26, 17, 19, 25, 27,
     20, 22, 28, 30, 21, 23, 29, 31
 };
 
-int psmt4_column_02[] = {
+static constexpr int psmt4_column_02[] = {
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
     0 , 1 , 4 , 5 , 8 , 9 , 12, 13,
@@ -376,7 +169,7 @@ int psmt4_column_02[] = {
     10, 11, 14, 15, 2 , 3 , 6 , 7
 };
 
-int psmt4_column_13[] = {
+static constexpr int psmt4_column_13[] = {
     8 , 9 , 12, 13, 0 , 1 , 4 , 5 ,
     8 , 9 , 12, 13, 0 , 1 , 4 , 5 ,
     8 , 9 , 12, 13, 0 , 1 , 4 , 5 ,
@@ -395,7 +188,7 @@ int psmt4_column_13[] = {
     2 , 3 , 6 , 7 , 10, 11, 14, 15
 };
 
-int psmt4_shift[] = {
+static constexpr int psmt4_shift[] = {
     0 , 0 , 0 , 0 , 0 , 0 , 0 , 0 ,
     8 , 8 , 8 , 8 , 8 , 8 , 8 , 8 ,
     16, 16, 16, 16, 16, 16, 16, 16,
@@ -414,30 +207,123 @@ int psmt4_shift[] = {
     28, 28, 28, 28, 28, 28, 28, 28
 };
 
-static inline int psmt4_addr(int base, int width, int x, int y) {
-    // page             block          column
-    // 128 x 128 pixels 32 x 16 pixels 32 x 4 pixels
-    int page = (x >> 7) + ((y >> 7) * (width >> 1));
-    int blkx = (x >> 5) & 3;
-    int blky = (y >> 4) & 7;
-    int blk = blkx + (blky * 4);
+// 32-bit formats
+// page            block          column
+// 64 x 32 pixels  8 x 8 pixels   8 x 2 pixels
+// 1 page = 64x32 = 8 KiB = 2048 words
+// 1 block = 8x8 = 256 B = 64 words
+// 1 column = 8x2 = 64 B = 16 words
+template <const int* Block> static constexpr int psm32_swizzle(int x, int y) {
+    int blk = ((x >> 3) & 7) + (((y >> 3) & 3) * 8);
+    int col = (y >> 1) & 3;
+    int idx = (x & 7) + ((y & 1) * 8);
+
+    return (Block[blk] * 64) + (col * 16) + psmct32_column[idx];
+}
+
+// 16-bit formats
+// page            block          column
+// 64 x 64 pixels  16 x 8 pixels  16 x 2 pixels
+template <const int* Block> static constexpr int psm16_swizzle(int x, int y) {
+    int blk = ((x >> 4) & 3) + (((y >> 3) & 7) * 4);
+    int col = (y >> 1) & 3;
+    int idx = (x & 15) + ((y & 1) * 16);
+
+    return (Block[blk] * 64) + (col * 16) + psmct16_column[idx];
+}
+
+// page            block          column
+// 128 x 64 pixels 16 x 16 pixels 16 x 4 pixels
+static constexpr int psmt8_swizzle(int x, int y) {
+    int blk = ((x >> 4) & 7) + (((y >> 4) & 3) * 8);
     int col = (y >> 2) & 3;
-    int idx = (x & 31) + ((y & 3) * 32);
-    // int shift = (x & 3) * 16;
+    int idx = (x & 15) + ((y & 3) * 16);
+
+    idx = (col & 1) ? psmt8_column_13[idx] : psmt8_column_02[idx];
+
+    return (psmct32_block[blk] * 64) + (col * 16) + idx;
+}
 
-    // Unswizzle block
-    blk = psmt4_block[blk];
+// page             block          column
+// 128 x 128 pixels 32 x 16 pixels 32 x 4 pixels
+static constexpr int psmt4_swizzle(int x, int y) {
+    int blk = ((x >> 5) & 3) + (((y >> 4) & 7) * 4);
+    int col = (y >> 2) & 3;
+    int idx = (x & 31) + ((y & 3) * 32);
 
-    // Unswizzle column
     idx = (col & 1) ? psmt4_column_13[idx] : psmt4_column_02[idx];
 
-    // printf("(%x, %d, %d, %d) -> p=%d b=%d c=%d addr=%08x\n",
-    //     base, width, x, y,
-    //     page, blk, cl,
-    //     (page * 2048) + (base * 64) + (blk * 64) + cl
-    // );
+    return (psmt4_block[blk] * 64) + (col * 16) + idx;
+}
+
+// Word offset within the page for every pixel of a page, indexed
+// by (y * width) + x, the page width being a power of two
+template <int W, int H, int (*Swizzle)(int, int)> static constexpr std::array <uint16_t, W * H> gs_make_page_table() {
+    std::array <uint16_t, W * H> table = {};
+
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            table[(y * W) + x] = Swizzle(x, y);
+
+    return table;
+}
+
+static constexpr auto psmct32_page = gs_make_page_table <64, 32, psm32_swizzle <psmct32_block>>();
+static constexpr auto psmz32_page = gs_make_page_table <64, 32, psm32_swizzle <psmz32_block>>();
+static constexpr auto psmct16_page = gs_make_page_table <64, 64, psm16_swizzle <psmct16_block>>();
+static constexpr auto psmz16_page = gs_make_page_table <64, 64, psm16_swizzle <psmz16_block>>();
+static constexpr auto psmct16s_page = gs_make_page_table <64, 64, psm16_swizzle <psmct16s_block>>();
+static constexpr auto psmt8_page = gs_make_page_table <128, 64, psmt8_swizzle>();
+static constexpr auto psmt4_page = gs_make_page_table <128, 128, psmt4_swizzle>();
+
+// base expressed in blocks, width in 64 pixel units
+static inline int psmct32_addr(int base, int width, int x, int y) {
+    int page = (x >> 6) + ((y >> 5) * width);
+
+    return (page * 2048) + (base * 64) + psmct32_page[((y & 31) << 6) | (x & 63)];
+}
+
+static inline int psmz32_addr(int base, int width, int x, int y) {
+    int page = (x >> 6) + ((y >> 5) * width);
 
-    return (page * 2048) + ((base + blk) * 64) + (col * 16) + idx;
+    return (page * 2048) + (base * 64) + psmz32_page[((y & 31) << 6) | (x & 63)];
+}
+
+static inline int psmct16_addr(int base, int width, int x, int y) {
+    int page = (x >> 6) + ((y >> 6) * width);
+
+    return (page * 2048) + (base * 64) + psmct16_page[((y & 63) << 6) | (x & 63)];
+}
+
+static inline int psmz16_addr(int base, int width, int x, int y) {
+    int page = (x >> 6) + ((y >> 6) * width);
+
+    return (page * 2048) + (base * 64) + psmz16_page[((y & 63) << 6) | (x & 63)];
+}
+
+static inline int psmct16s_addr(int base, int width, int x, int y) {
+    int page = (x >> 6) + ((y >> 6) * width);
+
+    return (page * 2048) + (base * 64) + psmct16s_page[((y & 63) << 6) | (x & 63)];
+}
+
+// Note: PSMZ16S has its own block table, but addressing it through
+//       the PSMCT16S layout is what we've always done, keep it that
+//       way until it can be checked against hardware
+static inline int psmz16s_addr(int base, int width, int x, int y) {
+    return psmct16s_addr(base, width, x, y);
+}
+
+static inline int psmt8_addr(int base, int width, int x, int y) {
+    int page = (x >> 7) + ((y >> 6) * (width >> 1));
+
+    return (page * 2048) + (base * 64) + psmt8_page[((y & 63) << 7) | (x & 127)];
+}
+
+static inline int psmt4_addr(int base, int width, int x, int y) {
+    int page = (x >> 7) + ((y >> 7) * (width >> 1));
+
+    return (page * 2048) + (base * 64) + psmt4_page[((y & 127) << 7) | (x & 127)];
 }
 
 static const int psmt8_clut_block[] = {
@@ -475,251 +361,1008 @@ static const int psmt8_clut_block[] = {
     0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
 };
 
-void render_point(struct ps2_gs* gs, void* udata);
-void render_line(struct ps2_gs* gs, void* udata);
-void render_triangle(struct ps2_gs* gs, void* udata);
-void render_sprite(struct ps2_gs* gs, void* udata);
+void render_point(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip);
+void render_line(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip);
+void render_triangle(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip);
+void render_sprite(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip);
 void transfer_start(struct ps2_gs* gs, void* udata);
 void transfer_write(struct ps2_gs* gs, void* udata);
 void transfer_read(struct ps2_gs* gs, void* udata);
+static void software_pipeline_select(software_thread_state* ctx, render_data* rdata, bool serial);
+
+// Pixels that made it to the pixel pipeline and bytes of texels
+// decoded into the texture cache, counted per rendering thread and
+// added to ctx->pixels and ctx->texture_decoded once a batch is done
+static thread_local uint64_t software_thread_pixel_count = 0;
+static thread_local uint64_t software_thread_decoded_count = 0;
+
+// Pixels a primitive covered but never shaded, their block being
+// behind everything the depth test would compare them against
+static thread_local uint64_t software_thread_hiz_culled = 0;
+
+static const software_clip software_clip_full = { 0, 0, 2048, 2048 };
+
+static inline void software_thread_draw(software_thread_state* ctx, render_data* rdata, const software_clip& clip) {
+    switch (rdata->prim) {
+        case 0: render_point(&rdata->gs, rdata->pipe, clip); break;
+        case 1: render_line(&rdata->gs, rdata->pipe, clip); break;
+        case 2: render_triangle(&rdata->gs, rdata->pipe, clip); break;
+        case 3: render_sprite(&rdata->gs, rdata->pipe, clip); break;
+    }
+}
 
-void software_thread_render_thread(software_thread_state* ctx) {
-    while (!ctx->end_signal) {
-        while (true) {
-            ctx->queue_mtx.lock();
-
-            if (ctx->render_queue.empty()) {
-                ctx->queue_mtx.unlock();
+// Walk a primitive's bounds one tile at a time instead of in raster
+// order, so the frame and Z buffer pixels touched in a row of tiles
+// stay within the few pages (and blocks) of that row rather than
+// sweeping every page along the full width of the primitive. Only
+// valid when pixel order doesn't matter, i.e. for primitives that
+// would otherwise be binned
+static inline void software_thread_draw_tiles(software_thread_state* ctx, render_data* rdata, const software_clip& r) {
+    if (rdata->prim < 2) {
+        software_thread_draw(ctx, rdata, software_clip_full);
 
-                break;
-            }
+        return;
+    }
 
-            // Explicitly copy data from the queue
-            render_data rdata = render_data(ctx->render_queue.front());
+    for (int y = r.y0 & ~(SOFTWARE_TILE_SIZE - 1); y < r.y1; y += SOFTWARE_TILE_SIZE) {
+        for (int x = r.x0 & ~(SOFTWARE_TILE_SIZE - 1); x < r.x1; x += SOFTWARE_TILE_SIZE) {
+            software_clip clip = { x, y, x + SOFTWARE_TILE_SIZE, y + SOFTWARE_TILE_SIZE };
 
-            // Assign context pointer to the copied context
-            rdata.gs.ctx = &rdata.gs.context[(rdata.gs.attr & GS_CTXT) ? 1 : 0];
+            software_thread_draw(ctx, rdata, clip);
+        }
+    }
+}
 
-            ctx->render_queue.pop();
-            ctx->queue_mtx.unlock();
+// VRAM page sets (512 pages of 8 KiB)
+static inline void software_pages_mark(uint64_t* set, uint32_t first, uint32_t count) {
+    count = std::min(count, 512u);
 
-            ctx->render_mtx.lock();
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t page = (first + i) & 511;
 
-            switch (rdata.prim) {
-                case 0: render_point(&rdata.gs, nullptr); break;
-                case 1: render_line(&rdata.gs, nullptr); break;
-                case 2: render_triangle(&rdata.gs, nullptr); break;
-                case 3: render_sprite(&rdata.gs, nullptr); break;
-            }
+        set[page >> 6] |= 1ull << (page & 63);
+    }
+}
 
-            ctx->render_mtx.unlock();
-        }
+static inline bool software_pages_intersect(const uint64_t* a, const uint64_t* b) {
+    for (int i = 0; i < 8; i++)
+        if (a[i] & b[i])
+            return true;
 
-        // std::this_thread::yield();
-    }
+    return false;
 }
 
-void software_thread_destroy(void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+// Pages touched by a (width x height) rectangle at the origin of a
+// buffer, conservative since base pointers aren't always page aligned
+static inline void software_pages_rect(uint64_t* set, uint32_t base_block, uint32_t bw, int bpp, int w, int h) {
+    // Page dimensions for 32, 16, 8 and 4-bit formats
+    int pw = (bpp >= 16) ? 64 : 128;
+    int ph = (bpp == 32) ? 32 : ((bpp == 4) ? 128 : 64);
+    int row = std::max(1, (int)((bw * 64) / pw));
 
-    // Send end signal to rendering thread
-    ctx->end_signal = true;
+    uint32_t count = ((w - 1) / pw) + (((h - 1) / ph) * row) + 2;
 
-    // Clear rendering queue
-    ctx->queue_mtx.lock();
+    software_pages_mark(set, base_block >> 5, count);
+}
 
-    while (!ctx->render_queue.empty())
-        ctx->render_queue.pop();
+static inline int software_psm_bpp(int psm) {
+    switch (psm) {
+        case GS_PSMCT16:
+        case GS_PSMCT16S:
+        case GS_PSMZ16:
+        case GS_PSMZ16S: return 16;
+        case GS_PSMT8: return 8;
+        case GS_PSMT4: return 4;
+    }
 
-    ctx->queue_mtx.unlock();
+    // 32-bit, 24-bit and the 8H/4HL/4HH formats
+    return 32;
+}
 
-    if (ctx->buf)
-        free(ctx->buf);
+// Screen rectangle a primitive can touch, mirrors the bounds used
+// by the render_* functions
+static inline bool software_thread_bounds(render_data* rdata, software_clip* r) {
+    struct ps2_gs* gs = &rdata->gs;
 
-    // release buffers
-    SDL_ReleaseGPUBuffer(ctx->device, ctx->vertex_buffer);
-    SDL_ReleaseGPUBuffer(ctx->device, ctx->index_buffer);
-    SDL_ReleaseGPUSampler(ctx->device, ctx->sampler[0]);
-    SDL_ReleaseGPUSampler(ctx->device, ctx->sampler[1]);
+    int ofx = gs->ctx->ofx;
+    int ofy = gs->ctx->ofy;
+    int n = rdata->prim == 2 ? 3 : (rdata->prim == 0 ? 1 : 2);
 
-    if (ctx->texture) SDL_ReleaseGPUTexture(ctx->device, ctx->texture);
-    
-    // release the pipeline
-    SDL_ReleaseGPUGraphicsPipeline(ctx->device, ctx->pipeline);
+    int x0 = INT32_MAX, y0 = INT32_MAX, x1 = INT32_MIN, y1 = INT32_MIN;
 
-    // Should call destructors for our mutex, thread and queue
-    delete ctx;
-}
+    for (int i = 0; i < n; i++) {
+        int x = (int)gs->vq[i].x - ofx;
+        int y = (int)gs->vq[i].y - ofy;
 
-void software_thread_set_size(void* udata, int width, int height) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+        x0 = std::min(x0, x);
+        y0 = std::min(y0, y);
+        x1 = std::max(x1, x);
+        y1 = std::max(y1, y);
+    }
 
-    int en1 = ctx->gs->pmode & 1;
-    int en2 = (ctx->gs->pmode >> 1) & 1;
+    // Subpixel to pixel, sprites round to the nearest pixel center
+    r->x0 = std::max((x0 >> 4) - 1, (int)gs->ctx->scax0);
+    r->y0 = std::max((y0 >> 4) - 1, (int)gs->ctx->scay0);
+    r->x1 = std::min((x1 >> 4) + 2, (int)gs->ctx->scax1 + 1);
+    r->y1 = std::min((y1 >> 4) + 2, (int)gs->ctx->scay1 + 1);
 
-    uint64_t display = 0, dispfb = 0;
+    r->x0 = std::max(r->x0, 0);
+    r->y0 = std::max(r->y0, 0);
+    r->x1 = std::min(r->x1, 2048);
+    r->y1 = std::min(r->y1, 2048);
 
-    if (en1 && en2) {
-        display = ctx->gs->display1 > ctx->gs->display2 ? ctx->gs->display1 : ctx->gs->display2;
-        dispfb = ctx->gs->dispfb1 > ctx->gs->dispfb2 ? ctx->gs->dispfb1 : ctx->gs->dispfb2;
-    } else if (en1) {
-        display = ctx->gs->display1;
-        dispfb = ctx->gs->dispfb1;
-    } else if (en2) {
-        display = ctx->gs->display2;
-        dispfb = ctx->gs->dispfb2;
-    }
+    return (r->x0 < r->x1) && (r->y0 < r->y1);
+}
 
-    uint32_t tex_fmt = (dispfb >> 15) & 0x1f;
+static inline int software_fb_layout(int psm) {
+    switch (psm) {
+        case GS_PSMCT32:
+        case GS_PSMCT24: return 0;
+        case GS_PSMCT16: return 1;
+        case GS_PSMCT16S: return 2;
+        case GS_PSMZ32:
+        case GS_PSMZ24: return 3;
+        case GS_PSMZ16: return 4;
+        case GS_PSMZ16S: return 5;
+    }
 
-    int magh = ((display >> 23) & 0xf) + 1;
-    int magv = ((display >> 27) & 3) + 1;
+    return 6 + psm;
+}
 
-    if (((display >> 32) & 0xfff) == 0) {
-        ctx->tex_w = 0;
-        ctx->tex_h = 0;
-        
-        return;
+static inline bool software_psm_is_clut(int psm) {
+    switch (psm) {
+        case GS_PSMT8:
+        case GS_PSMT8H:
+        case GS_PSMT4:
+        case GS_PSMT4HL:
+        case GS_PSMT4HH: return true;
     }
 
-    if (((display >> 44) & 0x7ff) == 0) {
-        ctx->tex_w = 0;
-        ctx->tex_h = 0;
-        
+    return false;
+}
+
+static inline void software_thread_clut_pages(struct ps2_gs* gs, uint64_t* set) {
+    if (!software_psm_is_clut(gs->ctx->tbpsm))
         return;
+
+    if (gs->ctx->csm) {
+        software_pages_rect(set, gs->ctx->cbp, gs->cbw, 16, gs->cou + 256, gs->cov + 1);
+    } else {
+        software_pages_mark(set, gs->ctx->cbp >> 5, 2);
     }
+}
 
-    uint32_t tex_w = (((display >> 32) & 0xfff) / magh) + 1;
-    uint32_t tex_h = (((display >> 44) & 0x7ff) / magv) + 1;
+// Pages read by a primitive, the texture and its CLUT (read straight
+// from VRAM on every lookup)
+static inline void software_thread_read_pages(struct ps2_gs* gs, uint64_t* set) {
+    if (!gs->tme)
+        return;
 
-    // SMODE2 INT=1 FFMD=1
-    // if ((ctx->gs->smode2 & 3) == 3) {
-    //     tex_h /= 2;
-    // }
+    int bpp = software_psm_bpp(gs->ctx->tbpsm);
 
-    // Weird dobiestation hack, should fix Silent Hill 2, Choro Q HG, etc.
-    if (tex_h >= (tex_w * 1.3))
-        tex_h = tex_h / 2;
+    // CLAMP can address one texel past the texture, and region
+    // clamp/repeat anywhere up to 1024x1024
+    int w = std::max((int)gs->ctx->tbw * 64, (int)gs->ctx->usize) + 1;
+    int h = gs->ctx->vsize + 1;
 
-    // printf("gsr: Setting framebuffer size to %dx%d fmt=%02x magh=%d magv=%d en=(%d,%d) dwh=(%d,%d) dxy=(%d,%d)\n", tex_w, tex_h, tex_fmt, magh, magv, en1, en2,
-    //     (int)((display >> 32) & 0xfff) + 1,
-    //     (int)((display >> 44) & 0x7ff) + 1,
-    //     (int)(display & 0xfff),
-    //     (int)((display >> 12) & 0xfff)
-    // );
+    if (gs->ctx->wms == 2) w = std::max(w, (int)gs->ctx->maxu + 1);
+    if (gs->ctx->wmt == 2) h = std::max(h, (int)gs->ctx->maxv + 1);
+    if (gs->ctx->wms == 3) w = std::max(w, (int)(gs->ctx->minu | gs->ctx->maxu) + 1);
+    if (gs->ctx->wmt == 3) h = std::max(h, (int)(gs->ctx->minv | gs->ctx->maxv) + 1);
 
-    // Do nothing if the size hasn't changed
-    if (tex_w == ctx->tex_w && tex_h == ctx->tex_h && tex_fmt == ctx->disp_fmt) {
-        return;
-    }
+    // REPEAT wraps negative coordinates to negative offsets, which
+    // land up to a row of pages before the base pointer
+    uint64_t pages[8] = { 0 };
 
-    ctx->tex_w = tex_w;
-    ctx->tex_h = tex_h;
-    ctx->disp_fmt = tex_fmt;
+    software_pages_rect(pages, gs->ctx->tbp0, gs->ctx->tbw, bpp, w, h);
 
-    if (ctx->buf) free(ctx->buf);
+    int pw = (bpp >= 16) ? 64 : 128;
+    uint32_t row = std::max(1, (int)((gs->ctx->tbw * 64) / pw)) + 1;
 
-    ctx->buf = (uint32_t*)malloc((ctx->tex_w * sizeof(uint32_t)) * ctx->tex_h);
+    for (int i = 0; i < 512; i++)
+        if ((pages[i >> 6] >> (i & 63)) & 1)
+            software_pages_mark(set, (i - row) & 511, row + 1);
 
-    SDL_GPUTextureFormat fmt;
+    software_thread_clut_pages(gs, set);
+}
 
-    switch (ctx->disp_fmt) {
-        case GS_PSMCT32:
-        case GS_PSMCT24: {
-            fmt = SDL_GPU_TEXTUREFORMAT_B8G8R8A8_UNORM;
-        } break;
+// Texture cache
+static inline bool software_texture_stale(software_thread_state* ctx, const software_texture* tex) {
+    for (int i = 0; i < 8; i++) {
+        for (uint64_t m = tex->pages[i]; m; m &= m - 1) {
+            if (ctx->page_gen[(i * 64) + std::countr_zero(m)] > tex->gen)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Called for every VRAM write (drawing, transfers and blits) before
+// anything reads the pages written
+static inline void software_texture_written(software_thread_state* ctx, const uint64_t* set) {
+    ctx->write_gen++;
+
+    for (int i = 0; i < 8; i++) {
+        for (uint64_t m = set[i]; m; m &= m - 1)
+            ctx->page_gen[(i * 64) + std::countr_zero(m)] = ctx->write_gen;
+    }
+}
+
+static inline size_t software_texture_size(const software_texture* tex) {
+    return (tex->key.height + 7) / 8 * 8 * tex->stride * sizeof(uint32_t) + tex->block_count;
+}
+
+// Drop least recently used entries until size more bytes fit, entries
+// used by the batch being binned stay, the workers will read them
+static void software_texture_evict(software_thread_state* ctx, size_t size) {
+    while (!ctx->textures.empty() && (ctx->texture_bytes + size) > SOFTWARE_TEXTURE_CACHE_SIZE) {
+        auto lru = ctx->textures.end();
+
+        for (auto it = ctx->textures.begin(); it != ctx->textures.end(); it++) {
+            const software_texture* tex = it->second.get();
+
+            if (!ctx->batch.empty() && tex->batch == ctx->pool_gen)
+                continue;
+
+            if (lru == ctx->textures.end() || tex->used < lru->second->used)
+                lru = it;
+        }
+
+        if (lru == ctx->textures.end())
+            break;
+
+        ctx->texture_bytes -= software_texture_size(lru->second.get());
+        ctx->textures.erase(lru);
+    }
+}
+
+static void software_texture_clear(software_thread_state* ctx) {
+    ctx->textures.clear();
+    ctx->texture_bytes = 0;
+}
+
+static software_texture* software_texture_lookup(software_thread_state* ctx, struct ps2_gs* gs) {
+    struct gs_context* c = gs->ctx;
+
+    software_texture_key key = {};
+
+    key.tbp0 = c->tbp0;
+    key.tbw = c->tbw;
+    key.psm = c->tbpsm;
+
+    // Every texel the wrap modes can reach
+    key.width = c->usize + 1;
+    key.height = c->vsize + 1;
+
+    if (c->wms == 2) key.width = std::max(key.width, c->maxu + 1);
+    if (c->wmt == 2) key.height = std::max(key.height, c->maxv + 1);
+    if (c->wms == 3) key.width = std::max(key.width, (c->minu | c->maxu) + 1);
+    if (c->wmt == 3) key.height = std::max(key.height, (c->minv | c->maxv) + 1);
+
+    bool clut = software_psm_is_clut(c->tbpsm);
+
+    if (clut) {
+        key.cbp = c->cbp;
+        key.cbpsm = c->cbpsm;
+        key.csm = c->csm;
+
+        if (c->csm) {
+            key.cbw = gs->cbw;
+            key.cou = gs->cou;
+            key.cov = gs->cov;
+        }
+    }
+
+    // TEXA only matters for 24 and 16-bit colors
+    int fmt = clut ? c->cbpsm : c->tbpsm;
+
+    if (fmt != GS_PSMCT32 && fmt != GS_PSMZ32) {
+        key.ta0 = gs->ta0;
+        key.ta1 = gs->ta1;
+        key.aem = gs->aem;
+    }
+
+    ctx->texture_lookups++;
+
+    software_texture* tex;
+
+    auto it = ctx->textures.find(key);
+
+    if (it != ctx->textures.end()) {
+        tex = it->second.get();
+
+        if (software_texture_stale(ctx, tex)) {
+            for (int i = 0; i < tex->block_count; i++)
+                tex->blocks[i].store(0, std::memory_order_relaxed);
+
+            ctx->texture_invalidations++;
+            ctx->texture_misses++;
+        } else {
+            ctx->texture_hits++;
+        }
+    } else {
+        std::unique_ptr <software_texture> entry = std::make_unique <software_texture>();
+
+        entry->key = key;
+        entry->stride = (key.width + 7) & ~7;
+        entry->block_count = (entry->stride / 8) * ((key.height + 7) / 8);
 
+        size_t size = software_texture_size(entry.get());
+
+        software_texture_evict(ctx, size);
+
+        // Texels are only ever read after being decoded, no need to
+        // clear them
+        entry->data.reset(new uint32_t[entry->stride * ((key.height + 7) & ~7)]);
+        entry->blocks.reset(new std::atomic <uint8_t>[entry->block_count]);
+
+        for (int i = 0; i < entry->block_count; i++)
+            entry->blocks[i].store(0, std::memory_order_relaxed);
+
+        // Only texels within the key's extent are ever read from the
+        // decoded copy, the rest of their blocks are never looked at
+        memset(entry->pages, 0, sizeof(entry->pages));
+
+        int w = std::max((int)key.tbw * 64, (int)key.width);
+
+        software_pages_rect(entry->pages, key.tbp0, key.tbw, software_psm_bpp(key.psm), w, key.height);
+        software_thread_clut_pages(gs, entry->pages);
+
+        tex = entry.get();
+
+        ctx->textures.emplace(key, std::move(entry));
+        ctx->texture_bytes += size;
+        ctx->texture_misses++;
+    }
+
+    tex->gen = ctx->write_gen;
+    tex->batch = ctx->pool_gen;
+    tex->used = ctx->texture_lookups;
+
+    return tex;
+}
+
+static inline void software_thread_surfaces(struct ps2_gs* gs, software_surface* s, int* count) {
+    *count = 0;
+
+    s[(*count)++] = { gs->ctx->fbp, gs->ctx->fbw, software_fb_layout(gs->ctx->fbpsm), { 0 } };
+
+    // Z is read by the depth test even when writes are masked
+    if (gs->ctx->zte)
+        s[(*count)++] = { gs->ctx->zbp, gs->ctx->fbw, software_fb_layout(0x30 | gs->ctx->zbpsm), { 0 } };
+}
+
+static inline bool software_surface_equal(const software_surface& a, const software_surface& b) {
+    return a.base == b.base && a.width == b.width && a.layout == b.layout;
+}
+
+static inline void software_surface_pages(const software_surface& s, const software_clip& r, uint64_t* set) {
+    int bpp = (s.layout == 1 || s.layout == 2 || s.layout == 4 || s.layout == 5) ? 16 : 32;
+
+    software_pages_rect(set, s.base >> 6, s.width >> 6, bpp, r.x1, r.y1);
+}
+
+// Hierarchical Z
+static inline int software_hiz_format(int zbpsm) {
+    switch (zbpsm) {
+        case GS_PSMCT32: return 1;
+        case GS_PSMCT24: return 2;
         case GS_PSMCT16:
-        case GS_PSMCT16S: {
-            fmt = SDL_GPU_TEXTUREFORMAT_B5G5R5A1_UNORM;
-        } break;
+        case GS_PSMCT16S: return 3;
+    }
 
-        default: {
-            // printf("gsr: Unknown framebuffer format %02x\n", ctx->disp_fmt);
-        } break;
+    return 0;
+}
+
+// Pages written to outside of the depth test, ranges taken there so
+// far no longer describe what's in VRAM
+static inline void software_hiz_invalidate(software_hiz* hiz, const uint64_t* set) {
+    bool hit = false;
+
+    for (int i = 0; i < 8; i++) {
+        for (uint64_t m = set[i] & hiz->pages[i]; m; m &= m - 1)
+            hiz->page_gen[(i * 64) + std::countr_zero(m)] = hiz->gen + 1;
+
+        hit = hit || (set[i] & hiz->pages[i]);
+
+        hiz->pages[i] &= ~set[i];
     }
 
-    if (ctx->texture) {
-        SDL_ReleaseGPUTexture(ctx->device, ctx->texture);
+    if (hit)
+        hiz->gen++;
+}
+
+// Called for every primitive along with software_texture_written.
+// Triangles and sprites binned into tiles keep the ranges of the
+// blocks they write Z to up to date themselves, every other write
+// (the frame buffer included, it may alias an old Z buffer) drops
+// the ranges of the pages it touches
+static inline void software_hiz_written(software_thread_state* ctx, render_data* rdata, const software_surface* s, int count, bool serial) {
+    struct ps2_gs* gs = &rdata->gs;
+    software_hiz* hiz = ctx->hiz.get();
+
+    bool tracked = !serial && rdata->prim >= 2 && gs->ctx->zte && software_hiz_format(gs->ctx->zbpsm);
+    bool zwrite = gs->ctx->zte && !gs->ctx->zbmsk && gs->ctx->ztst;
+
+    software_hiz_invalidate(hiz, s[0].pages);
+
+    if (count == 2) {
+        if (tracked) {
+            for (int i = 0; i < 8; i++)
+                hiz->pages[i] |= s[1].pages[i];
+        } else if (zwrite) {
+            software_hiz_invalidate(hiz, s[1].pages);
+        }
     }
 
-    // Create a texture to send in our frame data
-    SDL_GPUTextureCreateInfo tci = {
-        .type = SDL_GPU_TEXTURETYPE_2D,
-        .format = fmt,
-        .usage = SDL_GPU_TEXTUREUSAGE_SAMPLER,
-        .width = tex_w,
-        .height = tex_h,
-        .layer_count_or_depth = 1,
-        .num_levels = 1,
-        .sample_count = SDL_GPU_SAMPLECOUNT_1,
-    };
+    rdata->pipe.hiz = tracked ? hiz : nullptr;
+    rdata->pipe.hiz_gen = hiz->gen;
+}
 
-    ctx->texture = SDL_CreateGPUTexture(ctx->device, &tci);
+static void software_thread_render_tiles(software_thread_state* ctx) {
+    while (true) {
+        uint32_t i = ctx->next_tile++;
+
+        if (i >= ctx->active_tiles.size())
+            break;
+
+        uint32_t tile = ctx->active_tiles[i];
+
+        software_clip clip;
+
+        clip.x0 = (tile % SOFTWARE_TILES_X) << SOFTWARE_TILE_SHIFT;
+        clip.y0 = (tile / SOFTWARE_TILES_X) << SOFTWARE_TILE_SHIFT;
+        clip.x1 = clip.x0 + SOFTWARE_TILE_SIZE;
+        clip.y1 = clip.y0 + SOFTWARE_TILE_SIZE;
+
+        for (uint32_t idx : ctx->bins[tile])
+            software_thread_draw(ctx, &ctx->batch[idx], clip);
+    }
+
+    ctx->pixels += software_thread_pixel_count;
+    ctx->texture_decoded += software_thread_decoded_count;
+    ctx->hiz_culled += software_thread_hiz_culled;
+
+    software_thread_pixel_count = 0;
+    software_thread_decoded_count = 0;
+    software_thread_hiz_culled = 0;
 }
 
-void software_thread_set_scale(void* udata, float scale) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+static void software_thread_worker(software_thread_state* ctx) {
+    uint64_t gen = 0;
 
-    ctx->scale = scale;
+    while (true) {
+        std::unique_lock <std::mutex> lk(ctx->pool_mtx);
+
+        ctx->pool_cv.wait(lk, [&] { return ctx->pool_quit || ctx->pool_gen != gen; });
+
+        if (ctx->pool_quit)
+            return;
+
+        gen = ctx->pool_gen;
+
+        lk.unlock();
+
+        software_thread_render_tiles(ctx);
+
+        lk.lock();
+
+        if (++ctx->pool_done == ctx->workers.size())
+            ctx->done_cv.notify_one();
+    }
 }
 
-void software_thread_set_aspect_mode(void* udata, int aspect_mode) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+// Render everything binned so far
+static void software_thread_flush_batch(software_thread_state* ctx) {
+    if (ctx->batch.empty())
+        return;
+
+    // The batch doesn't move from here on
+    for (render_data& rdata : ctx->batch)
+        rdata.gs.ctx = &rdata.gs.context[(rdata.gs.attr & GS_CTXT) ? 1 : 0];
+
+    ctx->next_tile = 0;
+
+    {
+        std::lock_guard <std::mutex> lk(ctx->pool_mtx);
 
-    ctx->aspect_mode = aspect_mode;
+        ctx->pool_done = 0;
+        ctx->pool_gen++;
+    }
+
+    ctx->pool_cv.notify_all();
+
+    // Help out while the workers are at it
+    software_thread_render_tiles(ctx);
+
+    {
+        std::unique_lock <std::mutex> lk(ctx->pool_mtx);
+
+        ctx->done_cv.wait(lk, [&] { return ctx->pool_done == ctx->workers.size(); });
+    }
+
+    for (uint32_t tile : ctx->active_tiles)
+        ctx->bins[tile].clear();
+
+    ctx->active_tiles.clear();
+    ctx->surfaces.clear();
+    ctx->batch.clear();
+
+    memset(ctx->pending_reads, 0, sizeof(ctx->pending_reads));
+    memset(ctx->pending_writes, 0, sizeof(ctx->pending_writes));
+
+    ctx->tile_batches++;
 }
 
-void software_thread_set_integer_scaling(void* udata, bool integer_scaling) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+static void software_thread_barrier(software_thread_state* ctx) {
+    if (ctx->batch.empty())
+        return;
+
+    ctx->tile_barriers++;
 
-    ctx->integer_scaling = integer_scaling;
+    software_thread_flush_batch(ctx);
 }
 
-void software_thread_set_bilinear(void* udata, bool bilinear) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+static void software_thread_dispatch(software_thread_state* ctx, render_data& rdata) {
+    // Explicit barrier (TEXFLUSH)
+    if (rdata.prim == 4) {
+        software_thread_barrier(ctx);
+
+        return;
+    }
+
+    // Assign context pointer to the copied context
+    rdata.gs.ctx = &rdata.gs.context[(rdata.gs.attr & GS_CTXT) ? 1 : 0];
+
+    software_clip r;
+
+    if (!software_thread_bounds(&rdata, &r))
+        return;
+
+    uint64_t reads[8] = { 0 };
+    uint64_t writes[8] = { 0 };
+
+    software_surface s[2];
+    int count;
+
+    software_thread_read_pages(&rdata.gs, reads);
+    software_thread_surfaces(&rdata.gs, s, &count);
+
+    for (int i = 0; i < count; i++) {
+        software_surface_pages(s[i], r, s[i].pages);
+
+        for (int j = 0; j < 8; j++)
+            writes[j] |= s[i].pages[j];
+    }
+
+    // Feedback loops (texture reads from the frame or Z buffer being
+    // drawn to) and overlapping frame and Z buffers are rendered
+    // serially, pixel order matters there
+    bool serial = software_pages_intersect(reads, writes);
+
+    if (count == 2)
+        serial = serial || software_pages_intersect(s[0].pages, s[1].pages);
+
+    // Texture (or CLUT) source written by a binned primitive, or a
+    // binned texture about to be overwritten
+    if (software_pages_intersect(reads, ctx->pending_writes) ||
+        software_pages_intersect(writes, ctx->pending_reads)) {
+        software_thread_barrier(ctx);
+    }
+
+    // Pixels written through a different layout map to other tiles
+    if (software_pages_intersect(writes, ctx->pending_writes)) {
+        bool conflict = false;
+
+        for (int i = 0; i < count; i++) {
+            for (const software_surface& p : ctx->surfaces) {
+                if (software_surface_equal(p, s[i]))
+                    continue;
+
+                conflict = conflict || software_pages_intersect(s[i].pages, p.pages);
+            }
+        }
+
+        if (conflict)
+            software_thread_barrier(ctx);
+    }
 
-    ctx->bilinear = bilinear;
+    // Past the barriers the texture is what this primitive will see,
+    // its cached copy (if any) can be looked up now
+    software_pipeline_select(ctx, &rdata, serial);
+    software_texture_written(ctx, writes);
+    software_hiz_written(ctx, &rdata, s, count, serial);
+
+    if (ctx->workers.empty()) {
+        if (serial) {
+            software_thread_draw(ctx, &rdata, software_clip_full);
+        } else {
+            software_thread_draw_tiles(ctx, &rdata, r);
+        }
+
+        return;
+    }
+
+    if (serial) {
+        software_thread_flush_batch(ctx);
+        software_thread_draw(ctx, &rdata, software_clip_full);
+
+        ctx->serial_primitives++;
+
+        return;
+    }
+
+    uint32_t idx = ctx->batch.size();
+
+    ctx->batch.push_back(rdata);
+
+    int tx0 = r.x0 >> SOFTWARE_TILE_SHIFT;
+    int ty0 = r.y0 >> SOFTWARE_TILE_SHIFT;
+    int tx1 = (r.x1 - 1) >> SOFTWARE_TILE_SHIFT;
+    int ty1 = (r.y1 - 1) >> SOFTWARE_TILE_SHIFT;
+
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            uint32_t tile = tx + (ty * SOFTWARE_TILES_X);
+
+            if (ctx->bins[tile].empty())
+                ctx->active_tiles.push_back(tile);
+
+            ctx->bins[tile].push_back(idx);
+        }
+    }
+
+    for (int i = 0; i < 8; i++) {
+        ctx->pending_reads[i] |= reads[i];
+        ctx->pending_writes[i] |= writes[i];
+    }
+
+    for (int i = 0; i < count; i++) {
+        software_surface* p = nullptr;
+
+        for (software_surface& o : ctx->surfaces)
+            if (software_surface_equal(o, s[i]))
+                p = &o;
+
+        if (!p) {
+            ctx->surfaces.push_back(s[i]);
+
+            continue;
+        }
+
+        for (int j = 0; j < 8; j++)
+            p->pages[j] |= s[i].pages[j];
+    }
+
+    if (ctx->batch.size() == SOFTWARE_BATCH_SIZE)
+        software_thread_flush_batch(ctx);
 }
 
-void software_thread_get_viewport_size(void* udata, int* w, int* h) {
+static void software_thread_start_workers(software_thread_state* ctx) {
+    ctx->pool_quit = false;
+
+    // The render thread is one of the rasterizers
+    for (int i = 1; i < ctx->threads; i++)
+        ctx->workers.push_back(std::thread(software_thread_worker, ctx));
+}
+
+static void software_thread_stop_workers(software_thread_state* ctx) {
+    {
+        std::lock_guard <std::mutex> lk(ctx->pool_mtx);
+
+        ctx->pool_quit = true;
+    }
+
+    ctx->pool_cv.notify_all();
+
+    for (std::thread& t : ctx->workers)
+        t.join();
+
+    ctx->workers.clear();
+}
+
+static inline uint64_t software_thread_now() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// Rebuild the GS state a command was encoded against
+static inline void software_thread_apply(software_thread_state* ctx, const uint8_t* p, const software_command& cmd) {
+    uint8_t* state = (uint8_t*)&ctx->cmd.gs;
+
+    p += sizeof(software_command);
+
+    for (int i = 0; i < cmd.runs; i++) {
+        uint16_t run[2];
+
+        memcpy(run, p, sizeof(run));
+
+        p += sizeof(run);
+
+        memcpy(state + (run[0] * sizeof(uint64_t)), p, run[1] * sizeof(uint64_t));
+
+        p += run[1] * sizeof(uint64_t);
+    }
+
+    ctx->cmd.prim = cmd.prim;
+}
+
+static inline void software_thread_notify_producer(software_thread_state* ctx, uint64_t tail) {
+    uint64_t wait = ctx->producer_wait;
+
+    if (!wait || tail < wait)
+        return;
+
+    { std::lock_guard <std::mutex> lk(ctx->queue_mtx); }
+
+    ctx->idle_cv.notify_all();
+}
+
+static inline void software_thread_sleep(software_thread_state* ctx) {
+    std::unique_lock <std::mutex> lk(ctx->queue_mtx);
+
+    if (ctx->end_signal || ctx->ring_tail.load(std::memory_order_relaxed) != ctx->ring_head)
+        return;
+
+    ctx->render_sleeping = true;
+
+    // Checked again after publishing render_sleeping, see
+    // software_thread_push
+    while (!ctx->end_signal && ctx->ring_tail.load(std::memory_order_relaxed) == ctx->ring_head)
+        ctx->queue_cv.wait(lk);
+
+    ctx->render_sleeping = false;
+    ctx->wakeups++;
+}
+
+void software_thread_render_thread(software_thread_state* ctx) {
+    // Held from the moment a command is taken off the ring until it
+    // has been drawn, binned primitives included
+    bool locked = false;
+
+    ctx->awake_start = software_thread_now();
+
+    while (!ctx->end_signal) {
+        bool busy = false;
+
+        std::chrono::steady_clock::time_point start;
+
+        while (!ctx->end_signal) {
+            uint64_t tail = ctx->ring_tail.load(std::memory_order_relaxed);
+
+            if (tail == ctx->ring_head)
+                break;
+
+            // Take the render lock before the ring can be seen empty,
+            // so waiters don't miss the primitives in flight
+            if (!locked) {
+                ctx->render_mtx.lock();
+
+                locked = true;
+            }
+
+            if (!busy) {
+                busy = true;
+                start = std::chrono::steady_clock::now();
+            }
+
+            const uint8_t* p = ctx->ring.data() + (tail & (SOFTWARE_RING_SIZE - 1));
+
+            software_command cmd;
+
+            memcpy(&cmd, p, sizeof(cmd));
+
+            if (cmd.prim != SOFTWARE_COMMAND_WRAP)
+                software_thread_apply(ctx, p, cmd);
+
+            ctx->ring_tail = tail + cmd.size;
+
+            software_thread_notify_producer(ctx, tail + cmd.size);
+
+            if (cmd.prim != SOFTWARE_COMMAND_WRAP)
+                software_thread_dispatch(ctx, ctx->cmd);
+        }
+
+        if (locked) {
+            software_thread_flush_batch(ctx);
+
+            ctx->render_mtx.unlock();
+
+            locked = false;
+        }
+
+        if (busy) {
+            auto time = std::chrono::steady_clock::now() - start;
+
+            ctx->render_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+            ctx->pixels += software_thread_pixel_count;
+            ctx->texture_decoded += software_thread_decoded_count;
+            ctx->hiz_culled += software_thread_hiz_culled;
+
+            software_thread_pixel_count = 0;
+            software_thread_decoded_count = 0;
+            software_thread_hiz_culled = 0;
+        }
+
+        // Block until there's more work instead of spinning
+        ctx->awake_ns += software_thread_now() - ctx->awake_start.exchange(0);
+
+        software_thread_sleep(ctx);
+
+        ctx->awake_start = software_thread_now();
+    }
+}
+
+void gs_blit_dispfb_deinterlace_frame(software_thread_state* ctx, int dfb);
+void gs_blit_dispfb_deinterlace_field(software_thread_state* ctx, int dfb);
+void gs_blit_dispfb_no_deinterlace(software_thread_state* ctx, int dfb);
+
+// Block the EE thread until the render thread has read up to tail
+static inline void software_thread_wait_tail(software_thread_state* ctx, uint64_t tail) {
+    if (ctx->ring_tail >= tail)
+        return;
+
+    std::unique_lock <std::mutex> lk(ctx->queue_mtx);
+
+    ctx->producer_wait = tail;
+
+    ctx->idle_cv.wait(lk, [ctx, tail] { return ctx->ring_tail >= tail; });
+
+    ctx->producer_wait = 0;
+}
+
+// Block until the ring has room for everything up to head
+static inline void software_thread_wait_space(software_thread_state* ctx, uint64_t head) {
+    if (head > SOFTWARE_RING_SIZE)
+        software_thread_wait_tail(ctx, head - SOFTWARE_RING_SIZE);
+}
+
+static inline void software_thread_wait_idle(software_thread_state* ctx) {
+    // Block until the ring is empty
+    software_thread_wait_tail(ctx, ctx->ring_head);
+
+    // Wait for the primitive in flight, if any
+    ctx->render_mtx.lock();
+    ctx->render_mtx.unlock();
+}
+
+void software_thread_destroy(void* udata) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
-    *w = ctx->tex_w;
-    *h = ctx->tex_h;
+    // Send end signal to rendering thread, commands still in the
+    // ring are dropped
+    {
+        std::lock_guard <std::mutex> lk(ctx->queue_mtx);
+
+        ctx->end_signal = true;
+    }
+
+    ctx->queue_cv.notify_all();
+
+    if (ctx->render_thr.joinable())
+        ctx->render_thr.join();
+
+    software_thread_stop_workers(ctx);
+
+    if (ctx->buf)
+        free(ctx->buf);
+
+    // Should call destructors for our mutex, thread and queue
+    delete ctx;
 }
 
-void software_thread_get_display_size(void* udata, int* w, int* h) {
+void software_thread_set_size(void* udata, int width, int height) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
-    *w = ctx->disp_w;
-    *h = ctx->disp_h;
+    int en1 = ctx->gs->pmode & 1;
+    int en2 = (ctx->gs->pmode >> 1) & 1;
+
+    uint64_t display = 0, dispfb = 0;
+
+    if (en1 && en2) {
+        display = ctx->gs->display1 > ctx->gs->display2 ? ctx->gs->display1 : ctx->gs->display2;
+        dispfb = ctx->gs->dispfb1 > ctx->gs->dispfb2 ? ctx->gs->dispfb1 : ctx->gs->dispfb2;
+    } else if (en1) {
+        display = ctx->gs->display1;
+        dispfb = ctx->gs->dispfb1;
+    } else if (en2) {
+        display = ctx->gs->display2;
+        dispfb = ctx->gs->dispfb2;
+    }
+
+    uint32_t tex_fmt = (dispfb >> 15) & 0x1f;
+
+    int magh = ((display >> 23) & 0xf) + 1;
+    int magv = ((display >> 27) & 3) + 1;
+
+    if (((display >> 32) & 0xfff) == 0) {
+        ctx->tex_w = 0;
+        ctx->tex_h = 0;
+        
+        return;
+    }
+
+    if (((display >> 44) & 0x7ff) == 0) {
+        ctx->tex_w = 0;
+        ctx->tex_h = 0;
+        
+        return;
+    }
+
+    uint32_t tex_w = (((display >> 32) & 0xfff) / magh) + 1;
+    uint32_t tex_h = (((display >> 44) & 0x7ff) / magv) + 1;
+
+    // SMODE2 INT=1 FFMD=1
+    // if ((ctx->gs->smode2 & 3) == 3) {
+    //     tex_h /= 2;
+    // }
+
+    // Weird dobiestation hack, should fix Silent Hill 2, Choro Q HG, etc.
+    if (tex_h >= (tex_w * 1.3))
+        tex_h = tex_h / 2;
+
+    // printf("gsr: Setting framebuffer size to %dx%d fmt=%02x magh=%d magv=%d en=(%d,%d) dwh=(%d,%d) dxy=(%d,%d)\n", tex_w, tex_h, tex_fmt, magh, magv, en1, en2,
+    //     (int)((display >> 32) & 0xfff) + 1,
+    //     (int)((display >> 44) & 0x7ff) + 1,
+    //     (int)(display & 0xfff),
+    //     (int)((display >> 12) & 0xfff)
+    // );
+
+    // Do nothing if the size hasn't changed
+    if (tex_w == ctx->tex_w && tex_h == ctx->tex_h && tex_fmt == ctx->disp_fmt) {
+        return;
+    }
+
+    ctx->tex_w = tex_w;
+    ctx->tex_h = tex_h;
+    ctx->disp_fmt = tex_fmt;
+
+    if (ctx->buf) free(ctx->buf);
+
+    ctx->buf = (uint32_t*)malloc((ctx->tex_w * sizeof(uint32_t)) * ctx->tex_h);
 }
 
-void software_thread_get_display_format(void* udata, int* fmt) {
+void software_thread_get_viewport_size(void* udata, int* w, int* h) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
-    *fmt = ctx->disp_fmt;
+    *w = ctx->tex_w;
+    *h = ctx->tex_h;
 }
 
-void software_thread_set_window_rect(void* udata, int x, int y, int w, int h) {
+void software_thread_get_display_format(void* udata, int* fmt) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
-    ctx->window_x = x;
-    ctx->window_y = y;
-    ctx->window_w = w;
-    ctx->window_h = h;
+    *fmt = ctx->disp_fmt;
 }
 
 void* software_thread_get_buffer_data(void* udata, int* w, int* h, int* bpp) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
+    software_thread_wait_idle(ctx);
+    software_thread_set_size(ctx, 0, 0);
+
     if (!ctx->tex_w)
         return nullptr;
 
     if (!ctx->buf)
         return nullptr;
 
+    int en1 = ctx->gs->pmode & 1;
+    int en2 = (ctx->gs->pmode >> 1) & 1;
+    int dfb = (!en1 && en2) ? 1 : 0;
+
+    uint64_t start = software_thread_now();
+
+    if ((ctx->gs->smode2 & 3) == 3) {
+        gs_blit_dispfb_deinterlace_frame(ctx, dfb);
+    } else {
+        gs_blit_dispfb_no_deinterlace(ctx, dfb);
+    }
+
+    ctx->readout_ns += software_thread_now() - start;
+
     *w = ctx->tex_w;
     *h = ctx->tex_h;
 
@@ -732,6 +1375,9 @@ void* software_thread_get_buffer_data(void* udata, int* w, int* h, int* bpp) {
         case GS_PSMCT16S: {
             *bpp = 2;
         } break;
+        default: {
+            *bpp = 4;
+        } break;
     }
 
     return ctx->buf;
@@ -749,7 +1395,7 @@ const char* software_thread_get_name(void* udata) {
 
 #define CLAMP(v, l, u) (((v) > (u)) ? (u) : (((v) < (l)) ? (l) : (v)))
 
-static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t f) {
+template <int Tfx, bool Tcc> static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t f) {
     int pr, pg, pb, pa;
     int tr = t & 0xff;
     int tg = (t >> 8) & 0xff;
@@ -760,13 +1406,13 @@ static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t
     int fb = (f >> 16) & 0xff;
     int fa = (f >> 24) & 0xff;
 
-    switch (gs->ctx->tfx) {
+    switch (Tfx) {
         case GS_MODULATE: {
             pr = CLAMP((tr * fr) >> 7, 0, 255);
             pg = CLAMP((tg * fg) >> 7, 0, 255);
             pb = CLAMP((tb * fb) >> 7, 0, 255);
 
-            if (gs->ctx->tcc) {
+            if (Tcc) {
                 pa = CLAMP((ta * fa) >> 7, 0, 255);
             } else {
                 pa = fa;
@@ -777,7 +1423,7 @@ static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t
             pg = tg;
             pb = tb;
 
-            if (gs->ctx->tcc) {
+            if (Tcc) {
                 pa = ta;
             } else {
                 pa = fa;
@@ -788,7 +1434,7 @@ static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t
             pg = CLAMP(((tg * fg) >> 7) + fa, 0, 255);
             pb = CLAMP(((tb * fb) >> 7) + fa, 0, 255);
 
-            if (gs->ctx->tcc) {
+            if (Tcc) {
                 pa = CLAMP(fa + ta, 0, 255);
             } else {
                 pa = fa;
@@ -799,7 +1445,7 @@ static inline uint32_t gs_apply_function(struct ps2_gs* gs, uint32_t t, uint32_t
             pg = CLAMP(((tg * fg) >> 7) + fa, 0, 255);
             pb = CLAMP(((tb * fb) >> 7) + fa, 0, 255);
 
-            if (gs->ctx->tcc) {
+            if (Tcc) {
                 pa = ta;
             } else {
                 pa = fa;
@@ -868,8 +1514,12 @@ enum : int {
     TR_RGB_ONLY
 };
 
-static inline uint32_t gs_read_fb(struct ps2_gs* gs, int x, int y) {
-    switch (gs->ctx->fbpsm) {
+// Format arguments of -1 are read from the context instead, that is
+// what pipelines fall back to for formats without a specialisation
+template <int Psm = -1> static inline uint32_t gs_read_fb(struct ps2_gs* gs, int x, int y) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->fbpsm : Psm;
+
+    switch (psm) {
         case GS_PSMCT32: {
             uint32_t addr = psmct32_addr(gs->ctx->fbp >> 6, gs->ctx->fbw >> 6, x, y);
 
@@ -973,8 +1623,10 @@ static inline uint32_t gs_read_dispfb(struct ps2_gs* gs, int x, int y, int dfb)
     return 0;
 }
 
-static inline uint32_t gs_read_zb(struct ps2_gs* gs, int x, int y) {
-    switch (gs->ctx->zbpsm) {
+template <int Psm = -1> static inline uint32_t gs_read_zb(struct ps2_gs* gs, int x, int y) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->zbpsm : Psm;
+
+    switch (psm) {
         case GS_PSMCT32: {
             uint32_t addr = psmct32_addr(gs->ctx->zbp >> 6, gs->ctx->fbw >> 6, x, y);
 
@@ -1271,11 +1923,11 @@ static inline uint32_t gs_from_rgba32(struct ps2_gs* gs, uint32_t c, int fmt, in
     return 0;
 }
 
-static inline uint32_t gs_read_tb_impl(struct ps2_gs* gs, int u, int v) {
-    u = gs_clamp_u(gs, u);
-    v = gs_clamp_v(gs, v);
+// Raw texel at already wrapped coordinates
+template <int Psm = -1> static inline uint32_t gs_fetch_tb(struct ps2_gs* gs, int u, int v) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->tbpsm : Psm;
 
-    switch (gs->ctx->tbpsm) {
+    switch (psm) {
         case GS_PSMCT32:
             return gs->vram[psmct32_addr(gs->ctx->tbp0, gs->ctx->tbw, u, v) & 0xfffff];
         case GS_PSMCT24:
@@ -1361,11 +2013,66 @@ static inline uint32_t gs_read_tb_impl(struct ps2_gs* gs, int u, int v) {
         } break;
     }
 
-    return 0;
+    return 0;
+}
+
+template <int Psm = -1> static inline uint32_t gs_read_tb_impl(struct ps2_gs* gs, int u, int v) {
+    u = gs_clamp_u(gs, u);
+    v = gs_clamp_v(gs, v);
+
+    return gs_fetch_tb <Psm>(gs, u, v);
+}
+
+// Decode one 8x8 block of a cached texture, returns false when another
+// thread is already at it, the caller reads VRAM directly then
+template <int Psm> static bool gs_decode_tc_block(struct ps2_gs* gs, software_texture* tex, int bx, int by) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->tbpsm : Psm;
+
+    std::atomic <uint8_t>& state = tex->blocks[(by * (tex->stride >> 3)) + bx];
+
+    uint8_t expected = 0;
+
+    if (!state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+        return expected == 2;
+
+    for (int y = by * 8; y < (by * 8) + 8; y++) {
+        uint32_t* row = &tex->data[(y * tex->stride) + (bx * 8)];
+
+        for (int x = 0; x < 8; x++)
+            row[x] = gs_to_rgba32(gs, gs_fetch_tb <Psm>(gs, (bx * 8) + x, y), psm);
+    }
+
+    state.store(2, std::memory_order_release);
+
+    software_thread_decoded_count += 8 * 8 * sizeof(uint32_t);
+
+    return true;
+}
+
+// RGBA32 texel, through the texture cache when there is one
+template <int Psm, bool Cached> static inline uint32_t gs_read_texel(struct ps2_gs* gs, software_texture* tex, int u, int v) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->tbpsm : Psm;
+
+    u = gs_clamp_u(gs, u);
+    v = gs_clamp_v(gs, v);
+
+    if constexpr (Cached) {
+        // Negative coordinates (REPEAT keeps the sign) aren't cached
+        if ((uint32_t)u < tex->key.width && (uint32_t)v < tex->key.height) {
+            int b = ((v >> 3) * (tex->stride >> 3)) + (u >> 3);
+
+            if (tex->blocks[b].load(std::memory_order_acquire) == 2 || gs_decode_tc_block <Psm>(gs, tex, u >> 3, v >> 3))
+                return tex->data[(v * tex->stride) + u];
+        }
+    }
+
+    return gs_to_rgba32(gs, gs_fetch_tb <Psm>(gs, u, v), psm);
 }
 
-static inline uint32_t gs_read_tb(struct ps2_gs* gs, int u, int v) {
-    if (gs->ctx->mmag) {
+template <int Psm, bool Mmag, bool Cached> static inline uint32_t gs_read_tb(struct ps2_gs* gs, software_texture* tex, int u, int v) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->tbpsm : Psm;
+
+    if (Mmag) {
         float a = ((u - 8) & 0xf) * 0.0625;
         float b = ((v - 8) & 0xf) * 0.0625;
 
@@ -1374,15 +2081,10 @@ static inline uint32_t gs_read_tb(struct ps2_gs* gs, int u, int v) {
         int iu1 = iu0 + 1;
         int iv1 = iv0 + 1;
 
-        uint32_t s0 = gs_read_tb_impl(gs, iu0, iv0);
-        uint32_t s1 = gs_read_tb_impl(gs, iu1, iv0);
-        uint32_t s2 = gs_read_tb_impl(gs, iu0, iv1);
-        uint32_t s3 = gs_read_tb_impl(gs, iu1, iv1);
-
-        s0 = gs_to_rgba32(gs, s0, gs->ctx->tbpsm);
-        s1 = gs_to_rgba32(gs, s1, gs->ctx->tbpsm);
-        s2 = gs_to_rgba32(gs, s2, gs->ctx->tbpsm);
-        s3 = gs_to_rgba32(gs, s3, gs->ctx->tbpsm);
+        uint32_t s0 = gs_read_texel <Psm, Cached>(gs, tex, iu0, iv0);
+        uint32_t s1 = gs_read_texel <Psm, Cached>(gs, tex, iu1, iv0);
+        uint32_t s2 = gs_read_texel <Psm, Cached>(gs, tex, iu0, iv1);
+        uint32_t s3 = gs_read_texel <Psm, Cached>(gs, tex, iu1, iv1);
 
         int r0 = s0 & 0xff;
         int g0 = (s0 >> 8) & 0xff;
@@ -1411,17 +2113,23 @@ static inline uint32_t gs_read_tb(struct ps2_gs* gs, int u, int v) {
         bb = CLAMP(bb, 0, 255);
         aa = CLAMP(aa, 0, 255);
 
-        return gs_from_rgba32(gs, rr | (gg << 8) | (bb << 16) | (aa << 24), gs->ctx->tbpsm);
+        // Filtered texels go through the texture format and back
+        uint32_t t = gs_from_rgba32(gs, rr | (gg << 8) | (bb << 16) | (aa << 24), psm);
+
+        return gs_to_rgba32(gs, t, psm);
     }
 
-    return gs_read_tb_impl(gs, u >> 4, v >> 4);
+    return gs_read_texel <Psm, Cached>(gs, tex, u >> 4, v >> 4);
 }
 
-static inline void gs_write_fb(struct ps2_gs* gs, int x, int y, uint32_t c) {
-    uint32_t f = gs_from_rgba32(gs, c, gs->ctx->fbpsm, x, y, gs->dthe);
+template <int Psm = -1, int Dthe = -1> static inline void gs_write_fb(struct ps2_gs* gs, int x, int y, uint32_t c) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->fbpsm : Psm;
+    const int dthe = (Dthe < 0) ? (int)gs->dthe : Dthe;
+
+    uint32_t f = gs_from_rgba32(gs, c, psm, x, y, dthe);
 
     // To-do: Implement FBMSK
-    switch (gs->ctx->fbpsm) {
+    switch (psm) {
         case GS_PSMCT32: {
             uint32_t addr = psmct32_addr(gs->ctx->fbp >> 6, gs->ctx->fbw >> 6, x, y);
 
@@ -1489,11 +2197,13 @@ static inline void gs_write_fb(struct ps2_gs* gs, int x, int y, uint32_t c) {
     }
 }
 
-static inline void gs_write_fb_no_alpha(struct ps2_gs* gs, int x, int y, uint32_t c) {
-    uint32_t f = gs_from_rgba32(gs, c, gs->ctx->fbpsm);
+template <int Psm = -1> static inline void gs_write_fb_no_alpha(struct ps2_gs* gs, int x, int y, uint32_t c) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->fbpsm : Psm;
+
+    uint32_t f = gs_from_rgba32(gs, c, psm);
 
     // To-do: Implement FBMSK
-    switch (gs->ctx->fbpsm) {
+    switch (psm) {
         case GS_PSMCT32: {
             uint32_t addr = psmct32_addr(gs->ctx->fbp >> 6, gs->ctx->fbw >> 6, x, y);
             uint32_t p = gs->vram[addr & 0xfffff];
@@ -1563,11 +2273,13 @@ static inline void gs_write_fb_no_alpha(struct ps2_gs* gs, int x, int y, uint32_
     }
 }
 
-static inline void gs_write_zb(struct ps2_gs* gs, int x, int y, uint32_t z) {
+template <int Psm = -1> static inline void gs_write_zb(struct ps2_gs* gs, int x, int y, uint32_t z) {
+    const int psm = (Psm < 0) ? (int)gs->ctx->zbpsm : Psm;
+
     if (gs->ctx->zbmsk || !gs->ctx->zte)
         return;
 
-    switch (gs->ctx->zbpsm) {
+    switch (psm) {
         case 0x01: z = std::min(z, 0xffffffu); break;
         case 0x02: z = std::min(z, 0xffffu); break;
         case 0x0A: z = std::min(z, 0xffffu); break;
@@ -1576,7 +2288,7 @@ static inline void gs_write_zb(struct ps2_gs* gs, int x, int y, uint32_t z) {
         case 0x3A: z = std::min(z, 0xffffu); break;
     }
 
-    switch (gs->ctx->zbpsm) {
+    switch (psm) {
         case GS_PSMCT32:
         case GS_PSMCT24: {
             gs->vram[psmct32_addr(gs->ctx->zbp >> 6, gs->ctx->fbw >> 6, x, y) & 0xfffff] = z;
@@ -1633,11 +2345,15 @@ static inline int gs_test_scissor(struct ps2_gs* gs, int x, int y) {
     return TR_PASS;
 }
 
-static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uint8_t a) {
+// A Z format of -2 means depth testing is off
+template <int Fbpsm, int Zbpsm, int Ztst, bool Ate> static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uint8_t a) {
+    const int fbpsm = (Fbpsm < 0) ? (int)gs->ctx->fbpsm : Fbpsm;
+    const int zbpsm = (Zbpsm < 0) ? (int)gs->ctx->zbpsm : Zbpsm;
+
     int tr = TR_PASS;
 
     // Alpha test
-    if (gs->ctx->ate) {
+    if (Ate) {
         switch (gs->ctx->atst) {
             case 0: tr = TR_FAIL; break;
             case 2: tr = a < gs->ctx->aref; break;
@@ -1665,11 +2381,11 @@ static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uin
         //        It was believed that in 24bit mode all pixels pass because alpha
         //        doesn't exist however after testing this on a PS2 it turns out
         //        nothing passes, it ignores the draw."
-        if ((gs->ctx->fbpsm & 0xf) == GS_PSMCT24) return TR_FAIL;
+        if ((fbpsm & 0xf) == GS_PSMCT24) return TR_FAIL;
 
-        uint32_t s = gs_read_fb(gs, x, y);
+        uint32_t s = gs_read_fb <Fbpsm>(gs, x, y);
 
-        switch (gs->ctx->fbpsm) {
+        switch (fbpsm) {
             case GS_PSMCT16:
             case GS_PSMCT16S:
                 if (((s >> 15) & 1) != gs->ctx->datm) return TR_FAIL;
@@ -1685,10 +2401,10 @@ static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uin
     }
 
     // Depth test
-    if (gs->ctx->zte) {
-        uint32_t zb = gs_read_zb(gs, x, y);
+    if (Zbpsm != -2) {
+        uint32_t zb = gs_read_zb <Zbpsm>(gs, x, y);
 
-        switch (gs->ctx->zbpsm) {
+        switch (zbpsm) {
             case 0x01: z = std::min(z, 0xffffffu); break;
             case 0x02: z = std::min(z, 0xffffu); break;
             case 0x0A: z = std::min(z, 0xffffu); break;
@@ -1697,7 +2413,7 @@ static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uin
             case 0x3A: z = std::min(z, 0xffffu); break;
         }
 
-        switch (gs->ctx->ztst) {
+        switch (Ztst) {
             case 0: return TR_FAIL;
             case 2: {
                 if (z < zb) return TR_FAIL;
@@ -1711,10 +2427,12 @@ static inline int gs_test_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uin
     return tr;
 }
 
-static inline uint32_t gs_alpha_blend(struct ps2_gs* gs, int x, int y, uint32_t s) {
-    uint32_t d = gs_read_fb(gs, x, y);
+template <int Fbpsm> static inline uint32_t gs_alpha_blend(struct ps2_gs* gs, int x, int y, uint32_t s) {
+    const int fbpsm = (Fbpsm < 0) ? (int)gs->ctx->fbpsm : Fbpsm;
 
-    switch (gs->ctx->fbpsm) {
+    uint32_t d = gs_read_fb <Fbpsm>(gs, x, y);
+
+    switch (fbpsm) {
         case GS_PSMCT32: break;
         case GS_PSMCT24: d |= 0x80000000; break;
         case GS_PSMCT16:
@@ -1741,231 +2459,747 @@ static inline uint32_t gs_alpha_blend(struct ps2_gs* gs, int x, int y, uint32_t
     
     // cv = CLAMP(cv, 0, 127);
 
-    // if (!gs->tme)
-    //     printf("Cd=%08x Cs=%08x a=%08x (%d) b=%08x (%d) c=%08x (%d) d=%08x (%d)\n", d, s,
-    //     av, gs->ctx->a,
-    //     bv, gs->ctx->b,
-    //     cv, gs->ctx->c,
-    //     dv, gs->ctx->d
-    // );
+    // if (!gs->tme)
+    //     printf("Cd=%08x Cs=%08x a=%08x (%d) b=%08x (%d) c=%08x (%d) d=%08x (%d)\n", d, s,
+    //     av, gs->ctx->a,
+    //     bv, gs->ctx->b,
+    //     cv, gs->ctx->c,
+    //     dv, gs->ctx->d
+    // );
+
+    int ar = (av >> 0 ) & 0xff;
+    int ag = (av >> 8 ) & 0xff;
+    int ab = (av >> 16) & 0xff;
+    // uint32_t aa = (av >> 24) & 0xff;
+    int br = (bv >> 0 ) & 0xff;
+    int bg = (bv >> 8 ) & 0xff;
+    int bb = (bv >> 16) & 0xff;
+    // uint32_t ba = (bv >> 24) & 0xff;
+    int dr = (dv >> 0 ) & 0xff;
+    int dg = (dv >> 8 ) & 0xff;
+    int db = (dv >> 16) & 0xff;
+    // uint32_t da = (dv >> 24) & 0xff;
+
+    int rr = ar - br;
+    int rg = ag - bg;
+    int rb = ab - bb;
+
+    rr = ((rr * (int)cv) >> 7) + dr;
+    rg = ((rg * (int)cv) >> 7) + dg;
+    rb = ((rb * (int)cv) >> 7) + db;
+    // uint32_t ra = (((aa - ba) * cv) >> 7) + da;
+
+    rr = CLAMP(rr, 0, 255);
+    rg = CLAMP(rg, 0, 255);
+    rb = CLAMP(rb, 0, 255);
+
+    return (rr & 0xff) | ((rg & 0xff) << 8) | ((rb & 0xff) << 16) | (d & 0xff000000);
+}
+
+static inline float lerpf(int32_t x, float u1, int32_t x1, float u2, int32_t x2) {
+    float b = u1 * (x2 - x);
+
+    b += u2 * (x - x1);
+
+    if (!(x2 - x1))
+        return u1;
+
+    return b / (x2 - x1);
+}
+
+static inline int32_t lerp(int32_t x, int32_t u1, int32_t x1, int32_t u2, int32_t x2) {
+    int64_t b = (int64_t)u1 * (x2 - x);
+
+    b += (int64_t)u2 * (x - x1);
+
+    if (!(x2 - x1))
+        return u1;
+
+    return b / (x2 - x1);
+}
+
+int32_t stepsize(int32_t u1, int32_t x1, int32_t u2, int32_t x2, int64_t mult) {
+    if (!(x2 - x1))
+        return ((u2 - u1) * mult);
+
+    return ((u2 - u1) * mult)/(x2 - x1);
+}
+
+// Pixel pipelines
+//
+// Everything that stays constant for a whole primitive (frame and Z
+// formats, dithering, depth test, alpha test and blending) is resolved
+// at compile time, software_pixel_select picks the matching pipeline
+// when a primitive is dispatched. Formats without a specialisation
+// read theirs from the context.
+template <int Fbpsm, bool Dthe, int Zbpsm, int Ztst, bool Ate, bool Abe> static void gs_draw_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uint32_t c) {
+    int a = c >> 24;
+
+    software_thread_pixel_count++;
+
+    int tr = gs_test_pixel <Fbpsm, Zbpsm, Ztst, Ate>(gs, x, y, z, a);
+
+    if (tr == TR_FAIL)
+        return;
+
+    if (Abe) c = gs_alpha_blend <Fbpsm>(gs, x, y, c);
+
+    switch (tr) {
+        case TR_FB_ONLY: gs_write_fb <Fbpsm, Dthe>(gs, x, y, c); break;
+        case TR_RGB_ONLY: gs_write_fb_no_alpha <Fbpsm>(gs, x, y, c); break;
+        case TR_ZB_ONLY: {
+            if (Zbpsm != -2)
+                gs_write_zb <Zbpsm>(gs, x, y, z);
+        } break;
+        case TR_PASS: {
+            if (Zbpsm != -2)
+                gs_write_zb <Zbpsm>(gs, x, y, z);
+
+            gs_write_fb <Fbpsm, Dthe>(gs, x, y, c);
+        } break;
+    }
+}
+
+// Frame and Z formats with their own pipelines, anything else
+// takes the last (generic) slot
+static constexpr int software_pixel_fb_psm[] = { GS_PSMCT32, GS_PSMCT24, GS_PSMCT16, GS_PSMCT16S, -1 };
+static constexpr int software_pixel_zb_psm[] = { -2, GS_PSMCT32, GS_PSMCT24, GS_PSMCT16, GS_PSMCT16S, -1 };
+
+// Indexed like so:
+//   fb[10:8] dthe[7] zb[6:4] ztst[3:2] ate[1] abe[0]
+template <int I> static constexpr software_pixel_func software_pixel_entry() {
+    constexpr int fb = std::min((I >> 8) & 7, 4);
+    constexpr int zb = std::min((I >> 4) & 7, 5);
+    constexpr int fbpsm = software_pixel_fb_psm[fb];
+    constexpr int zbpsm = software_pixel_zb_psm[zb];
+
+    // Only 16-bit formats dither, and ZTST doesn't matter without
+    // a depth test, fold those so they share a pipeline
+    constexpr bool dthe = ((I >> 7) & 1) && (fbpsm != GS_PSMCT32) && (fbpsm != GS_PSMCT24);
+    constexpr int ztst = (zbpsm == -2) ? 0 : ((I >> 2) & 3);
+
+    return gs_draw_pixel <fbpsm, dthe, zbpsm, ztst, ((I >> 1) & 1) != 0, (I & 1) != 0>;
+}
+
+template <size_t... I> static constexpr std::array <software_pixel_func, sizeof...(I)> software_pixel_make_table(std::index_sequence <I...>) {
+    return {{ software_pixel_entry <I>()... }};
+}
+
+static constexpr auto software_pixel_table = software_pixel_make_table(std::make_index_sequence <SOFTWARE_PIXEL_VARIANTS>());
+
+static inline int software_pixel_key(struct ps2_gs* gs) {
+    int fb, zb = 0;
+
+    switch (gs->ctx->fbpsm) {
+        case GS_PSMCT32: fb = 0; break;
+        case GS_PSMCT24: fb = 1; break;
+        case GS_PSMCT16: fb = 2; break;
+        case GS_PSMCT16S: fb = 3; break;
+        default: fb = 4; break;
+    }
+
+    if (gs->ctx->zte) {
+        switch (gs->ctx->zbpsm) {
+            case GS_PSMCT32: zb = 1; break;
+            case GS_PSMCT24: zb = 2; break;
+            case GS_PSMCT16: zb = 3; break;
+            case GS_PSMCT16S: zb = 4; break;
+            default: zb = 5; break;
+        }
+    }
+
+    return (fb << 8) |
+           (((int)gs->dthe != 0) << 7) |
+           (zb << 4) |
+           ((gs->ctx->ztst & 3) << 2) |
+           ((gs->ctx->ate & 1) << 1) |
+           (gs->abe != 0);
+}
+
+// Texel pipelines, texture read, conversion to RGBA32 and the texture
+// function, specialised on TEX0 (format, TFX and TCC), magnification
+// and whether texels come from the texture cache
+template <int Tbpsm, int Tfx, bool Tcc, bool Mmag, bool Cached> static uint32_t gs_sample(struct ps2_gs* gs, software_texture* tex, int u, int v, uint32_t f) {
+    uint32_t t = gs_read_tb <Tbpsm, Mmag, Cached>(gs, tex, u, v);
+
+    return gs_apply_function <Tfx, Tcc>(gs, t, f);
+}
+
+static constexpr int software_texel_psm[] = { GS_PSMCT32, GS_PSMCT24, GS_PSMCT16, GS_PSMCT16S, GS_PSMT8, GS_PSMT4, -1 };
+
+// Indexed like so:
+//   cached[7] psm[6:4] tfx[3:2] tcc[1] mmag[0]
+template <int I> static constexpr software_texel_func software_texel_entry() {
+    constexpr int psm = software_texel_psm[std::min((I >> 4) & 7, 6)];
+
+    return gs_sample <psm, (I >> 2) & 3, ((I >> 1) & 1) != 0, (I & 1) != 0, ((I >> 7) & 1) != 0>;
+}
+
+template <size_t... I> static constexpr std::array <software_texel_func, sizeof...(I)> software_texel_make_table(std::index_sequence <I...>) {
+    return {{ software_texel_entry <I>()... }};
+}
+
+static constexpr auto software_texel_table = software_texel_make_table(std::make_index_sequence <SOFTWARE_TEXEL_VARIANTS>());
+
+static inline int software_texel_key(struct ps2_gs* gs, bool cached) {
+    int psm;
+
+    switch (gs->ctx->tbpsm) {
+        case GS_PSMCT32: psm = 0; break;
+        case GS_PSMCT24: psm = 1; break;
+        case GS_PSMCT16: psm = 2; break;
+        case GS_PSMCT16S: psm = 3; break;
+        case GS_PSMT8: psm = 4; break;
+        case GS_PSMT4: psm = 5; break;
+        default: psm = 6; break;
+    }
+
+    return ((cached ? 1 : 0) << 7) |
+           (psm << 4) |
+           ((gs->ctx->tfx & 3) << 2) |
+           ((gs->ctx->tcc & 1) << 1) |
+           (gs->ctx->mmag & 1);
+}
+
+// SIMD back end
+//
+// Spans go through the alpha test, destination alpha test, depth test
+// and blending a whole vector at a time, only the final stores are done
+// lane by lane. Just 32 and 24-bit frame and Z buffers are covered,
+// those share the PSMCT32 layout and one word per pixel. The SSE4.1
+// path does four lanes at once and the AVX2 one eight, the latter is
+// picked at init when CPUID reports it.
+#ifdef _EE_USE_INTRINSICS
+// PSMCT32 block and column swizzles for a given row, as PSHUFB tables
+alignas(16) static const uint8_t gs_span_block_lut[4][16] = {
+    { 0 , 1 , 4 , 5 , 16, 17, 20, 21 },
+    { 2 , 3 , 6 , 7 , 18, 19, 22, 23 },
+    { 8 , 9 , 12, 13, 24, 25, 28, 29 },
+    { 10, 11, 14, 15, 26, 27, 30, 31 }
+};
+
+alignas(16) static const uint8_t gs_span_column_lut[2][16] = {
+    { 0 , 1 , 4 , 5 , 8 , 9 , 12, 13 },
+    { 2 , 3 , 6 , 7 , 10, 11, 14, 15 }
+};
+
+// Word offset of each pixel within its row, the part of psmct32_addr
+// that both the frame and Z buffer share
+static inline __m128i gs_span_offset_sse41(__m128i x, int y) {
+    __m128i seven = _mm_set1_epi32(7);
+    __m128i hi = _mm_set1_epi32(0x80808000);
+
+    __m128i blut = _mm_load_si128((const __m128i*)gs_span_block_lut[(y >> 3) & 3]);
+    __m128i clut = _mm_load_si128((const __m128i*)gs_span_column_lut[y & 1]);
+
+    __m128i blk = _mm_shuffle_epi8(blut, _mm_or_si128(_mm_and_si128(_mm_srli_epi32(x, 3), seven), hi));
+    __m128i col = _mm_shuffle_epi8(clut, _mm_or_si128(_mm_and_si128(x, seven), hi));
+
+    __m128i r = _mm_slli_epi32(_mm_srli_epi32(x, 6), 11);
+
+    r = _mm_add_epi32(r, _mm_slli_epi32(blk, 6));
+
+    return _mm_add_epi32(r, col);
+}
+
+static inline __m128i gs_span_atest_sse41(__m128i a, uint32_t atst, uint32_t aref) {
+    __m128i r = _mm_set1_epi32(aref);
+    __m128i ones = _mm_set1_epi32(-1);
+
+    switch (atst) {
+        case 0: return _mm_setzero_si128();
+        case 2: return _mm_cmplt_epi32(a, r);
+        case 3: return _mm_xor_si128(_mm_cmpgt_epi32(a, r), ones);
+        case 4: return _mm_cmpeq_epi32(a, r);
+        case 5: return _mm_xor_si128(_mm_cmplt_epi32(a, r), ones);
+        case 6: return _mm_cmpgt_epi32(a, r);
+        case 7: return _mm_xor_si128(_mm_cmpeq_epi32(a, r), ones);
+    }
+
+    return ones;
+}
+
+// ((A - B) * C >> 7) + D for one color channel
+template <int Sh> static inline __m128i gs_span_blend_channel_sse41(__m128i a, __m128i b, __m128i c, __m128i d) {
+    __m128i m = _mm_set1_epi32(0xff);
+
+    __m128i ac = _mm_and_si128(_mm_srli_epi32(a, Sh), m);
+    __m128i bc = _mm_and_si128(_mm_srli_epi32(b, Sh), m);
+    __m128i dc = _mm_and_si128(_mm_srli_epi32(d, Sh), m);
+
+    __m128i r = _mm_mullo_epi32(_mm_sub_epi32(ac, bc), c);
+
+    r = _mm_add_epi32(_mm_srai_epi32(r, 7), dc);
+    r = _mm_min_epi32(_mm_max_epi32(r, _mm_setzero_si128()), m);
+
+    return _mm_slli_epi32(r, Sh);
+}
+
+static inline __m128i gs_span_blend_sse41(struct gs_context* ctx, __m128i s, __m128i d) {
+    __m128i zero = _mm_setzero_si128();
+
+    __m128i av = (ctx->a == 0) ? s : ((ctx->a == 1) ? d : zero);
+    __m128i bv = (ctx->b == 0) ? s : ((ctx->b == 1) ? d : zero);
+    __m128i cv = (ctx->c == 0) ? _mm_srli_epi32(s, 24) : ((ctx->c == 1) ? _mm_srli_epi32(d, 24) : _mm_set1_epi32(ctx->fix));
+    __m128i dv = (ctx->d == 0) ? s : ((ctx->d == 1) ? d : zero);
+
+    __m128i r = gs_span_blend_channel_sse41 <0>(av, bv, cv, dv);
+
+    r = _mm_or_si128(r, gs_span_blend_channel_sse41 <8>(av, bv, cv, dv));
+    r = _mm_or_si128(r, gs_span_blend_channel_sse41 <16>(av, bv, cv, dv));
+
+    return _mm_or_si128(r, _mm_and_si128(d, _mm_set1_epi32(0xff000000)));
+}
+
+// Lanes that fail a test still get their old value written back when
+// it was loaded anyway, that keeps the store loop free of branches
+template <int N> static inline void gs_span_store(uint32_t* vram, const uint32_t* addr, const uint32_t* data, int n, int mask, bool all) {
+    if (all) {
+        for (int i = 0; i < n; i++)
+            vram[addr[i]] = data[i];
+
+        return;
+    }
+
+    for (int i = 0; i < N; i++)
+        if (mask & (1 << i))
+            vram[addr[i]] = data[i];
+}
+
+template <int Fbpsm, int Zbpsm> static void gs_draw_span_sse41(struct ps2_gs* gs, const software_span* span) {
+    struct gs_context* ctx = gs->ctx;
+
+    software_thread_pixel_count += span->n;
+
+    // Nothing can pass
+    if ((Zbpsm != -2) && (ctx->ztst == 0))
+        return;
+
+    if (ctx->date && (Fbpsm == GS_PSMCT24))
+        return;
+
+    const bool read_fb = ctx->date || gs->abe || (Fbpsm == GS_PSMCT24) || (ctx->ate && ctx->afail == 3);
+    const bool read_zb = (Zbpsm != -2) && (ctx->ztst >= 2) && !span->pass;
+    const bool write_zb = (Zbpsm != -2) && !ctx->zbmsk;
+
+    const __m128i ones = _mm_set1_epi32(-1);
+    const __m128i rgb = _mm_set1_epi32(0xffffff);
+    const __m128i wrap = _mm_set1_epi32(0xfffff);
+
+    int row = ((span->y >> 5) * (ctx->fbw >> 6) * 2048) + (((span->y >> 1) & 3) * 16);
+
+    const __m128i fbase = _mm_set1_epi32(row + (ctx->fbp >> 6) * 64);
+    const __m128i zbase = _mm_set1_epi32(row + (ctx->zbp >> 6) * 64);
+
+    const uint32_t* vram = gs->vram;
+
+    for (int h = 0; h < span->n; h += 4) {
+        __m128i live = _mm_cmplt_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32(span->n - h));
+        __m128i c = _mm_loadu_si128((const __m128i*)(span->c + h));
+        __m128i z = _mm_loadu_si128((const __m128i*)(span->z + h));
+        __m128i o = gs_span_offset_sse41(_mm_loadu_si128((const __m128i*)(span->x + h)), span->y);
+
+        alignas(16) uint32_t fa[4], za[4], fv[4], zv[4];
+
+        _mm_store_si128((__m128i*)fa, _mm_and_si128(_mm_add_epi32(o, fbase), wrap));
+        _mm_store_si128((__m128i*)za, _mm_and_si128(_mm_add_epi32(o, zbase), wrap));
+
+        __m128i p = _mm_setzero_si128();
+        __m128i q = _mm_setzero_si128();
+
+        if (read_fb)
+            p = _mm_setr_epi32(vram[fa[0]], vram[fa[1]], vram[fa[2]], vram[fa[3]]);
+
+        if (read_zb)
+            q = _mm_setr_epi32(vram[za[0]], vram[za[1]], vram[za[2]], vram[za[3]]);
+
+        // Destination as the blender and DATE see it
+        __m128i d = p;
+
+        if (Fbpsm == GS_PSMCT24)
+            d = _mm_or_si128(_mm_and_si128(p, rgb), _mm_set1_epi32(0x80000000));
+
+        __m128i fbw = ones;
+        __m128i zbw = ones;
+        __m128i keep_a = _mm_setzero_si128();
+
+        if (ctx->ate) {
+            __m128i pass = gs_span_atest_sse41(_mm_srli_epi32(c, 24), ctx->atst, ctx->aref);
+
+            switch (ctx->afail) {
+                case 0: live = _mm_and_si128(live, pass); break;
+                case 1: zbw = pass; break;
+                case 2: fbw = pass; break;
+                case 3: zbw = pass; keep_a = _mm_xor_si128(pass, ones); break;
+            }
+        }
+
+        if (ctx->date)
+            live = _mm_and_si128(live, _mm_cmpeq_epi32(_mm_srli_epi32(d, 31), _mm_set1_epi32(ctx->datm)));
+
+        if (Zbpsm == GS_PSMCT24)
+            z = _mm_min_epu32(z, rgb);
+
+        if (read_zb) {
+            __m128i zb = (Zbpsm == GS_PSMCT24) ? _mm_and_si128(q, rgb) : q;
+            __m128i m = _mm_max_epu32(z, zb);
+
+            if (ctx->ztst == 2) {
+                live = _mm_and_si128(live, _mm_cmpeq_epi32(m, z));
+            } else {
+                live = _mm_andnot_si128(_mm_cmpeq_epi32(m, zb), live);
+            }
+        }
+
+        if (gs->abe)
+            c = gs_span_blend_sse41(ctx, c, d);
+
+        // 24-bit frames and RGB only writes keep the old alpha
+        __m128i f = _mm_or_si128(_mm_and_si128(c, rgb), _mm_andnot_si128(rgb, p));
+
+        if (Fbpsm != GS_PSMCT24)
+            f = _mm_blendv_epi8(c, f, keep_a);
+
+        fbw = _mm_and_si128(live, fbw);
+        zbw = _mm_and_si128(live, zbw);
+
+        _mm_store_si128((__m128i*)fv, read_fb ? _mm_blendv_epi8(p, f, fbw) : f);
+        _mm_store_si128((__m128i*)zv, read_zb ? _mm_blendv_epi8(q, z, zbw) : z);
+
+        int n = std::min(span->n - h, 4);
+
+        if (write_zb)
+            gs_span_store <4>(gs->vram, za, zv, n, _mm_movemask_ps(_mm_castsi128_ps(zbw)), read_zb);
+
+        gs_span_store <4>(gs->vram, fa, fv, n, _mm_movemask_ps(_mm_castsi128_ps(fbw)), read_fb);
+    }
+}
+
+static inline SOFTWARE_AVX2 __m256i gs_span_offset_avx2(__m256i x, int y) {
+    __m256i seven = _mm256_set1_epi32(7);
+    __m256i hi = _mm256_set1_epi32(0x80808000);
+
+    __m256i blut = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gs_span_block_lut[(y >> 3) & 3]));
+    __m256i clut = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)gs_span_column_lut[y & 1]));
+
+    __m256i blk = _mm256_shuffle_epi8(blut, _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(x, 3), seven), hi));
+    __m256i col = _mm256_shuffle_epi8(clut, _mm256_or_si256(_mm256_and_si256(x, seven), hi));
+
+    __m256i r = _mm256_slli_epi32(_mm256_srli_epi32(x, 6), 11);
+
+    r = _mm256_add_epi32(r, _mm256_slli_epi32(blk, 6));
+
+    return _mm256_add_epi32(r, col);
+}
+
+static inline SOFTWARE_AVX2 __m256i gs_span_atest_avx2(__m256i a, uint32_t atst, uint32_t aref) {
+    __m256i r = _mm256_set1_epi32(aref);
+    __m256i ones = _mm256_set1_epi32(-1);
+
+    switch (atst) {
+        case 0: return _mm256_setzero_si256();
+        case 2: return _mm256_cmpgt_epi32(r, a);
+        case 3: return _mm256_xor_si256(_mm256_cmpgt_epi32(a, r), ones);
+        case 4: return _mm256_cmpeq_epi32(a, r);
+        case 5: return _mm256_xor_si256(_mm256_cmpgt_epi32(r, a), ones);
+        case 6: return _mm256_cmpgt_epi32(a, r);
+        case 7: return _mm256_xor_si256(_mm256_cmpeq_epi32(a, r), ones);
+    }
+
+    return ones;
+}
+
+template <int Sh> static inline SOFTWARE_AVX2 __m256i gs_span_blend_channel_avx2(__m256i a, __m256i b, __m256i c, __m256i d) {
+    __m256i m = _mm256_set1_epi32(0xff);
+
+    __m256i ac = _mm256_and_si256(_mm256_srli_epi32(a, Sh), m);
+    __m256i bc = _mm256_and_si256(_mm256_srli_epi32(b, Sh), m);
+    __m256i dc = _mm256_and_si256(_mm256_srli_epi32(d, Sh), m);
+
+    __m256i r = _mm256_mullo_epi32(_mm256_sub_epi32(ac, bc), c);
+
+    r = _mm256_add_epi32(_mm256_srai_epi32(r, 7), dc);
+    r = _mm256_min_epi32(_mm256_max_epi32(r, _mm256_setzero_si256()), m);
+
+    return _mm256_slli_epi32(r, Sh);
+}
+
+static inline SOFTWARE_AVX2 __m256i gs_span_blend_avx2(struct gs_context* ctx, __m256i s, __m256i d) {
+    __m256i zero = _mm256_setzero_si256();
+
+    __m256i av = (ctx->a == 0) ? s : ((ctx->a == 1) ? d : zero);
+    __m256i bv = (ctx->b == 0) ? s : ((ctx->b == 1) ? d : zero);
+    __m256i cv = (ctx->c == 0) ? _mm256_srli_epi32(s, 24) : ((ctx->c == 1) ? _mm256_srli_epi32(d, 24) : _mm256_set1_epi32(ctx->fix));
+    __m256i dv = (ctx->d == 0) ? s : ((ctx->d == 1) ? d : zero);
+
+    __m256i r = gs_span_blend_channel_avx2 <0>(av, bv, cv, dv);
+
+    r = _mm256_or_si256(r, gs_span_blend_channel_avx2 <8>(av, bv, cv, dv));
+    r = _mm256_or_si256(r, gs_span_blend_channel_avx2 <16>(av, bv, cv, dv));
+
+    return _mm256_or_si256(r, _mm256_and_si256(d, _mm256_set1_epi32(0xff000000)));
+}
+
+template <int Fbpsm, int Zbpsm> static SOFTWARE_AVX2 void gs_draw_span_avx2(struct ps2_gs* gs, const software_span* span) {
+    struct gs_context* ctx = gs->ctx;
+
+    software_thread_pixel_count += span->n;
+
+    if ((Zbpsm != -2) && (ctx->ztst == 0))
+        return;
+
+    if (ctx->date && (Fbpsm == GS_PSMCT24))
+        return;
+
+    const bool read_fb = ctx->date || gs->abe || (Fbpsm == GS_PSMCT24) || (ctx->ate && ctx->afail == 3);
+    const bool read_zb = (Zbpsm != -2) && (ctx->ztst >= 2) && !span->pass;
+    const bool write_zb = (Zbpsm != -2) && !ctx->zbmsk;
+
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i rgb = _mm256_set1_epi32(0xffffff);
+    const __m256i wrap = _mm256_set1_epi32(0xfffff);
+
+    int row = ((span->y >> 5) * (ctx->fbw >> 6) * 2048) + (((span->y >> 1) & 3) * 16);
+
+    __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(span->n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    __m256i c = _mm256_loadu_si256((const __m256i*)span->c);
+    __m256i z = _mm256_loadu_si256((const __m256i*)span->z);
+    __m256i o = gs_span_offset_avx2(_mm256_loadu_si256((const __m256i*)span->x), span->y);
+
+    __m256i fa = _mm256_and_si256(_mm256_add_epi32(o, _mm256_set1_epi32(row + (ctx->fbp >> 6) * 64)), wrap);
+    __m256i za = _mm256_and_si256(_mm256_add_epi32(o, _mm256_set1_epi32(row + (ctx->zbp >> 6) * 64)), wrap);
+
+    const int* vram = (const int*)gs->vram;
+
+    __m256i p = _mm256_setzero_si256();
+    __m256i q = _mm256_setzero_si256();
+
+    if (read_fb)
+        p = _mm256_i32gather_epi32(vram, fa, 4);
+
+    if (read_zb)
+        q = _mm256_i32gather_epi32(vram, za, 4);
+
+    __m256i d = p;
+
+    if (Fbpsm == GS_PSMCT24)
+        d = _mm256_or_si256(_mm256_and_si256(p, rgb), _mm256_set1_epi32(0x80000000));
+
+    __m256i fbw = ones;
+    __m256i zbw = ones;
+    __m256i keep_a = _mm256_setzero_si256();
+
+    if (ctx->ate) {
+        __m256i pass = gs_span_atest_avx2(_mm256_srli_epi32(c, 24), ctx->atst, ctx->aref);
+
+        switch (ctx->afail) {
+            case 0: live = _mm256_and_si256(live, pass); break;
+            case 1: zbw = pass; break;
+            case 2: fbw = pass; break;
+            case 3: zbw = pass; keep_a = _mm256_xor_si256(pass, ones); break;
+        }
+    }
+
+    if (ctx->date)
+        live = _mm256_and_si256(live, _mm256_cmpeq_epi32(_mm256_srli_epi32(d, 31), _mm256_set1_epi32(ctx->datm)));
+
+    if (Zbpsm == GS_PSMCT24)
+        z = _mm256_min_epu32(z, rgb);
+
+    if (read_zb) {
+        __m256i zb = (Zbpsm == GS_PSMCT24) ? _mm256_and_si256(q, rgb) : q;
+        __m256i m = _mm256_max_epu32(z, zb);
+
+        if (ctx->ztst == 2) {
+            live = _mm256_and_si256(live, _mm256_cmpeq_epi32(m, z));
+        } else {
+            live = _mm256_andnot_si256(_mm256_cmpeq_epi32(m, zb), live);
+        }
+    }
+
+    if (gs->abe)
+        c = gs_span_blend_avx2(ctx, c, d);
 
-    int ar = (av >> 0 ) & 0xff;
-    int ag = (av >> 8 ) & 0xff;
-    int ab = (av >> 16) & 0xff;
-    // uint32_t aa = (av >> 24) & 0xff;
-    int br = (bv >> 0 ) & 0xff;
-    int bg = (bv >> 8 ) & 0xff;
-    int bb = (bv >> 16) & 0xff;
-    // uint32_t ba = (bv >> 24) & 0xff;
-    int dr = (dv >> 0 ) & 0xff;
-    int dg = (dv >> 8 ) & 0xff;
-    int db = (dv >> 16) & 0xff;
-    // uint32_t da = (dv >> 24) & 0xff;
+    __m256i f = _mm256_or_si256(_mm256_and_si256(c, rgb), _mm256_andnot_si256(rgb, p));
 
-    int rr = ar - br;
-    int rg = ag - bg;
-    int rb = ab - bb;
+    if (Fbpsm != GS_PSMCT24)
+        f = _mm256_blendv_epi8(c, f, keep_a);
 
-    rr = ((rr * (int)cv) >> 7) + dr;
-    rg = ((rg * (int)cv) >> 7) + dg;
-    rb = ((rb * (int)cv) >> 7) + db;
-    // uint32_t ra = (((aa - ba) * cv) >> 7) + da;
+    fbw = _mm256_and_si256(live, fbw);
+    zbw = _mm256_and_si256(live, zbw);
 
-    rr = CLAMP(rr, 0, 255);
-    rg = CLAMP(rg, 0, 255);
-    rb = CLAMP(rb, 0, 255);
+    alignas(32) uint32_t fav[8], zav[8], fv[8], zv[8];
 
-    return (rr & 0xff) | ((rg & 0xff) << 8) | ((rb & 0xff) << 16) | (d & 0xff000000);
+    _mm256_store_si256((__m256i*)fav, fa);
+    _mm256_store_si256((__m256i*)zav, za);
+    _mm256_store_si256((__m256i*)fv, read_fb ? _mm256_blendv_epi8(p, f, fbw) : f);
+    _mm256_store_si256((__m256i*)zv, read_zb ? _mm256_blendv_epi8(q, z, zbw) : z);
+
+    if (write_zb)
+        gs_span_store <8>(gs->vram, zav, zv, span->n, _mm256_movemask_ps(_mm256_castsi256_ps(zbw)), read_zb);
+
+    gs_span_store <8>(gs->vram, fav, fv, span->n, _mm256_movemask_ps(_mm256_castsi256_ps(fbw)), read_fb);
 }
 
-static inline float lerpf(int32_t x, float u1, int32_t x1, float u2, int32_t x2) {
-    float b = u1 * (x2 - x);
+// Indexed by frame (32, 24) and Z format (off, 32, 24)
+static const software_span_func software_span_sse41[2][3] = {
+    { gs_draw_span_sse41 <GS_PSMCT32, -2>, gs_draw_span_sse41 <GS_PSMCT32, GS_PSMCT32>, gs_draw_span_sse41 <GS_PSMCT32, GS_PSMCT24> },
+    { gs_draw_span_sse41 <GS_PSMCT24, -2>, gs_draw_span_sse41 <GS_PSMCT24, GS_PSMCT32>, gs_draw_span_sse41 <GS_PSMCT24, GS_PSMCT24> }
+};
 
-    b += u2 * (x - x1);
+static const software_span_func software_span_avx2[2][3] = {
+    { gs_draw_span_avx2 <GS_PSMCT32, -2>, gs_draw_span_avx2 <GS_PSMCT32, GS_PSMCT32>, gs_draw_span_avx2 <GS_PSMCT32, GS_PSMCT24> },
+    { gs_draw_span_avx2 <GS_PSMCT24, -2>, gs_draw_span_avx2 <GS_PSMCT24, GS_PSMCT32>, gs_draw_span_avx2 <GS_PSMCT24, GS_PSMCT24> }
+};
+#endif
 
-    if (!(x2 - x1))
-        return u1;
+static inline bool software_cpu_has_avx2() {
+#if !defined(_EE_USE_INTRINSICS)
+    return false;
+#elif defined(_MSC_VER)
+    int r[4];
 
-    return b / (x2 - x1);
-}
+    __cpuid(r, 0);
 
-static inline int32_t lerp(int32_t x, int32_t u1, int32_t x1, int32_t u2, int32_t x2) {
-    int64_t b = (int64_t)u1 * (x2 - x);
+    if (r[0] < 7)
+        return false;
 
-    b += (int64_t)u2 * (x - x1);
+    // AVX and OSXSAVE, then YMM state enabled by the OS
+    __cpuid(r, 1);
 
-    if (!(x2 - x1))
-        return u1;
+    if (((r[2] >> 27) & 3) != 3 || (_xgetbv(0) & 6) != 6)
+        return false;
 
-    return b / (x2 - x1);
+    __cpuidex(r, 7, 0);
+
+    return (r[1] >> 5) & 1;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
 }
 
-int32_t stepsize(int32_t u1, int32_t x1, int32_t u2, int32_t x2, int64_t mult) {
-    if (!(x2 - x1))
-        return ((u2 - u1) * mult);
+// Idle lanes repeat the first pixel, they may be loaded but are
+// never stored
+static inline void gs_flush_span(struct ps2_gs* gs, const software_pipeline& pipe, software_span* span) {
+    for (int i = span->n; i < SOFTWARE_SPAN_SIZE; i++) {
+        span->x[i] = span->x[0];
+        span->z[i] = span->z[0];
+        span->c[i] = span->c[0];
+    }
 
-    return ((u2 - u1) * mult)/(x2 - x1);
+    pipe.span(gs, span);
+
+    span->n = 0;
 }
 
-static inline void gs_draw_pixel(struct ps2_gs* gs, int x, int y, uint32_t z, uint32_t c) {
-    int a = c >> 24;
+// Sprites that can take a fast path in render_sprite, they write the
+// frame and at most a constant Z, with nothing read back. Serial ones
+// (feedback loops, frame and Z buffers sharing pages) stay on the
+// generic path, which keeps pixel order
+static inline int software_sprite_mode(struct ps2_gs* gs, bool serial) {
+    struct gs_context* c = gs->ctx;
+
+    if (serial || gs->abe || c->date || c->fbmsk)
+        return SOFTWARE_SPRITE_GENERIC;
+
+    // Only ALWAYS passes for alpha and depth tests
+    if ((c->ate && c->atst != 1) || (c->zte && c->ztst != 1))
+        return SOFTWARE_SPRITE_GENERIC;
+
+    if (c->zte && !c->zbmsk) {
+        switch (c->zbpsm) {
+            case GS_PSMCT32: case GS_PSMCT24: case GS_PSMCT16: case GS_PSMCT16S:
+            case GS_PSMZ32: case GS_PSMZ24: case GS_PSMZ16: case GS_PSMZ16S: break;
+            default: return SOFTWARE_SPRITE_GENERIC;
+        }
+    }
+
+    switch (c->fbpsm) {
+        case GS_PSMCT32:
+        case GS_PSMCT24: break;
+        case GS_PSMCT16:
+        case GS_PSMCT16S: {
+            if (gs->dthe)
+                return SOFTWARE_SPRITE_GENERIC;
+        } break;
+        default: return SOFTWARE_SPRITE_GENERIC;
+    }
 
-    int tr = gs_test_pixel(gs, x, y, z, a);
+    if (!gs->tme)
+        return SOFTWARE_SPRITE_FILL;
 
-    if (tr == TR_FAIL)
-        return;
+    // Copies, point-sampled UV coordinates into a texture of the same
+    // format, wrapping is checked per sprite
+    if (!gs->fst || c->mmag || c->tbpsm != c->fbpsm || c->wms > 1 || c->wmt > 1)
+        return SOFTWARE_SPRITE_GENERIC;
 
-    if (gs->abe) c = gs_alpha_blend(gs, x, y, c);
+    uint32_t f = gs->vq[1].rgbaq & 0xffffffff;
 
-    switch (tr) {
-        case TR_FB_ONLY: gs_write_fb(gs, x, y, c); break;
-        case TR_ZB_ONLY: gs_write_zb(gs, x, y, z); break;
-        case TR_RGB_ONLY: gs_write_fb_no_alpha(gs, x, y, c); break;
-        case TR_PASS: {
-            gs_write_zb(gs, x, y, z);
-            gs_write_fb(gs, x, y, c);
+    switch (c->tfx) {
+        case GS_DECAL: break;
+        case GS_MODULATE: {
+            if ((f & 0xffffff) != 0x808080 || (c->tcc && (f >> 24) != 0x80))
+                return SOFTWARE_SPRITE_GENERIC;
         } break;
+        default: return SOFTWARE_SPRITE_GENERIC;
     }
-}
 
-void software_thread_init(void* udata, struct ps2_gs* gs, SDL_Window* window, SDL_GPUDevice* device) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+    // 16-bit texels keep their alpha bit only when TEXA maps it
+    // straight back
+    if ((c->fbpsm == GS_PSMCT16 || c->fbpsm == GS_PSMCT16S) && c->tcc) {
+        if (!(gs->ta1 & 0x80) || (gs->ta0 & 0x80))
+            return SOFTWARE_SPRITE_GENERIC;
+    }
 
-    ctx->window = window;
-    ctx->device = device;
-    ctx->gs = gs;
-    ctx->scale = 1.5f;
+    return SOFTWARE_SPRITE_COPY;
+}
 
-    ctx->end_signal = false;
-    ctx->render_thr = std::thread(software_thread_render_thread, ctx);
-    ctx->render_thr.detach();
-
-    // create the vertex shader
-    SDL_GPUShaderCreateInfo vsci = {
-        .code_size = g_vertex_shader_size,
-        .code = g_vertex_shader_data,
-        .entrypoint = SHADER_ENTRYPOINT,
-        .format = SHADER_FORMAT,
-        .stage = SDL_GPU_SHADERSTAGE_VERTEX,
-        .num_samplers = 0,
-        .num_storage_textures = 0,
-        .num_storage_buffers = 0,
-        .num_uniform_buffers = 0,
-    };
+static void software_pipeline_select(software_thread_state* ctx, render_data* rdata, bool serial) {
+    struct ps2_gs* gs = &rdata->gs;
 
-    SDL_GPUShader* vertex_shader = SDL_CreateGPUShader(device, &vsci);
-
-    // create the fragment shader
-    SDL_GPUShaderCreateInfo fsci = {
-        .code_size = g_fragment_shader_size,
-        .code = g_fragment_shader_data,
-        .entrypoint = SHADER_ENTRYPOINT,
-        .format = SHADER_FORMAT,
-        .stage = SDL_GPU_SHADERSTAGE_FRAGMENT,
-        .num_samplers = 1,
-        .num_storage_textures = 0,
-        .num_storage_buffers = 0,
-        .num_uniform_buffers = 0,
-    };
+    int pixel = software_pixel_key(gs);
 
-    SDL_GPUShader* fragment_shader = SDL_CreateGPUShader(device, &fsci);
-
-    // Create vertex buffer description and attributes
-    SDL_GPUVertexBufferDescription vbd[1] = {{
-        .slot = 0,
-        .pitch = sizeof(gpu_vertex),
-        .input_rate = SDL_GPU_VERTEXINPUTRATE_VERTEX,
-        .instance_step_rate = 0,
-    }};
-
-    SDL_GPUVertexAttribute va[2] = {{
-        .location = 0,
-        .buffer_slot = 0,
-        .format = SDL_GPU_VERTEXELEMENTFORMAT_FLOAT2,
-        .offset = 0,
-    }, {
-        .location = 1,
-        .buffer_slot = 0,
-        .format = SDL_GPU_VERTEXELEMENTFORMAT_FLOAT2,
-        .offset = sizeof(float) * 2,
-    }};
-
-    SDL_GPUColorTargetDescription ctd[1] = {{
-        .format = SDL_GetGPUSwapchainTextureFormat(device, window),
-        .blend_state = {
-            .src_color_blendfactor = SDL_GPU_BLENDFACTOR_SRC_ALPHA,
-            .dst_color_blendfactor = SDL_GPU_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
-            .color_blend_op = SDL_GPU_BLENDOP_ADD,
-            .src_alpha_blendfactor = SDL_GPU_BLENDFACTOR_SRC_ALPHA,
-            .dst_alpha_blendfactor = SDL_GPU_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
-            .alpha_blend_op = SDL_GPU_BLENDOP_ADD,
-            .color_write_mask = SDL_GPU_COLORCOMPONENT_A,
-            .enable_blend = false,
-            .enable_color_write_mask = false,
-        },
-    }};
-
-    // Create graphics pipeline
-    SDL_GPUGraphicsPipelineCreateInfo gpci = {
-        .vertex_shader = vertex_shader,
-        .fragment_shader = fragment_shader,
-        .vertex_input_state = {
-            .vertex_buffer_descriptions = vbd,
-            .num_vertex_buffers = 1,
-            .vertex_attributes = va,
-            .num_vertex_attributes = 2,
-        },
-        .primitive_type = SDL_GPU_PRIMITIVETYPE_TRIANGLELIST,
-        .target_info = {
-            .color_target_descriptions = ctd,
-            .num_color_targets = 1,
-        },
-    };
+    rdata->pipe.pixel = software_pixel_table[pixel];
+    rdata->pipe.pass = software_pixel_table[(pixel & ~0xc) | (1 << 2)];
+    rdata->pipe.texel = nullptr;
+    rdata->pipe.tex = nullptr;
 
-    ctx->pipeline = SDL_CreateGPUGraphicsPipeline(device, &gpci);
+    ctx->pixel_stats[pixel]++;
 
-    SDL_assert(ctx->pipeline);
+    rdata->pipe.span = nullptr;
 
-    // we don't need to store the shaders after creating the pipeline
-    SDL_ReleaseGPUShader(device, vertex_shader);
-    SDL_ReleaseGPUShader(device, fragment_shader);
+#ifdef _EE_USE_INTRINSICS
+    // Pixels within a span are shaded out of order, that's only fine
+    // when nothing the primitive reads is also written by it
+    int fb = (gs->ctx->fbpsm == GS_PSMCT32) ? 0 : ((gs->ctx->fbpsm == GS_PSMCT24) ? 1 : -1);
+    int zb = !gs->ctx->zte ? 0 : ((gs->ctx->zbpsm == GS_PSMCT32) ? 1 : ((gs->ctx->zbpsm == GS_PSMCT24) ? 2 : -1));
 
-    // create the vertex and index buffers
-    SDL_GPUBufferCreateInfo vbci = {
-        .usage = SDL_GPU_BUFFERUSAGE_VERTEX,
-        .size = sizeof(gpu_vertex) * 4,
-    };
+    if (ctx->simd && !serial && fb >= 0 && zb >= 0)
+        rdata->pipe.span = ((ctx->simd == 2) ? software_span_avx2 : software_span_sse41)[fb][zb];
+#endif
 
-    ctx->vertex_buffer = SDL_CreateGPUBuffer(device, &vbci);
+    rdata->pipe.sprite = (rdata->prim == 3) ? software_sprite_mode(gs, serial) : SOFTWARE_SPRITE_GENERIC;
 
-    // We're sending two triangles to make a single quad so we need 6 indices
-    SDL_GPUBufferCreateInfo ibci = {
-        .usage = SDL_GPU_BUFFERUSAGE_INDEX,
-        .size = sizeof(Uint16) * 6,
-    };
+    if (rdata->pipe.sprite == SOFTWARE_SPRITE_FILL) {
+        ctx->sprite_fills++;
+    } else if (rdata->pipe.sprite == SOFTWARE_SPRITE_COPY) {
+        ctx->sprite_copies++;
+    }
 
-    ctx->index_buffer = SDL_CreateGPUBuffer(device, &ibci);
+    // Points and lines are never textured
+    if (rdata->prim < 2 || !gs->tme)
+        return;
 
-    SDL_GPUSamplerCreateInfo nearest_sci = {
-		.min_filter = SDL_GPU_FILTER_NEAREST,
-		.mag_filter = SDL_GPU_FILTER_NEAREST,
-		.mipmap_mode = SDL_GPU_SAMPLERMIPMAPMODE_NEAREST,
-		.address_mode_u = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-		.address_mode_v = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-		.address_mode_w = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-    };
+    // Feedback loops read texels the primitive itself writes, those
+    // can't be decoded ahead of time
+    if (!serial)
+        rdata->pipe.tex = software_texture_lookup(ctx, gs);
 
-    SDL_GPUSamplerCreateInfo linear_sci = {
-		.min_filter = SDL_GPU_FILTER_LINEAR,
-		.mag_filter = SDL_GPU_FILTER_LINEAR,
-		.mipmap_mode = SDL_GPU_SAMPLERMIPMAPMODE_NEAREST,
-		.address_mode_u = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-		.address_mode_v = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-		.address_mode_w = SDL_GPU_SAMPLERADDRESSMODE_CLAMP_TO_EDGE,
-    };
+    int texel = software_texel_key(gs, rdata->pipe.tex != nullptr);
 
-    ctx->sampler[0] = SDL_CreateGPUSampler(ctx->device, &nearest_sci);
-    ctx->sampler[1] = SDL_CreateGPUSampler(ctx->device, &linear_sci);
+    rdata->pipe.texel = software_texel_table[texel];
+
+    ctx->texel_stats[texel]++;
 }
 
 static inline uint32_t gs_generic_read(struct ps2_gs* gs, uint32_t bp, uint32_t bw, uint32_t bpsm, uint32_t u, uint32_t v) {
@@ -2050,6 +3284,8 @@ static inline uint32_t gs_generic_read(struct ps2_gs* gs, uint32_t bp, uint32_t
             // exit(1);
         } break;
     }
+
+    return 0;
 }
 
 static inline void gs_generic_write(struct ps2_gs* gs, uint32_t bp, uint32_t bw, uint32_t bpsm, uint32_t u, uint32_t v, uint32_t data) {
@@ -2144,6 +3380,15 @@ static inline void gs_generic_write(struct ps2_gs* gs, uint32_t bp, uint32_t bw,
     }
 }
 
+// Pages covered by the destination rectangle of the current transfer
+static inline void software_thread_transfer_written(software_thread_state* ctx) {
+    uint64_t set[8] = { 0 };
+
+    software_pages_rect(set, ctx->dbp, ctx->dbw, software_psm_bpp(ctx->dpsm), ctx->dsax + ctx->rrw, ctx->dsay + ctx->rrh);
+    software_texture_written(ctx, set);
+    software_hiz_invalidate(ctx->hiz.get(), set);
+}
+
 static inline void software_thread_vram_blit(struct ps2_gs* gs, software_thread_state* ctx) {
     // printf("dbp=%x (%x) dbw=%d (%d) dpsm=%02x dsa=(%d,%d) sbp=%x (%x) sbw=%d (%d) spsm=%02x ssa=(%d,%d) rr=(%d,%d) xdir=%d\n",
     //     ctx->dbp, ctx->dbp,
@@ -2168,9 +3413,288 @@ static inline void software_thread_vram_blit(struct ps2_gs* gs, software_thread_
             gs_generic_write(gs, ctx->dbp, ctx->dbw, ctx->dpsm, ctx->dsax + x, ctx->dsay + y, s);
         }
     }
+
+    software_thread_transfer_written(ctx);
+}
+
+static inline int gs_test_clip(const software_clip& clip, int x, int y) {
+    return (x >= clip.x0) && (y >= clip.y0) && (x < clip.x1) && (y < clip.y1);
+}
+
+// Hierarchical Z
+//
+// A primitive looks up the blocks it can touch within a tile once, up
+// front. Blocks whose range its depth can't reach are culled, blocks
+// its depth clears everywhere skip the depth test (the pass pipeline),
+// the rest are drawn as usual. Once drawn, ranges of blocks it wrote Z
+// to are widened to take its depth in, or replaced by it when every
+// pixel of the block was written.
+#define GS_HIZ_TEST 0
+#define GS_HIZ_PASS 1
+#define GS_HIZ_CULL 2
+
+// Tiles are what binned primitives are drawn in, so that is the most
+// a primitive ever covers at once here
+#define GS_HIZ_TILE_BLOCKS ((SOFTWARE_TILE_SIZE / 8) * (SOFTWARE_TILE_SIZE / 8))
+
+struct gs_hiz_tile {
+    // Origin in pixels of the first block, and blocks across and down
+    int x0, y0, nx, ny;
+    int shift;
+    int fmt;
+
+    // Pixels drawn within each block (x1/y1 inclusive), where it is
+    // in the coarse depth buffer and the depth range the primitive
+    // writes there
+    software_clip rect[GS_HIZ_TILE_BLOCKS];
+    uint32_t index[GS_HIZ_TILE_BLOCKS];
+    uint32_t zmin[GS_HIZ_TILE_BLOCKS];
+    uint32_t zmax[GS_HIZ_TILE_BLOCKS];
+    uint8_t state[GS_HIZ_TILE_BLOCKS];
+
+    // Blocks covered entirely, and blocks with pixels past the cull
+    uint32_t full;
+    uint32_t touched;
+};
+
+static inline uint32_t gs_hiz_limit(int fmt) {
+    return (fmt == 1) ? 0xffffffff : ((fmt == 2) ? 0xffffff : 0xffff);
+}
+
+static inline uint32_t gs_hiz_block_index(struct ps2_gs* gs, int x, int y) {
+    uint32_t zbp = gs->ctx->zbp >> 6;
+    uint32_t fbw = gs->ctx->fbw >> 6;
+    uint32_t addr;
+
+    switch (gs->ctx->zbpsm) {
+        case GS_PSMCT16: addr = psmct16_addr(zbp, fbw, x, y); break;
+        case GS_PSMCT16S: addr = psmct16s_addr(zbp, fbw, x, y); break;
+        default: addr = psmct32_addr(zbp, fbw, x, y); break;
+    }
+
+    return (addr & 0xfffff) >> 6;
+}
+
+// Depth range of a block as stored in VRAM
+static inline void gs_hiz_scan(const uint32_t* vram, uint32_t block, int fmt, uint32_t* zmin, uint32_t* zmax) {
+    const uint32_t* p = vram + (block * 64);
+
+#ifdef _EE_USE_INTRINSICS
+    __m128i lo = _mm_set1_epi32(-1);
+    __m128i hi = _mm_setzero_si128();
+
+    for (int i = 0; i < 64; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+
+        if (fmt == 2)
+            v = _mm_and_si128(v, _mm_set1_epi32(0xffffff));
+
+        if (fmt == 3) {
+            lo = _mm_min_epu16(lo, v);
+            hi = _mm_max_epu16(hi, v);
+        } else {
+            lo = _mm_min_epu32(lo, v);
+            hi = _mm_max_epu32(hi, v);
+        }
+    }
+
+    if (fmt == 3) {
+        // Fold halfwords into the low lanes, then take the minimum and
+        // maximum of each lane pair
+        lo = _mm_min_epu16(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_max_epu16(hi, _mm_srli_si128(hi, 8));
+        lo = _mm_min_epu16(lo, _mm_srli_si128(lo, 4));
+        hi = _mm_max_epu16(hi, _mm_srli_si128(hi, 4));
+        lo = _mm_min_epu16(lo, _mm_srli_si128(lo, 2));
+        hi = _mm_max_epu16(hi, _mm_srli_si128(hi, 2));
+
+        *zmin = _mm_cvtsi128_si32(lo) & 0xffff;
+        *zmax = _mm_cvtsi128_si32(hi) & 0xffff;
+
+        return;
+    }
+
+    lo = _mm_min_epu32(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_max_epu32(hi, _mm_srli_si128(hi, 8));
+    lo = _mm_min_epu32(lo, _mm_srli_si128(lo, 4));
+    hi = _mm_max_epu32(hi, _mm_srli_si128(hi, 4));
+
+    *zmin = _mm_cvtsi128_si32(lo);
+    *zmax = _mm_cvtsi128_si32(hi);
+#else
+    uint32_t lo = 0xffffffff, hi = 0;
+
+    if (fmt == 3) {
+        const uint16_t* h = (const uint16_t*)p;
+
+        for (int i = 0; i < 128; i++) {
+            lo = std::min(lo, (uint32_t)h[i]);
+            hi = std::max(hi, (uint32_t)h[i]);
+        }
+    } else {
+        uint32_t mask = (fmt == 2) ? 0xffffff : 0xffffffff;
+
+        for (int i = 0; i < 64; i++) {
+            lo = std::min(lo, p[i] & mask);
+            hi = std::max(hi, p[i] & mask);
+        }
+    }
+
+    *zmin = lo;
+    *zmax = hi;
+#endif
+}
+
+// Block grid over the pixels (x0, y0) to (x1, y1) (exclusive) of a
+// primitive, false when the primitive doesn't use the coarse depth
+// buffer. zmin and zmax are left to the caller
+static inline bool gs_hiz_begin(struct ps2_gs* gs, const software_pipeline& pipe, gs_hiz_tile* hz, int x0, int y0, int x1, int y1) {
+    if (!pipe.hiz || x0 >= x1 || y0 >= y1)
+        return false;
+
+    hz->fmt = software_hiz_format(gs->ctx->zbpsm);
+    hz->shift = (hz->fmt == 3) ? 4 : 3;
+    hz->x0 = x0 & ~((1 << hz->shift) - 1);
+    hz->y0 = y0 & ~7;
+    hz->nx = ((x1 - 1) >> hz->shift) - (hz->x0 >> hz->shift) + 1;
+    hz->ny = ((y1 - 1) >> 3) - (hz->y0 >> 3) + 1;
+    hz->full = 0;
+    hz->touched = 0;
+
+    for (int by = 0; by < hz->ny; by++) {
+        for (int bx = 0; bx < hz->nx; bx++) {
+            int b = (by * hz->nx) + bx;
+            int px = hz->x0 + (bx << hz->shift);
+            int py = hz->y0 + (by << 3);
+
+            software_clip& r = hz->rect[b];
+
+            r.x0 = std::max(px, x0);
+            r.y0 = std::max(py, y0);
+            r.x1 = std::min(px + (1 << hz->shift), x1) - 1;
+            r.y1 = std::min(py + 8, y1) - 1;
+
+            if (r.x0 == px && r.y0 == py && r.x1 == (px + (1 << hz->shift) - 1) && r.y1 == (py + 7))
+                hz->full |= 1u << b;
+
+            hz->index[b] = gs_hiz_block_index(gs, px, py);
+
+            hz->state[b] = GS_HIZ_TEST;
+        }
+    }
+
+    return true;
+}
+
+static inline int gs_hiz_decide(int ztst, uint32_t zmin, uint32_t zmax, const software_hiz_block* e) {
+    if (ztst == 2) {
+        if (zmax < e->zmin) return GS_HIZ_CULL;
+        if (zmin >= e->zmax) return GS_HIZ_PASS;
+    } else {
+        if (zmax <= e->zmin) return GS_HIZ_CULL;
+        if (zmin > e->zmax) return GS_HIZ_PASS;
+    }
+
+    return GS_HIZ_TEST;
+}
+
+static inline bool gs_hiz_valid(const software_pipeline& pipe, const software_hiz_block* e, uint32_t index, int fmt) {
+    return e->fmt == fmt && e->gen >= pipe.hiz->page_gen[index >> 5];
+}
+
+// Cull or accept blocks against their ranges, reading back the ones
+// unknown or too wide to decide on
+static inline void gs_hiz_classify(struct ps2_gs* gs, const software_pipeline& pipe, gs_hiz_tile* hz) {
+    int ztst = gs->ctx->ztst;
+
+    if (ztst < 2)
+        return;
+
+    for (int b = 0; b < (hz->nx * hz->ny); b++) {
+        uint32_t index = hz->index[b];
+        software_hiz_block* e = &pipe.hiz->blocks[index];
+
+        bool valid = gs_hiz_valid(pipe, e, index, hz->fmt);
+        int state = valid ? gs_hiz_decide(ztst, hz->zmin[b], hz->zmax[b], e) : GS_HIZ_TEST;
+
+        if (state == GS_HIZ_TEST && (!valid || e->loose)) {
+            gs_hiz_scan(gs->vram, index, hz->fmt, &e->zmin, &e->zmax);
+
+            e->gen = pipe.hiz_gen;
+            e->fmt = hz->fmt;
+            e->loose = 0;
+
+            state = gs_hiz_decide(ztst, hz->zmin[b], hz->zmax[b], e);
+        }
+
+        hz->state[b] = state;
+    }
+}
+
+// Block a pixel falls in
+static inline int gs_hiz_block(const gs_hiz_tile* hz, int x, int y) {
+    return (((y - hz->y0) >> 3) * hz->nx) + ((x - hz->x0) >> hz->shift);
+}
+
+// Whether any block was culled or accepted
+static inline bool gs_hiz_decided(const gs_hiz_tile* hz) {
+    for (int b = 0; b < (hz->nx * hz->ny); b++)
+        if (hz->state[b] != GS_HIZ_TEST)
+            return true;
+
+    return false;
+}
+
+// Spans only hold pixels that all skip the depth test or all take it
+static inline void gs_hiz_span(struct ps2_gs* gs, const software_pipeline& pipe, software_span* span, bool pass) {
+    if (!pipe.span || span->pass == pass)
+        return;
+
+    if (span->n)
+        gs_flush_span(gs, pipe, span);
+
+    span->pass = pass;
+}
+
+// Take the depth written by the primitive into the touched blocks
+static inline void gs_hiz_end(struct ps2_gs* gs, const software_pipeline& pipe, gs_hiz_tile* hz) {
+    if (gs->ctx->zbmsk || !gs->ctx->ztst)
+        return;
+
+    // Every pixel drawn also writes Z, unless a failed alpha test
+    // or the destination alpha test can leave it out
+    bool all = !(gs->ctx->ate && gs->ctx->atst != 1) && !gs->ctx->date;
+
+    for (uint32_t m = hz->touched; m; m &= m - 1) {
+        int b = std::countr_zero(m);
+
+        uint32_t index = hz->index[b];
+        software_hiz_block* e = &pipe.hiz->blocks[index];
+
+        if (all && ((hz->full >> b) & 1) && (gs->ctx->ztst == 1 || hz->state[b] == GS_HIZ_PASS)) {
+            e->zmin = hz->zmin[b];
+            e->zmax = hz->zmax[b];
+            e->gen = pipe.hiz_gen;
+            e->fmt = hz->fmt;
+            e->loose = 0;
+
+            continue;
+        }
+
+        // Taken in another format (or stale anyway), drop it
+        if (!gs_hiz_valid(pipe, e, index, hz->fmt)) {
+            e->fmt = 0;
+
+            continue;
+        }
+
+        e->zmin = std::min(e->zmin, hz->zmin[b]);
+        e->zmax = std::max(e->zmax, hz->zmax[b]);
+        e->loose = 1;
+    }
 }
 
-void render_point(struct ps2_gs* gs, void* udata) {
+void render_point(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip) {
     struct gs_vertex vert = gs->vq[0];
 
     vert.x -= gs->ctx->ofx;
@@ -2179,10 +3703,13 @@ void render_point(struct ps2_gs* gs, void* udata) {
     if (!gs_test_scissor(gs, vert.x >> 4, vert.y >> 4))
         return;
 
-    gs_draw_pixel(gs, vert.x >> 4, vert.y >> 4, vert.z, vert.rgbaq & 0xffffffff);
+    if (!gs_test_clip(clip, vert.x >> 4, vert.y >> 4))
+        return;
+
+    pipe.pixel(gs, vert.x >> 4, vert.y >> 4, vert.z, vert.rgbaq & 0xffffffff);
 }
 
-void render_line(struct ps2_gs* gs, void* udata) {
+void render_line(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip) {
     struct gs_vertex v0 = gs->vq[0];
     struct gs_vertex v1 = gs->vq[1];
 
@@ -2200,8 +3727,8 @@ void render_line(struct ps2_gs* gs, void* udata) {
     int error = dx + dy;
 
     while (1) {
-        if (gs_test_scissor(gs, v0.x >> 4, v0.y >> 4))
-            gs_draw_pixel(gs, v0.x >> 4, v0.y >> 4, v0.z, v1.rgbaq & 0xffffffff);
+        if (gs_test_scissor(gs, v0.x >> 4, v0.y >> 4) && gs_test_clip(clip, v0.x >> 4, v0.y >> 4))
+            pipe.pixel(gs, v0.x >> 4, v0.y >> 4, v0.z, v1.rgbaq & 0xffffffff);
 
         int e2 = error << 1;
     
@@ -2260,6 +3787,51 @@ void gs_draw_wireframe(struct ps2_gs* gs, struct gs_vertex v0, struct gs_vertex
     }
 }
 
+// Triangle attribute stepping
+//
+// q + r / d is the exact value of an attribute at the current pixel,
+// moving one pixel to the right adds qx + rx / d
+struct gs_attr_step {
+    int64_t q, r;
+    int64_t qx, rx;
+    int64_t d;
+};
+
+static inline int64_t gs_floor_div(int64_t n, int64_t d) {
+    int64_t q = n / d;
+
+    return ((n % d) && ((n < 0) != (d < 0))) ? q - 1 : q;
+}
+
+// Rounded attributes (colors, fog) round to nearest, texture coordinates
+// truncate like the float path used to
+static inline void gs_attr_setup(gs_attr_step* s, int64_t a0, int64_t a1, int64_t a2, int w0, int w1, int w2, int dx0, int dx1, int dx2, int64_t d, bool round) {
+    int64_t n = (a0 * w0) + (a1 * w1) + (a2 * w2);
+    int64_t nx = (a0 * dx0) + (a1 * dx1) + (a2 * dx2);
+
+    if (round) {
+        n = (n * 2) + d;
+        nx *= 2;
+        d *= 2;
+    }
+
+    s->d = d;
+    s->q = gs_floor_div(n, d);
+    s->r = n - (s->q * d);
+    s->qx = gs_floor_div(nx, d);
+    s->rx = nx - (s->qx * d);
+}
+
+static inline void gs_attr_advance(gs_attr_step* s) {
+    s->q += s->qx;
+    s->r += s->rx;
+
+    if (s->r >= s->d) {
+        s->q++;
+        s->r -= s->d;
+    }
+}
+
 #define EDGE(a, b, c) ((b.x-a.x)*(c.y-a.y)-(b.y-a.y)*(c.x-a.x))
 #define MIN2(a, b) ((((int)a) < ((int)b)) ? ((int)a) : ((int)b))
 #define MIN3(a, b, c) (MIN2(MIN2(a, b), c))
@@ -2268,7 +3840,77 @@ void gs_draw_wireframe(struct ps2_gs* gs, struct gs_vertex v0, struct gs_vertex
 
 #define IS_TOPLEFT(a, b) ((b.y > a.y) || ((a.y == b.y) && (b.x < a.x)))
 
-void render_triangle(struct ps2_gs* gs, void* udata) {
+// Depth range of a triangle within each block, from its plane at the
+// block's corners (and never past the vertices' own range), widened
+// by the rounding error of both that and the per-pixel sums, then
+// rounded and clamped the way the rasterizer does it
+static inline void gs_hiz_triangle(gs_hiz_tile* hz, const gs_vertex& v0, const gs_vertex& v1, const gs_vertex& v2, int bias0, int bias1, int bias2, int area) {
+    uint32_t limit = gs_hiz_limit(hz->fmt);
+
+    double vzmin = std::min({ (double)v0.z, (double)v1.z, (double)v2.z });
+    double vzmax = std::max({ (double)v0.z, (double)v1.z, (double)v2.z });
+
+    // Flat, the vertices' range is as tight as the plane gets
+    const bool flat = vzmin == vzmax;
+
+    for (int b = 0; b < (hz->nx * hz->ny); b++) {
+        const software_clip& r = hz->rect[b];
+
+        double nmin = INFINITY, nmax = -INFINITY, err = 0.0;
+        bool inside = true, huge = false;
+
+        for (int c = 0; c < 4; c++) {
+            int64_t px = (int64_t)((c & 1) ? r.x1 : r.x0) << 4;
+            int64_t py = (int64_t)((c & 2) ? r.y1 : r.y0) << 4;
+
+            int64_t w0 = (int64_t)(v2.x - v1.x) * (py - v1.y) - (int64_t)(v2.y - v1.y) * (px - v1.x);
+            int64_t w1 = (int64_t)(v0.x - v2.x) * (py - v2.y) - (int64_t)(v0.y - v2.y) * (px - v2.x);
+            int64_t w2 = (int64_t)(v1.x - v0.x) * (py - v0.y) - (int64_t)(v1.y - v0.y) * (px - v0.x);
+
+            inside = inside && (w0 + bias0) >= 0 && (w1 + bias1) >= 0 && (w2 + bias2) >= 0;
+
+            // Past what the rasterizer's edge functions hold
+            huge = huge || std::max({ std::abs(w0), std::abs(w1), std::abs(w2) }) >= (1ll << 30);
+
+            if (flat)
+                continue;
+
+            double t0 = (double)v0.z * w0;
+            double t1 = (double)v1.z * w1;
+            double t2 = (double)v2.z * w2;
+
+            nmin = std::min(nmin, t0 + t1 + t2);
+            nmax = std::max(nmax, t0 + t1 + t2);
+            err = std::max(err, std::fabs(t0) + std::fabs(t1) + std::fabs(t2));
+        }
+
+        // Convex, every pixel is inside when all four corners are
+        if (!inside || huge)
+            hz->full &= ~(1u << b);
+
+        err *= 0x1p-50;
+
+        double lo = flat ? vzmin : std::max((nmin - err) / area, vzmin);
+        double hi = flat ? vzmax : std::min((nmax + err) / area, vzmax);
+
+        lo = (lo * (1.0 - 0x1p-48)) - 1.0;
+        hi = (hi * (1.0 + 0x1p-48)) + 1.0;
+
+        float flo = roundf(std::max(lo, 0.0));
+        float fhi = roundf(hi);
+
+        // Rounds past 32 bits, which wraps around
+        if (huge || fhi >= 4294967296.0f) {
+            hz->zmin[b] = 0;
+            hz->zmax[b] = limit;
+        } else {
+            hz->zmin[b] = std::min((uint32_t)flo, limit);
+            hz->zmax[b] = std::min((uint32_t)fhi, limit);
+        }
+    }
+}
+
+void render_triangle(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip) {
     struct gs_vertex v0 = gs->vq[0];
     struct gs_vertex v1 = gs->vq[1];
     struct gs_vertex v2 = gs->vq[2];
@@ -2307,6 +3949,13 @@ void render_triangle(struct ps2_gs* gs, void* udata) {
     int32_t xmax = ((MIN2(MAX3(v0.x, v1.x, v2.x), scax1) + 16) >> 4) << 4;
     int32_t ymax = ((MIN2(MAX3(v0.y, v1.y, v2.y), scay1) + 16) >> 4) << 4;
 
+    // Edge functions are exact, starting inside the tile gives
+    // the same results as stepping there from the bounding box
+    xmin = std::max(xmin, clip.x0 << 4);
+    ymin = std::max(ymin, clip.y0 << 4);
+    xmax = std::min(xmax, clip.x1 << 4);
+    ymax = std::min(ymax, clip.y1 << 4);
+
     int a01 = (v0.y - v1.y) * 16, b01 = (v1.x - v0.x) * 16;
     int a12 = (v1.y - v2.y) * 16, b12 = (v2.x - v1.x) * 16;
     int a20 = (v2.y - v0.y) * 16, b20 = (v0.x - v2.x) * 16;
@@ -2336,98 +3985,199 @@ void render_triangle(struct ps2_gs* gs, void* udata) {
     //     gs->vq[3].x >> 4, (gs->vq[3].x & 0xf) * 625, gs->vq[3].y >> 4, (gs->vq[3].y & 0xf) * 625
     // );
 
+    // Degenerate, nothing to cover
+    if (!area)
+        return;
+
+    // Color, fog and UV are stepped in fixed point, an attribute is
+    // (A0*w0 + A1*w1 + A2*w2) / area with integer weights, so we keep
+    // that quotient and its remainder and step both along the row
+    int64_t d = area;
+
+    gs_attr_step ar, ag, ab, aa, af, au, av;
+
+    const bool iip = gs->iip;
+    const bool tme = gs->tme;
+    const bool fst = gs->fst;
+    const bool fge = gs->fge;
+
+    gs_hiz_tile hz;
+
+    const bool hiz = gs_hiz_begin(gs, pipe, &hz, xmin >> 4, ymin >> 4, xmax >> 4, ymax >> 4);
+
+    if (hiz) {
+        gs_hiz_triangle(&hz, v0, v1, v2, bias0, bias1, bias2, area);
+        gs_hiz_classify(gs, pipe, &hz);
+    }
+
+    // Nothing culled or accepted, pixels don't need to look their
+    // block up, every block the triangle reaches counts as touched
+    const bool hiz_pixels = hiz && gs_hiz_decided(&hz);
+
+    software_span span;
+
+    span.n = 0;
+    span.pass = false;
+
     for (p.y = ymin; p.y < ymax; p.y += 16) {
         // Barycentric coordinates at start of row
         int w0 = w0_row;
         int w1 = w1_row;
         int w2 = w2_row;
 
+        span.y = p.y >> 4;
+
+        if (iip) {
+            gs_attr_setup(&ar, v0.r, v1.r, v2.r, w0, w1, w2, a12, a20, a01, d, true);
+            gs_attr_setup(&ag, v0.g, v1.g, v2.g, w0, w1, w2, a12, a20, a01, d, true);
+            gs_attr_setup(&ab, v0.b, v1.b, v2.b, w0, w1, w2, a12, a20, a01, d, true);
+            gs_attr_setup(&aa, v0.a, v1.a, v2.a, w0, w1, w2, a12, a20, a01, d, true);
+        }
+
+        if (tme && fst) {
+            gs_attr_setup(&au, v0.u, v1.u, v2.u, w0, w1, w2, a12, a20, a01, d, false);
+            gs_attr_setup(&av, v0.v, v1.v, v2.v, w0, w1, w2, a12, a20, a01, d, false);
+        }
+
+        if (fge)
+            gs_attr_setup(&af, v0.fog, v1.fog, v2.fog, w0, w1, w2, a12, a20, a01, d, true);
+
         for (p.x = xmin; p.x < xmax; p.x += 16) {
             // If p is on or inside all edges, render pixel
-            if (((w0 + bias0) | (w1 + bias1) | (w2 + bias2)) < 0) {
-                w0 += a12;
-                w1 += a20;
-                w2 += a01;
+            bool inside = ((w0 + bias0) | (w1 + bias1) | (w2 + bias2)) >= 0;
 
-                continue;
-            }
+            software_pixel_func pixel = pipe.pixel;
 
-            // Calculate interpolation weights
-            double iw0 = (double)w0 / (double)area;
-            double iw1 = (double)w1 / (double)area;
-            double iw2 = (double)w2 / (double)area;
+            if (inside && hiz_pixels) {
+                int b = gs_hiz_block(&hz, p.x >> 4, p.y >> 4);
 
-            uint32_t fr, fg, fb, fa;
+                if (hz.state[b] == GS_HIZ_CULL) {
+                    software_thread_hiz_culled++;
 
-            if (gs->iip) {
-                fr = roundf(v0.r * iw0 + v1.r * iw1 + v2.r * iw2);
-                fg = roundf(v0.g * iw0 + v1.g * iw1 + v2.g * iw2);
-                fb = roundf(v0.b * iw0 + v1.b * iw1 + v2.b * iw2);
-                fa = roundf(v0.a * iw0 + v1.a * iw1 + v2.a * iw2);
-            } else {
-                fr = v2.r;
-                fg = v2.g;
-                fb = v2.b;
-                fa = v2.a;
+                    inside = false;
+                } else {
+                    hz.touched |= 1u << b;
+
+                    if (hz.state[b] == GS_HIZ_PASS)
+                        pixel = pipe.pass;
+
+                    gs_hiz_span(gs, pipe, &span, hz.state[b] == GS_HIZ_PASS);
+                }
             }
 
-            if (gs->tme) {
-                // Fixed-point 12:4
-                int u, v;
+            if (inside) {
+                // Z and STQ don't fit the same way. They go through the
+                // same doubles and float rounding as always, anything
+                // else moves Z by a unit now and then and flips depth
+                // tests that used to pass
+                double iw0 = (double)w0 / (double)area;
+                double iw1 = (double)w1 / (double)area;
+                double iw2 = (double)w2 / (double)area;
+
+                uint32_t fr, fg, fb, fa;
+
+                if (iip) {
+                    fr = ar.q;
+                    fg = ag.q;
+                    fb = ab.q;
+                    fa = aa.q;
+                } else {
+                    fr = v2.r;
+                    fg = v2.g;
+                    fb = v2.b;
+                    fa = v2.a;
+                }
+
+                if (tme) {
+                    // Fixed-point 12:4
+                    int u, v;
+
+                    if (fst) {
+                        u = au.q;
+                        v = av.q;
+                    } else {
+                        float s = v0.s * iw0 + v1.s * iw1 + v2.s * iw2;
+                        float t = v0.t * iw0 + v1.t * iw1 + v2.t * iw2;
+                        float q = v0.q * iw0 + v1.q * iw1 + v2.q * iw2;
+
+                        float uf = (s / q) * gs->ctx->usize;
+                        float vf = (t / q) * gs->ctx->vsize;
+
+                        // Convert to 12:4 fixed-point
+                        u = uf * (1 << 4);
+                        v = vf * (1 << 4);
+                    }
 
-                if (gs->fst) {
-                    u = v0.u * iw0 + v1.u * iw1 + v2.u * iw2;
-                    v = v0.v * iw0 + v1.v * iw1 + v2.v * iw2;
-                } else {
-                    float s = v0.s * iw0 + v1.s * iw1 + v2.s * iw2;
-                    float t = v0.t * iw0 + v1.t * iw1 + v2.t * iw2;
-                    float q = v0.q * iw0 + v1.q * iw1 + v2.q * iw2;
+                    uint32_t f = fr | (fg << 8) | (fb << 16) | (fa << 24);
 
-                    float uf = (s / q) * gs->ctx->usize;
-                    float vf = (t / q) * gs->ctx->vsize;
+                    uint32_t t = pipe.texel(gs, pipe.tex, u, v, f);
 
-                    // Convert to 12:4 fixed-point
-                    u = uf * (1 << 4);
-                    v = vf * (1 << 4);
+                    fr = t & 0xff;
+                    fg = (t >> 8) & 0xff;
+                    fb = (t >> 16) & 0xff;
+                    fa = t >> 24;
                 }
 
-                uint32_t f = fr | (fg << 8) | (fb << 16) | (fa << 24);
+                if (fge) {
+                    int f = af.q;
 
-                uint32_t t = gs_read_tb(gs, u, v);
-                t = gs_to_rgba32(gs, t, gs->ctx->tbpsm);
-                t = gs_apply_function(gs, t, f);
+                    fr = ((f * fr) >> 8) + (((255 - f) * fogr) >> 8);
+                    fg = ((f * fg) >> 8) + (((255 - f) * fogg) >> 8);
+                    fb = ((f * fb) >> 8) + (((255 - f) * fogb) >> 8);
+                }
 
-                fr = t & 0xff;
-                fg = (t >> 8) & 0xff;
-                fb = (t >> 16) & 0xff;
-                fa = t >> 24;
-            }
+                uint32_t fz = roundf(v0.z * iw0 + v1.z * iw1 + v2.z * iw2);
+                uint32_t fc = fr | (fg << 8) | (fb << 16) | (fa << 24);
 
-            if (gs->fge) {
-                int f = roundf(v0.fog * iw0 + v1.fog * iw1 + v2.fog * iw2);
+                if (pipe.span) {
+                    span.x[span.n] = p.x >> 4;
+                    span.z[span.n] = fz;
+                    span.c[span.n] = fc;
 
-                fr = ((f * fr) >> 8) + (((255 - f) * fogr) >> 8);
-                fg = ((f * fg) >> 8) + (((255 - f) * fogg) >> 8);
-                fb = ((f * fb) >> 8) + (((255 - f) * fogb) >> 8);
+                    if (++span.n == SOFTWARE_SPAN_SIZE)
+                        gs_flush_span(gs, pipe, &span);
+                } else {
+                    pixel(gs, p.x >> 4, p.y >> 4, fz, fc);
+                }
             }
 
-            uint32_t fz = roundf(v0.z * iw0 + v1.z * iw1 + v2.z * iw2);
-            uint32_t fc = fr | (fg << 8) | (fb << 16) | (fa << 24);
-
-            gs_draw_pixel(gs, p.x >> 4, p.y >> 4, fz, fc);
-
             // One step to the right
             w0 += a12;
             w1 += a20;
             w2 += a01;
+
+            if (iip) {
+                gs_attr_advance(&ar);
+                gs_attr_advance(&ag);
+                gs_attr_advance(&ab);
+                gs_attr_advance(&aa);
+            }
+
+            if (tme && fst) {
+                gs_attr_advance(&au);
+                gs_attr_advance(&av);
+            }
+
+            if (fge)
+                gs_attr_advance(&af);
         }
 
+        if (span.n)
+            gs_flush_span(gs, pipe, &span);
+
         // One row step
         w0_row += b12;
         w1_row += b20;
         w2_row += b01;
     }
 
+    if (hiz) {
+        if (!hiz_pixels)
+            hz.touched = (1u << (hz.nx * hz.ny)) - 1;
+
+        gs_hiz_end(gs, pipe, &hz);
+    }
+
     // gs_draw_wireframe(gs, gs->vq[0], gs->vq[1]);
     // gs_draw_wireframe(gs, gs->vq[1], gs->vq[2]);
     // gs_draw_wireframe(gs, gs->vq[2], gs->vq[0]);
@@ -2469,7 +4219,187 @@ float gs_stepf(float u1, int32_t x1, float u2, int32_t x2, int64_t mult) {
     return ((u2 - u1) * mult)/(x2 - x1);
 }
 
-void render_sprite(struct ps2_gs* gs, void* udata) {
+// Sprite fast paths
+//
+// Flat sprites that only write the frame (and possibly a constant Z)
+// are fills, unscaled point-sampled sprites reading a texture in the
+// frame's own format, passed through unchanged by the texture function,
+// are copies. Both skip the pixel pipeline and work on VRAM directly,
+// a whole block at a time wherever the sprite covers one. Blocks are
+// 64 consecutive words in every format, 8x8 pixels at 32 bits and
+// 16x8 at 16 bits.
+template <int Psm> static constexpr bool gs_psm_is_16bit() {
+    return Psm == GS_PSMCT16 || Psm == GS_PSMCT16S || Psm == GS_PSMZ16 || Psm == GS_PSMZ16S;
+}
+
+// Index of a pixel in VRAM, in words for 32-bit formats and in
+// halfwords for 16-bit ones
+template <int Psm> static inline uint32_t gs_pixel_index(uint32_t bp, uint32_t bw, int x, int y) {
+    int idx = (x & 15) + ((y & 1) * 16);
+
+    switch (Psm) {
+        case GS_PSMCT32:
+        case GS_PSMCT24: return psmct32_addr(bp, bw, x, y) & 0xfffff;
+        case GS_PSMZ32:
+        case GS_PSMZ24: return psmz32_addr(bp, bw, x, y) & 0xfffff;
+        case GS_PSMCT16: return ((psmct16_addr(bp, bw, x, y) & 0xfffff) * 2) + psmct16_shift[idx];
+        case GS_PSMCT16S: return ((psmct16s_addr(bp, bw, x, y) & 0xfffff) * 2) + psmct16_shift[idx];
+        case GS_PSMZ16: return ((psmz16_addr(bp, bw, x, y) & 0xfffff) * 2) + psmct16_shift[idx];
+        case GS_PSMZ16S: return ((psmz16s_addr(bp, bw, x, y) & 0xfffff) * 2) + psmct16_shift[idx];
+    }
+
+    return 0;
+}
+
+// dst = (dst & keep) | value
+template <int Psm> static void gs_fill_rect(struct ps2_gs* gs, uint32_t bp, uint32_t bw, const software_clip& r, uint32_t value, uint32_t keep) {
+    typedef std::conditional_t <gs_psm_is_16bit <Psm>(), uint16_t, uint32_t> T;
+
+    constexpr int block_w = gs_psm_is_16bit <Psm>() ? 16 : 8;
+    constexpr int block_size = 256 / sizeof(T);
+
+    T* vram = (T*)gs->vram;
+
+    for (int by = r.y0 & ~7; by < r.y1; by += 8) {
+        for (int bx = r.x0 & ~(block_w - 1); bx < r.x1; bx += block_w) {
+            if (bx >= r.x0 && by >= r.y0 && (bx + block_w) <= r.x1 && (by + 8) <= r.y1) {
+                T* p = vram + (gs_pixel_index <Psm>(bp, bw, bx, by) & ~(block_size - 1));
+
+                for (int i = 0; i < block_size; i++)
+                    p[i] = (p[i] & keep) | value;
+
+                continue;
+            }
+
+            for (int y = std::max(by, r.y0); y < std::min(by + 8, r.y1); y++) {
+                for (int x = std::max(bx, r.x0); x < std::min(bx + block_w, r.x1); x++) {
+                    T* p = vram + gs_pixel_index <Psm>(bp, bw, x, y);
+
+                    *p = (*p & keep) | value;
+                }
+            }
+        }
+    }
+}
+
+// dst = (dst & keep) | (src & mask) | value, the texel for pixel
+// (x, y) being (x + du, y + dv)
+template <int Psm> static void gs_copy_rect(struct ps2_gs* gs, const software_clip& r, int du, int dv, uint32_t keep, uint32_t mask, uint32_t value) {
+    typedef std::conditional_t <gs_psm_is_16bit <Psm>(), uint16_t, uint32_t> T;
+
+    constexpr int block_w = gs_psm_is_16bit <Psm>() ? 16 : 8;
+    constexpr int block_size = 256 / sizeof(T);
+
+    uint32_t fbp = gs->ctx->fbp >> 6;
+    uint32_t fbw = gs->ctx->fbw >> 6;
+    uint32_t tbp = gs->ctx->tbp0;
+    uint32_t tbw = gs->ctx->tbw;
+
+    // Texture and frame blocks only line up when the offset between
+    // them is a whole number of blocks
+    bool aligned = !(du & (block_w - 1)) && !(dv & 7);
+
+    T* vram = (T*)gs->vram;
+
+    for (int by = r.y0 & ~7; by < r.y1; by += 8) {
+        for (int bx = r.x0 & ~(block_w - 1); bx < r.x1; bx += block_w) {
+            if (aligned && bx >= r.x0 && by >= r.y0 && (bx + block_w) <= r.x1 && (by + 8) <= r.y1) {
+                T* d = vram + (gs_pixel_index <Psm>(fbp, fbw, bx, by) & ~(block_size - 1));
+                const T* s = vram + (gs_pixel_index <Psm>(tbp, tbw, bx + du, by + dv) & ~(block_size - 1));
+
+                for (int i = 0; i < block_size; i++)
+                    d[i] = (d[i] & keep) | (s[i] & mask) | value;
+
+                continue;
+            }
+
+            for (int y = std::max(by, r.y0); y < std::min(by + 8, r.y1); y++) {
+                for (int x = std::max(bx, r.x0); x < std::min(bx + block_w, r.x1); x++) {
+                    T* d = vram + gs_pixel_index <Psm>(fbp, fbw, x, y);
+                    T s = vram[gs_pixel_index <Psm>(tbp, tbw, x + du, y + dv)];
+
+                    *d = (*d & keep) | (s & mask) | value;
+                }
+            }
+        }
+    }
+}
+
+// Constant Z written alongside a fill or copy, Z test is ALWAYS here
+static inline void gs_fill_sprite_z(struct ps2_gs* gs, const software_clip& r, uint32_t z) {
+    if (!gs->ctx->zte || gs->ctx->zbmsk)
+        return;
+
+    uint32_t zbp = gs->ctx->zbp >> 6;
+    uint32_t fbw = gs->ctx->fbw >> 6;
+
+    switch (gs->ctx->zbpsm) {
+        case GS_PSMCT32: gs_fill_rect <GS_PSMCT32>(gs, zbp, fbw, r, z, 0); break;
+        case GS_PSMCT24: gs_fill_rect <GS_PSMCT32>(gs, zbp, fbw, r, std::min(z, 0xffffffu), 0); break;
+        case GS_PSMCT16: gs_fill_rect <GS_PSMCT16>(gs, zbp, fbw, r, std::min(z, 0xffffu), 0); break;
+        case GS_PSMCT16S: gs_fill_rect <GS_PSMCT16S>(gs, zbp, fbw, r, std::min(z, 0xffffu), 0); break;
+        case GS_PSMZ32: gs_fill_rect <GS_PSMZ32>(gs, zbp, fbw, r, z, 0); break;
+        case GS_PSMZ24: gs_fill_rect <GS_PSMZ32>(gs, zbp, fbw, r, std::min(z, 0xffffffu), 0); break;
+        case GS_PSMZ16: gs_fill_rect <GS_PSMZ16>(gs, zbp, fbw, r, std::min(z, 0xffffu), 0); break;
+        case GS_PSMZ16S: gs_fill_rect <GS_PSMZ16S>(gs, zbp, fbw, r, std::min(z, 0xffffu), 0); break;
+    }
+}
+
+static inline void gs_fill_sprite(struct ps2_gs* gs, const software_clip& r, uint32_t c, uint32_t z) {
+    uint32_t fbp = gs->ctx->fbp >> 6;
+    uint32_t fbw = gs->ctx->fbw >> 6;
+
+    switch (gs->ctx->fbpsm) {
+        case GS_PSMCT32: gs_fill_rect <GS_PSMCT32>(gs, fbp, fbw, r, c, 0); break;
+        case GS_PSMCT24: gs_fill_rect <GS_PSMCT24>(gs, fbp, fbw, r, c & 0xffffff, 0xff000000); break;
+        case GS_PSMCT16: gs_fill_rect <GS_PSMCT16>(gs, fbp, fbw, r, gs_from_rgba32(gs, c, GS_PSMCT16), 0); break;
+        case GS_PSMCT16S: gs_fill_rect <GS_PSMCT16S>(gs, fbp, fbw, r, gs_from_rgba32(gs, c, GS_PSMCT16S), 0); break;
+    }
+
+    gs_fill_sprite_z(gs, r, z);
+}
+
+// The texture function leaves texel colours alone, so only alpha
+// may come from the vertex instead (TCC off)
+static inline void gs_copy_sprite(struct ps2_gs* gs, const software_clip& r, int du, int dv, uint32_t f) {
+    uint32_t fa = f >> 24;
+
+    switch (gs->ctx->fbpsm) {
+        case GS_PSMCT32: {
+            if (gs->ctx->tcc) {
+                gs_copy_rect <GS_PSMCT32>(gs, r, du, dv, 0, 0xffffffff, 0);
+            } else {
+                gs_copy_rect <GS_PSMCT32>(gs, r, du, dv, 0, 0xffffff, fa << 24);
+            }
+        } break;
+        case GS_PSMCT24: gs_copy_rect <GS_PSMCT24>(gs, r, du, dv, 0xff000000, 0xffffff, 0); break;
+        case GS_PSMCT16: {
+            if (gs->ctx->tcc) {
+                gs_copy_rect <GS_PSMCT16>(gs, r, du, dv, 0, 0xffff, 0);
+            } else {
+                gs_copy_rect <GS_PSMCT16>(gs, r, du, dv, 0, 0x7fff, (fa & 0x80) << 8);
+            }
+        } break;
+        case GS_PSMCT16S: {
+            if (gs->ctx->tcc) {
+                gs_copy_rect <GS_PSMCT16S>(gs, r, du, dv, 0, 0xffff, 0);
+            } else {
+                gs_copy_rect <GS_PSMCT16S>(gs, r, du, dv, 0, 0x7fff, (fa & 0x80) << 8);
+            }
+        } break;
+    }
+}
+
+// Whether every pixel from a sprite's texture coordinate u (in 1/16
+// texels) onwards, stepped one texel at a time in floats, lands on
+// texel (u >> 4) + n, i.e. none of the additions round
+static inline bool gs_sprite_exact(float u, int n) {
+    double end = (double)u + (16.0 * n);
+
+    return u >= 0.0f && (double)(float)end == end;
+}
+
+void render_sprite(struct ps2_gs* gs, const software_pipeline& pipe, const software_clip& clip) {
     struct gs_vertex v0 = gs->vq[0];
     struct gs_vertex v1 = gs->vq[1];
 
@@ -2532,36 +4462,151 @@ void render_sprite(struct ps2_gs* gs, void* udata) {
     const int z = v1.z;
     int a = v1.a;
 
-    for (int y = ymin; y < ymax; y += 16) {
+    // Step (rather than lerp) to the tile, so coordinates round
+    // the same way they would when drawing the whole sprite
+    int32_t cx0 = std::max(xmin, clip.x0 << 4);
+    int32_t cy0 = std::max(ymin, clip.y0 << 4);
+    int32_t cx1 = std::min(xmax, clip.x1 << 4);
+    int32_t cy1 = std::min(ymax, clip.y1 << 4);
+
+    for (int x = xmin; x < cx0; x += 16) {
+        row_u += u_step;
+        row_s += s_step;
+    }
+
+    for (int y = ymin; y < cy0; y += 16) {
+        v += v_step;
+        t += t_step;
+    }
+
+    if (cx0 >= cx1 || cy0 >= cy1)
+        return;
+
+    software_clip r = { cx0 >> 4, cy0 >> 4, cx1 >> 4, cy1 >> 4 };
+
+    gs_hiz_tile hz;
+
+    const bool hiz = gs_hiz_begin(gs, pipe, &hz, r.x0, r.y0, r.x1, r.y1);
+
+    if (hiz) {
+        uint32_t zc = std::min((uint32_t)z, gs_hiz_limit(hz.fmt));
+
+        for (int b = 0; b < (hz.nx * hz.ny); b++) {
+            hz.zmin[b] = zc;
+            hz.zmax[b] = zc;
+        }
+
+        gs_hiz_classify(gs, pipe, &hz);
+    }
+
+    if (pipe.sprite == SOFTWARE_SPRITE_FILL) {
+        software_thread_pixel_count += (r.x1 - r.x0) * (r.y1 - r.y0);
+
+        gs_fill_sprite(gs, r, v1.rgbaq & 0xffffffff, z);
+
+        if (hiz) {
+            hz.touched = (1u << (hz.nx * hz.ny)) - 1;
+
+            gs_hiz_end(gs, pipe, &hz);
+        }
+
+        return;
+    }
+
+    // Texel coordinates need to step exactly one texel per pixel
+    if (pipe.sprite == SOFTWARE_SPRITE_COPY && u_step == 16.0f && v_step == 16.0f &&
+        gs_sprite_exact(row_u, r.x1 - r.x0) && gs_sprite_exact(v, r.y1 - r.y0)) {
+        int u0 = (int)row_u >> 4;
+        int v0 = (int)v >> 4;
+
+        if ((u0 + (r.x1 - r.x0)) <= (int)gs->ctx->usize && (v0 + (r.y1 - r.y0)) <= (int)gs->ctx->vsize) {
+            software_thread_pixel_count += (r.x1 - r.x0) * (r.y1 - r.y0);
+
+            gs_copy_sprite(gs, r, u0 - r.x0, v0 - r.y0, v1.rgbaq & 0xffffffff);
+            gs_fill_sprite_z(gs, r, z);
+
+            if (hiz) {
+                hz.touched = (1u << (hz.nx * hz.ny)) - 1;
+
+                gs_hiz_end(gs, pipe, &hz);
+            }
+
+            return;
+        }
+    }
+
+    software_span span;
+
+    span.n = 0;
+    span.pass = false;
+
+    for (int y = cy0; y < cy1; y += 16) {
         float u = row_u;
         float s = row_s;
 
-        for (int x = xmin; x < xmax; x += 16) {
+        span.y = y >> 4;
+
+        for (int x = cx0; x < cx1; x += 16) {
             uint32_t c = v1.rgbaq & 0xffffffff;
 
+            software_pixel_func pixel = pipe.pixel;
+
+            if (hiz) {
+                int b = gs_hiz_block(&hz, x >> 4, y >> 4);
+
+                if (hz.state[b] == GS_HIZ_CULL) {
+                    software_thread_hiz_culled++;
+
+                    u += u_step;
+                    s += s_step;
+
+                    continue;
+                }
+
+                hz.touched |= 1u << b;
+
+                if (hz.state[b] == GS_HIZ_PASS)
+                    pixel = pipe.pass;
+
+                gs_hiz_span(gs, pipe, &span, hz.state[b] == GS_HIZ_PASS);
+            }
+
             if (gs->tme) {
                 if (!gs->fst) {
                     u = ((s / q) * gs->ctx->usize) * 16.0;
                     v = ((t / q) * gs->ctx->vsize) * 16.0;
                 }
 
-                c = gs_read_tb(gs, u, v);
-                c = gs_to_rgba32(gs, c, gs->ctx->tbpsm);
-                c = gs_apply_function(gs, c, v1.rgbaq & 0xffffffff);
+                c = pipe.texel(gs, pipe.tex, u, v, v1.rgbaq & 0xffffffff);
 
                 a = c >> 24;
             }
 
-            gs_draw_pixel(gs, x >> 4, y >> 4, z, c);
+            if (pipe.span) {
+                span.x[span.n] = x >> 4;
+                span.z[span.n] = z;
+                span.c[span.n] = c;
+
+                if (++span.n == SOFTWARE_SPAN_SIZE)
+                    gs_flush_span(gs, pipe, &span);
+            } else {
+                pixel(gs, x >> 4, y >> 4, z, c);
+            }
 
             u += u_step;
             s += s_step;
         }
 
+        if (span.n)
+            gs_flush_span(gs, pipe, &span);
+
         v += v_step;
         t += t_step;
     }
 
+    if (hiz)
+        gs_hiz_end(gs, pipe, &hz);
+
     // struct gs_vertex dv0 = gs->vq[0];
     // struct gs_vertex dv1 = gs->vq[0];
     // struct gs_vertex dv2 = gs->vq[1];
@@ -2820,13 +4865,340 @@ static inline void gs_store_hwreg_psmct16s(struct ps2_gs* gs, software_thread_st
     }
 }
 
+// Block-at-a-time uploads
+//
+// Rows of blocks a transfer covers from side to side are converted from
+// the linear host image straight into their swizzled layout, one column
+// (the 16 words that hold 2 or 4 rows of a block) at a time. Pixels of
+// rectangles not aligned to blocks on the left and right, and rows a
+// transfer starts or ends with mid-block, are written one at a time.
+template <int Psm> static constexpr int gs_upload_bpp() {
+    switch (Psm) {
+        case GS_PSMCT24: return 24;
+        case GS_PSMCT16: case GS_PSMCT16S: return 16;
+        case GS_PSMT8: case GS_PSMT8H: return 8;
+        case GS_PSMT4: case GS_PSMT4HL: case GS_PSMT4HH: return 4;
+    }
+
+    return 32;
+}
+
+template <int Psm> static constexpr int gs_upload_block_width() {
+    switch (Psm) {
+        case GS_PSMCT16: case GS_PSMCT16S: case GS_PSMT8: return 16;
+        case GS_PSMT4: return 32;
+    }
+
+    return 8;
+}
+
+template <int Psm> static constexpr int gs_upload_block_height() {
+    return (Psm == GS_PSMT8 || Psm == GS_PSMT4) ? 16 : 8;
+}
+
+// Bits of a word a 32-bit layout format leaves alone
+template <int Psm> static constexpr uint32_t gs_upload_keep() {
+    switch (Psm) {
+        case GS_PSMCT24: return 0xff000000;
+        case GS_PSMT8H: return 0x00ffffff;
+        case GS_PSMT4HL: return 0xf0ffffff;
+        case GS_PSMT4HH: return 0x0fffffff;
+    }
+
+    return 0;
+}
+
+// Pixel p of a linear host image
+template <int Psm> static inline uint32_t gs_upload_pixel(const uint8_t* src, size_t p) {
+    constexpr int bpp = gs_upload_bpp<Psm>();
+
+    if constexpr (bpp == 4) {
+        return (src[p >> 1] >> ((p & 1) * 4)) & 0xf;
+    } else if constexpr (bpp == 8) {
+        return src[p];
+    } else if constexpr (bpp == 16) {
+        uint16_t v; memcpy(&v, src + (p * 2), 2);
+
+        return v;
+    } else if constexpr (bpp == 24) {
+        return src[p * 3] | (src[(p * 3) + 1] << 8) | (src[(p * 3) + 2] << 16);
+    } else {
+        uint32_t v; memcpy(&v, src + (p * 4), 4);
+
+        return v;
+    }
+}
+
+// Address of the block with its top-left pixel at (x, y)
+template <int Psm> static inline uint32_t gs_upload_block_addr(int bp, int bw, int x, int y) {
+    uint32_t addr;
+
+    switch (Psm) {
+        case GS_PSMCT16: addr = psmct16_addr(bp, bw, x, y); break;
+        case GS_PSMCT16S: addr = psmct16s_addr(bp, bw, x, y); break;
+        case GS_PSMT8: addr = psmt8_addr(bp, bw, x, y); break;
+        case GS_PSMT4: addr = psmt4_addr(bp, bw, x, y); break;
+        default: addr = psmct32_addr(bp, bw, x, y); break;
+    }
+
+    return addr & 0xfffff;
+}
+
+#ifdef _EE_USE_INTRINSICS
+// 8 pixels of a row of a 32-bit layout format, moved to the bits
+// they are stored at
+template <int Psm> static inline void gs_upload_row32(const uint8_t* src, __m128i* lo, __m128i* hi) {
+    if constexpr (Psm == GS_PSMCT24) {
+        *lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1));
+        *hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 8)), _mm_setr_epi8(4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1));
+    } else if constexpr (Psm == GS_PSMT8H) {
+        __m128i v = _mm_loadl_epi64((const __m128i*)src);
+
+        *lo = _mm_slli_epi32(_mm_cvtepu8_epi32(v), 24);
+        *hi = _mm_slli_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), 24);
+    } else if constexpr (Psm == GS_PSMT4HL || Psm == GS_PSMT4HH) {
+        constexpr int shift = (Psm == GS_PSMT4HL) ? 24 : 28;
+
+        uint32_t w; memcpy(&w, src, 4);
+
+        __m128i v = _mm_cvtsi32_si128(w);
+        __m128i m = _mm_set1_epi8(0xf);
+
+        // Low nibble first
+        v = _mm_unpacklo_epi8(_mm_and_si128(v, m), _mm_and_si128(_mm_srli_epi16(v, 4), m));
+
+        *lo = _mm_slli_epi32(_mm_cvtepu8_epi32(v), shift);
+        *hi = _mm_slli_epi32(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4)), shift);
+    } else {
+        *lo = _mm_loadu_si128((const __m128i*)src);
+        *hi = _mm_loadu_si128((const __m128i*)(src + 16));
+    }
+}
+
+// 32-bit (and CT16) columns are two rows of 8 word sized pixels,
+// stored as 2x2 squares from left to right
+static inline void gs_upload_store(uint32_t* dst, __m128i a0, __m128i a1, __m128i b0, __m128i b1, uint32_t keep) {
+    __m128i w[4] = {
+        _mm_unpacklo_epi64(a0, b0),
+        _mm_unpackhi_epi64(a0, b0),
+        _mm_unpacklo_epi64(a1, b1),
+        _mm_unpackhi_epi64(a1, b1)
+    };
+
+    for (int i = 0; i < 4; i++) {
+        if (keep)
+            w[i] = _mm_or_si128(w[i], _mm_and_si128(_mm_loadu_si128((const __m128i*)(dst + (i * 4))), _mm_set1_epi32(keep)));
+
+        _mm_storeu_si128((__m128i*)(dst + (i * 4)), w[i]);
+    }
+}
+
+// CT16 packs pixels x and x + 8 of a column row into one word
+static inline void gs_upload_pair16(const uint8_t* src, __m128i* lo, __m128i* hi) {
+    __m128i l = _mm_loadu_si128((const __m128i*)src);
+    __m128i h = _mm_loadu_si128((const __m128i*)(src + 16));
+
+    *lo = _mm_unpacklo_epi16(l, h);
+    *hi = _mm_unpackhi_epi16(l, h);
+}
+
+// 8 and 4-bit columns are four rows, every other pair of rows is
+// rotated by 4 pixels. A word holds pixels x, x + 8 (and x + 16,
+// x + 24 for 4-bit) from an upper and a lower row
+static inline __m128i gs_upload_rotate(__m128i v) {
+    return _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+static inline void gs_upload_quad8(__m128i a, __m128i c, __m128i* lo, __m128i* hi) {
+    __m128i l = _mm_unpacklo_epi8(a, c);
+    __m128i h = _mm_unpackhi_epi8(a, c);
+
+    *lo = _mm_unpacklo_epi16(l, h);
+    *hi = _mm_unpackhi_epi16(l, h);
+}
+
+static inline void gs_upload_nibbles(const uint8_t* src, __m128i* lo, __m128i* hi) {
+    __m128i v = _mm_loadu_si128((const __m128i*)src);
+    __m128i m = _mm_set1_epi8(0xf);
+    __m128i l = _mm_and_si128(v, m);
+    __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), m);
+
+    *lo = _mm_unpacklo_epi8(l, h);
+    *hi = _mm_unpackhi_epi8(l, h);
+}
+
+static inline void gs_upload_quad4(__m128i ex, __m128i ey, __m128i* lo, __m128i* hi) {
+    __m128i x = _mm_unpacklo_epi8(ex, _mm_srli_si128(ex, 8));
+    __m128i y = _mm_unpacklo_epi8(ey, _mm_srli_si128(ey, 8));
+
+    *lo = _mm_unpacklo_epi16(x, y);
+    *hi = _mm_unpackhi_epi16(x, y);
+}
+
+// Column c of a block, src points at its first row
+template <int Psm> static inline void gs_upload_column(uint32_t* dst, const uint8_t* src, size_t stride, int c) {
+    __m128i a0, a1, b0, b1;
+
+    if constexpr (gs_upload_bpp<Psm>() == 16) {
+        gs_upload_pair16(src, &a0, &a1);
+        gs_upload_pair16(src + stride, &b0, &b1);
+    } else if constexpr (Psm == GS_PSMT8) {
+        __m128i r[4];
+
+        for (int i = 0; i < 4; i++)
+            r[i] = _mm_loadu_si128((const __m128i*)(src + (i * stride)));
+
+        for (int i = (c & 1) ? 0 : 2, e = i + 2; i < e; i++)
+            r[i] = gs_upload_rotate(r[i]);
+
+        gs_upload_quad8(r[0], r[2], &a0, &a1);
+        gs_upload_quad8(r[1], r[3], &b0, &b1);
+    } else if constexpr (Psm == GS_PSMT4) {
+        __m128i x[4], y[4];
+
+        for (int i = 0; i < 4; i++)
+            gs_upload_nibbles(src + (i * stride), &x[i], &y[i]);
+
+        for (int i = (c & 1) ? 0 : 2, e = i + 2; i < e; i++) {
+            x[i] = gs_upload_rotate(x[i]);
+            y[i] = gs_upload_rotate(y[i]);
+        }
+
+        // Upper row in the low nibble, lower row in the high one
+        for (int i = 0; i < 2; i++) {
+            x[i] = _mm_or_si128(x[i], _mm_slli_epi16(x[i + 2], 4));
+            y[i] = _mm_or_si128(y[i], _mm_slli_epi16(y[i + 2], 4));
+        }
+
+        gs_upload_quad4(x[0], y[0], &a0, &a1);
+        gs_upload_quad4(x[1], y[1], &b0, &b1);
+    } else {
+        gs_upload_row32<Psm>(src, &a0, &a1);
+        gs_upload_row32<Psm>(src + stride, &b0, &b1);
+    }
+
+    gs_upload_store(dst, a0, a1, b0, b1, gs_upload_keep<Psm>());
+}
+#endif
+
+template <int Psm> static inline void gs_upload_block(struct ps2_gs* gs, software_thread_state* ctx, const uint8_t* src, size_t p, size_t stride, int x, int y) {
+#ifdef _EE_USE_INTRINSICS
+    constexpr int rows = gs_upload_block_height<Psm>() / 4;
+
+    uint32_t* dst = gs->vram + gs_upload_block_addr<Psm>(ctx->dbp, ctx->dbw, x, y);
+
+    src += (p * gs_upload_bpp<Psm>()) / 8;
+
+    for (int c = 0; c < 4; c++)
+        gs_upload_column<Psm>(dst + (c * 16), src + (c * rows * stride), stride, c);
+#else
+    for (int j = 0; j < gs_upload_block_height<Psm>(); j++)
+        for (int i = 0; i < gs_upload_block_width<Psm>(); i++)
+            gs_generic_write(gs, ctx->dbp, ctx->dbw, Psm, x + i, y + j, gs_upload_pixel<Psm>(src, p + (j * ctx->rrw) + i));
+#endif
+}
+
+// A row of blocks from side to side, starting at pixel p of src
+template <int Psm> static inline void gs_upload_band(struct ps2_gs* gs, software_thread_state* ctx, const uint8_t* src, size_t p) {
+    constexpr int bw = gs_upload_block_width<Psm>();
+    constexpr int bh = gs_upload_block_height<Psm>();
+
+    const size_t stride = ((size_t)ctx->rrw * gs_upload_bpp<Psm>()) / 8;
+
+    int x0 = ctx->dsax;
+    int x1 = ctx->dsax + ctx->rrw;
+    int bx0 = (x0 + bw - 1) & ~(bw - 1);
+    int bx1 = x1 & ~(bw - 1);
+
+    // Ragged edges
+    for (int j = 0; j < bh; j++) {
+        size_t row = p + (j * ctx->rrw);
+
+        for (int x = x0; x < std::min(bx0, x1); x++)
+            gs_generic_write(gs, ctx->dbp, ctx->dbw, Psm, x, ctx->dy + j, gs_upload_pixel<Psm>(src, row + (x - x0)));
+
+        for (int x = std::max(bx1, bx0); x < x1; x++)
+            gs_generic_write(gs, ctx->dbp, ctx->dbw, Psm, x, ctx->dy + j, gs_upload_pixel<Psm>(src, row + (x - x0)));
+    }
+
+    for (int x = bx0; x < bx1; x += bw)
+        gs_upload_block<Psm>(gs, ctx, src, p + (x - x0), stride, x, ctx->dy);
+}
+
+// Writes the pixels of a run of doublewords, returns how many of
+// them were taken
+template <int Psm> static size_t gs_upload_stream(struct ps2_gs* gs, software_thread_state* ctx, const uint64_t* data, size_t size) {
+    constexpr int bpp = gs_upload_bpp<Psm>();
+    constexpr int bh = gs_upload_block_height<Psm>();
+
+    // 24-bit pixels only line up with doublewords every 3 of them,
+    // whatever is left over goes through gs_store_hwreg_psmct24
+    if constexpr (bpp == 24) {
+        if (ctx->psmct24_shift)
+            return 0;
+
+        size -= size % 3;
+    }
+
+    // 4-bit rows and blocks have to start on a whole byte, there's
+    // nothing to gain over gs_store_hwreg_psmt4 otherwise
+    if (bpp == 4 && ((ctx->rrw | ctx->dsax) & 1))
+        return 0;
+
+    const uint8_t* src = (const uint8_t*)data;
+    const size_t count = (size * 64) / bpp;
+    const size_t band = (size_t)ctx->rrw * bh;
+
+    size_t p = 0;
+
+    while (p < count) {
+        if (ctx->dx == ctx->dsax && !(ctx->dy % bh) && (count - p) >= band && (ctx->dy + bh) <= (ctx->dsay + ctx->rrh)) {
+            gs_upload_band<Psm>(gs, ctx, src, p);
+
+            p += band;
+            ctx->dy += bh;
+
+            continue;
+        }
+
+        gs_generic_write(gs, ctx->dbp, ctx->dbw, Psm, ctx->dx, ctx->dy, gs_upload_pixel<Psm>(src, p++));
+
+        if (++ctx->dx == (ctx->rrw + ctx->dsax)) {
+            ctx->dx = ctx->dsax;
+            ctx->dy++;
+        }
+    }
+
+    return size;
+}
+
+static inline size_t gs_upload(struct ps2_gs* gs, software_thread_state* ctx, const uint64_t* data, size_t size) {
+    switch (ctx->dpsm) {
+        case GS_PSMCT24: return gs_upload_stream <GS_PSMCT24>(gs, ctx, data, size);
+        case GS_PSMCT16: return gs_upload_stream <GS_PSMCT16>(gs, ctx, data, size);
+        case GS_PSMCT16S: return gs_upload_stream <GS_PSMCT16S>(gs, ctx, data, size);
+        case GS_PSMT8: return gs_upload_stream <GS_PSMT8>(gs, ctx, data, size);
+        case GS_PSMT8H: return gs_upload_stream <GS_PSMT8H>(gs, ctx, data, size);
+        case GS_PSMT4: return gs_upload_stream <GS_PSMT4>(gs, ctx, data, size);
+        case GS_PSMT4HL: return gs_upload_stream <GS_PSMT4HL>(gs, ctx, data, size);
+        case GS_PSMT4HH: return gs_upload_stream <GS_PSMT4HH>(gs, ctx, data, size);
+    }
+
+    // Anything else is written as CT32 (see transfer_flush_buffer)
+    return gs_upload_stream <GS_PSMCT32>(gs, ctx, data, size);
+}
+
 void transfer_flush_buffer(software_thread_state* ctx) {
     // printf("gs: Flushing transfer... %d (%d)\n", ctx->transfer_buffer.size(), ctx->transfer_size);
 
     ctx->render_mtx.lock();
 
-    for (int i = 0; i < ctx->transfer_buffer.size(); i++) {
-        ctx->gs->hwreg = ctx->transfer_buffer[i];
+    const uint64_t* data = ctx->transfer_buffer.data();
+    size_t size = ctx->transfer_buffer.size();
+
+    // Doublewords the block path leaves, the tail of a CT24 transfer
+    for (size_t i = gs_upload(ctx->gs, ctx, data, size); i < size; i++) {
+        ctx->gs->hwreg = data[i];
 
         switch (ctx->dpsm) {
             case GS_PSMCT32: {
@@ -2871,6 +5243,8 @@ void transfer_flush_buffer(software_thread_state* ctx) {
         }
     }
 
+    software_thread_transfer_written(ctx);
+
     ctx->render_mtx.unlock();
 }
 
@@ -2945,511 +5319,1244 @@ void transfer_start(struct ps2_gs* gs, void* udata) {
     ctx->transfer_buffer.clear();
     ctx->transfer_buffer.reserve(ctx->transfer_size);
 
-    ctx->psmct24_data = 0;
-    ctx->psmct24_shift = 0;
+    ctx->psmct24_data = 0;
+    ctx->psmct24_shift = 0;
+
+    // printf("dbp=%x (%x) dbw=%d (%d) dpsm=%02x dsa=(%d,%d) rr=(%d,%d) xdir=%d transfer_size=%d\n",
+    //     ctx->dbp, ctx->dbp,
+    //     ctx->dbw, ctx->dbw,
+    //     ctx->dpsm,
+    //     ctx->dsax,
+    //     ctx->dsay,
+    //     ctx->rrw,
+    //     ctx->rrh,
+    //     ctx->xdir,
+    //     ctx->transfer_size
+    // );
+
+    if (ctx->xdir == 2) {
+        ctx->render_mtx.lock();
+
+        ctx->stats.texture_blits++;
+
+        software_thread_vram_blit(gs, ctx);
+
+        ctx->render_mtx.unlock();
+    } else if (ctx->xdir == 1) {
+        printf("gs: Read transfer requested\n");
+
+        // exit(1);
+    } else {
+        ctx->stats.texture_uploads++;
+    }
+}
+
+void transfer_write(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    ctx->transfer_buffer.push_back(gs->hwreg);
+    ctx->transfer_size--;
+
+    if (ctx->transfer_size == 0) {
+        transfer_flush_buffer(ctx);
+    }
+}
+
+void transfer_read(struct ps2_gs* gs, void* udata) {
+    gs->hwreg = 0;
+}
+
+// Encode the words of the GS state that changed since the last
+// command, the render thread applies them to its own copy
+static void software_thread_push(software_thread_state* ctx, struct ps2_gs* gs, int prim) {
+    static_assert(sizeof(struct ps2_gs) % sizeof(uint64_t) == 0);
+
+    constexpr size_t max_size = sizeof(software_command) + (SOFTWARE_STATE_WORDS * (sizeof(uint64_t) + 4));
+
+    uint64_t head = ctx->ring_head.load(std::memory_order_relaxed);
+    size_t offset = head & (SOFTWARE_RING_SIZE - 1);
+
+    // Not enough room before the end of the ring, skip to the start
+    if (SOFTWARE_RING_SIZE - offset < max_size) {
+        software_command wrap = { (uint32_t)(SOFTWARE_RING_SIZE - offset), SOFTWARE_COMMAND_WRAP, 0 };
+
+        software_thread_wait_space(ctx, head + sizeof(wrap));
+
+        memcpy(ctx->ring.data() + offset, &wrap, sizeof(wrap));
+
+        head += wrap.size;
+        offset = 0;
+    }
+
+    software_thread_wait_space(ctx, head + max_size);
+
+    const uint8_t* state = (const uint8_t*)gs;
+    uint8_t* base = ctx->ring.data() + offset;
+    uint8_t* p = base + sizeof(software_command);
+
+    software_command cmd;
+
+    cmd.prim = prim;
+    cmd.runs = 0;
+
+    if (prim != 4) {
+        size_t i = 0;
+
+        while (i < SOFTWARE_STATE_WORDS) {
+            uint64_t w;
+
+            memcpy(&w, state + (i * sizeof(uint64_t)), sizeof(w));
+
+            if (w == ctx->shadow[i]) {
+                i++;
+
+                continue;
+            }
+
+            uint16_t run[2] = { (uint16_t)i, 0 };
+            uint8_t* header = p;
+
+            p += sizeof(run);
+
+            do {
+                ctx->shadow[i++] = w;
+
+                memcpy(p, &w, sizeof(w));
+
+                p += sizeof(w);
+                run[1]++;
+
+                if (i == SOFTWARE_STATE_WORDS)
+                    break;
+
+                memcpy(&w, state + (i * sizeof(uint64_t)), sizeof(w));
+            } while (w != ctx->shadow[i]);
+
+            memcpy(header, run, sizeof(run));
+
+            cmd.runs++;
+        }
+    }
+
+    cmd.size = ((p - base) + 7) & ~7;
+
+    memcpy(base, &cmd, sizeof(cmd));
+
+    ctx->stats.command_bytes += cmd.size;
+    ctx->ring_head = head + cmd.size;
+
+    // Checked after publishing the command, see software_thread_sleep
+    if (ctx->render_sleeping) {
+        { std::lock_guard <std::mutex> lk(ctx->queue_mtx); }
+
+        ctx->queue_cv.notify_one();
+    }
+}
+
+extern "C" void software_thread_render_point(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    ctx->stats.points++;
+    ctx->stats.primitives++;
+
+    software_thread_push(ctx, gs, 0);
+}
+
+extern "C" void software_thread_render_line(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    ctx->stats.lines++;
+    ctx->stats.primitives++;
+
+    software_thread_push(ctx, gs, 1);
+}
+
+extern "C" void software_thread_render_triangle(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    ctx->stats.triangles++;
+    ctx->stats.primitives++;
+
+    software_thread_push(ctx, gs, 2);
+}
+
+extern "C" void software_thread_render_sprite(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    ctx->stats.sprites++;
+    ctx->stats.primitives++;
+
+    software_thread_push(ctx, gs, 3);
+}
+
+extern "C" void software_thread_transfer_start(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    software_thread_wait_idle(ctx);
+
+    transfer_start(gs, ctx);
+}
+
+extern "C" void software_thread_transfer_write(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    transfer_write(gs, ctx);
+}
+
+extern "C" void software_thread_transfer_read(struct ps2_gs* gs, void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    software_thread_wait_idle(ctx);
+
+    // ctx->render_mtx.lock();
+
+    transfer_read(gs, ctx);
+
+    // ctx->render_mtx.unlock();
+}
+
+extern "C" void software_thread_flush(void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
+
+    software_thread_push(ctx, ctx->gs, 4);
+}
+
+// Display readout
+//
+// The display buffer is read two rows at a time, the pair of rows that
+// shares a block column. For every block of those rows we read its
+// column (16 words) and undo the 2x2 word interleave with SSE, so a
+// 640x448 frame is a few thousand column reads instead of ~300k
+// swizzled lookups. Pixels past the last whole block go through
+// gs_read_dispfb.
+#ifdef _EE_USE_INTRINSICS
+// Rows y and y + 1 (y even), either row can be left out
+template <int Psm> static inline void gs_readout_pair(struct ps2_gs* gs, int dfb, int y, int w, void* row0, void* row1) {
+    uint32_t bp = dfb ? gs->dfbp2 : gs->dfbp1;
+    uint32_t bw = dfb ? gs->dfbw2 : gs->dfbw1;
+
+    constexpr bool psm16 = (Psm == GS_PSMCT16) || (Psm == GS_PSMCT16S);
+    constexpr int bx = psm16 ? 16 : 8;
+
+    int x = 0;
+
+    for (; x < (w & ~(bx - 1)); x += bx) {
+        uint32_t addr;
+
+        switch (Psm) {
+            case GS_PSMCT16: addr = psmct16_addr(bp, bw, x, y); break;
+            case GS_PSMCT16S: addr = psmct16s_addr(bp, bw, x, y); break;
+            default: addr = psmct32_addr(bp, bw, x, y); break;
+        }
+
+        const __m128i* col = (const __m128i*)(gs->vram + (addr & 0xfffff));
+
+        __m128i w0 = _mm_loadu_si128(col + 0);
+        __m128i w1 = _mm_loadu_si128(col + 1);
+        __m128i w2 = _mm_loadu_si128(col + 2);
+        __m128i w3 = _mm_loadu_si128(col + 3);
+
+        // Words for x 0-3 and 4-7 of both rows
+        __m128i a0 = _mm_unpacklo_epi64(w0, w1);
+        __m128i a1 = _mm_unpacklo_epi64(w2, w3);
+        __m128i b0 = _mm_unpackhi_epi64(w0, w1);
+        __m128i b1 = _mm_unpackhi_epi64(w2, w3);
+
+        if constexpr (psm16) {
+            // Pixel x in the low half of a word, x + 8 in the high one
+            const __m128i lo = _mm_set1_epi32(0xffff);
+
+            if (row0) {
+                __m128i* d0 = (__m128i*)((uint16_t*)row0 + x);
+
+                _mm_storeu_si128(d0 + 0, _mm_packus_epi32(_mm_and_si128(a0, lo), _mm_and_si128(a1, lo)));
+                _mm_storeu_si128(d0 + 1, _mm_packus_epi32(_mm_srli_epi32(a0, 16), _mm_srli_epi32(a1, 16)));
+            }
+
+            if (row1) {
+                __m128i* d1 = (__m128i*)((uint16_t*)row1 + x);
+
+                _mm_storeu_si128(d1 + 0, _mm_packus_epi32(_mm_and_si128(b0, lo), _mm_and_si128(b1, lo)));
+                _mm_storeu_si128(d1 + 1, _mm_packus_epi32(_mm_srli_epi32(b0, 16), _mm_srli_epi32(b1, 16)));
+            }
+        } else {
+            if (Psm == GS_PSMCT24) {
+                const __m128i rgb = _mm_set1_epi32(0xffffff);
+
+                a0 = _mm_and_si128(a0, rgb);
+                a1 = _mm_and_si128(a1, rgb);
+                b0 = _mm_and_si128(b0, rgb);
+                b1 = _mm_and_si128(b1, rgb);
+            }
+
+            if (row0) {
+                __m128i* d0 = (__m128i*)((uint32_t*)row0 + x);
+
+                _mm_storeu_si128(d0 + 0, a0);
+                _mm_storeu_si128(d0 + 1, a1);
+            }
+
+            if (row1) {
+                __m128i* d1 = (__m128i*)((uint32_t*)row1 + x);
+
+                _mm_storeu_si128(d1 + 0, b0);
+                _mm_storeu_si128(d1 + 1, b1);
+            }
+        }
+    }
+
+    for (; x < w; x++) {
+        typedef std::conditional_t <psm16, uint16_t, uint32_t> pixel;
+
+        if (row0)
+            ((pixel*)row0)[x] = gs_read_dispfb(gs, x, y, dfb);
+
+        if (row1)
+            ((pixel*)row1)[x] = gs_read_dispfb(gs, x, y + 1, dfb);
+    }
+}
+#endif
+
+// Rows src_y, src_y + src_step... of display buffer dfb to rows
+// dst_y, dst_y + dst_step... of the frame
+static void gs_readout(software_thread_state* ctx, int dfb, int src_y, int src_step, int dst_y, int dst_step, int rows) {
+    struct ps2_gs* gs = ctx->gs;
+
+    bool out16 = (ctx->disp_fmt == GS_PSMCT16) || (ctx->disp_fmt == GS_PSMCT16S);
+    bool out32 = (ctx->disp_fmt == GS_PSMCT32) || (ctx->disp_fmt == GS_PSMCT24);
+
+    if (!out16 && !out32)
+        return;
+
+    size_t pitch = (size_t)ctx->tex_w * (out16 ? 2 : 4);
+    uint8_t* buf = (uint8_t*)ctx->buf;
+
+    auto row = [&](int i) { return (void*)(buf + ((dst_y + (i * dst_step)) * pitch)); };
+
+#ifdef _EE_USE_INTRINSICS
+    uint32_t psm = dfb ? gs->dfbpsm2 : gs->dfbpsm1;
+
+    bool psm16 = (psm == GS_PSMCT16) || (psm == GS_PSMCT16S);
+    bool psm32 = (psm == GS_PSMCT32) || (psm == GS_PSMCT24);
+
+    if ((out16 && psm16) || (out32 && psm32)) {
+        for (int i = 0; i < rows;) {
+            int y = src_y + (i * src_step);
+
+            void* row0 = nullptr;
+            void* row1 = nullptr;
+
+            // Consecutive rows share their block columns
+            if ((y & 1) == 0) {
+                row0 = row(i++);
+
+                if (src_step == 1 && i < rows)
+                    row1 = row(i++);
+            } else {
+                row1 = row(i++);
+            }
+
+            switch (psm) {
+                case GS_PSMCT32: gs_readout_pair <GS_PSMCT32>(gs, dfb, y & ~1, ctx->tex_w, row0, row1); break;
+                case GS_PSMCT24: gs_readout_pair <GS_PSMCT24>(gs, dfb, y & ~1, ctx->tex_w, row0, row1); break;
+                case GS_PSMCT16: gs_readout_pair <GS_PSMCT16>(gs, dfb, y & ~1, ctx->tex_w, row0, row1); break;
+                case GS_PSMCT16S: gs_readout_pair <GS_PSMCT16S>(gs, dfb, y & ~1, ctx->tex_w, row0, row1); break;
+            }
+        }
+
+        return;
+    }
+#endif
+
+    for (int i = 0; i < rows; i++) {
+        int y = src_y + (i * src_step);
+
+        for (int x = 0; x < ctx->tex_w; x++) {
+            if (out16) {
+                ((uint16_t*)row(i))[x] = gs_read_dispfb(gs, x, y, dfb);
+            } else {
+                ((uint32_t*)row(i))[x] = gs_read_dispfb(gs, x, y, dfb);
+            }
+        }
+    }
+}
+
+void gs_blit_dispfb_deinterlace_frame(software_thread_state* ctx, int dfb) {
+    // Get current field
+    int odd = ((ctx->gs->csr >> 13) & 1) == 0;
+
+    gs_readout(ctx, dfb, 0, 1, odd, 2, ctx->tex_h / 2);
+}
+
+void gs_blit_dispfb_deinterlace_field(software_thread_state* ctx, int dfb) {
+    // Get current field
+    int odd = ((ctx->gs->csr >> 13) & 1) == 0;
+
+    gs_readout(ctx, dfb, odd, 2, odd, 2, ctx->tex_h / 2);
+}
+
+void gs_blit_dispfb_no_deinterlace(software_thread_state* ctx, int dfb) {
+    gs_readout(ctx, dfb, 0, 1, 0, 1, ctx->tex_h);
+}
+
+// GS internal registers
+//
+// The GIF hands us raw packets, so the software renderer keeps the GS
+// drawing state itself. Primitives are queued to the render thread
+// along with a snapshot of that state.
+static inline void gs_unpack_tex0(struct ps2_gs* gs, int i) {
+    gs->context[i].tbp0 = gs->context[i].tex0 & 0x3fff;
+    gs->context[i].tbw = (gs->context[i].tex0 >> 14) & 0x3f;
+    gs->context[i].tbpsm = (gs->context[i].tex0 >> 20) & 0x3f;
+    gs->context[i].usize = 1 << ((gs->context[i].tex0 >> 26) & 0xf); // tw
+    gs->context[i].vsize = 1 << ((gs->context[i].tex0 >> 30) & 0xf); // th
+    gs->context[i].tcc = (gs->context[i].tex0 >> 34) & 1;
+    gs->context[i].tfx = (gs->context[i].tex0 >> 35) & 3;
+    gs->context[i].cbp = (gs->context[i].tex0 >> 37) & 0x3fff;
+    gs->context[i].cbpsm = (gs->context[i].tex0 >> 51) & 0xf;
+    gs->context[i].csm = (gs->context[i].tex0 >> 55) & 1;
+    gs->context[i].csa = (gs->context[i].tex0 >> 56) & 0x1f;
+    gs->context[i].cld = (gs->context[i].tex0 >> 61) & 7;
+
+    gs->context[i].usize = (gs->context[i].usize > 1024) ? 1024 : gs->context[i].usize;
+    gs->context[i].vsize = (gs->context[i].vsize > 1024) ? 1024 : gs->context[i].vsize;
+}
+
+static inline void gs_unpack_clamp(struct ps2_gs* gs, int i) {
+    gs->context[i].wms = gs->context[i].clamp & 3;
+    gs->context[i].wmt = (gs->context[i].clamp >> 2) & 3;
+    gs->context[i].minu = (gs->context[i].clamp >> 4) & 0x3ff;
+    gs->context[i].maxu = (gs->context[i].clamp >> 14) & 0x3ff;
+    gs->context[i].minv = (gs->context[i].clamp >> 24) & 0x3ff;
+    gs->context[i].maxv = (gs->context[i].clamp >> 34) & 0x3ff;
+}
+
+static inline void gs_unpack_tex1(struct ps2_gs* gs, int i) {
+    gs->context[i].lcm = gs->context[i].tex1 & 1;
+    gs->context[i].mxl = (gs->context[i].tex1 >> 2) & 7;
+    gs->context[i].mmag = (gs->context[i].tex1 >> 5) & 1;
+    gs->context[i].mmin = (gs->context[i].tex1 >> 6) & 7;
+    gs->context[i].mtba = (gs->context[i].tex1 >> 9) & 1;
+    gs->context[i].l = (gs->context[i].tex1 >> 19) & 3;
+    gs->context[i].k = gs->context[i].tex1 >> 32;
+}
+
+static inline void gs_unpack_tex2(struct ps2_gs* gs, int i) {
+    gs->context[i].tbpsm = (gs->context[i].tex2 >> 20) & 0x3f;
+    gs->context[i].cbp = (gs->context[i].tex2 >> 37) & 0x3fff;
+    gs->context[i].cbpsm = (gs->context[i].tex2 >> 51) & 0xf;
+    gs->context[i].csm = (gs->context[i].tex2 >> 55) & 1;
+    gs->context[i].csa = (gs->context[i].tex2 >> 56) & 0x1f;
+    gs->context[i].cld = (gs->context[i].tex2 >> 61) & 7;
+}
+
+static inline void gs_unpack_xyoffset(struct ps2_gs* gs, int i) {
+    gs->context[i].ofx = gs->context[i].xyoffset & 0xffff;
+    gs->context[i].ofy = (gs->context[i].xyoffset >> 32) & 0xffff;
+}
+
+static inline void gs_unpack_miptbp1(struct ps2_gs* gs, int i) {
+    gs->context[i].mmtbp[0] = gs->context[i].miptbp1 & 0x3fff;
+    gs->context[i].mmtbw[0] = (gs->context[i].miptbp1 >> 14) & 0x3f;
+    gs->context[i].mmtbp[1] = (gs->context[i].miptbp1 >> 20) & 0x3fff;
+    gs->context[i].mmtbw[1] = (gs->context[i].miptbp1 >> 34) & 0x3f;
+    gs->context[i].mmtbp[2] = (gs->context[i].miptbp1 >> 40) & 0x3fff;
+    gs->context[i].mmtbw[2] = (gs->context[i].miptbp1 >> 54) & 0x3f;
+}
+
+static inline void gs_unpack_miptbp2(struct ps2_gs* gs, int i) {
+    gs->context[i].mmtbp[3] = gs->context[i].miptbp2 & 0x3fff;
+    gs->context[i].mmtbw[3] = (gs->context[i].miptbp2 >> 14) & 0x3f;
+    gs->context[i].mmtbp[4] = (gs->context[i].miptbp2 >> 20) & 0x3fff;
+    gs->context[i].mmtbw[4] = (gs->context[i].miptbp2 >> 34) & 0x3f;
+    gs->context[i].mmtbp[5] = (gs->context[i].miptbp2 >> 40) & 0x3fff;
+    gs->context[i].mmtbw[5] = (gs->context[i].miptbp2 >> 54) & 0x3f;
+}
+
+static inline void gs_unpack_scissor(struct ps2_gs* gs, int i) {
+    gs->context[i].scax0 = gs->context[i].scissor & 0x3ff;
+    gs->context[i].scay0 = (gs->context[i].scissor >> 32) & 0x3ff;
+    gs->context[i].scax1 = (gs->context[i].scissor >> 16) & 0x3ff;
+    gs->context[i].scay1 = (gs->context[i].scissor >> 48) & 0x3ff;
+}
+
+static inline void gs_unpack_alpha(struct ps2_gs* gs, int i) {
+    gs->context[i].a = gs->context[i].alpha & 3;
+    gs->context[i].b = (gs->context[i].alpha >> 2) & 3;
+    gs->context[i].c = (gs->context[i].alpha >> 4) & 3;
+    gs->context[i].d = (gs->context[i].alpha >> 6) & 3;
+    gs->context[i].fix = (gs->context[i].alpha >> 32) & 0xff;
+}
+
+static inline void gs_unpack_test(struct ps2_gs* gs, int i) {
+    gs->context[i].ate = gs->context[i].test & 1;
+    gs->context[i].atst = (gs->context[i].test >> 1) & 7;
+    gs->context[i].aref = (gs->context[i].test >> 4) & 0xff;
+    gs->context[i].afail = (gs->context[i].test >> 12) & 3;
+    gs->context[i].date = (gs->context[i].test >> 14) & 1;
+    gs->context[i].datm = (gs->context[i].test >> 15) & 1;
+    gs->context[i].zte = (gs->context[i].test >> 16) & 1;
+    gs->context[i].ztst = (gs->context[i].test >> 17) & 3;
+}
+
+static inline void gs_unpack_frame(struct ps2_gs* gs, int i) {
+    gs->context[i].fbp = (gs->context[i].frame & 0x1ff) << 11;
+    gs->context[i].fbw = ((gs->context[i].frame >> 16) & 0x3f) << 6;
+    gs->context[i].fbpsm = (gs->context[i].frame >> 24) & 0x3f;
+    gs->context[i].fbmsk = gs->context[i].frame >> 32;
+}
+
+static inline void gs_unpack_zbuf(struct ps2_gs* gs, int i) {
+    gs->context[i].zbp = (gs->context[i].zbuf & 0x1ff) << 11;
+    gs->context[i].zbpsm = (gs->context[i].zbuf >> 24) & 0xf;
+    gs->context[i].zbmsk = (gs->context[i].zbuf >> 32) & 1;
+}
+
+static inline void gs_unpack_texclut(struct ps2_gs* gs) {
+    gs->cbw = gs->texclut & 0x3f;
+    gs->cou = ((gs->texclut >> 6) & 0x3f) << 4;
+    gs->cov = (gs->texclut >> 12) & 0x3ff;
+}
+
+static inline void gs_unpack_texa(struct ps2_gs* gs) {
+    gs->ta0 = gs->texa & 0xff;
+    gs->aem = (gs->texa >> 15) & 1;
+    gs->ta1 = (gs->texa >> 32) & 0xff;
+}
+
+static inline void gs_unpack_dimx(struct ps2_gs* gs) {
+    for (int i = 0; i < 16; i++)
+        gs->dither[i >> 2][i & 3] = ((int32_t)(((gs->dimx >> (i * 4)) & 7) << 29)) >> 29;
+}
+
+static inline void gs_unpack_vertex(struct ps2_gs* gs, struct gs_vertex* v) {
+    v->x = v->xyz & 0xffff;
+    v->y = (v->xyz >> 16) & 0xffff;
+    v->z = v->xyz >> 32;
+    v->r = v->rgbaq & 0xff;
+    v->g = (v->rgbaq >> 8) & 0xff;
+    v->b = (v->rgbaq >> 16) & 0xff;
+    v->a = (v->rgbaq >> 24) & 0xff;
+
+    union {
+        uint32_t u32;
+        float f;
+    } s, t, q;
+
+    s.u32 = v->st & 0xffffffff;
+    t.u32 = v->st >> 32;
+    q.u32 = v->rgbaq >> 32;
+
+    v->s = s.f;
+    v->t = t.f;
+    v->q = q.f;
+    v->u = v->uv & 0x3fff;
+    v->v = (v->uv >> 16) & 0x3fff;
+}
+
+static inline void gs_write_vertex(software_thread_state* ctx, struct ps2_gs* gs, uint64_t data, uint64_t fog, int discard) {
+    gs->vq[gs->vqi].xyz = data;
+    gs->vq[gs->vqi].st = gs->st;
+    gs->vq[gs->vqi].uv = gs->uv;
+    gs->vq[gs->vqi].rgbaq = gs->rgbaq;
+    gs->vq[gs->vqi].fog = fog;
+
+    gs->attr = (gs->prmodecont & 1) ? gs->prim : gs->prmode;
+
+    // Cache PRIM/PRMODE fields
+    gs->iip = (gs->attr >> 3) & 1;
+    gs->tme = (gs->attr >> 4) & 1;
+    gs->fge = (gs->attr >> 5) & 1;
+    gs->abe = (gs->attr >> 6) & 1;
+    gs->aa1 = (gs->attr >> 7) & 1;
+    gs->fst = (gs->attr >> 8) & 1;
+    gs->ctxt = (gs->attr >> 9) & 1;
+    gs->fix = (gs->attr >> 10) & 1;
+
+    gs_unpack_vertex(gs, &gs->vq[gs->vqi]);
+
+    gs->vqi++;
 
-    // printf("dbp=%x (%x) dbw=%d (%d) dpsm=%02x dsa=(%d,%d) rr=(%d,%d) xdir=%d transfer_size=%d\n",
-    //     ctx->dbp, ctx->dbp,
-    //     ctx->dbw, ctx->dbw,
-    //     ctx->dpsm,
-    //     ctx->dsax,
-    //     ctx->dsay,
-    //     ctx->rrw,
-    //     ctx->rrh,
-    //     ctx->xdir,
-    //     ctx->transfer_size
-    // );
+    gs->ctx = &gs->context[gs->ctxt];
 
-    if (ctx->xdir == 2) {
-        ctx->render_mtx.lock();
+    switch (gs->prim & 7) {
+        case 0: if (gs->vqi == 1) { software_thread_render_point(gs, ctx); gs->vqi = 0; } break;
+        case 1: if (gs->vqi == 2) { software_thread_render_line(gs, ctx); gs->vqi = 0; } break;
+        case 2: {
+            if (gs->vqi == 2) {
+                if (!discard) software_thread_render_line(gs, ctx);
+            } else if (gs->vqi == 3) {
+                gs->vq[0] = gs->vq[1];
+                gs->vq[1] = gs->vq[2];
 
-        ctx->stats.texture_blits++;
+                if (!discard) software_thread_render_line(gs, ctx);
 
-        software_thread_vram_blit(gs, ctx);
+                gs->vqi = 2;
+            }
+        } break;
+        case 3: if (gs->vqi == 3) { if (!discard) software_thread_render_triangle(gs, ctx); gs->vqi = 0; } break;
+        case 4: {
+            if (gs->vqi == 3) {
+                if (!discard) software_thread_render_triangle(gs, ctx);
+            } else if (gs->vqi == 4) {
+                gs->vq[0] = gs->vq[1];
+                gs->vq[1] = gs->vq[2];
+                gs->vq[2] = gs->vq[3];
+
+                if (!discard) software_thread_render_triangle(gs, ctx);
+
+                gs->vqi = 3;
+            }
+        } break;
+        case 5: {
+            if (gs->vqi == 3) {
+                if (!discard) software_thread_render_triangle(gs, ctx);
+            } else if (gs->vqi == 4) {
+                gs->vq[1] = gs->vq[2];
+                gs->vq[2] = gs->vq[3];
 
-        ctx->render_mtx.unlock();
-    } else if (ctx->xdir == 1) {
-        printf("gs: Read transfer requested\n");
+                if (!discard) software_thread_render_triangle(gs, ctx);
 
-        // exit(1);
-    } else {
-        ctx->stats.texture_uploads++;
+                gs->vqi = 3;
+            }
+        } break;
+        case 6: if (gs->vqi == 2) { if (!discard) software_thread_render_sprite(gs, ctx); gs->vqi = 0; } break;
+        case 7: {
+            // Reserved, drop the vertex
+            gs->vqi = 0;
+        } break;
     }
 }
 
-void transfer_write(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+static void gs_write_internal(software_thread_state* ctx, int reg, uint64_t data) {
+    struct ps2_gs* gs = ctx->gs;
+
+    switch (reg) {
+        case GS_PRIM: gs->prim = data; gs->vqi = 0; return;
+        case GS_RGBAQ: gs->rgbaq = data; return;
+        case GS_ST: gs->st = data; return;
+        case GS_UV: gs->uv = data; return;
+        case GS_XYZF2: gs->xyzf2 = data; gs_write_vertex(ctx, gs, data & 0xffffffffffffffull, data >> 56, 0); return;
+        case GS_XYZ2: gs->xyz2 = data; gs_write_vertex(ctx, gs, data, gs->fog >> 56, 0); return;
+        case GS_TEX0_1: gs->context[0].tex0 = data; gs_unpack_tex0(gs, 0); return;
+        case GS_TEX0_2: gs->context[1].tex0 = data; gs_unpack_tex0(gs, 1); return;
+        case GS_CLAMP_1: gs->context[0].clamp = data; gs_unpack_clamp(gs, 0); return;
+        case GS_CLAMP_2: gs->context[1].clamp = data; gs_unpack_clamp(gs, 1); return;
+        case GS_FOG: gs->fog = data; return;
+        case GS_XYZF3: gs->xyzf3 = data; gs_write_vertex(ctx, gs, data & 0xffffffffffffffull, data >> 56, 1); return;
+        case GS_XYZ3: gs->xyz3 = data; gs_write_vertex(ctx, gs, data, gs->fog >> 56, 1); return;
+        case GS_TEX1_1: gs->context[0].tex1 = data; gs_unpack_tex1(gs, 0); return;
+        case GS_TEX1_2: gs->context[1].tex1 = data; gs_unpack_tex1(gs, 1); return;
+        case GS_TEX2_1: gs->context[0].tex2 = data; gs_unpack_tex2(gs, 0); return;
+        case GS_TEX2_2: gs->context[1].tex2 = data; gs_unpack_tex2(gs, 1); return;
+        case GS_XYOFFSET_1: gs->context[0].xyoffset = data; gs_unpack_xyoffset(gs, 0); return;
+        case GS_XYOFFSET_2: gs->context[1].xyoffset = data; gs_unpack_xyoffset(gs, 1); return;
+        case GS_PRMODECONT: gs->prmodecont = data; return;
+        case GS_PRMODE: gs->prmode = data; return;
+        case GS_TEXCLUT: gs->texclut = data; gs_unpack_texclut(gs); return;
+        case GS_SCANMSK: gs->scanmsk = data; return;
+        case GS_MIPTBP1_1: gs->context[0].miptbp1 = data; gs_unpack_miptbp1(gs, 0); return;
+        case GS_MIPTBP1_2: gs->context[1].miptbp1 = data; gs_unpack_miptbp1(gs, 1); return;
+        case GS_MIPTBP2_1: gs->context[0].miptbp2 = data; gs_unpack_miptbp2(gs, 0); return;
+        case GS_MIPTBP2_2: gs->context[1].miptbp2 = data; gs_unpack_miptbp2(gs, 1); return;
+        case GS_TEXA: gs->texa = data; gs_unpack_texa(gs); return;
+        case GS_FOGCOL: gs->fogcol = data; return;
+        case GS_TEXFLUSH: gs->texflush = data; software_thread_flush(ctx); return;
+        case GS_SCISSOR_1: gs->context[0].scissor = data; gs_unpack_scissor(gs, 0); return;
+        case GS_SCISSOR_2: gs->context[1].scissor = data; gs_unpack_scissor(gs, 1); return;
+        case GS_ALPHA_1: gs->context[0].alpha = data; gs_unpack_alpha(gs, 0); return;
+        case GS_ALPHA_2: gs->context[1].alpha = data; gs_unpack_alpha(gs, 1); return;
+        case GS_DIMX: gs->dimx = data; gs_unpack_dimx(gs); return;
+        case GS_DTHE: gs->dthe = data; return;
+        case GS_COLCLAMP: gs->colclamp = data; return;
+        case GS_TEST_1: gs->context[0].test = data; gs_unpack_test(gs, 0); return;
+        case GS_TEST_2: gs->context[1].test = data; gs_unpack_test(gs, 1); return;
+        case GS_PABE: gs->pabe = data; return;
+        case GS_FBA_1: gs->context[0].fba = data; return;
+        case GS_FBA_2: gs->context[1].fba = data; return;
+        case GS_FRAME_1: gs->context[0].frame = data; gs_unpack_frame(gs, 0); return;
+        case GS_FRAME_2: gs->context[1].frame = data; gs_unpack_frame(gs, 1); return;
+        case GS_ZBUF_1: gs->context[0].zbuf = data; gs_unpack_zbuf(gs, 0); return;
+        case GS_ZBUF_2: gs->context[1].zbuf = data; gs_unpack_zbuf(gs, 1); return;
+        case GS_BITBLTBUF: gs->bitbltbuf = data; return;
+        case GS_TRXPOS: gs->trxpos = data; return;
+        case GS_TRXREG: gs->trxreg = data; return;
+        case GS_TRXDIR: gs->trxdir = data; software_thread_transfer_start(gs, ctx); return;
+        case GS_HWREG: gs->hwreg = data; software_thread_transfer_write(gs, ctx); return;
+        case GS_SIGNAL: gs->signal = data; ps2_gs_write_signal(gs, data); return;
+        case GS_FINISH: gs->finish = data; ps2_gs_write_finish(gs, data); return;
+        case GS_LABEL: ps2_gs_write_label(gs, data); return;
+    }
 
-    ctx->transfer_buffer.push_back(gs->hwreg);
-    ctx->transfer_size--;
+    // printf("gs: Invalid internal register %02x write\n", reg);
+}
 
-    if (ctx->transfer_size == 0) {
-        transfer_flush_buffer(ctx);
+// GIF packet decoding
+static inline void software_gif_write_packed(software_thread_state* ctx, int r, uint64_t lo, uint64_t hi) {
+    switch (r) {
+        case 0x00: gs_write_internal(ctx, GS_PRIM, lo & 0x7ff); break;
+        case 0x01: {
+            uint64_t v = (lo & 0xff) |
+                        (((lo >> 32) & 0xff) << 8) |
+                        ((hi & 0xff) << 16) |
+                        (((hi >> 32) & 0xff) << 24) |
+                        (ctx->q << 32);
+
+            gs_write_internal(ctx, GS_RGBAQ, v);
+        } break;
+        case 0x02: {
+            ctx->q = hi & 0xffffffff;
+
+            gs_write_internal(ctx, GS_ST, lo);
+        } break;
+        case 0x03: gs_write_internal(ctx, GS_UV, (lo & 0x3fff) | (((lo >> 32) & 0x3fff) << 16)); break;
+        case 0x04: {
+            uint64_t x = lo & 0xffff;
+            uint64_t y = (lo >> 32) & 0xffff;
+            uint64_t z = (hi >> 4) & 0xffffff;
+            uint64_t f = (hi >> 36) & 0xff;
+            int adc = (hi >> 47) & 1;
+
+            gs_write_internal(ctx, adc ? GS_XYZF3 : GS_XYZF2, x | (y << 16) | (z << 32) | (f << 56));
+        } break;
+        case 0x05: {
+            uint64_t x = lo & 0xffff;
+            uint64_t y = (lo >> 32) & 0xffff;
+            uint64_t z = hi & 0xffffffff;
+            int adc = (hi >> 47) & 1;
+
+            gs_write_internal(ctx, adc ? GS_XYZ3 : GS_XYZ2, x | (y << 16) | (z << 32));
+        } break;
+        case 0x06: gs_write_internal(ctx, GS_TEX0_1, lo); break;
+        case 0x07: gs_write_internal(ctx, GS_TEX0_2, lo); break;
+        case 0x08: gs_write_internal(ctx, GS_CLAMP_1, lo); break;
+        case 0x09: gs_write_internal(ctx, GS_CLAMP_2, lo); break;
+        case 0x0a: gs_write_internal(ctx, GS_FOG, ((hi >> 36) & 0xff) << 56); break;
+        case 0x0c: gs_write_internal(ctx, GS_XYZF3, lo); break;
+        case 0x0d: gs_write_internal(ctx, GS_XYZ3, lo); break;
+
+        // A+D
+        case 0x0e: gs_write_internal(ctx, hi & 0xff, lo); break;
+
+        // NOP
+        case 0x0f: break;
     }
 }
 
-void transfer_read(struct ps2_gs* gs, void* udata) {
-    gs->hwreg = 0;
+static inline void software_gif_write_reglist(software_thread_state* ctx, int r, uint64_t data) {
+    static const int regs[] = {
+        GS_PRIM, GS_RGBAQ, GS_ST, GS_UV,
+        GS_XYZF2, GS_XYZ2, GS_TEX0_1, GS_TEX0_2,
+        GS_CLAMP_1, GS_CLAMP_2, GS_FOG, -1,
+        GS_XYZF3, GS_XYZ3, -1, -1
+    };
+
+    if (regs[r] != -1)
+        gs_write_internal(ctx, regs[r], data);
 }
 
-extern "C" void software_thread_render_point(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+static inline void software_gif_handle_qword(software_thread_state* ctx, software_gif_path* p, const uint8_t* data) {
+    uint64_t lo, hi;
 
-    ctx->stats.points++;
-    ctx->stats.primitives++;
+    memcpy(&lo, data, 8);
+    memcpy(&hi, data + 8, 8);
 
-    ctx->queue_mtx.lock();
-    ctx->render_queue.push(render_data());
+    if (!p->active) {
+        uint32_t nloop = lo & 0x7fff;
 
-    render_data& rdata = ctx->render_queue.back();
+        p->fmt = (lo >> 58) & 3;
+        p->nregs = (lo >> 60) & 0xf;
+        p->reg = hi;
+        p->index = 0;
 
-    rdata.gs = *gs;
-    rdata.prim = 0;
-    ctx->queue_mtx.unlock();
-}
+        if (p->nregs == 0)
+            p->nregs = 16;
 
-extern "C" void software_thread_render_line(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+        // PRE
+        if ((lo >> 46) & 1)
+            gs_write_internal(ctx, GS_PRIM, (lo >> 47) & 0x7ff);
 
-    ctx->stats.lines++;
-    ctx->stats.primitives++;
+        // 1.0f
+        ctx->q = 0x3f800000;
 
-    ctx->queue_mtx.lock();
-    ctx->render_queue.push(render_data());
+        switch (p->fmt) {
+            case 0: {
+                p->remaining = p->nregs * nloop;
+                p->qwc = p->remaining;
+            } break;
+            case 1: {
+                p->remaining = p->nregs * nloop;
+                p->qwc = (p->remaining + 1) / 2;
+            } break;
+            default: {
+                p->remaining = nloop;
+                p->qwc = nloop;
+            } break;
+        }
 
-    render_data& rdata = ctx->render_queue.back();
+        p->active = p->qwc != 0;
 
-    rdata.gs = *gs;
-    rdata.prim = 1;
-    ctx->queue_mtx.unlock();
-}
+        return;
+    }
 
-extern "C" void software_thread_render_triangle(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+    switch (p->fmt) {
+        case 0: {
+            int r = (p->reg >> ((p->index++ % p->nregs) * 4)) & 0xf;
 
-    ctx->stats.triangles++;
-    ctx->stats.primitives++;
+            software_gif_write_packed(ctx, r, lo, hi);
+        } break;
 
-    ctx->queue_mtx.lock();
-    ctx->render_queue.push(render_data());
+        case 1: {
+            for (int i = 0; i < 2; i++) {
+                // Odd NREGS*NLOOP, the last doubleword is padding
+                if (p->index == p->remaining)
+                    break;
+
+                int r = (p->reg >> ((p->index++ % p->nregs) * 4)) & 0xf;
+
+                software_gif_write_reglist(ctx, r, i ? hi : lo);
+            }
+        } break;
 
-    render_data& rdata = ctx->render_queue.back();
+        default: {
+            gs_write_internal(ctx, GS_HWREG, lo);
+            gs_write_internal(ctx, GS_HWREG, hi);
+        } break;
+    }
 
-    rdata.gs = *gs;
-    rdata.prim = 2;
-    ctx->queue_mtx.unlock();
+    if (!--p->qwc)
+        p->active = 0;
 }
 
-extern "C" void software_thread_render_sprite(struct ps2_gs* gs, void* udata) {
+extern "C" void software_thread_transfer(void* udata, int path, const void* data, size_t size) {
     software_thread_state* ctx = (software_thread_state*)udata;
+    software_gif_path* p = &ctx->path[(path < 0 || path > 2) ? 2 : path];
 
-    ctx->stats.sprites++;
-    ctx->stats.primitives++;
+    const uint8_t* ptr = (const uint8_t*)data;
 
-    ctx->queue_mtx.lock();
-    ctx->render_queue.push(render_data());
+    // Finish off a qword split across transfers
+    if (p->buf_size) {
+        size_t n = std::min(size, (size_t)(16 - p->buf_size));
 
-    render_data& rdata = ctx->render_queue.back();
+        memcpy(p->buf + p->buf_size, ptr, n);
 
-    rdata.gs = *gs;
-    rdata.prim = 3;
-    ctx->queue_mtx.unlock();
-}
+        p->buf_size += n;
+        ptr += n;
+        size -= n;
 
-extern "C" void software_thread_transfer_start(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+        if (p->buf_size < 16)
+            return;
 
-    // Block until queue is empty
-    while (true) {
-        ctx->queue_mtx.lock();
+        software_gif_handle_qword(ctx, p, p->buf);
 
-        if (ctx->render_queue.empty()) {
-            ctx->queue_mtx.unlock();
+        p->buf_size = 0;
+    }
 
-            break;
-        }
+    while (size >= 16) {
+        software_gif_handle_qword(ctx, p, ptr);
 
-        ctx->queue_mtx.unlock();
+        ptr += 16;
+        size -= 16;
     }
 
-    transfer_start(gs, ctx);
-}
+    if (size) {
+        memcpy(p->buf, ptr, size);
 
-extern "C" void software_thread_transfer_write(struct ps2_gs* gs, void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+        p->buf_size = size;
+    }
+}
 
-    transfer_write(gs, ctx);
+void* software_thread_create() {
+    return new software_thread_state();
 }
 
-extern "C" void software_thread_transfer_read(struct ps2_gs* gs, void* udata) {
+bool software_thread_init(void* udata, const renderer_create_info& info) {
     software_thread_state* ctx = (software_thread_state*)udata;
 
-    // Block until queue is empty
-    while (true) {
-        ctx->queue_mtx.lock();
+    ctx->gs = info.gs;
+    ctx->gs->ctx = &ctx->gs->context[0];
 
-        if (ctx->render_queue.empty()) {
-            ctx->queue_mtx.unlock();
+    // Leave a core for the EE thread
+    int threads = (int)std::thread::hardware_concurrency() - 1;
 
-            break;
-        }
+    ctx->threads = std::clamp(threads, 1, SOFTWARE_MAX_THREADS);
+    ctx->batch.reserve(SOFTWARE_BATCH_SIZE);
 
-        ctx->queue_mtx.unlock();
-    }
+#ifdef _EE_USE_INTRINSICS
+    ctx->simd = software_cpu_has_avx2() ? 2 : 1;
+#endif
 
-    // ctx->render_mtx.lock();
+    software_thread_start_workers(ctx);
 
-    transfer_read(gs, ctx);
+    ctx->ring.resize(SOFTWARE_RING_SIZE);
+    ctx->hiz = std::make_unique <software_hiz>();
+    ctx->frame_start = software_thread_now();
 
-    // ctx->render_mtx.unlock();
+    ctx->end_signal = false;
+    ctx->render_thr = std::thread(software_thread_render_thread, ctx);
+
+    return true;
 }
 
-void gs_blit_dispfb_deinterlace_frame(software_thread_state* ctx, int dfb) {
-    // Get current field
-    int odd = ((ctx->gs->csr >> 13) & 1) == 0;
+void software_thread_set_threads(void* udata, int threads) {
+    software_thread_state* ctx = (software_thread_state*)udata;
 
-    switch (ctx->disp_fmt) {
-        case GS_PSMCT32:
-        case GS_PSMCT24: {
-            for (int y = 0; y < ctx->tex_h / 2; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint32_t* dst = ctx->buf + x + (((y * 2) + odd) * ctx->tex_w);
+    software_thread_wait_idle(ctx);
 
-                    *dst = gs_read_dispfb(ctx->gs, x, y, dfb);
-                }
-            }
-        } break;
-        case GS_PSMCT16:
-        case GS_PSMCT16S: {
-            for (int y = 0; y < ctx->tex_h / 2; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint16_t* dst = ((uint16_t*)ctx->buf) + x + (((y * 2) + odd) * ctx->tex_w);
+    std::lock_guard <std::mutex> lk(ctx->render_mtx);
 
-                    *dst = gs_read_dispfb(ctx->gs, x, y, dfb);
-                }
-            }
-        } break;
-    }
+    software_thread_stop_workers(ctx);
+
+    ctx->threads = std::clamp(threads, 1, SOFTWARE_MAX_THREADS);
+
+    software_thread_start_workers(ctx);
 }
 
-void gs_blit_dispfb_deinterlace_field(software_thread_state* ctx, int dfb) {
-    // Get current field
-    int odd = ((ctx->gs->csr >> 13) & 1) == 0;
+void software_thread_reset(void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
 
-    switch (ctx->disp_fmt) {
-        case GS_PSMCT32:
-        case GS_PSMCT24: {
-            for (int y = 0; y < ctx->tex_h / 2; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint32_t* dst = ctx->buf + x + (((y * 2) + odd) * ctx->tex_w);
+    software_thread_wait_idle(ctx);
 
-                    *dst = gs_read_dispfb(ctx->gs, x, (y * 2) + odd, dfb);
-                }
-            }
-        } break;
-        case GS_PSMCT16:
-        case GS_PSMCT16S: {
-            for (int y = 0; y < ctx->tex_h / 2; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint16_t* dst = ((uint16_t*)ctx->buf) + x + (((y * 2) + odd) * ctx->tex_w);
+    for (int i = 0; i < 3; i++)
+        ctx->path[i] = {};
 
-                    *dst = gs_read_dispfb(ctx->gs, x, (y * 2) + odd, dfb);
-                }
-            }
-        } break;
-    }
-}
+    ctx->transfer_size = 0;
+    ctx->transfer_buffer.clear();
+    ctx->q = 0x3f800000;
+    ctx->gs->vqi = 0;
 
-void gs_blit_dispfb_no_deinterlace(software_thread_state* ctx, int dfb) {
-    switch (ctx->disp_fmt) {
-        case GS_PSMCT32:
-        case GS_PSMCT24: {
-            for (int y = 0; y < ctx->tex_h; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint32_t* dst = ctx->buf + x + (y * ctx->tex_w);
+    // VRAM is cleared on reset
+    std::lock_guard <std::mutex> lk(ctx->render_mtx);
 
-                    *dst = gs_read_dispfb(ctx->gs, x, y, dfb);
-                }
-            }
-        } break;
-        case GS_PSMCT16:
-        case GS_PSMCT16S: {
-            for (int y = 0; y < ctx->tex_h; y++) {
-                for (int x = 0; x < ctx->tex_w; x++) {
-                    uint16_t* dst = ((uint16_t*)ctx->buf) + x + (y * ctx->tex_w);
+    software_texture_clear(ctx);
 
-                    *dst = gs_read_dispfb(ctx->gs, x, y, dfb);
-                }
-            }
-        } break;
-    }
+    memset(ctx->hiz.get(), 0, sizeof(software_hiz));
 }
 
-// This starts a copy pass and transfers our vertex/index buffers and our
-// display frame
-void software_thread_begin_render(void* udata, SDL_GPUCommandBuffer* command_buffer) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+void software_thread_set_config(void* udata, void* config) {
+    // Nothing
+}
 
-    // Block until queue is empty
-    while (true) {
-        ctx->queue_mtx.lock();
+renderer_image software_thread_get_frame(void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
 
-        if (ctx->render_queue.empty()) {
-            ctx->queue_mtx.unlock();
+    int w, h, bpp;
 
-            break;
-        }
+    software_thread_get_buffer_data(ctx, &w, &h, &bpp);
 
-        ctx->queue_mtx.unlock();
-    }
+    // Throughput of the render thread, per second of actual work
+    uint64_t render_ns = ctx->render_ns.exchange(0);
+    uint64_t pixels = ctx->pixels;
 
-    int en1 = ctx->gs->pmode & 1;
-    int en2 = (ctx->gs->pmode >> 1) & 1;
+    ctx->stats.frames_rendered++;
+    ctx->stats.pixels = pixels - ctx->last_frame_stats.pixels_total;
+    ctx->stats.pixels_total = pixels;
 
-    uint32_t dfbp = 0;
-    int dfb = 0;
+    ctx->render_mtx.lock();
 
-    if (en1) {
-        dfb = 0;
-        dfbp = ctx->gs->dispfb1;
-    } else if (en2) {
-        dfb = 1;
-        dfbp = ctx->gs->dispfb2;
-    }
+    ctx->stats.threads = ctx->threads;
+    ctx->stats.tile_batches = ctx->tile_batches;
+    ctx->stats.tile_barriers = ctx->tile_barriers;
+    ctx->stats.serial_primitives = ctx->serial_primitives;
+    ctx->stats.sprite_fills = ctx->sprite_fills;
+    ctx->stats.sprite_copies = ctx->sprite_copies;
+    ctx->stats.hiz_culled = ctx->hiz_culled.exchange(0);
+    ctx->stats.hiz_cull_rate = ctx->stats.hiz_culled ? (float)ctx->stats.hiz_culled / (ctx->stats.hiz_culled + ctx->stats.pixels) : 0.0f;
+    ctx->stats.texture_hits = ctx->texture_hits;
+    ctx->stats.texture_misses = ctx->texture_misses;
+    ctx->stats.texture_invalidations = ctx->texture_invalidations;
+    ctx->stats.texture_bytes_decoded = ctx->texture_decoded.exchange(0);
+    ctx->stats.render_wakeups = ctx->wakeups.exchange(0);
+    ctx->tile_batches = 0;
+    ctx->tile_barriers = 0;
+    ctx->serial_primitives = 0;
+    ctx->sprite_fills = 0;
+    ctx->sprite_copies = 0;
+    ctx->texture_hits = 0;
+    ctx->texture_misses = 0;
+    ctx->texture_invalidations = 0;
 
-    if (!ctx->tex_w) {
-        return;
-    }
+    ctx->render_mtx.unlock();
 
-    // printf("dfbp2=%08x dfbp1=%08x dfbpsm2=%02x dfbpsm1=%02x dfb=%d fbp=%x\n", ctx->gs->dfbp2, ctx->gs->dfbp1, ctx->gs->dfbpsm2, ctx->gs->dfbpsm1, dfb, ctx->gs->ctx->fbp >> 6);
+    // Share of the frame the render thread spent awake rather than
+    // blocked waiting for commands. If it's awake right now, the time
+    // so far goes to this frame and the rest to the next one
+    uint64_t now = software_thread_now();
+    uint64_t awake = 0;
+    uint64_t since = ctx->awake_start;
 
-    if (ctx->gs->smode2 & 1) {
-        // Need to deinterlace
-        if (ctx->gs->smode2 & 2) {
-            gs_blit_dispfb_deinterlace_frame(ctx, dfb);
-        } else {
-            gs_blit_dispfb_no_deinterlace(ctx, dfb);
-        }
-    } else {
-        gs_blit_dispfb_no_deinterlace(ctx, dfb);
-    }
+    while (since && !ctx->awake_start.compare_exchange_weak(since, now));
 
-    uint32_t* ptr = ctx->buf;
+    if (since)
+        awake = now - since;
 
-    SDL_Rect size, rect;
+    awake += ctx->awake_ns.exchange(0);
 
-    rect.w = ctx->tex_w;
-    rect.h = ctx->tex_h;
+    ctx->stats.render_thread_usage = (now > ctx->frame_start) ? (float)awake / (now - ctx->frame_start) : 0.0f;
+    ctx->frame_start = now;
 
-    SDL_GetWindowSize(ctx->window, &size.w, &size.h);
+    ctx->stats.frame_readout_ms = ctx->readout_ns / 1000000.0f;
+    ctx->readout_ns = 0;
 
-    float scale = ctx->integer_scaling ? floorf(ctx->scale) : ctx->scale;
+    if (render_ns) {
+        ctx->stats.primitives_per_second = (ctx->stats.primitives * 1000000000.0) / render_ns;
+        ctx->stats.pixels_per_second = (ctx->stats.pixels * 1000000000.0) / render_ns;
+        ctx->stats.sprite_fills_per_second = (ctx->stats.sprite_fills * 1000000000.0) / render_ns;
+        ctx->stats.sprite_copies_per_second = (ctx->stats.sprite_copies * 1000000000.0) / render_ns;
+    }
 
-    switch (ctx->aspect_mode) {
-        case RENDERER_ASPECT_NATIVE: {
-            rect.w *= scale;
-            rect.h *= scale;
-        } break;
+    ctx->last_frame_stats = ctx->stats;
+    ctx->stats.lines = 0;
+    ctx->stats.points = 0;
+    ctx->stats.triangles = 0;
+    ctx->stats.sprites = 0;
+    ctx->stats.primitives = 0;
+    ctx->stats.texture_uploads = 0;
+    ctx->stats.texture_blits = 0;
+    ctx->stats.pixels = 0;
+    ctx->stats.command_bytes = 0;
 
-        case RENDERER_ASPECT_4_3: {
-            rect.w *= scale;
-            rect.h = (float)rect.w * (3.0f / 4.0f);
-        } break;
+    // The frame only lives in system memory, see get_buffer_data
+    renderer_image image = {};
 
-        case RENDERER_ASPECT_16_9: {
-            rect.w *= scale;
-            rect.h = (float)rect.w * (9.0f / 16.0f);
-        } break;
+    image.image = VK_NULL_HANDLE;
+    image.view = VK_NULL_HANDLE;
 
-        case RENDERER_ASPECT_5_4: {
-            rect.w *= scale;
-            rect.h = (float)rect.w * (4.0f / 5.0f);
-        } break;
+    return image;
+}
 
-        case RENDERER_ASPECT_STRETCH: {
-            rect.w = size.w;
-            rect.h = size.h;
-        } break;
+renderer_stats* software_thread_get_debug_stats(void* udata) {
+    software_thread_state* ctx = (software_thread_state*)udata;
 
-        case RENDERER_ASPECT_AUTO:
-        case RENDERER_ASPECT_STRETCH_KEEP: {
-            rect.h = size.h;
-            rect.w = (float)rect.h * (4.0f / 3.0f);
-        } break;
-    }
+    return &ctx->last_frame_stats;
+}
 
-    ctx->disp_w = rect.w;
-    ctx->disp_h = rect.h;
+// Prints the pixel and texel pipelines that drew the most primitives
+// since the backend was created, along with how many variants were used
+void software_thread_print_pipeline_stats(void* udata, FILE* file) {
+    software_thread_state* ctx = (software_thread_state*)udata;
 
-    rect.x = (size.w / 2) - (rect.w / 2);
-    rect.y = (size.h / 2) - (rect.h / 2);
+    static const char* fb_names[] = { "CT32", "CT24", "CT16", "CT16S", "other" };
+    static const char* zb_names[] = { "off", "Z32", "Z24", "Z16", "Z16S", "other" };
+    static const char* ztst_names[] = { "never", "always", "gequal", "greater" };
+    static const char* psm_names[] = { "CT32", "CT24", "CT16", "CT16S", "T8", "T4", "other" };
+    static const char* tfx_names[] = { "modulate", "decal", "highlight", "highlight2" };
 
-    float x0 = (rect.x / ((float)size.w / 2.0f)) - 1.0f;
-    float y0 = (rect.y / ((float)size.h / 2.0f)) - 1.0f;
-    float x1 = ((rect.x + rect.w) / ((float)size.w / 2.0f)) - 1.0f;
-    float y1 = ((rect.y + rect.h) / ((float)size.h / 2.0f)) - 1.0f;
+    auto top = [](const uint64_t* counts, int n, std::vector <int>& keys) {
+        for (int i = 0; i < n; i++)
+            if (counts[i])
+                keys.push_back(i);
 
-    // Create a transfer buffer to upload our vertex buffer and index buffer
-    SDL_GPUTransferBufferCreateInfo btbci = {
-        .usage = SDL_GPU_TRANSFERBUFFERUSAGE_UPLOAD,
-        .size = sizeof(gpu_vertex) * 4 + sizeof(Uint16) * 6,
+        std::sort(keys.begin(), keys.end(), [counts](int a, int b) {
+            return counts[a] > counts[b];
+        });
     };
 
-    SDL_GPUTransferBuffer* buffer_tb = SDL_CreateGPUTransferBuffer(ctx->device, &btbci);
+    std::vector <int> pixel, texel;
 
-    // fill the transfer buffer
-    gpu_vertex* vertices = (gpu_vertex*)SDL_MapGPUTransferBuffer(ctx->device, buffer_tb, false);
+    top(ctx->pixel_stats, SOFTWARE_PIXEL_VARIANTS, pixel);
+    top(ctx->texel_stats, SOFTWARE_TEXEL_VARIANTS, texel);
 
-    vertices[0] = { x0, y1, 0.0, 1.0 }; // Top left
-    vertices[1] = { x1, y1, 1.0, 1.0 }; // Top right
-    vertices[2] = { x1, y0, 1.0, 0.0 }; // Bottom right
-    vertices[3] = { x0, y0, 0.0, 0.0 }; // Bottom left
+    fprintf(file, "Pixel pipelines (%zu of %d used):\n", pixel.size(), SOFTWARE_PIXEL_VARIANTS);
 
-    Uint16* indices = (Uint16*)&vertices[4];
+    for (size_t i = 0; i < std::min(pixel.size(), (size_t)10); i++) {
+        int k = pixel[i];
 
-    indices[0] = 0;
-    indices[1] = 1;
-    indices[2] = 2;
-    indices[3] = 0;
-    indices[4] = 2;
-    indices[5] = 3;
+        fprintf(file, "  %12llu  fb=%s z=%s ztst=%s%s%s%s\n",
+            (unsigned long long)ctx->pixel_stats[k],
+            fb_names[std::min(k >> 8, 4)],
+            zb_names[std::min((k >> 4) & 7, 5)],
+            ztst_names[(k >> 2) & 3],
+            (k & 2) ? " ate" : "",
+            (k & 1) ? " abe" : "",
+            (k & 0x80) ? " dthe" : ""
+        );
+    }
 
-    SDL_UnmapGPUTransferBuffer(ctx->device, buffer_tb);
+    fprintf(file, "Texel pipelines (%zu of %d used):\n", texel.size(), SOFTWARE_TEXEL_VARIANTS);
 
-    // start a copy pass
-    SDL_GPUCopyPass* cp = SDL_BeginGPUCopyPass(command_buffer);
+    for (size_t i = 0; i < std::min(texel.size(), (size_t)10); i++) {
+        int k = texel[i];
 
-    // Upload vertex buffer (at offset 0)
-    SDL_GPUTransferBufferLocation tbl = {
-        .transfer_buffer = buffer_tb,
-        .offset = 0,
-    };
+        fprintf(file, "  %12llu  psm=%s tfx=%s tcc=%s mmag=%s%s\n",
+            (unsigned long long)ctx->texel_stats[k],
+            psm_names[std::min((k >> 4) & 7, 6)],
+            tfx_names[(k >> 2) & 3],
+            (k & 2) ? "rgba" : "rgb",
+            (k & 1) ? "linear" : "nearest",
+            (k & 0x80) ? " cached" : ""
+        );
+    }
+}
 
-    SDL_GPUBufferRegion br = {
-        .buffer = ctx->vertex_buffer,
-        .offset = 0,
-        .size = sizeof(gpu_vertex) * 4,
+#ifdef IRIS_BENCH
+// Swizzled VRAM access microbenchmark, writes and then reads back a
+// 512x512 area through every format's addressing, first in raster
+// order and then one 32x32 tile at a time (the order primitives are
+// drawn in)
+void software_thread_bench_swizzle(void) {
+    static const struct {
+        uint32_t psm;
+        const char* name;
+    } formats[] = {
+        { GS_PSMCT32, "PSMCT32" },
+        { GS_PSMCT24, "PSMCT24" },
+        { GS_PSMCT16, "PSMCT16" },
+        { GS_PSMCT16S, "PSMCT16S" },
+        { GS_PSMZ32, "PSMZ32" },
+        { GS_PSMZ24, "PSMZ24" },
+        { GS_PSMZ16, "PSMZ16" },
+        { GS_PSMZ16S, "PSMZ16S" },
+        { GS_PSMT8, "PSMT8" },
+        { GS_PSMT8H, "PSMT8H" },
+        { GS_PSMT4, "PSMT4" },
+        { GS_PSMT4HL, "PSMT4HL" },
+        { GS_PSMT4HH, "PSMT4HH" }
     };
 
-    SDL_UploadToGPUBuffer(cp, &tbl, &br, false);
+    const int size = 512;
+    const int passes = 16;
 
-    tbl = {
-        .transfer_buffer = buffer_tb,
-        .offset = sizeof(gpu_vertex) * 4,
-    };
+    struct ps2_gs* gs = (struct ps2_gs*)calloc(1, sizeof(struct ps2_gs));
 
-    br = {
-        .buffer = ctx->index_buffer,
-        .offset = 0,
-        .size = sizeof(Uint16) * 6,
-    };
+    gs->vram = (uint32_t*)calloc(1, 4 * 1024 * 1024);
 
-    // Upload index buffer (right after our vertex data)
-    SDL_UploadToGPUBuffer(cp, &tbl, &br, false);
+    uint32_t sum = 0;
 
-    int stride = 4;
+    printf("%-10s %10s %10s %10s %10s\n", "Format", "Write", "Read", "Write (T)", "Read (T)");
 
-    switch (ctx->disp_fmt) {
-        case GS_PSMCT32:
-        case GS_PSMCT24: {
-            stride = 4;
-        } break;
+    for (const auto& f : formats) {
+        double mps[4];
 
-        case GS_PSMCT16:
-        case GS_PSMCT16S: {
-            stride = 2;
-        } break;
+        for (int tiled = 0; tiled < 2; tiled++) {
+            int step = tiled ? SOFTWARE_TILE_SIZE : size;
 
-        // Ignore unknown formats
-        // default: {
-        //     printf("Unsupported display format %d\n", ctx->disp_fmt);
-            
-        //     exit(1);
-        // } break;
+            for (int read = 0; read < 2; read++) {
+                auto start = std::chrono::high_resolution_clock::now();
+
+                for (int p = 0; p < passes; p++) {
+                    for (int ty = 0; ty < size; ty += step) {
+                        for (int tx = 0; tx < size; tx += step) {
+                            for (int y = ty; y < ty + step; y++) {
+                                for (int x = tx; x < tx + step; x++) {
+                                    if (read) {
+                                        sum += gs_generic_read(gs, 0, size >> 6, f.psm, x, y);
+                                    } else {
+                                        gs_generic_write(gs, 0, size >> 6, f.psm, x, y, x ^ y ^ p);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+
+                auto end = std::chrono::high_resolution_clock::now();
+
+                double s = std::chrono::duration <double> (end - start).count();
+
+                mps[(tiled * 2) + read] = (passes * size * size) / (s * 1000000.0);
+            }
+        }
+
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f\n", f.name, mps[0], mps[1], mps[2], mps[3]);
     }
 
-    SDL_GPUTransferBufferCreateInfo ttbci = {
-        .usage = SDL_GPU_TRANSFERBUFFERUSAGE_UPLOAD,
-        .size = static_cast<Uint32>(ctx->tex_w) * static_cast<Uint32>(ctx->tex_h) * stride
+    printf("Millions of pixels per second (checksum %08x)\n", sum);
+
+    free(gs->vram);
+    free(gs);
+}
+
+// Host to local transfer benchmark, uploads a 512x512 image through
+// HWREG in every format, once lined up with the blocks and once a few
+// pixels off so the edges and the first rows are written a pixel at
+// a time
+void software_thread_bench_transfer(void) {
+    static const struct {
+        uint32_t psm;
+        int bpp;
+        const char* name;
+    } formats[] = {
+        { GS_PSMCT32, 32, "PSMCT32" },
+        { GS_PSMCT24, 24, "PSMCT24" },
+        { GS_PSMCT16, 16, "PSMCT16" },
+        { GS_PSMCT16S, 16, "PSMCT16S" },
+        { GS_PSMT8, 8, "PSMT8" },
+        { GS_PSMT8H, 8, "PSMT8H" },
+        { GS_PSMT4, 4, "PSMT4" },
+        { GS_PSMT4HL, 4, "PSMT4HL" },
+        { GS_PSMT4HH, 4, "PSMT4HH" }
     };
 
-    SDL_GPUTransferBuffer* texture_tb = SDL_CreateGPUTransferBuffer(ctx->device, &ttbci);
+    const int size = 512;
+    const int passes = 16;
 
-    // fill the transfer buffer
-    void* data = SDL_MapGPUTransferBuffer(ctx->device, texture_tb, false);
+    struct ps2_gs* gs = (struct ps2_gs*)calloc(1, sizeof(struct ps2_gs));
 
-    SDL_memcpy(data, ptr, (ctx->tex_w * stride) * ctx->tex_h);
+    gs->vram = (uint32_t*)calloc(1, 4 * 1024 * 1024);
 
-    SDL_UnmapGPUTransferBuffer(ctx->device, texture_tb);
+    renderer_create_info info = {};
 
-    SDL_GPUTextureTransferInfo tti = {
-        .transfer_buffer = texture_tb,
-        .offset = 0,
-    };
+    info.gs = gs;
 
-    SDL_GPUTextureRegion tr = {
-        .texture = ctx->texture,
-        .w = static_cast<Uint32>(ctx->tex_w),
-        .h = static_cast<Uint32>(ctx->tex_h),
-        .d = 1,
-    };
+    void* ctx = software_thread_create();
 
-    SDL_UploadToGPUTexture(cp, &tti, &tr, false);
+    software_thread_init(ctx, info);
 
-    // end the copy pass
-    SDL_EndGPUCopyPass(cp);
+    std::vector <uint64_t> data(((size_t)size * size * 4) / 8);
 
-    SDL_ReleaseGPUTransferBuffer(ctx->device, buffer_tb);
-    SDL_ReleaseGPUTransferBuffer(ctx->device, texture_tb);
-}
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (i * 0x9e3779b97f4a7c15ull) ^ (i >> 7);
 
-void software_thread_render(void* udata, SDL_GPUCommandBuffer* command_buffer, SDL_GPURenderPass* render_pass) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+    printf("%-10s %10s %10s\n", "Format", "Aligned", "Unaligned");
 
-    if (!ctx->texture)
-        return;
+    for (const auto& f : formats) {
+        double mbs[2];
 
-    ctx->stats.frames_rendered++;
-    ctx->last_frame_stats = ctx->stats;
-    ctx->stats.lines = 0;
-    ctx->stats.points = 0;
-    ctx->stats.triangles = 0;
-    ctx->stats.sprites = 0;
-    ctx->stats.primitives = 0;
-    ctx->stats.texture_uploads = 0;
-    ctx->stats.texture_blits = 0;
+        for (int offset = 0; offset < 2; offset++) {
+            int x = offset ? 2 : 0;
+            int y = offset ? 5 : 0;
+            int w = offset ? (size - 6) : size;
+            int h = offset ? (size - 10) : size;
 
-    SDL_BindGPUGraphicsPipeline(render_pass, ctx->pipeline);
+            // What transfer_start expects (CT24 sends a doubleword less)
+            size_t words = ((size_t)w * h * f.bpp) / 64;
 
-    // bind the vertex buffer
-    SDL_GPUBufferBinding bb[1]{};
-    bb[0].buffer = ctx->vertex_buffer;
-    bb[0].offset = 0;
+            if (f.psm == GS_PSMCT24)
+                words = (((size_t)w * h) / 3) + 1;
 
-    SDL_BindGPUVertexBuffers(render_pass, 0, bb, 1);
+            auto start = std::chrono::high_resolution_clock::now();
 
-    bb[0].buffer = ctx->index_buffer;
-    bb[0].offset = 0;
+            for (int p = 0; p < passes; p++) {
+                gs->bitbltbuf = ((uint64_t)(size >> 6) << 48) | ((uint64_t)f.psm << 56);
+                gs->trxpos = ((uint64_t)x << 32) | ((uint64_t)y << 48);
+                gs->trxreg = (uint64_t)w | ((uint64_t)h << 32);
+                gs->trxdir = 0;
 
-    SDL_BindGPUIndexBuffer(render_pass, bb, SDL_GPU_INDEXELEMENTSIZE_16BIT);
+                software_thread_transfer_start(gs, ctx);
 
-    SDL_GPUTextureSamplerBinding tsb = {
-        .texture = ctx->texture,
-        .sampler = ctx->bilinear ? ctx->sampler[1] : ctx->sampler[0],
-    };
+                for (size_t i = 0; i < words; i++) {
+                    gs->hwreg = data[i];
 
-    SDL_BindGPUFragmentSamplers(render_pass, 0, &tsb, 1);
+                    software_thread_transfer_write(gs, ctx);
+                }
+            }
 
-    // issue a draw call
-    SDL_DrawGPUIndexedPrimitives(render_pass, 6, 1, 0, 0, 0);
-}
+            auto end = std::chrono::high_resolution_clock::now();
 
-void software_thread_end_render(void* udata, SDL_GPUCommandBuffer* command_buffer) {
-    // Nothing for now
-}
+            double s = std::chrono::duration <double> (end - start).count();
 
-renderer_stats* software_thread_get_debug_stats(void* udata) {
-    software_thread_state* ctx = (software_thread_state*)udata;
+            mbs[offset] = (passes * words * 8) / (s * 1000000.0);
+        }
 
-    return &ctx->last_frame_stats;
-}
\ No newline at end of file
+        printf("%-10s %10.1f %10.1f\n", f.name, mbs[0], mbs[1]);
+    }
+
+    printf("Megabytes per second\n");
+
+    software_thread_destroy(ctx);
+
+    free(gs->vram);
+    free(gs);
+}
+#endif
@@ -5,30 +5,246 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
-#include <queue>
 #include <mutex>
-
-#include <SDL3/SDL.h>
+#include <condition_variable>
+#include <unordered_map>
+#include <memory>
 
 #include "gs/gs.h"
 
 #include "renderer.hpp"
 
+struct software_texture;
+struct software_hiz;
+
+// Per-primitive pixel (test, blend and write) and texel (read, convert
+// and texture function) pipelines, specialised on the GS state
+typedef void (*software_pixel_func)(struct ps2_gs*, int, int, uint32_t, uint32_t);
+typedef uint32_t (*software_texel_func)(struct ps2_gs*, software_texture*, int, int, uint32_t);
+
+#define SOFTWARE_PIXEL_VARIANTS 2048
+#define SOFTWARE_TEXEL_VARIANTS 256
+
+// A run of pixels from one row, shaded together by the SIMD back end
+#define SOFTWARE_SPAN_SIZE 8
+
+struct software_span {
+    int y, n;
+
+    // Every pixel is known to pass the depth test (hierarchical Z)
+    bool pass;
+
+    int x[SOFTWARE_SPAN_SIZE];
+    uint32_t z[SOFTWARE_SPAN_SIZE];
+    uint32_t c[SOFTWARE_SPAN_SIZE];
+};
+
+typedef void (*software_span_func)(struct ps2_gs*, const software_span*);
+
+// Sprites that only fill or copy a rectangle skip the pixel pipeline
+#define SOFTWARE_SPRITE_GENERIC 0
+#define SOFTWARE_SPRITE_FILL 1
+#define SOFTWARE_SPRITE_COPY 2
+
+// span is only set when the SIMD back end covers the primitive's
+// state, everything else goes through pixel one at a time
+struct software_pipeline {
+    software_pixel_func pixel;
+    software_texel_func texel;
+    software_span_func span;
+    int sprite;
+
+    // Decoded copy of the texture, if the texel pipeline reads one
+    software_texture* tex;
+
+    // Coarse depth buffer the primitive tests against and keeps up
+    // to date (null if it doesn't), the generation it was dispatched
+    // at, and the pixel pipeline for blocks known to pass the depth
+    // test (same state with ZTST set to ALWAYS)
+    software_hiz* hiz;
+    uint64_t hiz_gen;
+    software_pixel_func pass;
+};
+
+// 0: Point, 1: Line, 2: Triangle, 3: Sprite, 4: Flush (barrier)
 struct render_data {
     int prim;
+    software_pipeline pipe;
     struct ps2_gs gs;
 };
 
-struct gpu_vertex {
-    float x, y, u, v;
+// Primitives are binned into 32x32 pixel tiles, workers then
+// rasterize disjoint tiles in parallel, primitives within a tile
+// are always drawn in submission order
+#define SOFTWARE_TILE_SHIFT 5
+#define SOFTWARE_TILE_SIZE (1 << SOFTWARE_TILE_SHIFT)
+#define SOFTWARE_TILES_X (2048 >> SOFTWARE_TILE_SHIFT)
+#define SOFTWARE_TILES (SOFTWARE_TILES_X * SOFTWARE_TILES_X)
+#define SOFTWARE_BATCH_SIZE 1024
+#define SOFTWARE_MAX_THREADS 16
+
+// Pixel rectangle a primitive is rasterized into, x1/y1 exclusive
+struct software_clip {
+    int x0, y0, x1, y1;
+};
+
+// A surface written by the binned primitives (frame or Z buffer),
+// tiles only stay independent while every write to a VRAM page
+// goes through the same address layout
+struct software_surface {
+    uint32_t base;
+    uint32_t width;
+    int layout;
+
+    // Pages written through this surface so far
+    uint64_t pages[8];
+};
+
+// Texture cache
+//
+// Textures are kept decoded to RGBA32 (CLUT and TEXA already applied)
+// in a linear array covering every texel the wrap mode can address.
+// Texels are decoded lazily, one 8x8 block at a time, the first time
+// a pipeline reads them. An entry goes stale once any of the VRAM
+// pages it was decoded from (texture and CLUT) is written to.
+#define SOFTWARE_TEXTURE_CACHE_SIZE (64 * 1024 * 1024)
+
+struct software_texture_key {
+    uint32_t tbp0, tbw, psm;
+    uint32_t width, height;
+    uint32_t cbp, cbpsm, csm, cbw, cou, cov;
+    uint32_t ta0, ta1, aem;
+
+    bool operator==(const software_texture_key& other) const = default;
+};
+
+struct software_texture_hash {
+    size_t operator()(const software_texture_key& key) const {
+        const uint32_t* w = (const uint32_t*)&key;
+
+        uint64_t h = 14695981039346656037ull;
+
+        for (size_t i = 0; i < sizeof(key) / sizeof(uint32_t); i++)
+            h = (h ^ w[i]) * 1099511628211ull;
+
+        return h;
+    }
+};
+
+struct software_texture {
+    software_texture_key key;
+
+    // Pages decoded from, and the write generation it was checked at
+    uint64_t pages[8];
+    uint64_t gen;
+
+    // Pool generation of the last batch that used it, and the
+    // lookup it was last used by
+    uint64_t batch;
+    uint64_t used;
+
+    int stride;
+    std::unique_ptr <uint32_t[]> data;
+
+    // 0: Empty, 1: Being decoded, 2: Ready
+    std::unique_ptr <std::atomic <uint8_t>[]> blocks;
+    int block_count;
+};
+
+// Hierarchical Z
+//
+// Depth range of every 64-word VRAM block, the unit a Z buffer block
+// (8x8 pixels at 32 bits, 16x8 at 16 bits) is stored in, so triangles
+// and sprites can cull or trivially accept whole blocks before any
+// per-pixel work. Ranges are kept per VRAM block rather than per
+// buffer, any ZBP and FBW addressing the same memory shares them,
+// and are tagged with the Z format they were taken in. Primitives
+// keep the blocks they write Z to up to date, anything else writing
+// to a page (frame buffers aliasing it, points and lines, transfers
+// and blits) moves the page to a new generation instead, which drops
+// every range taken there before it. Dropped or widened ranges are
+// rebuilt from VRAM the next time a primitive needs them.
+#define SOFTWARE_HIZ_BLOCKS 16384
+
+struct software_hiz_block {
+    uint32_t zmin, zmax;
+    uint64_t gen;
+
+    // 0: Unknown, 1: 32-bit, 2: 24-bit, 3: 16-bit
+    uint8_t fmt;
+
+    // Widened by writes since it was last read back from VRAM
+    uint8_t loose;
+};
+
+struct software_hiz {
+    software_hiz_block blocks[SOFTWARE_HIZ_BLOCKS];
+
+    // Generation each page was last written at outside of the depth
+    // test, and the pages that might hold ranges worth dropping
+    uint64_t page_gen[512];
+    uint64_t pages[8];
+    uint64_t gen;
+};
+
+// Command ring
+//
+// Primitives are handed to the render thread through a preallocated
+// ring of commands. A command only carries the 64-bit words of
+// struct ps2_gs that changed since the previous one (registers and
+// vertex queue alike), as runs of { uint16_t word, uint16_t count }
+// each followed by the words themselves. Commands are padded to 8
+// bytes and never wrap around the end of the ring.
+#define SOFTWARE_RING_SIZE (4 * 1024 * 1024)
+#define SOFTWARE_STATE_WORDS (sizeof(struct ps2_gs) / sizeof(uint64_t))
+
+// 0-4: render_data prim, 5: Skip to the start of the ring
+#define SOFTWARE_COMMAND_WRAP 5
+
+struct software_command {
+    uint32_t size;
+    uint16_t prim;
+    uint16_t runs;
+};
+
+// GIF packet decoding state, kept per path since a packet may be
+// handed to us in more than one piece
+struct software_gif_path {
+    int active;
+    int fmt;
+    int nregs;
+    uint64_t reg;
+    uint32_t index;
+    uint32_t remaining;
+    uint32_t qwc;
+
+    // Partial qword left over from the last transfer
+    uint8_t buf[16];
+    int buf_size;
 };
 
 struct software_thread_state {
-    std::queue <render_data> render_queue;
     std::thread render_thr;
     std::mutex queue_mtx;
     std::mutex render_mtx;
 
+    // Command ring, head is only written by the EE thread and tail
+    // by the render thread. shadow holds the GS state as of the last
+    // command sent, cmd the same state as rebuilt by the render thread
+    std::vector <uint8_t> ring;
+    std::atomic <uint64_t> ring_head = 0;
+    std::atomic <uint64_t> ring_tail = 0;
+    uint64_t shadow[SOFTWARE_STATE_WORDS] = { 0 };
+    render_data cmd = {};
+
+    // Either side blocks on queue_mtx and these when it has to wait
+    // for the other. producer_wait is the ring tail the EE thread is
+    // waiting for (0 if it isn't)
+    std::condition_variable queue_cv;
+    std::condition_variable idle_cv;
+    std::atomic <bool> render_sleeping = false;
+    std::atomic <uint64_t> producer_wait = 0;
+
     std::vector <uint64_t> transfer_buffer;
     int transfer_index = 0;
     int transfer_size = 0;
@@ -47,62 +263,105 @@ struct software_thread_state {
     uint32_t psmct24_data = 0;
     uint32_t psmct24_shift = 0;
 
-    // SDL stuff
-    SDL_Window* window = nullptr;
-    SDL_GPUDevice* device = nullptr;
-    SDL_GPUBuffer* vertex_buffer = nullptr;
-    SDL_GPUBuffer* index_buffer = nullptr;
-    SDL_GPUTexture* texture = nullptr;
-    SDL_GPUSampler* sampler[2] = { nullptr };
-    SDL_GPUGraphicsPipeline* pipeline = nullptr;
+    // GIF
+    software_gif_path path[3] = {};
 
-    // Context
-    SDL_GPUCommandBuffer* cb = nullptr;
-    SDL_GPURenderPass* rp = nullptr;
+    // From ST(Q) to RGBA(Q)
+    uint64_t q = 0x3f800000;
 
     struct ps2_gs* gs = nullptr;
 
-    unsigned int window_x = 0, window_y = 0;
-    unsigned int window_w = 0, window_h = 0;
-
     int tex_w = 0;
     int tex_h = 0;
-    int disp_w = 0;
-    int disp_h = 0;
     int disp_fmt = 0;
-    int aspect_mode = 0; // Native
-    bool integer_scaling = false;
-    float scale = 1.5;
-    bool bilinear = true;
-
-    unsigned int frame = 0;
 
     uint32_t* buf = nullptr;
 
-    renderer_stats stats = { 0 };
-    renderer_stats last_frame_stats = { 0 };
+    // Written by the render thread
+    std::atomic <uint64_t> pixels = 0;
+    std::atomic <uint64_t> render_ns = 0;
+    std::atomic <uint64_t> awake_ns = 0;
+    std::atomic <uint64_t> awake_start = 0;
+    std::atomic <uint32_t> wakeups = 0;
+    uint64_t frame_start = 0;
+    uint64_t readout_ns = 0;
+
+    renderer_stats stats = {};
+    renderer_stats last_frame_stats = {};
+
+    // 0: Scalar, 1: SSE4.1, 2: AVX2
+    int simd = 0;
+
+    // Tile binning, only touched by the render thread while it
+    // holds render_mtx
+    int threads = 1;
+    std::vector <render_data> batch;
+    std::vector <uint32_t> bins[SOFTWARE_TILES];
+    std::vector <uint32_t> active_tiles;
+    std::vector <software_surface> surfaces;
+    uint64_t pending_reads[8] = { 0 };
+    uint64_t pending_writes[8] = { 0 };
+    unsigned int tile_batches = 0;
+    unsigned int tile_barriers = 0;
+    unsigned int serial_primitives = 0;
+    unsigned int sprite_fills = 0;
+    unsigned int sprite_copies = 0;
+
+    // Coarse depth buffer, dispatch updates the page generations and
+    // the rasterizers the blocks (each one only ever from one tile)
+    std::unique_ptr <software_hiz> hiz;
+    std::atomic <uint64_t> hiz_culled = 0;
+
+    // Primitives drawn through each pipeline
+    uint64_t pixel_stats[SOFTWARE_PIXEL_VARIANTS] = { 0 };
+    uint64_t texel_stats[SOFTWARE_TEXEL_VARIANTS] = { 0 };
+
+    // Texture cache, touched under render_mtx. page_gen holds the
+    // write generation each VRAM page was last written at
+    std::unordered_map <software_texture_key, std::unique_ptr <software_texture>, software_texture_hash> textures;
+    size_t texture_bytes = 0;
+    uint64_t texture_lookups = 0;
+    uint64_t write_gen = 0;
+    uint64_t page_gen[512] = { 0 };
+    unsigned int texture_hits = 0;
+    unsigned int texture_misses = 0;
+    unsigned int texture_invalidations = 0;
+    std::atomic <uint64_t> texture_decoded = 0;
+
+    // Worker pool
+    std::vector <std::thread> workers;
+    std::mutex pool_mtx;
+    std::condition_variable pool_cv;
+    std::condition_variable done_cv;
+    uint64_t pool_gen = 0;
+    unsigned int pool_done = 0;
+    bool pool_quit = false;
+    std::atomic <uint32_t> next_tile = 0;
 };
 
-void software_thread_init(void* udata, struct ps2_gs* gs, SDL_Window* window, SDL_GPUDevice* device);
+void* software_thread_create();
+bool software_thread_init(void* udata, const renderer_create_info& info);
+void software_thread_reset(void* udata);
 void software_thread_destroy(void* udata);
+void software_thread_set_config(void* udata, void* config);
+renderer_image software_thread_get_frame(void* udata);
 void software_thread_set_size(void* udata, int width, int height);
-void software_thread_set_scale(void* udata, float scale);
-void software_thread_set_aspect_mode(void* udata, int aspect_mode);
-void software_thread_set_integer_scaling(void* udata, bool integer_scaling);
-void software_thread_set_bilinear(void* udata, bool bilinear);
 void software_thread_get_viewport_size(void* udata, int* w, int* h);
-void software_thread_get_display_size(void* udata, int* w, int* h);
 void software_thread_get_display_format(void* udata, int* fmt);
 void software_thread_get_interlace_mode(void* udata, int* mode);
-void software_thread_set_window_rect(void* udata, int x, int y, int w, int h);
 void* software_thread_get_buffer_data(void* udata, int* w, int* h, int* bpp);
 renderer_stats* software_thread_get_debug_stats(void* udata);
+void software_thread_print_pipeline_stats(void* udata, FILE* file);
 const char* software_thread_get_name(void* udata);
-void software_thread_begin_render(void* udata, SDL_GPUCommandBuffer* command_buffer);
-void software_thread_render(void* udata, SDL_GPUCommandBuffer* command_buffer, SDL_GPURenderPass* render_pass);
-void software_thread_end_render(void* udata, SDL_GPUCommandBuffer* command_buffer);
+void software_thread_set_threads(void* udata, int threads);
+
+#ifdef IRIS_BENCH
+void software_thread_bench_swizzle(void);
+void software_thread_bench_transfer(void);
+#endif
 
 extern "C" {
+void software_thread_transfer(void* udata, int path, const void* data, size_t size);
 void software_thread_render_point(struct ps2_gs* gs, void* udata);
 void software_thread_render_line(struct ps2_gs* gs, void* udata);
 void software_thread_render_triangle(struct ps2_gs* gs, void* udata);
@@ -110,4 +369,5 @@ void software_thread_render_sprite(struct ps2_gs* gs, void* udata);
 void software_thread_transfer_start(struct ps2_gs* gs, void* udata);
 void software_thread_transfer_write(struct ps2_gs* gs, void* udata);
 void software_thread_transfer_read(struct ps2_gs* gs, void* udata);
-}
\ No newline at end of file
+void software_thread_flush(void* udata);
+}
@@ -1,18 +1,32 @@
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <thread>
+#include <vector>
 #include "ipu.hpp"
 #include "ee/dmac.h"
 #include "ee/intc.h"
 
+#ifdef IRIS_BENCH
+#include <chrono>
+#include "ee/bus.h"
+#endif
+
+#ifdef _EE_USE_INTRINSICS
+#include <smmintrin.h>
+#endif
+
 #if defined(IRIS_IPU_TRACE)
 #define printf(...) std::printf(__VA_ARGS__)
 #else
 #define printf(...) ((void)0)
 #endif
 
+static void idct(int16_t* block);
+
 /**
   * The majority of this code is based upon Play!'s implementation of the IPU.
   * All the relevant files are located in the following links:
@@ -87,39 +101,32 @@ static const uint8_t default_nonintra_IQ[0x40] =
     23, 24, 25, 27, 28, 30, 31, 33,
 };
 
-ImageProcessingUnit::ImageProcessingUnit(struct ps2_intc* intc, struct ps2_dmac* dmac) : intc(intc), dmac(dmac)
+ImageProcessingUnit::ImageProcessingUnit(struct ps2_intc* intc, struct ps2_dmac* dmac, struct sched_state* sched) :
+    intc(intc), dmac(dmac), sched(sched)
 {
-    //Generate CrCb->RGB conversion map
-    for (unsigned int i = 0; i < 0x40; i += 0x8)
-    {
-        for (unsigned int j = 0; j < 0x10; j += 2)
-        {
-            int index = j + (i * 4);
-            crcb_map[index + 0x00] = (j / 2) + i;
-            crcb_map[index + 0x01] = (j / 2) + i;
+    event_pending = false;
+    finish_pending = false;
+    running = false;
+    cycles_owed = 0;
 
-            crcb_map[index + 0x10] = (j / 2) + i;
-            crcb_map[index + 0x11] = (j / 2) + i;
-        }
-    }
+    mb_ring.reset(new IPU_Macroblock[IPU_PIPELINE_SIZE]);
+    mb_staged = 0;
+    mb_next = 0;
+    mb_retired = 0;
+    pipeline_quads = 0;
+
+    for (int i = 0; i < IPU_PIPELINE_SIZE; i++)
+        mb_ring[i].done = false;
+
+    //Leave cores for the EE and the renderer, small machines decode inline
+    int count = (int)std::thread::hardware_concurrency() / 2 - 1;
+
+    start_workers(std::clamp(count, 0, IPU_MAX_WORKERS));
+}
 
-    //I'm assuming the dithering process rounds down so I've rounded the matrix values down
-    dither_mtx[0][0] = -4;
-    dither_mtx[0][1] = 0;
-    dither_mtx[0][2] = -3;
-    dither_mtx[0][3] = 1;
-    dither_mtx[1][0] = 2;
-    dither_mtx[1][1] = -2;
-    dither_mtx[1][2] = 3;
-    dither_mtx[1][3] = -1;
-    dither_mtx[2][0] = -3;
-    dither_mtx[2][1] = 1;
-    dither_mtx[2][2] = -4;
-    dither_mtx[2][3] = 0;
-    dither_mtx[3][0] = 3;
-    dither_mtx[3][1] = -1;
-    dither_mtx[3][2] = 2;
-    dither_mtx[3][3] = -2;
+ImageProcessingUnit::~ImageProcessingUnit()
+{
+    stop_workers();
 }
 
 void ImageProcessingUnit::reset()
@@ -128,7 +135,6 @@ void ImageProcessingUnit::reset()
     VDEC_table = nullptr;
     in_FIFO.reset();
     out_FIFO.reset();
-    prepare_IDCT();
     memcpy(intra_IQ, default_intra_IQ, sizeof(intra_IQ));
     memcpy(nonintra_IQ, default_nonintra_IQ, sizeof(nonintra_IQ));
 
@@ -143,101 +149,194 @@ void ImageProcessingUnit::reset()
     command_option = 0;
     bytes_left = 0;
     command_decoding = false;
+    TH0 = 0;
+    TH1 = 0;
+    csc.use_RGB16 = false;
+    csc.use_dithering = false;
+
+    //The scheduler has just been reset, so nothing is queued anymore
+    event_pending = false;
+    finish_pending = false;
+    running = false;
+    cycles_owed = 0;
+
+    update_DMA();
+}
+
+static void ipu_run_event(void* udata, int overshoot)
+{
+    ((ImageProcessingUnit*)udata)->run();
+}
+
+//Runs the IPU after the given delay plus whatever the last batch of work
+//would have taken on hardware
+void ImageProcessingUnit::schedule_run(long cycles)
+{
+    if (event_pending)
+        return;
+
+    event_pending = true;
+
+    struct sched_event event;
+
+    event.callback = ipu_run_event;
+    event.cycles = std::max(cycles + cycles_owed, 1L);
+    event.name = "IPU run";
+    event.udata = this;
+
+    cycles_owed = 0;
+
+    sched_schedule(sched, event);
 }
 
 void ImageProcessingUnit::run()
 {
-    if (ctrl.busy)
+    event_pending = false;
+
+    //The previous batch finished the command, its time is up now
+    if (finish_pending)
+    {
+        finish_pending = false;
+        finish_command();
+    }
+
+    //Decode as far as the input allows, topping the FIFO up from IPU_TO
+    //between passes so a whole transfer goes through in one event
+    running = true;
+
+    while (ctrl.busy && !finish_pending)
+    {
+        int in_size = in_FIFO.size();
+        int in_bp = in_FIFO.bit_pointer;
+        size_t out_size = out_FIFO.f.size() + pipeline_quads;
+
+        step();
+
+        long quads = (in_size - in_FIFO.size()) + ((long)(out_FIFO.f.size() + pipeline_quads) - (long)out_size);
+
+        cycles_owed += quads * IPU_CYCLES_PER_QWORD;
+
+        bool progress = quads || in_FIFO.bit_pointer != in_bp;
+
+        in_size = in_FIFO.size();
+
+        update_DMA();
+
+        if (!progress && in_FIFO.size() == in_size)
+            break;
+    }
+
+    running = false;
+
+    //Everything decoded by this run is visible by the time it ends
+    retire_macroblocks(true);
+
+    update_DMA();
+
+    //Post the completion for when the command would be done on hardware
+    if (finish_pending)
+        schedule_run(0);
+}
+
+void ImageProcessingUnit::step()
+{
+    try
     {
-        try
+        switch (command)
         {
-            switch (command)
-            {
-                case 0x01:
-                    if (in_FIFO.f.size())
-                    {
-                        if (process_IDEC())
-                            finish_command();
-                    }
-                    break;
-                case 0x02:
-                    if (in_FIFO.f.size())
-                    {
-                        if (process_BDEC())
-                            finish_command();
-                    }
-                    break;
-                case 0x03:
-                    if (in_FIFO.f.size())
-                        process_VDEC();
-                    break;
-                case 0x04:
-                    if (in_FIFO.f.size())
-                        process_FDEC();
-                    break;
-                case 0x05:
-                    if (setiq_state == SETIQ_STATE::ADVANCE)
-                    {
-                        if (!in_FIFO.advance_stream(command_option & 0x3F))
-                            break;
+            case 0x01:
+                if (in_FIFO.size())
+                {
+                    if (process_IDEC())
+                        complete_command();
+                }
+                break;
+            case 0x02:
+                if (in_FIFO.size())
+                {
+                    if (process_BDEC())
+                        complete_command();
+                }
+                break;
+            case 0x03:
+                if (in_FIFO.size())
+                    process_VDEC();
+                break;
+            case 0x04:
+                if (in_FIFO.size())
+                    process_FDEC();
+                break;
+            case 0x05:
+                if (setiq_state == SETIQ_STATE::ADVANCE)
+                {
+                    if (!in_FIFO.advance_stream(command_option & 0x3F))
+                        break;
 
-                        setiq_state = SETIQ_STATE::POPULATE_TABLE;
-                    }
-                    while (bytes_left && in_FIFO.f.size())
-                    {
-                        uint32_t value;
-                        if (!in_FIFO.get_bits(value, 8))
-                            break;
-                        in_FIFO.advance_stream(8);
-                        int index = 64 - bytes_left;
-                        if (command_option & (1 << 27))
-                            nonintra_IQ[index] = value & 0xFF;
-                        else
-                            intra_IQ[index] = value & 0xFF;
-                        bytes_left--;
-                    }
-                    if (bytes_left <= 0)
-                        ctrl.busy = false;
-                    break;
-                case 0x06:
-                    while (bytes_left && in_FIFO.f.size())
-                    {
-                        uint128_t quad = in_FIFO.f.front();
-                        in_FIFO.f.pop_front();
-                        for (int i = 0; i < 8; i++)
-                        {
-                            int index = (32 - bytes_left) >> 1;
-                            VQCLUT[index] = quad.u16[i];
-                            bytes_left -= 2;
-                        }
-                    }
-                    if (bytes_left <= 0)
-                        ctrl.busy = false;
-                    break;
-                case 0x07:
-                    if (in_FIFO.f.size())
-                    {
-                        if (process_CSC())
-                            finish_command();
-                    }
-                    break;
-                case 0x08:
-                    if (in_FIFO.f.size())
+                    setiq_state = SETIQ_STATE::POPULATE_TABLE;
+                }
+                while (bytes_left && in_FIFO.size())
+                {
+                    uint32_t value;
+                    if (!in_FIFO.get_bits(value, 8))
+                        break;
+                    in_FIFO.advance_stream(8);
+                    int index = 64 - bytes_left;
+                    if (command_option & (1 << 27))
+                        nonintra_IQ[index] = value & 0xFF;
+                    else
+                        intra_IQ[index] = value & 0xFF;
+                    bytes_left--;
+                }
+                if (bytes_left <= 0)
+                    ctrl.busy = false;
+                break;
+            case 0x06:
+                while (bytes_left && in_FIFO.size())
+                {
+                    uint128_t quad = in_FIFO.front();
+                    in_FIFO.pop();
+                    for (int i = 0; i < 8; i++)
                     {
-                        if (process_PACK())
-                            finish_command();
+                        int index = (32 - bytes_left) >> 1;
+                        VQCLUT[index] = quad.u16[i];
+                        bytes_left -= 2;
                     }
-                    break;
-            }
+                }
+                if (bytes_left <= 0)
+                    ctrl.busy = false;
+                break;
+            case 0x07:
+                if (in_FIFO.size())
+                {
+                    if (process_CSC())
+                        complete_command();
+                }
+                break;
+            case 0x08:
+                if (in_FIFO.size())
+                {
+                    if (process_PACK())
+                        complete_command();
+                }
+                break;
         }
-        catch (VLC_Error& e)
-        {
-            std::fprintf(stderr, "ipu: VLC error: %s\n", e.what());
+    }
+    catch (VLC_Error& e)
+    {
+        std::fprintf(stderr, "ipu: VLC error: %s\n", e.what());
 
-            ctrl.error_code = true;
-            finish_command();
-        }
+        ctrl.error_code = true;
+        complete_command();
     }
+}
+
+void ImageProcessingUnit::complete_command()
+{
+    finish_pending = true;
+}
+
+void ImageProcessingUnit::update_DMA()
+{
     if (can_write_FIFO()) {
         dmac->ipu_to.dreq = 1;
         // printf("ipu: set ipu_to dreq\n");
@@ -265,10 +364,6 @@ bool ImageProcessingUnit::process_IDEC()
     {
         switch (idec.state)
         {
-            case IDEC_STATE::DELAY:
-                //Play delays IDEC execution before consuming FIFO data.
-                idec.state = IDEC_STATE::ADVANCE;
-                return false;
             case IDEC_STATE::ADVANCE:
                 printf("ipu: Advance stream\n");
                 if (!in_FIFO.advance_stream(command_option & 0x3F))
@@ -312,7 +407,7 @@ bool ImageProcessingUnit::process_IDEC()
                 bdec.state = BDEC_STATE::RESET_DC;
                 bdec.intra = true;
                 bdec.quantizer_step = idec.qsc;
-                bdec.out_fifo = &idec.temp_fifo;
+                bdec.csc = true;
                 ctrl.coded_block_pattern = 0x3F;
                 bdec.block_index = 0;
                 bdec.cur_channel = 0;
@@ -325,38 +420,6 @@ bool ImageProcessingUnit::process_IDEC()
                 if (!process_BDEC())
                     return false;
                 idec.blocks_decoded++;
-                idec.state = IDEC_STATE::INIT_CSC;
-                break;
-            case IDEC_STATE::INIT_CSC:
-                //BDEC outputs in RAW16. CSC works in RAW8, so we need to convert appropriately.
-                printf("ipu: Init CSC\n");
-                for (int i = 0; i < RAW_BLOCK_SIZE / 8; i++)
-                {
-                    uint128_t quad = idec.temp_fifo.f.front();
-                    idec.temp_fifo.f.pop_front();
-
-                    int offset = i * 8;
-
-                    for (int j = 0; j < 8; j++)
-                    {
-                        int16_t data = (int16_t)quad.u16[j];
-                        if (data < 0)
-                            data = 0;
-                        if (data > 255)
-                            data = 255;
-                        csc.block[offset + j] = (uint8_t)data;
-                    }
-                }
-                csc.state = CSC_STATE::CONVERT;
-                csc.block_index = 0;
-                csc.macroblocks = 1;
-
-                idec.state = IDEC_STATE::EXEC_CSC;
-                break;
-            case IDEC_STATE::EXEC_CSC:
-                printf("ipu: Exec CSC\n");
-                if (!process_CSC())
-                    return false;
                 idec.state = IDEC_STATE::CHECK_START_CODE;
                 break;
             case IDEC_STATE::CHECK_START_CODE:
@@ -508,15 +571,6 @@ bool ImageProcessingUnit::process_BDEC()
                 printf("ipu: Read coeffs!\n");
                 if (!BDEC_read_coeffs())
                     return false;
-                printf("ipu: Dequantize!\n");
-                dequantize(bdec.cur_block);
-                printf("ipu: Inverse scan!\n");
-                inverse_scan(bdec.cur_block);
-                printf("ipu: IDCT!\n");
-
-                int16_t temp[0x40];
-                memcpy(temp, bdec.cur_block, 0x40 * sizeof(int16_t));
-                perform_IDCT(temp, bdec.cur_block);
                 bdec.state = BDEC_STATE::LOAD_NEXT_BLOCK;
             }
                 break;
@@ -531,34 +585,31 @@ bool ImageProcessingUnit::process_BDEC()
             case BDEC_STATE::DONE:
             {
                 printf("ipu: BDEC done!\n");
-                uint128_t quad;
-                for (int i = 0; i < 8; i++)
-                {
-                    memcpy(quad.u8, bdec.blocks[0] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                    memcpy(quad.u8, bdec.blocks[1] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                }
+                IPU_Macroblock& mb = stage_macroblock();
+
+                memcpy(mb.blocks, bdec.blocks, sizeof(mb.blocks));
+                mb.coded_block_pattern = ctrl.coded_block_pattern;
+                mb.intra = bdec.intra;
+                mb.intra_DC_precision = ctrl.intra_DC_precision;
+                mb.alternate_scan = ctrl.alternate_scan;
+                if (ctrl.nonlinear_Q_step)
+                    mb.q_scale = quantizer_nonlinear[bdec.quantizer_step];
+                else
+                    mb.q_scale = quantizer_linear[bdec.quantizer_step];
 
-                for (int i = 0; i < 8; i++)
-                {
-                    memcpy(quad.u8, bdec.blocks[2] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                    memcpy(quad.u8, bdec.blocks[3] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                }
+                mb.csc = bdec.csc;
+                mb.use_RGB16 = csc.use_RGB16;
+                mb.use_dithering = csc.use_dithering;
+                mb.TH0 = TH0 & 0x1FF;
+                mb.TH1 = TH1 & 0x1FF;
 
-                for (int i = 0; i < 8; i++)
-                {
-                    memcpy(quad.u8, bdec.blocks[4] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                }
+                //RAW16 is 6 blocks of 8 quads, RGB32 is 64 quads, RGB16 half that
+                if (!mb.csc)
+                    mb.out_quads = 48;
+                else
+                    mb.out_quads = mb.use_RGB16 ? 32 : 64;
 
-                for (int i = 0; i < 8; i++)
-                {
-                    memcpy(quad.u8, bdec.blocks[5] + (i * 8), sizeof(int16_t) * 8);
-                    bdec.out_fifo->f.push_back(quad);
-                }
+                submit_macroblock(mb);
 
                 if (bdec.check_start_code)
                     bdec.state = BDEC_STATE::CHECK_START_CODE;
@@ -585,7 +636,7 @@ bool ImageProcessingUnit::process_BDEC()
     }
 }
 
-void ImageProcessingUnit::inverse_scan(int16_t *block)
+void ImageProcessingUnit::inverse_scan(int16_t *block, bool alternate)
 {
     int16_t temp[0x40];
     memcpy(temp, block, 0x40 * sizeof(int16_t));
@@ -593,7 +644,7 @@ void ImageProcessingUnit::inverse_scan(int16_t *block)
     int id;
     for (int i = 0; i < 0x40; i++)
     {
-        if (ctrl.alternate_scan)
+        if (alternate)
             id = inverse_scan_alternate[i];
         else
             id = inverse_scan_zigzag[i];
@@ -601,16 +652,12 @@ void ImageProcessingUnit::inverse_scan(int16_t *block)
     }
 }
 
-void ImageProcessingUnit::dequantize(int16_t *block)
+void ImageProcessingUnit::dequantize(int16_t *block, const IPU_Macroblock& mb)
 {
-    int q_scale;
-    if (ctrl.nonlinear_Q_step)
-        q_scale = quantizer_nonlinear[bdec.quantizer_step];
-    else
-        q_scale = quantizer_linear[bdec.quantizer_step];
-    if (bdec.intra)
+    int q_scale = mb.q_scale;
+    if (mb.intra)
     {
-        switch (ctrl.intra_DC_precision)
+        switch (mb.intra_DC_precision)
         {
             case 0:
                 block[0] *= 8;
@@ -692,8 +739,214 @@ void ImageProcessingUnit::dequantize(int16_t *block)
     }
 }
 
-//IDCT code here taken from mpeg2decode
-//Copyright (C) 1996, MPEG Software Simulation Group. All Rights Reserved.
+//IDCT
+//
+//Chen-Wang's separable integer IDCT, as found in mpeg2decode
+//(Copyright (C) 1996, MPEG Software Simulation Group), which meets
+//the IEEE 1180 accuracy requirements. The passes are written once
+//over a lane type: plain ints for the scalar version, four 32-bit
+//lanes for SSE, where a block is transformed eight rows (or columns)
+//at a time. Results are saturated to 16 bits after each pass.
+#define IDCT_W1 2841 // 2048 * sqrt(2) * cos(1 * pi / 16)
+#define IDCT_W2 2676 // 2048 * sqrt(2) * cos(2 * pi / 16)
+#define IDCT_W3 2408 // 2048 * sqrt(2) * cos(3 * pi / 16)
+#define IDCT_W5 1609 // 2048 * sqrt(2) * cos(5 * pi / 16)
+#define IDCT_W6 1108 // 2048 * sqrt(2) * cos(6 * pi / 16)
+#define IDCT_W7 565  // 2048 * sqrt(2) * cos(7 * pi / 16)
+
+template <typename T> static inline T idct_set(int c);
+template <> inline int idct_set <int>(int c) { return c; }
+
+static inline int idct_add(int a, int b) { return a + b; }
+static inline int idct_sub(int a, int b) { return a - b; }
+static inline int idct_mul(int a, int c) { return a * c; }
+static inline int idct_and(int a, int c) { return a & c; }
+template <int N> static inline int idct_sra(int a) { return a >> N; }
+template <int N> static inline int idct_sll(int a) { return a * (1 << N); }
+
+#ifdef _EE_USE_INTRINSICS
+template <> inline __m128i idct_set <__m128i>(int c) { return _mm_set1_epi32(c); }
+
+static inline __m128i idct_add(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+static inline __m128i idct_sub(__m128i a, __m128i b) { return _mm_sub_epi32(a, b); }
+static inline __m128i idct_mul(__m128i a, int c) { return _mm_mullo_epi32(a, _mm_set1_epi32(c)); }
+static inline __m128i idct_and(__m128i a, int c) { return _mm_and_si128(a, _mm_set1_epi32(c)); }
+template <int N> static inline __m128i idct_sra(__m128i a) { return _mm_srai_epi32(a, N); }
+template <int N> static inline __m128i idct_sll(__m128i a) { return _mm_slli_epi32(a, N); }
+#endif
+
+//(x * 181 + 128) >> 8, where 181 / 256 is 1 / sqrt(2). x can get big
+//enough for the product to overflow on saturated blocks, so the high
+//and low bytes of x are scaled separately, which gives the same result
+template <typename T> static inline T idct_scale181(T x)
+{
+    T hi = idct_mul(idct_sra <8>(x), 181);
+    T lo = idct_sra <8>(idct_add(idct_mul(idct_and(x, 255), 181), idct_set <T>(128)));
+
+    return idct_add(hi, lo);
+}
+
+//One pass over x[0..7]. The row pass scales the input up by 2^11 and
+//drops 8 bits at the end, the column pass scales by 2^8, rounds the
+//products down by 3 bits and drops 14 bits at the end
+template <bool Col, typename T> static inline void idct_pass(T* x)
+{
+    constexpr int s = Col ? 3 : 0;
+    const T r = idct_set <T>(Col ? 4 : 0);
+
+    T x0 = Col ? idct_add(idct_sll <8>(x[0]), idct_set <T>(8192)) : idct_add(idct_sll <11>(x[0]), idct_set <T>(128));
+    T x1 = Col ? idct_sll <8>(x[4]) : idct_sll <11>(x[4]);
+    T x2 = x[6];
+    T x3 = x[2];
+    T x4 = x[1];
+    T x5 = x[7];
+    T x6 = x[5];
+    T x7 = x[3];
+    T x8;
+
+    //First stage
+    x8 = idct_add(idct_mul(idct_add(x4, x5), IDCT_W7), r);
+    x4 = idct_sra <s>(idct_add(x8, idct_mul(x4, IDCT_W1 - IDCT_W7)));
+    x5 = idct_sra <s>(idct_sub(x8, idct_mul(x5, IDCT_W1 + IDCT_W7)));
+    x8 = idct_add(idct_mul(idct_add(x6, x7), IDCT_W3), r);
+    x6 = idct_sra <s>(idct_sub(x8, idct_mul(x6, IDCT_W3 - IDCT_W5)));
+    x7 = idct_sra <s>(idct_sub(x8, idct_mul(x7, IDCT_W3 + IDCT_W5)));
+
+    //Second stage
+    x8 = idct_add(x0, x1);
+    x0 = idct_sub(x0, x1);
+    x1 = idct_add(idct_mul(idct_add(x3, x2), IDCT_W6), r);
+    x2 = idct_sra <s>(idct_sub(x1, idct_mul(x2, IDCT_W2 + IDCT_W6)));
+    x3 = idct_sra <s>(idct_add(x1, idct_mul(x3, IDCT_W2 - IDCT_W6)));
+    x1 = idct_add(x4, x6);
+    x4 = idct_sub(x4, x6);
+    x6 = idct_add(x5, x7);
+    x5 = idct_sub(x5, x7);
+
+    //Third stage
+    x7 = idct_add(x8, x3);
+    x8 = idct_sub(x8, x3);
+    x3 = idct_add(x0, x2);
+    x0 = idct_sub(x0, x2);
+    x2 = idct_scale181(idct_add(x4, x5));
+    x4 = idct_scale181(idct_sub(x4, x5));
+
+    //Fourth stage
+    constexpr int o = Col ? 14 : 8;
+
+    x[0] = idct_sra <o>(idct_add(x7, x1));
+    x[1] = idct_sra <o>(idct_add(x3, x2));
+    x[2] = idct_sra <o>(idct_add(x0, x4));
+    x[3] = idct_sra <o>(idct_add(x8, x6));
+    x[4] = idct_sra <o>(idct_sub(x8, x6));
+    x[5] = idct_sra <o>(idct_sub(x0, x4));
+    x[6] = idct_sra <o>(idct_sub(x3, x2));
+    x[7] = idct_sra <o>(idct_sub(x7, x1));
+}
+
+static inline int16_t idct_saturate(int v)
+{
+    return (int16_t)std::clamp(v, -32768, 32767);
+}
+
+#ifdef _EE_USE_INTRINSICS
+static inline void idct_transpose(__m128i* r)
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    r[0] = _mm_unpacklo_epi64(b0, b4);
+    r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5);
+    r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6);
+    r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7);
+    r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+//Both passes over eight 16-bit vectors, v[k] holds coefficient k of
+//eight rows (or columns), results are saturated back to 16 bits
+template <bool Col> static inline void idct_pass8(__m128i* v)
+{
+    __m128i lo[8], hi[8];
+
+    for (int k = 0; k < 8; k++)
+    {
+        lo[k] = _mm_cvtepi16_epi32(v[k]);
+        hi[k] = _mm_cvtepi16_epi32(_mm_srli_si128(v[k], 8));
+    }
+
+    idct_pass <Col>(lo);
+    idct_pass <Col>(hi);
+
+    for (int k = 0; k < 8; k++)
+        v[k] = _mm_packs_epi32(lo[k], hi[k]);
+}
+#endif
+
+//In place 8x8 IDCT
+static void idct(int16_t* block)
+{
+#ifdef _EE_USE_INTRINSICS
+    __m128i v[8];
+
+    for (int i = 0; i < 8; i++)
+        v[i] = _mm_loadu_si128((const __m128i*)(block + (i * 8)));
+
+    //Rows, then columns. Each transpose turns rows into lanes
+    idct_transpose(v);
+    idct_pass8 <false>(v);
+    idct_transpose(v);
+    idct_pass8 <true>(v);
+
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)(block + (i * 8)), v[i]);
+#else
+    int x[8];
+
+    for (int i = 0; i < 8; i++)
+    {
+        int16_t* row = block + (i * 8);
+
+        for (int k = 0; k < 8; k++)
+            x[k] = row[k];
+
+        idct_pass <false>(x);
+
+        for (int k = 0; k < 8; k++)
+            row[k] = idct_saturate(x[k]);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        int16_t* col = block + i;
+
+        for (int k = 0; k < 8; k++)
+            x[k] = col[k * 8];
+
+        idct_pass <true>(x);
+
+        for (int k = 0; k < 8; k++)
+            col[k * 8] = idct_saturate(x[k]);
+    }
+#endif
+}
 
 #ifndef PI
 #	ifdef M_PI
@@ -702,61 +955,57 @@ void ImageProcessingUnit::dequantize(int16_t *block)
 #		define PI 3.14159265358979323846
 #	endif
 #endif
-void ImageProcessingUnit::prepare_IDCT()
+
+#ifdef IRIS_BENCH
+//Double precision IDCT, the IEEE 1180 reference. Only used to check
+//and time the integer one
+static void reference_idct(const int16_t* in, double* out)
 {
-    int freq, time;
-    double scale;
+    static double table[8][8];
+    static bool init = false;
 
-    for (freq=0; freq < 8; freq++)
+    if (!init)
     {
-        scale = (freq == 0) ? sqrt(0.125) : 0.5;
-        for (time=0; time<8; time++)
+        for (int freq = 0; freq < 8; freq++)
         {
-            IDCT_table[freq][time] = scale*cos((PI/8.0)*freq*(time + 0.5));
+            double scale = (freq == 0) ? sqrt(0.125) : 0.5;
+
+            for (int time = 0; time < 8; time++)
+                table[freq][time] = scale * cos((PI / 8.0) * freq * (time + 0.5));
         }
+
+        init = true;
     }
-}
 
-void ImageProcessingUnit::perform_IDCT(const int16_t* pUV, int16_t* pXY)
-{
-    int i, j, k, v;
-    double partial_product;
     double tmp[64];
 
-    for (i=0; i<8; i++)
+    for (int i = 0; i < 8; i++)
     {
-        for (j=0; j<8; j++)
+        for (int j = 0; j < 8; j++)
         {
-            partial_product = 0.0;
+            double sum = 0.0;
 
-            for (k=0; k<8; k++)
-            {
-                partial_product+= IDCT_table[k][j]*pUV[8*i+k];
-            }
+            for (int k = 0; k < 8; k++)
+                sum += table[k][j] * in[(8 * i) + k];
 
-            tmp[8*i+j] = partial_product;
+            tmp[(8 * i) + j] = sum;
         }
     }
 
-  /* Transpose operation is integrated into address mapping by switching
-     loop order of i and j */
-
-    for (j=0; j<8; j++)
+    for (int j = 0; j < 8; j++)
     {
-        for (i=0; i<8; i++)
+        for (int i = 0; i < 8; i++)
         {
-            partial_product = 0.0;
+            double sum = 0.0;
 
-            for (k=0; k<8; k++)
-            {
-                partial_product+= IDCT_table[k][i]*tmp[8*k+j];
-            }
+            for (int k = 0; k < 8; k++)
+                sum += table[k][i] * tmp[(8 * k) + j];
 
-            v = (int) floor(partial_product+0.5);
-            pXY[8*i+j] = v;
+            out[(8 * i) + j] = sum;
         }
     }
 }
+#endif
 
 //End IDCT code
 
@@ -879,7 +1128,164 @@ bool ImageProcessingUnit::BDEC_read_diff()
     }
 }
 
-void ImageProcessingUnit::convert_RGB32_to_RGB16(const uint8_t* rgb32, uint16_t* rgb16, bool dithering)
+//CSC
+//
+//YCbCr to RGB in fixed point. The hardware's exact arithmetic isn't
+//known, so these reproduce the single precision float conversion this
+//used before, bit for bit, over every Y, Cb and Cr:
+//
+//  R = Y + 1.402 * (Cr - 128)
+//  G = Y - 0.34414 * (Cb - 128) - 0.71414 * (Cr - 128)
+//  B = Y + 1.772 * (Cb - 128)
+//
+//R and B match with 13 fractional bits, G, which was rounded twice,
+//needs 20 bits and a bias. The chroma terms don't depend on Y, so they
+//are worked out once per chroma sample and added to the four luma
+//samples that share it.
+#define CSC_CR_R 11485   // 1.402 * 2^13
+#define CSC_CB_B 14516   // 1.772 * 2^13
+#define CSC_CB_G 360857  // 0.34414 * 2^20
+#define CSC_CR_G 748830  // 0.71414 * 2^20
+#define CSC_G_BIAS 16
+
+//I'm assuming the dithering process rounds down so I've rounded the matrix values down
+static const int8_t dither_mtx[4][4] =
+{
+    { -4, 0, -3, 1 },
+    { 2, -2, 3, -1 },
+    { -3, 1, -4, 0 },
+    { 3, -1, 2, -2 }
+};
+
+static inline int csc_offset_r(int cr) { return ((cr - 128) * CSC_CR_R) >> 13; }
+static inline int csc_offset_b(int cb) { return ((cb - 128) * CSC_CB_B) >> 13; }
+static inline int csc_offset_g(int cb, int cr)
+{
+    return (CSC_G_BIAS - ((cb - 128) * CSC_CB_G) - ((cr - 128) * CSC_CR_G)) >> 20;
+}
+
+//Threshold alpha, in the RGB32 encoding: 0 below TH0, 0x40 below TH1
+static inline uint8_t csc_alpha(int r, int g, int b, int th0, int th1)
+{
+    int max = std::max(r, std::max(g, b));
+
+    if (max < th0)
+        return 0;
+    if (max < th1)
+        return 0x40;
+    return 0x80;
+}
+
+//Converts a RAW8 macroblock (16x16 Y, 8x8 Cb, 8x8 Cr) to RGB32
+static void csc_macroblock(const uint8_t* block, uint8_t* rgb32, int th0, int th1)
+{
+    const uint8_t* lum_block = block;
+    const uint8_t* cb_block = block + 0x100;
+    const uint8_t* cr_block = block + 0x140;
+
+#ifdef _EE_USE_INTRINSICS
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi16(255);
+    const __m128i v128 = _mm_set1_epi16(128);
+    const __m128i vth0 = _mm_set1_epi16(th0);
+    const __m128i vth1 = _mm_set1_epi16(th1);
+
+    for (int y = 0; y < 8; y++)
+    {
+        //Chroma terms for a row of eight samples
+        __m128i cb = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(cb_block + (y * 8)))), v128);
+        __m128i cr = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(cr_block + (y * 8)))), v128);
+
+        __m128i ofs_r = _mm_mulhi_epi16(_mm_slli_epi16(cr, 3), _mm_set1_epi16(CSC_CR_R));
+        __m128i ofs_b = _mm_mulhi_epi16(_mm_slli_epi16(cb, 3), _mm_set1_epi16(CSC_CB_B));
+
+        __m128i g_lo = _mm_sub_epi32(
+            _mm_sub_epi32(_mm_set1_epi32(CSC_G_BIAS), _mm_mullo_epi32(_mm_cvtepi16_epi32(cb), _mm_set1_epi32(CSC_CB_G))),
+            _mm_mullo_epi32(_mm_cvtepi16_epi32(cr), _mm_set1_epi32(CSC_CR_G))
+        );
+        __m128i g_hi = _mm_sub_epi32(
+            _mm_sub_epi32(_mm_set1_epi32(CSC_G_BIAS), _mm_mullo_epi32(_mm_cvtepi16_epi32(_mm_srli_si128(cb, 8)), _mm_set1_epi32(CSC_CB_G))),
+            _mm_mullo_epi32(_mm_cvtepi16_epi32(_mm_srli_si128(cr, 8)), _mm_set1_epi32(CSC_CR_G))
+        );
+        __m128i ofs_g = _mm_packs_epi32(_mm_srai_epi32(g_lo, 20), _mm_srai_epi32(g_hi, 20));
+
+        //Each chroma sample covers two pixels horizontally
+        __m128i r_ofs[2] = { _mm_unpacklo_epi16(ofs_r, ofs_r), _mm_unpackhi_epi16(ofs_r, ofs_r) };
+        __m128i g_ofs[2] = { _mm_unpacklo_epi16(ofs_g, ofs_g), _mm_unpackhi_epi16(ofs_g, ofs_g) };
+        __m128i b_ofs[2] = { _mm_unpacklo_epi16(ofs_b, ofs_b), _mm_unpackhi_epi16(ofs_b, ofs_b) };
+
+        //...and two vertically
+        for (int row = y * 2; row < (y * 2) + 2; row++)
+        {
+            __m128i lum = _mm_loadu_si128((const __m128i*)(lum_block + (row * 16)));
+            __m128i r[2], g[2], b[2], a[2];
+
+            for (int h = 0; h < 2; h++)
+            {
+                __m128i l = h ? _mm_unpackhi_epi8(lum, zero) : _mm_unpacklo_epi8(lum, zero);
+
+                r[h] = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(l, r_ofs[h]), zero), max);
+                g[h] = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(l, g_ofs[h]), zero), max);
+                b[h] = _mm_min_epi16(_mm_max_epi16(_mm_add_epi16(l, b_ofs[h]), zero), max);
+
+                __m128i m = _mm_max_epi16(r[h], _mm_max_epi16(g[h], b[h]));
+                __m128i lt0 = _mm_cmplt_epi16(m, vth0);
+                __m128i lt1 = _mm_cmplt_epi16(m, vth1);
+
+                a[h] = _mm_andnot_si128(lt0, _mm_sub_epi16(_mm_set1_epi16(0x80), _mm_and_si128(lt1, _mm_set1_epi16(0x40))));
+            }
+
+            __m128i r8 = _mm_packus_epi16(r[0], r[1]);
+            __m128i g8 = _mm_packus_epi16(g[0], g[1]);
+            __m128i b8 = _mm_packus_epi16(b[0], b[1]);
+            __m128i a8 = _mm_packus_epi16(a[0], a[1]);
+
+            __m128i rg_lo = _mm_unpacklo_epi8(r8, g8);
+            __m128i rg_hi = _mm_unpackhi_epi8(r8, g8);
+            __m128i ba_lo = _mm_unpacklo_epi8(b8, a8);
+            __m128i ba_hi = _mm_unpackhi_epi8(b8, a8);
+
+            __m128i* out = (__m128i*)(rgb32 + (row * 64));
+
+            _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rg_lo, ba_lo));
+            _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rg_hi, ba_hi));
+            _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rg_hi, ba_hi));
+        }
+    }
+#else
+    int ofs_r[0x40], ofs_g[0x40], ofs_b[0x40];
+
+    for (int i = 0; i < 0x40; i++)
+    {
+        ofs_r[i] = csc_offset_r(cr_block[i]);
+        ofs_g[i] = csc_offset_g(cb_block[i], cr_block[i]);
+        ofs_b[i] = csc_offset_b(cb_block[i]);
+    }
+
+    for (int i = 0; i < 16; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            int index = j + (i * 16);
+            int c = (j / 2) + ((i / 2) * 8);
+            int lum = lum_block[index];
+
+            int r = std::clamp(lum + ofs_r[c], 0, 255);
+            int g = std::clamp(lum + ofs_g[c], 0, 255);
+            int b = std::clamp(lum + ofs_b[c], 0, 255);
+
+            rgb32[4 * index] = r;
+            rgb32[4 * index + 1] = g;
+            rgb32[4 * index + 2] = b;
+            rgb32[4 * index + 3] = csc_alpha(r, g, b, th0, th1);
+        }
+    }
+#endif
+}
+
+#if !defined(_EE_USE_INTRINSICS) || defined(IRIS_BENCH)
+static void convert_RGB32_to_RGB16_generic(const uint8_t* rgb32, uint16_t* rgb16, bool dithering)
 {
     for (int i = 0; i < 16; ++i)
     {
@@ -896,29 +1302,355 @@ void ImageProcessingUnit::convert_RGB32_to_RGB16(const uint8_t* rgb32, uint16_t*
         }
     }
 }
+#endif
 
-void ImageProcessingUnit::process_VDEC()
+static void convert_RGB32_to_RGB16(const uint8_t* rgb32, uint16_t* rgb16, bool dithering)
 {
-    int table = command_option >> 26;
-    switch (table)
+#ifdef _EE_USE_INTRINSICS
+    for (int i = 0; i < 16; ++i)
     {
-        case 0:
-            printf("ipu: MBAI\n");
-            VDEC_table = &macroblock_increment;
-            break;
-        case 1:
-            printf("ipu: MBT\n");
-            switch (ctrl.picture_type)
-            {
-                case 0x1:
-                    printf("ipu: I pic\n");
-                    VDEC_table = &macroblock_I_pic;
-                    break;
-                case 0x2:
-                    printf("ipu: P pic\n");
-                    VDEC_table = &macroblock_P_pic;
-                    break;
-                case 0x3:
+        //Every four pixels of a row take the same dither, alpha isn't dithered
+        const int8_t* d = dither_mtx[i & 3];
+
+        __m128i dither_lo = _mm_setzero_si128();
+        __m128i dither_hi = _mm_setzero_si128();
+
+        if (dithering)
+        {
+            dither_lo = _mm_setr_epi16(d[0], d[0], d[0], 0, d[1], d[1], d[1], 0);
+            dither_hi = _mm_setr_epi16(d[2], d[2], d[2], 0, d[3], d[3], d[3], 0);
+        }
+
+        __m128i out[4];
+
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i*)(rgb32 + (i * 64) + (j * 16)));
+
+            __m128i lo = _mm_add_epi16(_mm_cvtepu8_epi16(p), dither_lo);
+            __m128i hi = _mm_add_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(p, 8)), dither_hi);
+
+            p = _mm_packus_epi16(lo, hi);
+
+            //It's worth noting that bit 30 is the alpha bit for RGB16, not bit 31.
+            __m128i r = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x1f));
+            __m128i g = _mm_and_si128(_mm_srli_epi32(p, 6), _mm_set1_epi32(0x3e0));
+            __m128i b = _mm_and_si128(_mm_srli_epi32(p, 9), _mm_set1_epi32(0x7c00));
+            __m128i a = _mm_and_si128(_mm_cmpeq_epi32(_mm_srli_epi32(p, 24), _mm_set1_epi32(0x40)), _mm_set1_epi32(0x8000));
+
+            out[j] = _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a));
+        }
+
+        _mm_storeu_si128((__m128i*)(rgb16 + (i * 16)), _mm_packus_epi32(out[0], out[1]));
+        _mm_storeu_si128((__m128i*)(rgb16 + (i * 16) + 8), _mm_packus_epi32(out[2], out[3]));
+    }
+#else
+    convert_RGB32_to_RGB16_generic(rgb32, rgb16, dithering);
+#endif
+}
+
+#ifdef IRIS_BENCH
+//Single precision float CSC, what the IPU used before. Only used to
+//check and time the fixed point one
+static void reference_csc(const uint8_t* block, uint8_t* rgb32, int th0, int th1)
+{
+    const uint8_t* lum_block = block;
+    const uint8_t* cb_block = block + 0x100;
+    const uint8_t* cr_block = block + 0x140;
+
+    for (int i = 0; i < 16; i++)
+    {
+        for (int j = 0; j < 16; j++)
+        {
+            int index = j + (i * 16);
+            int c = (j / 2) + ((i / 2) * 8);
+            float lum = lum_block[index];
+            float cb = cb_block[c];
+            float cr = cr_block[c];
+
+            float r = lum + 1.402f * (cr - 128);
+            float g = lum - 0.34414f * (cb - 128) - 0.71414f * (cr - 128);
+            float b = lum + 1.772f * (cb - 128);
+
+            r = std::clamp(r, 0.0f, 255.0f);
+            g = std::clamp(g, 0.0f, 255.0f);
+            b = std::clamp(b, 0.0f, 255.0f);
+
+            uint8_t alpha;
+            if (r < th0 && g < th0 && b < th0)
+                alpha = 0;
+            else if (r < th1 && g < th1 && b < th1)
+                alpha = 0x40;
+            else
+                alpha = 0x80;
+
+            rgb32[4 * index] = (uint8_t)r;
+            rgb32[4 * index + 1] = (uint8_t)g;
+            rgb32[4 * index + 2] = (uint8_t)b;
+            rgb32[4 * index + 3] = alpha;
+        }
+    }
+}
+#endif
+
+//End CSC code
+
+//Macroblock pipeline
+
+IPU_Macroblock& ImageProcessingUnit::stage_macroblock()
+{
+    //Make room by waiting for the oldest macroblock
+    if (mb_staged - mb_retired == IPU_PIPELINE_SIZE)
+    {
+        retire_macroblocks(false);
+
+        while (mb_staged - mb_retired == IPU_PIPELINE_SIZE)
+        {
+            if (!decode_next_macroblock())
+                std::this_thread::yield();
+
+            retire_macroblocks(false);
+        }
+    }
+
+    return mb_ring[mb_staged % IPU_PIPELINE_SIZE];
+}
+
+void ImageProcessingUnit::submit_macroblock(IPU_Macroblock& mb)
+{
+    pipeline_quads += mb.out_quads;
+
+    mb_staged.store(mb_staged + 1, std::memory_order_seq_cst);
+
+    if (workers.empty())
+    {
+        decode_next_macroblock();
+    }
+    else if (pool_sleeping && mb_next != mb_staged)
+    {
+        {
+            std::lock_guard<std::mutex> lk(pool_mtx);
+        }
+
+        pool_cv.notify_one();
+    }
+
+    retire_macroblocks(false);
+}
+
+//Claims the oldest macroblock nobody has started on, returns false if
+//there is none
+bool ImageProcessingUnit::decode_next_macroblock()
+{
+    uint32_t index = mb_next.load(std::memory_order_relaxed);
+
+    do
+    {
+        if (index == mb_staged.load(std::memory_order_acquire))
+            return false;
+    } while (!mb_next.compare_exchange_weak(index, index + 1));
+
+    IPU_Macroblock& mb = mb_ring[index % IPU_PIPELINE_SIZE];
+
+    decode_macroblock(mb);
+
+    mb.done.store(true, std::memory_order_release);
+
+    return true;
+}
+
+void ImageProcessingUnit::decode_macroblock(IPU_Macroblock& mb)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        if (!(mb.coded_block_pattern & (1 << (5 - i))))
+            continue;
+
+        dequantize(mb.blocks[i], mb);
+        inverse_scan(mb.blocks[i], mb.alternate_scan);
+        idct(mb.blocks[i]);
+    }
+
+    //RAW16, the Y blocks interleaved into a 16x16 raster followed by Cb and Cr
+    uint128_t raw16[48];
+    uint128_t* raw = mb.csc ? raw16 : mb.out;
+
+    for (int i = 0; i < 8; i++)
+    {
+        memcpy(raw++, mb.blocks[0] + (i * 8), sizeof(uint128_t));
+        memcpy(raw++, mb.blocks[1] + (i * 8), sizeof(uint128_t));
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        memcpy(raw++, mb.blocks[2] + (i * 8), sizeof(uint128_t));
+        memcpy(raw++, mb.blocks[3] + (i * 8), sizeof(uint128_t));
+    }
+
+    for (int i = 0; i < 8; i++)
+        memcpy(raw++, mb.blocks[4] + (i * 8), sizeof(uint128_t));
+
+    for (int i = 0; i < 8; i++)
+        memcpy(raw++, mb.blocks[5] + (i * 8), sizeof(uint128_t));
+
+    if (!mb.csc)
+        return;
+
+    //IDEC feeds the macroblock to CSC, which works in RAW8
+    uint8_t raw8[RAW_BLOCK_SIZE];
+
+#ifdef _EE_USE_INTRINSICS
+    for (int i = 0; i < RAW_BLOCK_SIZE / 16; i++)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i*)&raw16[i * 2]);
+        __m128i hi = _mm_loadu_si128((const __m128i*)&raw16[(i * 2) + 1]);
+
+        _mm_storeu_si128((__m128i*)(raw8 + (i * 16)), _mm_packus_epi16(lo, hi));
+    }
+#else
+    for (int i = 0; i < RAW_BLOCK_SIZE; i++)
+    {
+        int16_t data = (int16_t)raw16[i / 8].u16[i % 8];
+
+        raw8[i] = (uint8_t)std::clamp<int16_t>(data, 0, 255);
+    }
+#endif
+
+    uint8_t rgb32[4 * RGB_BLOCK_SIZE];
+
+    csc_macroblock(raw8, rgb32, mb.TH0, mb.TH1);
+
+    if (mb.use_RGB16)
+    {
+        uint16_t rgb16[RGB_BLOCK_SIZE];
+
+        convert_RGB32_to_RGB16(rgb32, rgb16, mb.use_dithering);
+
+        memcpy(mb.out, rgb16, sizeof(rgb16));
+    }
+    else
+    {
+        memcpy(mb.out, rgb32, sizeof(rgb32));
+    }
+}
+
+//Moves finished macroblocks to out_FIFO in the order they were staged.
+//With wait set this doesn't return until the pipeline is empty.
+void ImageProcessingUnit::retire_macroblocks(bool wait)
+{
+    while (mb_retired != mb_staged)
+    {
+        IPU_Macroblock& mb = mb_ring[mb_retired % IPU_PIPELINE_SIZE];
+
+        if (!mb.done.load(std::memory_order_acquire))
+        {
+            if (!wait)
+                return;
+
+            //Help out, or give the worker on it a moment
+            if (!decode_next_macroblock())
+                std::this_thread::yield();
+
+            continue;
+        }
+
+        for (int i = 0; i < mb.out_quads; i++)
+            out_FIFO.f.push_back(mb.out[i]);
+
+        pipeline_quads -= mb.out_quads;
+
+        mb.done.store(false, std::memory_order_relaxed);
+
+        mb_retired++;
+    }
+}
+
+void ImageProcessingUnit::worker_main()
+{
+    while (true)
+    {
+        if (decode_next_macroblock())
+            continue;
+
+        //The parser usually has the next macroblock ready in a moment
+        bool found = false;
+
+        for (int i = 0; i < 64 && !found; i++)
+        {
+            std::this_thread::yield();
+
+            found = mb_next != mb_staged;
+        }
+
+        if (found)
+            continue;
+
+        std::unique_lock<std::mutex> lk(pool_mtx);
+
+        pool_sleeping++;
+
+        pool_cv.wait(lk, [&] { return pool_quit || mb_next != mb_staged; });
+
+        pool_sleeping--;
+
+        if (pool_quit)
+            return;
+    }
+}
+
+void ImageProcessingUnit::start_workers(int count)
+{
+    pool_quit = false;
+    pool_sleeping = 0;
+
+    for (int i = 0; i < count; i++)
+        workers.push_back(std::thread(&ImageProcessingUnit::worker_main, this));
+}
+
+void ImageProcessingUnit::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lk(pool_mtx);
+
+        pool_quit = true;
+    }
+
+    pool_cv.notify_all();
+
+    for (std::thread& t : workers)
+        t.join();
+
+    workers.clear();
+}
+
+void ImageProcessingUnit::set_workers(int count)
+{
+    stop_workers();
+    start_workers(std::clamp(count, 0, IPU_MAX_WORKERS));
+}
+
+void ImageProcessingUnit::process_VDEC()
+{
+    int table = command_option >> 26;
+    switch (table)
+    {
+        case 0:
+            printf("ipu: MBAI\n");
+            VDEC_table = &macroblock_increment;
+            break;
+        case 1:
+            printf("ipu: MBT\n");
+            switch (ctrl.picture_type)
+            {
+                case 0x1:
+                    printf("ipu: I pic\n");
+                    VDEC_table = &macroblock_I_pic;
+                    break;
+                case 0x2:
+                    printf("ipu: P pic\n");
+                    VDEC_table = &macroblock_P_pic;
+                    break;
+                case 0x3:
                     printf("ipu: B pic\n");
                     VDEC_table = &macroblock_B_pic;
                     break;
@@ -946,7 +1678,7 @@ void ImageProcessingUnit::process_VDEC()
                     vdec_state = VDEC_STATE::DONE;
                 break;
             case VDEC_STATE::DONE:
-                printf("ipu: VDEC done! Output: $%08X infifo=%d\n", command_output, in_FIFO.f.size());
+                printf("ipu: VDEC done! Output: $%08X infifo=%d\n", command_output, in_FIFO.size());
                 finish_command();
                 return;
         }
@@ -1009,53 +1741,7 @@ bool ImageProcessingUnit::process_CSC()
             {
                 uint8_t rgb32[4 * RGB_BLOCK_SIZE];
 
-                uint8_t* lum_block = csc.block;
-                uint8_t* cb_block = csc.block + 0x100;
-                uint8_t* cr_block = csc.block + 0x140;
-
-                uint16_t alphaTh0 = (TH0 & 0x1FF);
-                uint16_t alphaTh1 = (TH1 & 0x1FF);
-
-                for (int i = 0; i < 16; i++)
-                {
-                    for (int j = 0; j < 16; j++)
-                    {
-                        int index = j + (i * 16);
-                        float lum = lum_block[index];
-                        float cb = cb_block[crcb_map[index]];
-                        float cr = cr_block[crcb_map[index]];
-
-                        float r = lum + 1.402f * (cr - 128);
-                        float g = lum - 0.34414f * (cb - 128) - 0.71414f * (cr - 128);
-                        float b = lum + 1.772f * (cb - 128);
-
-                        if (r < 0)
-                            r = 0;
-                        if (r > 255)
-                            r = 255;
-                        if (g < 0)
-                            g = 0;
-                        if (g > 255)
-                            g = 255;
-                        if (b < 0)
-                            b = 0;
-                        if (b > 255)
-                            b = 255;
-
-                        uint8_t alpha;
-                        if (r < alphaTh0 && g < alphaTh0 && b < alphaTh0)
-                            alpha = 0;
-                        else if (r < alphaTh1 && g < alphaTh1 && b < alphaTh1)
-                            alpha = 0x40;
-                        else
-                            alpha = 0x80;
-
-                        rgb32[4 * index] = (uint8_t)r;
-                        rgb32[4 * index + 1] = (uint8_t)g;
-                        rgb32[4 * index + 2] = (uint8_t)b;
-                        rgb32[4 * index + 3] = alpha;
-                    }
-                }
+                csc_macroblock(csc.block, rgb32, TH0 & 0x1FF, TH1 & 0x1FF);
 
                 uint128_t quad;
                 if (csc.use_RGB16)
@@ -1066,10 +1752,7 @@ bool ImageProcessingUnit::process_CSC()
 
                     for (int i = 0; i < RGB_BLOCK_SIZE / 8; i++)
                     {
-                        for (int j = 0; j < 8; j++)
-                        {
-                            quad.u16[j] = rgb16[j + (i * 8)];
-                        }
+                        memcpy(&quad, rgb16 + (i * 8), sizeof(quad));
                         out_FIFO.f.push_back(quad);
                     }
                 }
@@ -1077,16 +1760,7 @@ bool ImageProcessingUnit::process_CSC()
                 {
                     for (int i = 0; i < RGB_BLOCK_SIZE / 4; i++)
                     {
-                        for (int j = 0; j < 4; j++)
-                        {
-                            int index = 4 * (j + (i * 4));
-                            uint8_t r = rgb32[index];
-                            uint8_t g = rgb32[index + 1];
-                            uint8_t b = rgb32[index + 2];
-                            uint8_t a = rgb32[index + 3];
-                            uint32_t color = r | g << 8 | b << 16 | a << 24;
-                            quad.u32[j] = color;
-                        }
+                        memcpy(&quad, rgb32 + (i * 16), sizeof(quad));
                         out_FIFO.f.push_back(quad);
                     }
                 }
@@ -1227,7 +1901,7 @@ uint64_t ImageProcessingUnit::read_command()
 uint32_t ImageProcessingUnit::read_control()
 {
     uint32_t reg = 0;
-    reg |= in_FIFO.f.size();
+    reg |= in_FIFO.size();
     reg |= (ctrl.coded_block_pattern & 0x3F) << 8;
     reg |= ctrl.error_code << 14;
     reg |= ctrl.start_code << 15;
@@ -1244,7 +1918,7 @@ uint32_t ImageProcessingUnit::read_control()
 uint32_t ImageProcessingUnit::read_BP()
 {
     uint32_t reg = 0;
-    uint8_t fifo_size = in_FIFO.f.size();
+    uint8_t fifo_size = in_FIFO.size();
 
     //Check for FP bit
     if (in_FIFO.bit_pointer && fifo_size)
@@ -1261,7 +1935,7 @@ uint32_t ImageProcessingUnit::read_BP()
 uint64_t ImageProcessingUnit::read_top()
 {
     uint64_t reg = 0;
-    int max_bits = (in_FIFO.f.size() * 128) - in_FIFO.bit_pointer;
+    int max_bits = (in_FIFO.size() * 128) - in_FIFO.bit_pointer;
     if (max_bits > 32)
         max_bits = 32;
     uint32_t next_data;
@@ -1300,7 +1974,7 @@ void ImageProcessingUnit::write_command(uint32_t value)
                 break;
             case 0x01:
                 printf("ipu: IDEC\n");
-                idec.state = IDEC_STATE::DELAY;
+                idec.state = IDEC_STATE::ADVANCE;
                 idec.macro_type = 0;
                 idec.qsc = (command_option >> 16) & 0x1F;
                 idec.decodes_dct = command_option & (1 << 24);
@@ -1310,7 +1984,7 @@ void ImageProcessingUnit::write_command(uint32_t value)
             case 0x02:
                 printf("ipu: BDEC\n");
                 bdec.state = BDEC_STATE::ADVANCE;
-                bdec.out_fifo = &out_FIFO;
+                bdec.csc = false;
                 ctrl.coded_block_pattern = 0x3F;
                 bdec.block_index = 0;
                 bdec.cur_channel = 0;
@@ -1361,6 +2035,12 @@ void ImageProcessingUnit::write_command(uint32_t value)
                 finish_command();
                 break;
         }
+
+        //Anything still busy needs data, pick it up once the IPU gets going
+        if (ctrl.busy)
+            schedule_run(IPU_COMMAND_LATENCY);
+
+        update_DMA();
     }
 }
 
@@ -1376,6 +2056,7 @@ void ImageProcessingUnit::write_control(uint32_t value)
     if (value & (1 << 30))
     {
         command = 0;
+        finish_pending = false;
         in_FIFO.reset();
         out_FIFO.reset();
         // Note: A control reset does a forced command end, meaning it will
@@ -1384,6 +2065,7 @@ void ImageProcessingUnit::write_control(uint32_t value)
         //       Fightbox relies on this behaviour to boot and play its first
         //       two videos.
         finish_command();
+        update_DMA();
     }
 }
 
@@ -1394,7 +2076,7 @@ bool ImageProcessingUnit::can_read_FIFO()
 
 bool ImageProcessingUnit::can_write_FIFO()
 {
-    return in_FIFO.f.size() < 8;
+    return in_FIFO.size() < 8;
 }
 
 uint128_t ImageProcessingUnit::read_FIFO()
@@ -1414,21 +2096,25 @@ void ImageProcessingUnit::write_FIFO(uint128_t quad)
 
     //Certain games (Theme Park, Neo Contra, etc) read command output without sending a command.
     //They expect to read the first word of a newly started IPU_TO transfer.
-    if (in_FIFO.f.size() == 0 && !ctrl.busy)
+    if (in_FIFO.size() == 0 && !ctrl.busy)
     {
         command_output = quad.u32[0];
         command_output = (command_output >> 24) | (((command_output >> 16) & 0xFF) << 8) |
                          (((command_output >> 8) & 0xFF) << 16) | (command_output << 24);
     }
-    if (in_FIFO.f.size() == 7)
+    if (in_FIFO.size() == 7)
     {
         dmac->ipu_to.dreq = 0;
     }
-    if (in_FIFO.f.size() >= 8)
+    if (in_FIFO.size() >= 8)
     {
     }
-    in_FIFO.f.push_back(quad);
-    in_FIFO.bit_cache_dirty = true;
+    in_FIFO.push(quad);
+
+    //New data for a command that was waiting on it. Transfers started from
+    //run() are picked up by its own loop.
+    if (ctrl.busy && !finish_pending && !running)
+        schedule_run(0);
 }
 
 struct ps2_ipu {
@@ -1439,8 +2125,8 @@ extern "C" struct ps2_ipu* ps2_ipu_create(void) {
     return (struct ps2_ipu*)malloc(sizeof(struct ps2_ipu));
 }
 
-extern "C" void ps2_ipu_init(struct ps2_ipu* ipu, struct ps2_dmac* dmac, struct ps2_intc* intc) {
-    ipu->ipu = new ImageProcessingUnit(intc, dmac);
+extern "C" void ps2_ipu_init(struct ps2_ipu* ipu, struct ps2_dmac* dmac, struct ps2_intc* intc, struct sched_state* sched) {
+    ipu->ipu = new ImageProcessingUnit(intc, dmac, sched);
 }
 
 extern "C" void ps2_ipu_reset(struct ps2_ipu* ipu) {
@@ -1495,12 +2181,535 @@ extern "C" void ps2_ipu_write128(struct ps2_ipu* ipu, uint32_t addr, uint128_t d
     exit(1);
 }
 
-void ps2_ipu_run(struct ps2_ipu* ipu) {
-    ipu->ipu->run();
-}
-
 extern "C" void ps2_ipu_destroy(struct ps2_ipu* ipu) {
     delete ipu->ipu;
 
     free(ipu);
-}
\ No newline at end of file
+}
+
+#ifdef IRIS_BENCH
+//IEEE 1180 accuracy test of the integer IDCT against the double
+//precision reference, followed by a throughput comparison
+static uint32_t idct_test_seed;
+
+static int idct_test_rand(int l, int h)
+{
+    idct_test_seed = (idct_test_seed * 1103515245) + 12345;
+
+    double x = (double)(idct_test_seed & 0x7ffffffe) / (double)0x7fffffff;
+
+    return (int)(x * (l + h + 1)) - l;
+}
+
+static void idct_test_fdct(const int16_t* in, int16_t* out)
+{
+    double c[8][8];
+    double tmp[64];
+
+    for (int freq = 0; freq < 8; freq++)
+    {
+        double scale = (freq == 0) ? sqrt(0.125) : 0.5;
+
+        for (int time = 0; time < 8; time++)
+            c[freq][time] = scale * cos((PI / 8.0) * freq * (time + 0.5));
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        for (int u = 0; u < 8; u++)
+        {
+            double sum = 0.0;
+
+            for (int k = 0; k < 8; k++)
+                sum += c[u][k] * in[(8 * i) + k];
+
+            tmp[(8 * i) + u] = sum;
+        }
+    }
+
+    for (int u = 0; u < 8; u++)
+    {
+        for (int v = 0; v < 8; v++)
+        {
+            double sum = 0.0;
+
+            for (int k = 0; k < 8; k++)
+                sum += c[v][k] * tmp[(8 * k) + u];
+
+            out[(8 * v) + u] = (int16_t)std::clamp((int)floor(sum + 0.5), -2048, 2047);
+        }
+    }
+}
+
+extern "C" int ps2_ipu_bench_idct(void) {
+    static const int ranges[3][2] = { { 256, 255 }, { 5, 5 }, { 300, 300 } };
+    const int blocks = 10000;
+
+    bool pass = true;
+
+    for (int r = 0; r < 3; r++) {
+        for (int sign = 1; sign >= -1; sign -= 2) {
+            int l = ranges[r][0], h = ranges[r][1];
+
+            double err[64] = { 0 }, sq[64] = { 0 };
+            int peak = 0;
+
+            idct_test_seed = 1;
+
+            for (int n = 0; n < blocks; n++) {
+                int16_t in[64], coeffs[64], block[64];
+                double ref[64];
+
+                for (int i = 0; i < 64; i++)
+                    in[i] = idct_test_rand(l, h) * sign;
+
+                idct_test_fdct(in, coeffs);
+                reference_idct(coeffs, ref);
+
+                memcpy(block, coeffs, sizeof(block));
+                idct(block);
+
+                for (int i = 0; i < 64; i++) {
+                    int a = std::clamp((int)floor(ref[i] + 0.5), -256, 255);
+                    int b = std::clamp((int)block[i], -256, 255);
+                    int e = b - a;
+
+                    peak = std::max(peak, std::abs(e));
+                    err[i] += e;
+                    sq[i] += e * e;
+                }
+            }
+
+            double pmse = 0.0, omse = 0.0, pme = 0.0, ome = 0.0;
+
+            for (int i = 0; i < 64; i++) {
+                pmse = std::max(pmse, sq[i] / blocks);
+                pme = std::max(pme, std::abs(err[i]) / blocks);
+                omse += sq[i];
+                ome += err[i];
+            }
+
+            omse /= 64.0 * blocks;
+            ome = std::abs(ome) / (64.0 * blocks);
+
+            bool ok = (peak <= 1) && (pmse <= 0.06) && (omse <= 0.02) && (pme <= 0.015) && (ome <= 0.0015);
+
+            fprintf(stdout, "idct: [-%d,%d] sign %+d: peak %d, pmse %.4f, omse %.4f, pme %.4f, ome %.5f: %s\n",
+                l, h, sign, peak, pmse, omse, pme, ome, ok ? "PASS" : "FAIL"
+            );
+
+            pass = pass && ok;
+        }
+    }
+
+    //All zero input must give all zero output
+    int16_t zero[64] = { 0 };
+
+    idct(zero);
+
+    for (int i = 0; i < 64; i++)
+        pass = pass && !zero[i];
+
+    fprintf(stdout, "idct: IEEE 1180 %s\n", pass ? "PASS" : "FAIL");
+
+    //Throughput, over a set of blocks with real looking coefficients
+    const int set = 1024;
+
+    std::vector <int16_t> coeffs(set * 64), block(set * 64);
+
+    idct_test_seed = 1;
+
+    for (int n = 0; n < set; n++) {
+        int16_t in[64];
+
+        for (int i = 0; i < 64; i++)
+            in[i] = idct_test_rand(256, 255);
+
+        idct_test_fdct(in, &coeffs[n * 64]);
+    }
+
+    auto bench = [&](const char* name, int iterations, auto&& fn) {
+        auto start = std::chrono::steady_clock::now();
+
+        for (int it = 0; it < iterations; it++) {
+            memcpy(block.data(), coeffs.data(), block.size() * sizeof(int16_t));
+
+            for (int n = 0; n < set; n++)
+                fn(&block[n * 64]);
+        }
+
+        double s = std::chrono::duration <double>(std::chrono::steady_clock::now() - start).count();
+
+        fprintf(stdout, "idct: %s: %.2f Mblocks/s\n", name, ((double)iterations * set) / s / 1e6);
+    };
+
+    bench("double", 20, [](int16_t* b) {
+        double out[64];
+
+        reference_idct(b, out);
+
+        for (int i = 0; i < 64; i++)
+            b[i] = (int16_t)floor(out[i] + 0.5);
+    });
+
+    bench("integer", 2000, [](int16_t* b) {
+        idct(b);
+    });
+
+    return pass ? 0 : 1;
+}
+
+static volatile uint32_t bench_sink;
+
+//Checks the fixed point CSC against the float one over every Y, Cb
+//and Cr, with random thresholds, then times both
+extern "C" int ps2_ipu_bench_csc(void) {
+    std::vector <uint8_t> blocks;
+
+    //Every chroma sample of a macroblock gets its own Cb and Cr, with
+    //the four luma samples that share it set to consecutive values
+    for (int cb = 0; cb < 256; cb++) {
+        for (int cr = 0; cr < 256; cr += 0x40) {
+            for (int lum = 0; lum < 256; lum += 4) {
+                uint8_t block[RAW_BLOCK_SIZE];
+
+                for (int i = 0; i < 0x100; i++) {
+                    int c = ((i & 15) / 2) + ((i / 32) * 8);
+                    int k = (i & 1) + (((i >> 4) & 1) * 2);
+
+                    block[i] = lum + k;
+                    block[0x100 + c] = cb;
+                    block[0x140 + c] = cr + c;
+                }
+
+                blocks.insert(blocks.end(), block, block + RAW_BLOCK_SIZE);
+            }
+        }
+    }
+
+    const size_t count = blocks.size() / RAW_BLOCK_SIZE;
+
+    uint32_t seed = 1;
+    size_t mismatches = 0;
+
+    for (size_t n = 0; n < count; n++) {
+        const uint8_t* block = &blocks[n * RAW_BLOCK_SIZE];
+
+        seed = (seed * 1103515245) + 12345;
+
+        int th0 = (seed >> 8) & 0x1ff;
+        int th1 = (seed >> 17) & 0x1ff;
+
+        uint8_t a[4 * RGB_BLOCK_SIZE], b[4 * RGB_BLOCK_SIZE];
+        uint16_t a16[RGB_BLOCK_SIZE], b16[RGB_BLOCK_SIZE];
+
+        reference_csc(block, a, th0, th1);
+        csc_macroblock(block, b, th0, th1);
+
+        bool dithering = n & 1;
+
+        convert_RGB32_to_RGB16_generic(a, a16, dithering);
+        convert_RGB32_to_RGB16(b, b16, dithering);
+
+        if (memcmp(a, b, sizeof(a)) || memcmp(a16, b16, sizeof(a16)))
+            mismatches++;
+    }
+
+    fprintf(stdout, "csc: %zu macroblocks, %zu mismatches: %s\n",
+        count, mismatches, mismatches ? "FAIL" : "PASS"
+    );
+
+    auto bench = [&](const char* name, int iterations, auto&& fn) {
+        uint8_t rgb32[4 * RGB_BLOCK_SIZE];
+        uint16_t rgb16[RGB_BLOCK_SIZE];
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (int it = 0; it < iterations; it++) {
+            for (size_t n = 0; n < 4096; n++) {
+                fn(&blocks[n * RAW_BLOCK_SIZE], rgb32, rgb16);
+
+                bench_sink = rgb16[n & 0xff];
+            }
+        }
+
+        double s = std::chrono::duration <double>(std::chrono::steady_clock::now() - start).count();
+
+        fprintf(stdout, "csc: %s: %.2f Mpixels/s\n", name, ((double)iterations * 4096 * RGB_BLOCK_SIZE) / s / 1e6);
+    };
+
+    bench("float", 20, [](const uint8_t* block, uint8_t* rgb32, uint16_t* rgb16) {
+        reference_csc(block, rgb32, 0x40, 0x80);
+        convert_RGB32_to_RGB16_generic(rgb32, rgb16, true);
+    });
+
+    bench("fixed point", 200, [](const uint8_t* block, uint8_t* rgb32, uint16_t* rgb16) {
+        csc_macroblock(block, rgb32, 0x40, 0x80);
+        convert_RGB32_to_RGB16(rgb32, rgb16, true);
+    });
+
+    return mismatches ? 1 : 0;
+}
+
+//Bitstream reader throughput: VLC style peeks and skips of 1 to 32
+//bits, with the FIFO kept topped up the way IPU_TO DMA does
+extern "C" int ps2_ipu_bench_fifo(void) {
+    std::vector <uint128_t> stream(4096);
+    std::vector <uint8_t> lengths(4096);
+
+    uint32_t seed = 1;
+
+    for (uint128_t& quad : stream) {
+        for (int i = 0; i < 4; i++) {
+            seed = (seed * 1103515245) + 12345;
+            quad.u32[i] = seed;
+        }
+    }
+
+    for (uint8_t& len : lengths) {
+        seed = (seed * 1103515245) + 12345;
+        len = 1 + ((seed >> 16) % 32);
+    }
+
+    IPU_FIFO fifo;
+    uint64_t bits = 0, reads = 0;
+    uint32_t sum = 0;
+
+    const int iterations = 200;
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int it = 0; it < iterations; it++) {
+        size_t next = 0, n = 0;
+
+        fifo.reset();
+
+        while (true) {
+            while (fifo.size() < 8 && next < stream.size())
+                fifo.push(stream[next++]);
+
+            uint32_t data;
+            int len = lengths[n++ & 4095];
+
+            if (!fifo.get_bits(data, len))
+                break;
+
+            fifo.advance_stream(len);
+
+            sum += data;
+            bits += len;
+            reads++;
+        }
+    }
+
+    bench_sink = sum;
+
+    double s = std::chrono::duration <double>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(stdout, "fifo: %.2f Mbits/s, %.2f Mreads/s\n", bits / s / 1e6, reads / s / 1e6);
+
+    return 0;
+}
+
+//FMV decode throughput. An intra slice of synthetic macroblocks goes
+//through IDEC the way a game feeds it, IPU_TO in and IPU_FROM out over
+//the DMAC, once decoded on the emulation thread alone and once with the
+//decode workers. The outputs have to match.
+struct ipu_bench_writer {
+    std::vector <uint8_t> data;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    void put(uint32_t value, int count) {
+        for (int i = count - 1; i >= 0; i--) {
+            acc = (acc << 1) | ((value >> i) & 1);
+
+            if (++bits == 8) {
+                data.push_back(acc);
+
+                acc = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    void put(const char* code) {
+        for (; *code; code++)
+            put(*code == '1', 1);
+    }
+};
+
+static void ipu_bench_stream(std::vector <uint8_t>& stream, int macroblocks) {
+    // dct_dc_size_luminance/chrominance for sizes 0 to 5
+    static const char* lum_dc[] = { "100", "00", "01", "101", "110", "1110" };
+    static const char* chrom_dc[] = { "00", "01", "10", "110", "1110", "11110" };
+
+    ipu_bench_writer w;
+
+    uint32_t seed = 1;
+    int predictor[3] = { 128, 128, 128 };
+
+    auto rand = [&]() {
+        seed = (seed * 1103515245) + 12345;
+
+        return (seed >> 16) & 0x7fff;
+    };
+
+    for (int mb = 0; mb < macroblocks; mb++) {
+        // Address increment of 1, then an intra macroblock type
+        if (mb)
+            w.put(1, 1);
+
+        w.put(1, 1);
+
+        for (int block = 0; block < 6; block++) {
+            int channel = block < 4 ? 0 : block - 3;
+            int diff = std::clamp((16 + (int)(rand() % 224)) - predictor[channel], -31, 31);
+            int size = 0;
+
+            while ((1 << size) <= std::abs(diff))
+                size++;
+
+            w.put(channel ? chrom_dc[size] : lum_dc[size]);
+
+            if (size)
+                w.put(diff > 0 ? diff : diff + (1 << size) - 1, size);
+
+            predictor[channel] += diff;
+
+            // A few AC coefficients from table B-14, the rest escaped
+            int pos = 1, count = rand() % 12;
+
+            for (int i = 0; i < count; i++) {
+                int run = rand() % 4;
+
+                if (pos + run >= 64)
+                    break;
+
+                pos += run + 1;
+
+                int kind = rand() % 8;
+                int sign = rand() & 1;
+
+                if (run == 0 && kind < 3) {
+                    w.put("11"); w.put(sign, 1);
+                } else if (run == 1 && kind < 5) {
+                    w.put("011"); w.put(sign, 1);
+                } else if (run == 0 && kind < 5) {
+                    w.put("0100"); w.put(sign, 1);
+                } else if (run == 2 && kind < 6) {
+                    w.put("0101"); w.put(sign, 1);
+                } else {
+                    int level = 1 + (rand() % 40);
+
+                    w.put("000001");
+                    w.put(run, 6);
+                    w.put((sign ? -level : level) & 0xfff, 12);
+                }
+            }
+
+            // End of block
+            w.put("10");
+        }
+    }
+
+    // Byte align, then a start code ends the slice
+    while (w.bits)
+        w.put(0, 1);
+
+    w.put(0x00000001, 32);
+    w.put(0xb3, 8);
+
+    stream = w.data;
+
+    // Room for IPU_TO to keep the FIFO topped up past the end
+    stream.resize(((stream.size() + 15) & ~15) + (IPU_FIFO_SIZE * 16), 0);
+}
+
+static double ipu_bench_decode(const std::vector <uint8_t>& stream, std::vector <uint8_t>& out, int macroblocks, int workers) {
+    struct ee_bus* bus = ee_bus_create();
+    struct ps2_dmac* dmac = (struct ps2_dmac*)calloc(1, sizeof(struct ps2_dmac));
+    struct sched_state* sched = sched_create();
+    struct ps2_ipu* ipu = ps2_ipu_create();
+
+    ee_bus_init(bus, NULL);
+    sched_init(sched);
+
+    // The stream sits at 0 and the output at 0x1000000, mapped straight
+    // in through the fastmem tables
+    for (size_t i = 0; i < stream.size(); i += 0x2000)
+        bus->fastmem_r_table[i >> 13] = (void*)(stream.data() + i);
+
+    for (size_t i = 0; i < out.size(); i += 0x2000)
+        bus->fastmem_w_table[(0x1000000 + i) >> 13] = out.data() + i;
+
+    dmac->bus = bus;
+
+    // There's no INTC, nothing here raises an interrupt
+    ps2_ipu_init(ipu, dmac, NULL, sched);
+    ps2_ipu_reset(ipu);
+    ee_bus_init_ipu(bus, ipu);
+
+    ipu->ipu->set_workers(workers);
+
+    // Normal mode, end tag, enough QWC that neither channel finishes
+    dmac->ipu_to.chcr = 0x101;
+    dmac->ipu_to.qwc = stream.size() / 16;
+    dmac->ipu_to.tag.end = 1;
+    dmac->ipu_from.chcr = 0x100;
+    dmac->ipu_from.madr = 0x1000000;
+    dmac->ipu_from.qwc = (out.size() / 16) + 1;
+
+    // I picture, MPEG-2
+    ipu->ipu->write_control(1 << 24);
+
+    auto start = std::chrono::steady_clock::now();
+
+    // IDEC, QSC 8, RGB32. The whole slice goes through in one IPU event
+    ipu->ipu->write_command((1 << 28) | (8 << 16));
+
+    sched_tick(sched, IPU_COMMAND_LATENCY);
+
+    double s = std::chrono::duration <double>(std::chrono::steady_clock::now() - start).count();
+
+    if (dmac->ipu_from.madr != 0x1000000 + (uint32_t)(macroblocks * RGB_BLOCK_SIZE * 4))
+        fprintf(stderr, "ipu: Decode bench got %u bytes of output\n", dmac->ipu_from.madr - 0x1000000);
+
+    ps2_ipu_destroy(ipu);
+    sched_destroy(sched);
+    free(dmac);
+    free(bus);
+
+    return s;
+}
+
+extern "C" int ps2_ipu_bench_decode(void) {
+    // Four 720x480 frames
+    const int macroblocks = 45 * 30 * 4;
+
+    std::vector <uint8_t> stream;
+
+    ipu_bench_stream(stream, macroblocks);
+
+    int workers = std::clamp((int)std::thread::hardware_concurrency() - 1, 1, IPU_MAX_WORKERS);
+
+    std::vector <uint8_t> serial(macroblocks * RGB_BLOCK_SIZE * 4);
+    std::vector <uint8_t> pooled(serial.size());
+
+    double serial_s = 1e9, pooled_s = 1e9;
+
+    for (int i = 0; i < 5; i++) {
+        serial_s = std::min(serial_s, ipu_bench_decode(stream, serial, macroblocks, 0));
+        pooled_s = std::min(pooled_s, ipu_bench_decode(stream, pooled, macroblocks, workers));
+    }
+
+    bool match = serial == pooled;
+
+    fprintf(stdout, "decode: %zu bytes, %d macroblocks\n", stream.size(), macroblocks);
+    fprintf(stdout, "decode: inline     %.0f macroblocks/s\n", macroblocks / serial_s);
+    fprintf(stdout, "decode: %d workers  %.0f macroblocks/s (%.2fx)\n", workers, macroblocks / pooled_s, serial_s / pooled_s);
+    fprintf(stdout, "decode: output %s\n", match ? "matches" : "MISMATCH");
+
+    return match ? 0 : 1;
+}
+#endif
@@ -7,6 +7,7 @@ extern "C" {
 
 #include "ee/dmac.h"
 #include "ee/intc.h"
+#include "scheduler.h"
 #include "u128.h"
 
 #include <stdint.h>
@@ -39,15 +40,29 @@ struct ipu_fifo {
 struct ps2_ipu;
 
 struct ps2_ipu* ps2_ipu_create(void);
-void ps2_ipu_init(struct ps2_ipu* ipu, struct ps2_dmac* dmac, struct ps2_intc* intc);
+void ps2_ipu_init(struct ps2_ipu* ipu, struct ps2_dmac* dmac, struct ps2_intc* intc, struct sched_state* sched);
 void ps2_ipu_reset(struct ps2_ipu* ipu);
 uint64_t ps2_ipu_read64(struct ps2_ipu* ipu, uint32_t addr);
 uint128_t ps2_ipu_read128(struct ps2_ipu* ipu, uint32_t addr);
 void ps2_ipu_write64(struct ps2_ipu* ipu, uint32_t addr, uint64_t data);
 void ps2_ipu_write128(struct ps2_ipu* ipu, uint32_t addr, uint128_t data);
-void ps2_ipu_run(struct ps2_ipu* ipu);
 void ps2_ipu_destroy(struct ps2_ipu* ipu);
 
+#ifdef IRIS_BENCH
+// IDCT accuracy (IEEE 1180) and throughput check, returns 0 on pass
+int ps2_ipu_bench_idct(void);
+
+// CSC exactness and throughput check, returns 0 on pass
+int ps2_ipu_bench_csc(void);
+
+// Input FIFO bitstream reader throughput
+int ps2_ipu_bench_fifo(void);
+
+// IDEC throughput with and without the decode workers, returns 0 if
+// both produce the same output
+int ps2_ipu_bench_decode(void);
+#endif
+
 #ifdef __cplusplus
 }
 #endif
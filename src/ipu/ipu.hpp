@@ -1,7 +1,13 @@
 #ifndef IPU_HPP
 #define IPU_HPP
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <thread>
+#include <vector>
 
 #include "u128.h"
 #include "chromtable.hpp"
@@ -18,10 +24,20 @@
 // eegs includes
 #include "ee/dmac.h"
 #include "ee/intc.h"
+#include "scheduler.h"
 
 constexpr int RAW_BLOCK_SIZE = 0x180;
 constexpr int RGB_BLOCK_SIZE = 0x100;
 
+//Rough IPU timings in EE cycles. The IPU moves about a quadword per bus
+//cycle on either side, and takes a while to get going on a new command.
+constexpr int IPU_CYCLES_PER_QWORD = 2;
+constexpr int IPU_COMMAND_LATENCY = 64;
+
+//Macroblocks in flight between the bitstream parser and the decode workers
+constexpr int IPU_PIPELINE_SIZE = 64;
+constexpr int IPU_MAX_WORKERS = 3;
+
 struct IPU_CTRL
 {
     uint8_t coded_block_pattern;
@@ -57,15 +73,12 @@ enum class BDEC_STATE
 
 enum class IDEC_STATE
 {
-    DELAY,
     ADVANCE,
     MACRO_I_TYPE,
     DCT_TYPE,
     QSC,
     INIT_BDEC,
     READ_BLOCK,
-    INIT_CSC,
-    EXEC_CSC,
     CHECK_START_CODE,
     VALID_START_CODE,
     MACRO_INC,
@@ -86,15 +99,13 @@ struct IDEC_Command
     bool decodes_dct;
     uint32_t qsc;
 
-    IPU_FIFO temp_fifo;
-
     int blocks_decoded;
 };
 
 struct BDEC_Command
 {
     BDEC_STATE state;
-    IPU_FIFO* out_fifo;
+    bool csc; //IDEC converts the macroblock to RGB
     bool intra;
     bool reset_dc;
     bool check_start_code;
@@ -169,11 +180,35 @@ struct PACK_Command
     int block_index;
 };
 
+//A macroblock whose coefficients have been parsed. Dequantisation, the
+//IDCT and colour conversion don't depend on the bitstream, so they run
+//on the decode workers, the output is picked up in order afterwards.
+struct IPU_Macroblock
+{
+    alignas(16) int16_t blocks[6][64];
+    uint8_t coded_block_pattern;
+    bool intra;
+    uint8_t intra_DC_precision;
+    bool alternate_scan;
+    int q_scale;
+
+    bool csc;
+    bool use_RGB16;
+    bool use_dithering;
+    uint32_t TH0, TH1;
+
+    uint128_t out[64];
+    int out_quads;
+
+    std::atomic<bool> done;
+};
+
 struct ImageProcessingUnit
 {
     private:
         struct ps2_intc* intc;
         struct ps2_dmac* dmac;
+        struct sched_state* sched;
         DCT_Coeff_Table0 dct_coeff0;
         DCT_Coeff_Table1 dct_coeff1;
         DCT_Coeff* dct_coeff;
@@ -186,16 +221,13 @@ struct ImageProcessingUnit
         Macroblock_BPic macroblock_B_pic;
         MotionCode motioncode;
         VLC_Table* VDEC_table;
-        IPU_FIFO in_FIFO, out_FIFO;
-
-        int8_t dither_mtx[4][4];
+        IPU_FIFO in_FIFO;
+        IPU_Output_FIFO out_FIFO;
 
         uint8_t intra_IQ[0x40], nonintra_IQ[0x40];
         uint16_t VQCLUT[16];
         uint32_t TH0, TH1;
 
-        unsigned int crcb_map[0x100];
-
         static uint32_t inverse_scan_zigzag[0x40];
         static uint32_t inverse_scan_alternate[0x40];
 
@@ -216,27 +248,61 @@ struct ImageProcessingUnit
         SETIQ_STATE setiq_state;
         PACK_Command pack;
 
-        double IDCT_table[8][8];
-
+        //Scheduling state. The IPU only runs when an event fires, which
+        //happens when a command is written or IPU_TO delivers data.
+        bool event_pending;
+        bool finish_pending;
+        bool running;
+        long cycles_owed;
+
+        void schedule_run(long cycles);
+        void step();
+        void complete_command();
+        void update_DMA();
         void finish_command();
 
+        //Macroblock pipeline. The parser stages macroblocks on the emulation
+        //thread, workers claim them in order of staging and the results are
+        //retired to out_FIFO in that same order.
+        std::unique_ptr<IPU_Macroblock[]> mb_ring;
+        std::atomic<uint32_t> mb_staged;
+        std::atomic<uint32_t> mb_next;
+        uint32_t mb_retired;
+        size_t pipeline_quads;
+
+        std::vector<std::thread> workers;
+        std::mutex pool_mtx;
+        std::condition_variable pool_cv;
+        std::atomic<int> pool_sleeping;
+        bool pool_quit;
+
+        IPU_Macroblock& stage_macroblock();
+        void submit_macroblock(IPU_Macroblock& mb);
+        bool decode_next_macroblock();
+        void decode_macroblock(IPU_Macroblock& mb);
+        void retire_macroblocks(bool wait);
+        void worker_main();
+        void start_workers(int count);
+        void stop_workers();
+
         bool process_IDEC();
 
         bool process_BDEC();
-        void inverse_scan(int16_t* block);
-        void dequantize(int16_t* block);
-        void prepare_IDCT();
-        void perform_IDCT(const int16_t* pUV, int16_t* pXY);
+        void inverse_scan(int16_t* block, bool alternate);
+        void dequantize(int16_t* block, const IPU_Macroblock& mb);
         bool BDEC_read_coeffs();
         bool BDEC_read_diff();
 
-        void convert_RGB32_to_RGB16(const uint8_t* rgb32, uint16_t *rgb16, bool dithering);
         void process_VDEC();
         void process_FDEC();
         bool process_CSC();
         bool process_PACK();
     public:
-        ImageProcessingUnit(struct ps2_intc* intc, struct ps2_dmac* dmac);
+        ImageProcessingUnit(struct ps2_intc* intc, struct ps2_dmac* dmac, struct sched_state* sched);
+        ~ImageProcessingUnit();
+
+        //0 decodes every macroblock on the emulation thread
+        void set_workers(int count);
 
         void reset();
         void run();
@@ -4,7 +4,7 @@
 
 bool IPU_FIFO::get_bits(uint32_t &data, int bits)
 {
-    int bits_available = (f.size() * 128) - bit_pointer;
+    int bits_available = (count * 128) - bit_pointer;
 
     if (bits_available < bits || bits_available == 0)
     {
@@ -12,28 +12,14 @@ bool IPU_FIFO::get_bits(uint32_t &data, int bits)
         return false;
     }
 
-    if (bit_cache_dirty)
-    {
-        uint8_t temp[32];
-        *(uint128_t*)&temp[0] = f[0];
-        if (f.size() > 1)
-            *(uint128_t*)&temp[16] = f[1];
-
-        uint8_t blorp[8];
-        int index = (bit_pointer & ~0x1F) / 8;
-
-        //MPEG is big-endian...
-        for (int i = 0; i < 8; i++)
-        {
-            int fifo_index = index + i;
-            blorp[7 - i] = temp[fifo_index];
-        }
-        bit_cache_dirty = false;
-        cached_bits = *(uint64_t*)&blorp[0];
-    }
-    int shift = 64 - (bit_pointer % 32) - bits;
-    uint64_t mask = ~0x0ULL >> (64 - bits);
-    data = (cached_bits >> shift) & mask;
+    //MPEG is big-endian...
+    int offset = (head * 16) + (bit_pointer >> 3);
+    uint64_t window;
+
+    memcpy(&window, &buf[offset], sizeof(window));
+    window = __builtin_bswap64(window) << (bit_pointer & 7);
+
+    data = bits ? (uint32_t)(window >> (64 - bits)) : 0;
 
     return true;
 }
@@ -42,35 +28,73 @@ bool IPU_FIFO::advance_stream(uint8_t amount)
 {
     if (amount > 32)
         amount = 32;
-    
-    //printf("Advance stream: %d + %d = %d\n", bit_pointer - amount, amount, bit_pointer);
 
-    if ((bit_pointer + amount) > (f.size() * 128))
+    if ((bit_pointer + amount) > (count * 128))
     {
         return false;
     }
 
-    uint32_t old_words = bit_pointer / 32;
-    uint32_t new_words = (bit_pointer + amount) / 32;
-    bit_cache_dirty |= (old_words != new_words);
     bit_pointer += amount;
 
     while (bit_pointer >= 128)
     {
         bit_pointer -= 128;
-        f.pop_front();
-        bit_cache_dirty = true;
+        pop();
     }
     return true;
 }
 
+uint128_t IPU_FIFO::front() const
+{
+    uint128_t quad;
+    memcpy(&quad, &buf[head * 16], sizeof(quad));
+    return quad;
+}
+
+void IPU_FIFO::push(const uint128_t& quad)
+{
+    if (count == capacity)
+        grow();
+
+    int index = (head + count) & (capacity - 1);
+
+    memcpy(&buf[index * 16], &quad, sizeof(quad));
+
+    //Keep the mirror of the first quadword up to date
+    if (!index)
+        memcpy(&buf[capacity * 16], &quad, sizeof(quad));
+
+    count++;
+}
+
+void IPU_FIFO::pop()
+{
+    head = (head + 1) & (capacity - 1);
+    count--;
+}
+
+//Doubles the ring, the quadwords move to the start in stream order
+void IPU_FIFO::grow()
+{
+    std::vector<uint8_t> next((capacity * 2 + 1) * 16, 0);
+
+    for (int i = 0; i < count; i++)
+        memcpy(&next[i * 16], &buf[((head + i) & (capacity - 1)) * 16], 16);
+
+    memcpy(&next[capacity * 2 * 16], &next[0], 16);
+
+    buf.swap(next);
+    capacity *= 2;
+    head = 0;
+}
+
 void IPU_FIFO::reset()
 {
-    std::deque<uint128_t> empty;
-    f.swap(empty);
+    buf.assign((IPU_FIFO_SIZE + 1) * 16, 0);
+    capacity = IPU_FIFO_SIZE;
+    head = 0;
+    count = 0;
     bit_pointer = 0;
-    cached_bits = 0;
-    bit_cache_dirty = true;
 }
 
 void IPU_FIFO::byte_align()
@@ -79,3 +103,9 @@ void IPU_FIFO::byte_align()
     if (bits)
         advance_stream(8 - bits);
 }
+
+void IPU_Output_FIFO::reset()
+{
+    std::deque<uint128_t> empty;
+    f.swap(empty);
+}
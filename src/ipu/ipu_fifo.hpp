@@ -1,21 +1,51 @@
 #ifndef IPU_FIFO_HPP
 #define IPU_FIFO_HPP
 #include <cstdint>
+#include <cstring>
 #include <queue>
+#include <vector>
 
 #include "u128.h"
 
+//Starting capacity of the input FIFO in quadwords. The hardware holds
+//8, IPU_TO stops there, the rest is slack for direct EE writes past a
+//full FIFO. Those aren't throttled, so the ring doubles when they fill
+//it rather than lose data
+constexpr int IPU_FIFO_SIZE = 32;
+
+//Input FIFO. Quadwords are kept as a contiguous ring of bytes in
+//stream order, with the first quadword mirrored past the end, so any
+//8 bytes from the read position can be loaded at once and byte swapped
+//into a big-endian window. Up to 32 bits can be peeked or skipped
+//without refilling or branching on quadword boundaries.
 struct IPU_FIFO
 {
-    std::deque<uint128_t> f;
+    std::vector<uint8_t> buf;
+    int capacity;
+    int head;
+    int count;
     int bit_pointer;
-    uint64_t cached_bits;
-    bool bit_cache_dirty;
+
     bool get_bits(uint32_t& data, int bits);
     bool advance_stream(uint8_t amount);
 
+    int size() const { return count; }
+    uint128_t front() const;
+    void push(const uint128_t& quad);
+    void pop();
+    void grow();
+
     void reset();
     void byte_align();
 };
 
+//Output FIFO, plain quadwords. Also used to hand BDEC output to CSC
+//within IDEC
+struct IPU_Output_FIFO
+{
+    std::deque<uint128_t> f;
+
+    void reset();
+};
+
 #endif // IPU_FIFO_HPP
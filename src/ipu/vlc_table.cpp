@@ -1,14 +1,97 @@
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
 #include "vlc_table.hpp"
 
 VLC_Table::VLC_Table(VLC_Entry* table, int table_size, int max_bits, unsigned int* index_table) :
     table(table), table_size(table_size), max_bits(max_bits), index_table(index_table)
 {
+    build_lookup();
+}
+
+void VLC_Table::build_lookup()
+{
+    //Resolve every max_bits long key the way peek_symbol_slow would:
+    //shortest length first, first matching entry of that length wins
+    std::vector<int16_t> full(1 << max_bits, VLC_NONE);
+
+    for (int i = 0; i < max_bits; i++)
+    {
+        int bits = i + 1;
+        int shift = max_bits - bits;
+
+        for (int j = index_table[i]; j < table_size; j++)
+        {
+            if (bits != table[j].bits)
+                break;
+
+            if (table[j].key >> bits)
+                continue;
+
+            uint32_t start = table[j].key << shift;
+
+            for (uint32_t key = start; key < start + (1 << shift); key++)
+            {
+                if (full[key] == VLC_NONE)
+                    full[key] = j;
+            }
+        }
+    }
+
+    //Split into a first level and overflow blocks, a first level slot
+    //only needs a block if the keys under it don't all agree
+    lookup_bits = std::min(max_bits, VLC_LOOKUP_BITS);
+    overflow_bits = max_bits - lookup_bits;
+    lookup.assign(1 << lookup_bits, VLC_NONE);
+    overflow.clear();
+
+    const int block_size = 1 << overflow_bits;
 
+    for (int i = 0; i < (1 << lookup_bits); i++)
+    {
+        const int16_t* keys = &full[i * block_size];
+
+        bool same = true;
+        for (int j = 1; j < block_size; j++)
+            same = same && (keys[j] == keys[0]);
+
+        if (same)
+        {
+            lookup[i] = keys[0];
+        }
+        else
+        {
+            lookup[i] = -2 - (int)(overflow.size() / block_size);
+            overflow.insert(overflow.end(), keys, keys + block_size);
+        }
+    }
 }
 
 bool VLC_Table::peek_symbol(IPU_FIFO &FIFO, VLC_Entry &entry)
+{
+    uint32_t key;
+
+    //Near the end of the FIFO a short code may still be complete, let
+    //the bit by bit search sort that out
+    if (!FIFO.get_bits(key, max_bits))
+        return peek_symbol_slow(FIFO, entry);
+
+    int index = lookup[key >> overflow_bits];
+
+    if (index < VLC_NONE)
+    {
+        int block = -2 - index;
+        index = overflow[(block << overflow_bits) | (key & ((1 << overflow_bits) - 1))];
+    }
+
+    if (index == VLC_NONE)
+        throw VLC_Error("VLC symbol not found");
+
+    entry = table[index];
+    return true;
+}
+
+bool VLC_Table::peek_symbol_slow(IPU_FIFO &FIFO, VLC_Entry &entry)
 {
     uint32_t key;
     for (int i = 0; i < max_bits; i++)
@@ -3,6 +3,7 @@
 #include <stdexcept>
 #include <cstdint>
 #include <queue>
+#include <vector>
 #include "ipu_fifo.hpp"
 
 struct VLC_Entry
@@ -17,12 +18,27 @@ class VLC_Error : public std::runtime_error
     using std::runtime_error::runtime_error;
 };
 
+//Bits looked up at once by the first level of a VLC lookup table
+constexpr int VLC_LOOKUP_BITS = 8;
+
 class VLC_Table
 {
     private:
         VLC_Entry* table;
         int table_size, max_bits;
         unsigned int* index_table;
+
+        //Lookup tables built from the code table. The first level is
+        //indexed by the first lookup_bits of the stream, the overflow
+        //blocks by the bits after that, up to max_bits. Entries are a
+        //table index, VLC_NONE, or -2 - n for overflow block n
+        constexpr static int16_t VLC_NONE = -1;
+
+        int lookup_bits, overflow_bits;
+        std::vector<int16_t> lookup, overflow;
+
+        void build_lookup();
+        bool peek_symbol_slow(IPU_FIFO& FIFO, VLC_Entry& entry);
     protected:
         VLC_Table(VLC_Entry* table, int table_size, int max_bits, unsigned int* index_table);
     public:
@@ -90,7 +90,7 @@ void ps2_init(struct ps2_state* ps2) {
     ps2_vif_init(ps2->vif0, 0, ps2->vu0, ps2->gif, ps2->ee_intc, ps2->sched, ps2->ee_bus);
     ps2_vif_init(ps2->vif1, 1, ps2->vu1, ps2->gif, ps2->ee_intc, ps2->sched, ps2->ee_bus);
     ps2_gs_init(ps2->gs, ps2->ee_intc, ps2->iop_intc, ps2->ee_timers, ps2->iop_timers, ps2->sched);
-    ps2_ipu_init(ps2->ipu, ps2->ee_dma, ps2->ee_intc);
+    ps2_ipu_init(ps2->ipu, ps2->ee_dma, ps2->ee_intc, ps2->sched);
     ps2_intc_init(ps2->ee_intc, ps2->ee, ps2->sched);
     ps2_ee_timers_init(ps2->ee_timers, ps2->ee_intc, ps2->sched);
     ps2_ram_init(ps2->iop_ram, RAM_SIZE_2MB);
@@ -291,8 +291,6 @@ void ps2_cycle(struct ps2_state* ps2) {
 
     sched_tick(ps2->sched, ps2->timescale * cycles);
 
-    ps2_ipu_run(ps2->ipu);
-
     for (int i = 0; i < cycles; i++)
         ps2_ee_timers_tick(ps2->ee_timers);
 
@@ -310,8 +308,6 @@ void ps2_step_ee(struct ps2_state* ps2) {
     sched_tick(ps2->sched, 1);
     ps2_ee_timers_tick(ps2->ee_timers);
 
-    ps2_ipu_run(ps2->ipu);
-
     ps2->ee_cycles++; 
 
     if (ps2->ee_cycles == 8) {
@@ -331,8 +327,6 @@ void ps2_step_iop(struct ps2_state* ps2) {
     sched_tick(ps2->sched, 8);
     iop_cycle(ps2->iop);
     ps2_iop_timers_tick(ps2->iop_timers);
-
-    ps2_ipu_run(ps2->ipu);
 }
 
 void ps2_iop_cycle(struct ps2_state* ps2) {